@@ -0,0 +1,176 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the per-packet cost of debug logging, using a mix of
+ * log_debug() calls modeled on what the adaptor does for each
+ * packet it sends.
+ *
+ * Modes:
+ *	off	debugging disabled
+ *	other	debugging enabled, but for a different subsystem
+ *	on	debugging enabled for the adaptor, logging to /dev/null
+ *
+ * When built with NABUD_DISABLE_DEBUG_LOGGING, the log_debug() calls
+ * are compiled out, which gives the floor to compare against.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnabud/log.h"
+#include "libnabud/missing.h"
+
+#define	DEFAULT_PACKETS		1000000
+
+static const char *conn_name = "IPv4-5816";
+
+/* Stand-in for the real work of sending a packet. */
+static volatile unsigned long bench_packets_sent;
+
+/* Something that would be wasted work if evaluated needlessly. */
+static uint32_t __attribute__((__noinline__))
+bench_segment_crc(uint32_t segment)
+{
+	uint32_t crc = 0xffff;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		crc = (crc >> 1) ^ ((crc & 1) ? 0x8408 : 0) ^ segment;
+	}
+	return crc;
+}
+
+static void __attribute__((__noinline__))
+bench_one_packet(uint32_t image, uint16_t segment)
+{
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Got message 0x%02x.",
+	    conn_name, 0x84);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Sending ACK.", conn_name);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Waiting for NABU to ACK.",
+	    conn_name);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] NABU requested segment %u "
+	    "of image %06X.", conn_name, segment, image);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Loading image %06X.",
+	    conn_name, image);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Using cached image %06X.",
+	    conn_name, image);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Sending segment %u of image "
+	    "%06X%s", conn_name, segment, image, segment == 0 ? "" : " (last)");
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Segment CRC 0x%04x.",
+	    conn_name, bench_segment_crc(segment));
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Sending AUTHORIZED.",
+	    conn_name);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Waiting for ACK.", conn_name);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Sending packet (%u bytes).",
+	    conn_name, 1009);
+	log_debug(LOG_SUBSYS_ADAPTOR, "[%s] Sending FINISHED.", conn_name);
+	bench_packets_sent++;
+}
+
+static void __attribute__((__noreturn__))
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-m off|other|on] [-n packets]\n",
+	    getprogname());
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *mode = "off";
+	unsigned long packets = DEFAULT_PACKETS, i;
+	struct timespec start, end;
+	const char *logfile = NULL;
+	double ns;
+	int ch;
+
+	setprogname(argv[0]);
+
+	while ((ch = getopt(argc, argv, "m:n:")) != -1) {
+		switch (ch) {
+		case 'm':
+			mode = optarg;
+			break;
+
+		case 'n':
+			packets = strtoul(optarg, NULL, 10);
+			if (packets == 0) {
+				usage();
+			}
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	if (strcmp(mode, "off") == 0) {
+		/* Nothing to do. */
+	} else if (strcmp(mode, "other") == 0) {
+		log_debug_enable("nhacp");
+	} else if (strcmp(mode, "on") == 0) {
+		log_debug_enable("adaptor");
+		logfile = "/dev/null";
+	} else {
+		usage();
+	}
+
+	if (! log_init(logfile, 0)) {
+		errx(EXIT_FAILURE, "log_init() failed");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < packets; i++) {
+		bench_one_packet((uint32_t)i & 0xffffff, (uint16_t)i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (double)(end.tv_sec - start.tv_sec) * 1e9 +
+	    (double)(end.tv_nsec - start.tv_nsec);
+
+	printf("%s: debug logging %s, mode %s: %lu packets, "
+	    "%.2f ns/packet\n", getprogname(),
+#ifdef NABUD_DISABLE_DEBUG_LOGGING
+	    "compiled out",
+#else
+	    "compiled in",
+#endif
+	    mode, packets, ns / (double)packets);
+
+	log_fini();
+	return 0;
+}
@@ -0,0 +1,841 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the hot paths in the server, linked against
+ * the real server code.
+ *
+ * Each benchmark is calibrated to run for roughly the requested
+ * time, repeated several times, and the median is reported.  The
+ * output is one tab-separated line per benchmark:
+ *
+ *	name	ns/op	MB/s	iterations
+ *
+ * (MB/s is "-" for benchmarks that don't process a byte stream.)
+ * Lines starting with '#' are comments.  Saving this output gives
+ * a baseline that a later run can be compared against with -b; a
+ * benchmark that got slower than the threshold is flagged, and the
+ * exit status is non-zero.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/socket.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	NABU_PROTO_INLINES
+
+#include "libnabud/atom.h"
+#include "libnabud/conn_io.h"
+#include "libnabud/crc16_genibus.h"
+#include "libnabud/crc8_cdma2000.h"
+#include "libnabud/log.h"
+#include "libnabud/missing.h"
+#include "libnabud/nabu_proto.h"
+#include "libnabud/nabuctl_proto.h"
+#include "libnabud/pak.h"
+
+#include "nabud/adaptor.h"
+#include "nabud/conn.h"
+#include "nabud/image.h"
+
+/* The server code expects this; it normally lives in main.c. */
+const char nabud_version[] = VERSION;
+
+#define	DEFAULT_RUN_MS		200
+#define	DEFAULT_REPEAT		5
+#define	DEFAULT_THRESHOLD	10	/* percent */
+#define	MAX_REPEAT		101
+
+#define	CACHE_NTHREADS		4
+#define	CACHE_NIMAGES		4
+#define	CACHE_IMAGE_SIZE	(32 * 1024)
+
+#define	ATOM_NOBJS		8
+
+struct microbench {
+	const char	*name;
+	size_t		bytes_per_op;
+	bool		(*setup)(void);
+	void		(*run)(uint64_t);
+	void		(*teardown)(void);
+};
+
+static uint8_t	bench_buf[NABU_MAXSEGMENTSIZE];
+static volatile uint32_t bench_sink;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+	    (uint64_t)ts.tv_nsec;
+}
+
+static void
+bench_fill_random(uint8_t *buf, size_t len)
+{
+	uint32_t x = 0x12345678;
+	size_t i;
+
+	/* xorshift32; deterministic so runs are comparable. */
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[i] = (uint8_t)x;
+	}
+}
+
+static struct nabu_connection *
+bench_conn_alloc(const char *name)
+{
+	struct nabu_connection *conn = calloc(1, sizeof(*conn));
+
+	if (conn == NULL) {
+		return NULL;
+	}
+	conn->io.name = strdup(name);
+	conn->io.fd = -1;
+	pthread_mutex_init(&conn->mutex, NULL);
+	return conn;
+}
+
+static void
+bench_conn_free(struct nabu_connection *conn)
+{
+	if (conn != NULL) {
+		conn_image_flush(conn);
+		pthread_mutex_destroy(&conn->mutex);
+		free(conn->io.name);
+		free(conn);
+	}
+}
+
+/*****************************************************************************
+ * CRCs
+ *****************************************************************************/
+
+static void
+bench_crc16_run(uint64_t iters)
+{
+	uint16_t crc = 0;
+
+	while (iters--) {
+		crc ^= crc16_genibus_fini(crc16_genibus_update(bench_buf,
+		    NABU_MAXPACKETSIZE, crc16_genibus_init()));
+	}
+	bench_sink = crc;
+}
+
+static void
+bench_crc8_run(uint64_t iters)
+{
+	uint8_t crc = 0;
+
+	while (iters--) {
+		crc ^= crc8_cdma2000_fini(crc8_cdma2000_update(bench_buf,
+		    NABU_MAXPACKETSIZE, crc8_cdma2000_init()));
+	}
+	bench_sink = crc;
+}
+
+/*****************************************************************************
+ * Packet framing and escaping
+ *****************************************************************************/
+
+static struct nabu_connection *bench_escape_conn;
+
+static bool
+bench_escape_setup(void)
+{
+	bench_escape_conn = bench_conn_alloc("escape");
+	return bench_escape_conn != NULL;
+}
+
+static void
+bench_escape_run(uint64_t iters)
+{
+	while (iters--) {
+		adaptor_escape_packet(bench_escape_conn, bench_buf,
+		    NABU_MAXPACKETSIZE);
+	}
+	bench_sink = (uint32_t)bench_escape_conn->pktlen;
+}
+
+static void
+bench_escape_teardown(void)
+{
+	bench_conn_free(bench_escape_conn);
+	bench_escape_conn = NULL;
+}
+
+/*
+ * This mirrors what adaptor_send_image() does to wrap a segment
+ * of a NABU image in a packet.
+ */
+static void
+bench_framing_run(uint64_t iters)
+{
+	uint16_t segment = 0;
+	uint8_t *pktbuf;
+	size_t pktlen = NABU_MAXPAYLOADSIZE + NABU_HEADERSIZE +
+	    NABU_FOOTERSIZE;
+	size_t i;
+
+	while (iters--) {
+		pktbuf = malloc(pktlen);
+		if (pktbuf == NULL) {
+			errx(EXIT_FAILURE, "out of memory");
+		}
+		i = nabu_init_pkthdr(pktbuf, 1, segment,
+		    (uint16_t)(segment * NABU_MAXPAYLOADSIZE), false);
+		memcpy(&pktbuf[i], &bench_buf[segment * NABU_MAXPAYLOADSIZE],
+		    NABU_MAXPAYLOADSIZE);
+		i += NABU_MAXPAYLOADSIZE;
+		uint16_t crc = crc16_genibus_fini(crc16_genibus_update(pktbuf,
+		    i, crc16_genibus_init()));
+		i += nabu_set_crc(&pktbuf[i], crc);
+		bench_sink = pktbuf[i - 1];
+		free(pktbuf);
+		segment = (segment + 1) & 0x3f;
+	}
+}
+
+/*****************************************************************************
+ * PAK decryption
+ *****************************************************************************/
+
+static bool
+bench_pak_decrypt_setup(void)
+{
+	/* Bail out if we weren't built with a DES implementation. */
+	return pak_decrypt(bench_buf, sizeof(bench_buf));
+}
+
+static void
+bench_pak_decrypt_run(uint64_t iters)
+{
+	while (iters--) {
+		(void) pak_decrypt(bench_buf, sizeof(bench_buf));
+	}
+	bench_sink = bench_buf[0];
+}
+
+/*****************************************************************************
+ * Image cache
+ *****************************************************************************/
+
+static char	bench_cache_dir[] = "/tmp/nabud-microbench.XXXXXX";
+static bool	bench_cache_ready;
+static unsigned int bench_cache_max_images;
+
+struct bench_cache_thread {
+	pthread_t	thread;
+	struct nabu_connection *conn;
+	uint64_t	iters;
+	bool		failed;
+};
+
+static bool
+bench_cache_setup(void)
+{
+	struct image_add_source_args srcargs;
+	struct image_add_channel_args chanargs;
+	char path[sizeof(bench_cache_dir) + sizeof("/000001.nabu")];
+	unsigned int i;
+	FILE *fp;
+
+	if (bench_cache_ready) {
+		return true;
+	}
+
+	if (mkdtemp(bench_cache_dir) == NULL) {
+		warn("mkdtemp");
+		return false;
+	}
+	for (i = 1; i <= CACHE_NIMAGES; i++) {
+		snprintf(path, sizeof(path), "%s/%06X.nabu",
+		    bench_cache_dir, i);
+		if ((fp = fopen(path, "w")) == NULL ||
+		    fwrite(bench_buf, CACHE_IMAGE_SIZE, 1, fp) != 1 ||
+		    fclose(fp) != 0) {
+			warn("%s", path);
+			return false;
+		}
+	}
+
+	memset(&srcargs, 0, sizeof(srcargs));
+	srcargs.name = strdup("bench");
+	srcargs.root = strdup(bench_cache_dir);
+	image_add_source(&srcargs);
+
+	memset(&chanargs, 0, sizeof(chanargs));
+	chanargs.type = IMAGE_CHANNEL_NABU;
+	chanargs.name = strdup("bench");
+	chanargs.source = strdup("bench");
+	chanargs.relpath = ".";
+	chanargs.number = 1;
+	image_add_channel(&chanargs);
+
+	if (image_channel_lookup(1) == NULL) {
+		return false;
+	}
+	bench_cache_ready = true;
+	return true;
+}
+
+static void *
+bench_cache_thread(void *arg)
+{
+	struct bench_cache_thread *t = arg;
+	struct nabu_image *img;
+	uint64_t i;
+
+	/*
+	 * Cycle through the images, just like a NABU that's switching
+	 * between a program and its overlays.  Depending on the size of
+	 * the connection's working set, every load either misses it and
+	 * has to look in the channel cache, or hits it.
+	 */
+	for (i = 0; i < t->iters; i++) {
+		img = image_load(t->conn, (uint32_t)(i % CACHE_NIMAGES) + 1);
+		if (img == NULL) {
+			t->failed = true;
+			break;
+		}
+		image_unload(t->conn, img, false);
+	}
+	return NULL;
+}
+
+static void
+bench_cache_run(uint64_t iters)
+{
+	struct bench_cache_thread threads[CACHE_NTHREADS];
+	struct image_channel *chan = image_channel_lookup(1);
+	char name[sizeof("bench-XX")];
+	unsigned int i;
+
+	for (i = 0; i < CACHE_NTHREADS; i++) {
+		snprintf(name, sizeof(name), "bench-%u", i);
+		threads[i].conn = bench_conn_alloc(name);
+		if (threads[i].conn == NULL) {
+			errx(EXIT_FAILURE, "out of memory");
+		}
+		threads[i].conn->max_images = bench_cache_max_images;
+		conn_set_channel(threads[i].conn, chan);
+		threads[i].iters = iters / CACHE_NTHREADS +
+		    (i < iters % CACHE_NTHREADS ? 1 : 0);
+		threads[i].failed = false;
+		if (pthread_create(&threads[i].thread, NULL,
+				   bench_cache_thread, &threads[i]) != 0) {
+			errx(EXIT_FAILURE, "pthread_create failed");
+		}
+	}
+	for (i = 0; i < CACHE_NTHREADS; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed) {
+			errx(EXIT_FAILURE, "image_load() failed");
+		}
+		bench_conn_free(threads[i].conn);
+	}
+}
+
+static void
+bench_cache_contended_run(uint64_t iters)
+{
+	/* Working set too small to help. */
+	bench_cache_max_images = 1;
+	bench_cache_run(iters);
+}
+
+static void
+bench_cache_working_set_run(uint64_t iters)
+{
+	bench_cache_max_images = CACHE_NIMAGES;
+	bench_cache_run(iters);
+}
+
+static void
+bench_cache_cleanup(void)
+{
+	char path[sizeof(bench_cache_dir) + sizeof("/000001.nabu")];
+	unsigned int i;
+
+	if (! bench_cache_ready) {
+		return;
+	}
+	image_cache_clear(image_channel_lookup(1));
+	for (i = 1; i <= CACHE_NIMAGES; i++) {
+		snprintf(path, sizeof(path), "%s/%06X.nabu",
+		    bench_cache_dir, i);
+		(void) unlink(path);
+	}
+	(void) rmdir(bench_cache_dir);
+}
+
+/*****************************************************************************
+ * Atom lists
+ *****************************************************************************/
+
+static struct atom_list bench_atoms;
+
+/* Something shaped like a LIST_CHANNELS reply. */
+static bool
+bench_atom_build(struct atom_list *list)
+{
+	unsigned int i;
+	bool rv = true;
+
+	for (i = 0; i < ATOM_NOBJS; i++) {
+		rv = rv && atom_list_append_void(list, NABUCTL_OBJ_CHANNEL);
+		rv = rv && atom_list_append_string(list, NABUCTL_CHAN_NAME,
+		    "NABU Network 1984 Cycle v1");
+		rv = rv && atom_list_append_string(list, NABUCTL_CHAN_PATH,
+		    "https://cloud.nabu.ca/cycle1");
+		rv = rv && atom_list_append_string(list,
+		    NABUCTL_CHAN_DEFAULT_FILE, "000001.pak");
+		rv = rv && atom_list_append_number(list, NABUCTL_CHAN_NUMBER,
+		    i + 1);
+		rv = rv && atom_list_append_string(list, NABUCTL_CHAN_TYPE,
+		    "PAK");
+		rv = rv && atom_list_append_string(list, NABUCTL_CHAN_SOURCE,
+		    "NabuRetroNet");
+		rv = rv && atom_list_append_bool(list,
+		    NABUCTL_CHAN_RETRONET_EXTENSIONS, false);
+		rv = rv && atom_list_append_done(list);
+	}
+	rv = rv && atom_list_append_done(list);
+	return rv;
+}
+
+static bool
+bench_atom_setup(void)
+{
+	atom_list_init(&bench_atoms);
+	return true;
+}
+
+static void
+bench_atom_encode_run(uint64_t iters)
+{
+	while (iters--) {
+		atom_list_reset(&bench_atoms);
+		if (! bench_atom_build(&bench_atoms)) {
+			errx(EXIT_FAILURE, "atom_list_append failed");
+		}
+	}
+	bench_sink = atom_list_count(&bench_atoms);
+}
+
+static void
+bench_atom_teardown(void)
+{
+	atom_list_free(&bench_atoms);
+}
+
+struct bench_atom_writer {
+	struct conn_io	io;
+	uint64_t	iters;
+};
+
+static void *
+bench_atom_writer_thread(void *arg)
+{
+	struct bench_atom_writer *w = arg;
+	struct atom_list list;
+	uint64_t i;
+
+	atom_list_init(&list);
+	if (! bench_atom_build(&list)) {
+		errx(EXIT_FAILURE, "atom_list_append failed");
+	}
+	for (i = 0; i < w->iters; i++) {
+		if (! atom_list_send(&w->io, &list)) {
+			break;
+		}
+	}
+	atom_list_free(&list);
+	return NULL;
+}
+
+/*
+ * Decoding is measured on the receive side of a socket pair, with
+ * another thread sending a pre-built list as fast as it can.
+ */
+static void
+bench_atom_decode_run(uint64_t iters)
+{
+	struct bench_atom_writer w;
+	struct conn_io rio;
+	struct atom *atom;
+	pthread_t thread;
+	uint32_t sum = 0;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		err(EXIT_FAILURE, "socketpair");
+	}
+	memset(&w, 0, sizeof(w));
+	memset(&rio, 0, sizeof(rio));
+	if (! conn_io_init(&w.io, strdup("writer"), fds[0]) ||
+	    ! conn_io_init(&rio, strdup("reader"), fds[1])) {
+		errx(EXIT_FAILURE, "conn_io_init failed");
+	}
+	w.iters = iters;
+	if (pthread_create(&thread, NULL, bench_atom_writer_thread, &w) != 0) {
+		errx(EXIT_FAILURE, "pthread_create failed");
+	}
+
+	while (iters--) {
+		atom_list_reset(&bench_atoms);
+		if (! atom_list_recv(&rio, &bench_atoms)) {
+			errx(EXIT_FAILURE, "atom_list_recv failed");
+		}
+		for (atom = atom_list_next(&bench_atoms, NULL); atom != NULL;
+		     atom = atom_list_next(&bench_atoms, atom)) {
+			sum += atom_tag(atom);
+		}
+	}
+	bench_sink = sum;
+
+	pthread_join(thread, NULL);
+	conn_io_fini(&w.io);
+	conn_io_fini(&rio);
+}
+
+static const struct microbench microbenches[] = {
+	{ .name		= "crc16_genibus",
+	  .bytes_per_op	= NABU_MAXPACKETSIZE,
+	  .run		= bench_crc16_run },
+
+	{ .name		= "crc8_cdma2000",
+	  .bytes_per_op	= NABU_MAXPACKETSIZE,
+	  .run		= bench_crc8_run },
+
+	{ .name		= "escape_packet",
+	  .bytes_per_op	= NABU_MAXPACKETSIZE,
+	  .setup	= bench_escape_setup,
+	  .run		= bench_escape_run,
+	  .teardown	= bench_escape_teardown },
+
+	{ .name		= "packet_framing",
+	  .bytes_per_op	= NABU_MAXPAYLOADSIZE,
+	  .run		= bench_framing_run },
+
+	{ .name		= "pak_decrypt",
+	  .bytes_per_op	= sizeof(bench_buf),
+	  .setup	= bench_pak_decrypt_setup,
+	  .run		= bench_pak_decrypt_run },
+
+	{ .name		= "image_cache_contended",
+	  .setup	= bench_cache_setup,
+	  .run		= bench_cache_contended_run },
+
+	{ .name		= "image_working_set",
+	  .setup	= bench_cache_setup,
+	  .run		= bench_cache_working_set_run },
+
+	{ .name		= "atom_list_encode",
+	  .setup	= bench_atom_setup,
+	  .run		= bench_atom_encode_run,
+	  .teardown	= bench_atom_teardown },
+
+	{ .name		= "atom_list_decode",
+	  .setup	= bench_atom_setup,
+	  .run		= bench_atom_decode_run,
+	  .teardown	= bench_atom_teardown },
+};
+static const unsigned int microbench_count =
+    sizeof(microbenches) / sizeof(microbenches[0]);
+
+/*****************************************************************************
+ * Driver
+ *****************************************************************************/
+
+struct bench_result {
+	char		name[64];
+	double		ns_per_op;
+	double		mb_per_sec;
+	uint64_t	iters;
+};
+
+static int
+bench_double_cmp(const void *v1, const void *v2)
+{
+	double a = *(const double *)v1;
+	double b = *(const double *)v2;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/*
+ * bench_measure --
+ *	Calibrate a benchmark to the requested run time, then run it
+ *	the requested number of times and report the median.
+ */
+static void
+bench_measure(const struct microbench *mb, unsigned int run_ms,
+    unsigned int repeat, struct bench_result *res)
+{
+	uint64_t target = (uint64_t)run_ms * 1000000;
+	uint64_t iters = 1, start, elapsed;
+	double samples[MAX_REPEAT];
+	unsigned int i;
+
+	/* Calibrate: grow until a run takes at least 1/10th the target. */
+	for (;;) {
+		start = bench_now();
+		(*mb->run)(iters);
+		elapsed = bench_now() - start;
+		if (elapsed >= target / 10 || iters >= UINT64_C(1) << 40) {
+			break;
+		}
+		iters *= elapsed < target / 100 ? 10 : 2;
+	}
+	if (elapsed > 0) {
+		iters = (uint64_t)((double)iters * (double)target /
+		    (double)elapsed);
+	}
+	if (iters == 0) {
+		iters = 1;
+	}
+
+	for (i = 0; i < repeat; i++) {
+		start = bench_now();
+		(*mb->run)(iters);
+		elapsed = bench_now() - start;
+		samples[i] = (double)elapsed / (double)iters;
+	}
+	qsort(samples, repeat, sizeof(samples[0]), bench_double_cmp);
+
+	snprintf(res->name, sizeof(res->name), "%s", mb->name);
+	res->ns_per_op = samples[repeat / 2];
+	res->mb_per_sec = mb->bytes_per_op == 0 ? 0.0 :
+	    (double)mb->bytes_per_op * 1e3 / res->ns_per_op;
+	res->iters = iters;
+}
+
+static struct bench_result *
+bench_load_baseline(const char *path, unsigned int *countp)
+{
+	struct bench_result *results = NULL, *nresults;
+	unsigned int count = 0;
+	char line[256], mbs[32];
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		struct bench_result r;
+
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		if (sscanf(line, "%63s %lf %31s %" SCNu64, r.name,
+			   &r.ns_per_op, mbs, &r.iters) != 4) {
+			warnx("%s: ignoring malformed line: %s", path, line);
+			continue;
+		}
+		nresults = realloc(results, (count + 1) * sizeof(*results));
+		if (nresults == NULL) {
+			errx(EXIT_FAILURE, "out of memory");
+		}
+		results = nresults;
+		results[count++] = r;
+	}
+	fclose(fp);
+
+	*countp = count;
+	return results;
+}
+
+static void __attribute__((__noreturn__))
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-l] [-b baseline] [-n repeat] "
+	    "[-t ms] [-T threshold%%] [benchmark ...]\n", getprogname());
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *baseline_path = NULL;
+	struct bench_result *baseline = NULL, res;
+	unsigned int nbaseline = 0;
+	unsigned int run_ms = DEFAULT_RUN_MS;
+	unsigned int repeat = DEFAULT_REPEAT;
+	unsigned int threshold = DEFAULT_THRESHOLD;
+	unsigned int i, j, nregressions = 0;
+	bool list_only = false;
+	int ch, k;
+
+	setprogname(argv[0]);
+
+	while ((ch = getopt(argc, argv, "b:ln:t:T:")) != -1) {
+		switch (ch) {
+		case 'b':
+			baseline_path = optarg;
+			break;
+
+		case 'l':
+			list_only = true;
+			break;
+
+		case 'n':
+			repeat = (unsigned int)strtoul(optarg, NULL, 10);
+			if (repeat == 0 || repeat > MAX_REPEAT) {
+				usage();
+			}
+			break;
+
+		case 't':
+			run_ms = (unsigned int)strtoul(optarg, NULL, 10);
+			if (run_ms == 0) {
+				usage();
+			}
+			break;
+
+		case 'T':
+			threshold = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (list_only) {
+		for (i = 0; i < microbench_count; i++) {
+			printf("%s\n", microbenches[i].name);
+		}
+		return 0;
+	}
+
+	/*
+	 * Keep nabud's log messages out of the results on stdout (which
+	 * also get saved as baselines and read back by -b).
+	 */
+	if (! log_init("/dev/stderr", 0)) {
+		errx(EXIT_FAILURE, "log_init() failed");
+	}
+	bench_fill_random(bench_buf, sizeof(bench_buf));
+
+	if (baseline_path != NULL) {
+		baseline = bench_load_baseline(baseline_path, &nbaseline);
+	}
+
+	printf("# %s %s: median of %u runs of ~%u ms\n", getprogname(),
+	    VERSION, repeat, run_ms);
+	printf("# name\tns/op\tMB/s\titerations%s\n",
+	    baseline != NULL ? "\tbaseline-ns/op\tchange" : "");
+
+	for (i = 0; i < microbench_count; i++) {
+		const struct microbench *mb = &microbenches[i];
+
+		if (argc != 0) {
+			for (k = 0; k < argc; k++) {
+				if (strcmp(argv[k], mb->name) == 0) {
+					break;
+				}
+			}
+			if (k == argc) {
+				continue;
+			}
+		}
+
+		if (mb->setup != NULL && ! (*mb->setup)()) {
+			printf("# %s: skipped (setup failed)\n", mb->name);
+			continue;
+		}
+		bench_measure(mb, run_ms, repeat, &res);
+		if (mb->teardown != NULL) {
+			(*mb->teardown)();
+		}
+
+		printf("%s\t%.2f\t", res.name, res.ns_per_op);
+		if (mb->bytes_per_op != 0) {
+			printf("%.1f", res.mb_per_sec);
+		} else {
+			printf("-");
+		}
+		printf("\t%" PRIu64, res.iters);
+
+		if (baseline != NULL) {
+			for (j = 0; j < nbaseline; j++) {
+				if (strcmp(baseline[j].name, res.name) == 0) {
+					break;
+				}
+			}
+			if (j == nbaseline) {
+				printf("\t-\tnew");
+			} else {
+				double change = (res.ns_per_op -
+				    baseline[j].ns_per_op) * 100.0 /
+				    baseline[j].ns_per_op;
+				bool regressed = change > (double)threshold;
+
+				printf("\t%.2f\t%+.1f%%%s",
+				    baseline[j].ns_per_op, change,
+				    regressed ? "\tREGRESSION" : "");
+				if (regressed) {
+					nregressions++;
+				}
+			}
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	bench_cache_cleanup();
+	free(baseline);
+
+	if (nregressions != 0) {
+		printf("# %u benchmark%s regressed by more than %u%%\n",
+		    nregressions, nregressions == 1 ? "" : "s", threshold);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,763 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * End-to-end boot-time measurement over an emulated serial line.
+ *
+ * We create a pseudo-terminal pair, start a private nabud instance
+ * with a Serial connection on the slave side, and play the part of
+ * the NABU on the master side: RESET, CHANGE_CHANNEL, and then every
+ * segment of the boot image, just like the NABU ROM does.
+ *
+ * A pty moves bytes as fast as the kernel can copy them, so we pace
+ * both directions at the emulated line rate (1 start bit, 8 data bits,
+ * and the configured number of stop bits per character).  A byte sent
+ * by nabud is not considered "received" until the time it would have
+ * taken to clock it over the wire has elapsed, and a request from the
+ * "NABU" is not handed to nabud until it would have finished arriving.
+ * The wall-clock time to load the image therefore includes the line
+ * time plus all of nabud's own overhead (turnaround, packet assembly,
+ * escaping, image cache), which is what we want to measure.
+ *
+ * Caveats:
+ *
+ * ==> Hardware flow control cannot be emulated on a pty; -F only
+ *     passes FlowControl through to the nabud configuration.
+ *
+ * ==> nabud always creates its control socket at the default path,
+ *     so this refuses to run if another nabud is already listening
+ *     there.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	NABU_PROTO_INLINES
+
+#include "libnabud/missing.h"
+#include "libnabud/nabu_proto.h"
+#include "libnabud/nabuctl_proto.h"
+
+/* Same derivation as in nabud/conn.c. */
+#define	NABU_NATIVE_BPS		((3579540 / 2) / 16)
+
+#define	SIM_CHANNEL		1
+#define	SIM_IMAGE		0x000001
+
+#define	MAX_RUNS		100
+
+static const uint8_t ack_seq[] = NABU_MSGSEQ_ACK;
+
+static int	sim_fd = -1;		/* pty master */
+static pid_t	sim_pid = -1;		/* nabud */
+static char	sim_dir[] = "/tmp/serial_bench.XXXXXX";
+static bool	sim_keep;
+
+/* Emulated line. */
+static uint64_t	char_ns;		/* time to clock one character */
+static uint64_t	rx_free;		/* when the rx wire goes idle */
+static uint64_t	vnow;			/* "NABU" virtual time */
+
+static uint8_t	rbuf[4096];
+static uint64_t	rbuf_start;		/* arrival of rbuf[0] - char_ns */
+static size_t	rlen, roff;
+
+/* Per-run statistics. */
+static uint64_t	rx_bytes, tx_bytes;
+static unsigned int segments;
+
+static uint64_t
+sim_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+	    (uint64_t)ts.tv_nsec;
+}
+
+static void
+sim_sleep_until(uint64_t when)
+{
+	struct timespec ts;
+
+	if (when <= sim_now()) {
+		return;
+	}
+	ts.tv_sec = (time_t)(when / UINT64_C(1000000000));
+	ts.tv_nsec = (long)(when % UINT64_C(1000000000));
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR) {
+		/* keep sleeping */
+	}
+}
+
+/*
+ * sim_send --
+ *	Send bytes to nabud.  They are delivered once they would have
+ *	finished arriving over the emulated line.
+ */
+static bool
+sim_send(const void *vbuf, size_t len)
+{
+	const uint8_t *buf = vbuf;
+	uint64_t start;
+	ssize_t actual;
+
+	start = sim_now();
+	if (vnow > start) {
+		start = vnow;
+	}
+	vnow = start + len * char_ns;
+	sim_sleep_until(vnow);
+
+	tx_bytes += len;
+	while (len != 0) {
+		actual = write(sim_fd, buf, len);
+		if (actual <= 0) {
+			if (actual < 0 && errno == EINTR) {
+				continue;
+			}
+			warnx("write to pty failed: %s",
+			    actual == 0 ? "short write" : strerror(errno));
+			return false;
+		}
+		buf += actual;
+		len -= (size_t)actual;
+	}
+	return true;
+}
+
+static bool
+sim_send_byte(uint8_t val)
+{
+	return sim_send(&val, 1);
+}
+
+/*
+ * sim_recv_byte --
+ *	Receive a byte from nabud.  We don't actually sleep here;
+ *	instead, the NABU's virtual clock advances to the time the
+ *	byte would have arrived, and the next send (or the end of
+ *	the run) waits for it.  That avoids a nanosleep per byte.
+ */
+static bool
+sim_recv_byte(uint8_t *valp, uint64_t timeout_ns)
+{
+	ssize_t actual;
+	uint64_t t, arrival;
+
+	if (roff == rlen) {
+		struct timeval tv;
+		fd_set fds;
+
+		FD_ZERO(&fds);
+		FD_SET(sim_fd, &fds);
+		tv.tv_sec = (time_t)(timeout_ns / UINT64_C(1000000000));
+		tv.tv_usec =
+		    (long)((timeout_ns % UINT64_C(1000000000)) / 1000);
+		if (select(sim_fd + 1, &fds, NULL, NULL, &tv) <= 0) {
+			return false;
+		}
+		actual = read(sim_fd, rbuf, sizeof(rbuf));
+		if (actual <= 0) {
+			if (actual < 0 && errno != EINTR) {
+				warnx("read from pty failed: %s",
+				    strerror(errno));
+			}
+			return false;
+		}
+		t = sim_now();
+		rbuf_start = t > rx_free ? t : rx_free;
+		rlen = (size_t)actual;
+		roff = 0;
+		rx_free = rbuf_start + rlen * char_ns;
+	}
+	arrival = rbuf_start + (roff + 1) * char_ns;
+	if (arrival > vnow) {
+		vnow = arrival;
+	}
+	rx_bytes++;
+	*valp = rbuf[roff++];
+	return true;
+}
+
+static void
+sim_drain(void)
+{
+	uint8_t c;
+
+	roff = rlen = 0;
+	while (sim_recv_byte(&c, UINT64_C(100000000))) {
+		/* discard */
+	}
+	roff = rlen = 0;
+}
+
+static bool
+sim_expect(const uint8_t *seq, size_t len, const char *what)
+{
+	uint8_t c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (! sim_recv_byte(&c, UINT64_C(5000000000))) {
+			warnx("timed out waiting for %s", what);
+			return false;
+		}
+		if (c != seq[i]) {
+			warnx("expected %s, got $%02X", what, c);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+sim_expect_ack(void)
+{
+	return sim_expect(ack_seq, sizeof(ack_seq), "ACK");
+}
+
+static bool
+sim_expect_confirmed(void)
+{
+	static const uint8_t confirmed = NABU_STATE_CONFIRMED;
+
+	return sim_expect(&confirmed, 1, "CONFIRMED");
+}
+
+static bool
+sim_reset(void)
+{
+	return sim_send_byte(NABU_MSG_RESET) &&
+	       sim_expect_ack() &&
+	       sim_expect_confirmed();
+}
+
+static bool
+sim_change_channel(void)
+{
+	uint8_t msg[2];
+
+	nabu_set_uint16(msg, SIM_CHANNEL);
+	return sim_send_byte(NABU_MSG_CHANGE_CHANNEL) &&
+	       sim_expect_ack() &&
+	       sim_send(msg, sizeof(msg)) &&
+	       sim_expect_confirmed();
+}
+
+/*
+ * sim_get_segment --
+ *	Request a single segment of the boot image and receive the
+ *	packet.  Sets *lastp if it was the last segment.
+ */
+static bool
+sim_get_segment(uint8_t segment, bool *lastp)
+{
+	uint8_t pkt[NABU_MAXPACKETSIZE];
+	size_t pktlen = 0;
+	bool have_escape = false;
+	uint8_t msg[4], c;
+
+	if (! sim_send_byte(NABU_MSG_PACKET_REQUEST) ||
+	    ! sim_expect_ack()) {
+		return false;
+	}
+	msg[0] = segment;
+	nabu_set_uint24(&msg[1], SIM_IMAGE);
+	if (! sim_send(msg, sizeof(msg)) ||
+	    ! sim_expect_confirmed()) {
+		return false;
+	}
+
+	if (! sim_recv_byte(&c, UINT64_C(5000000000))) {
+		warnx("timed out waiting for segment %u", segment);
+		return false;
+	}
+	if (c != NABU_SERVICE_AUTHORIZED) {
+		warnx("segment %u: %s", segment,
+		    c == NABU_SERVICE_UNAUTHORIZED ? "UNAUTHORIZED"
+						   : "unexpected reply");
+		return false;
+	}
+	if (! sim_send(ack_seq, sizeof(ack_seq))) {
+		return false;
+	}
+
+	for (;;) {
+		if (! sim_recv_byte(&c, UINT64_C(5000000000))) {
+			warnx("timed out receiving segment %u", segment);
+			return false;
+		}
+		if (have_escape) {
+			have_escape = false;
+			if (c == NABU_STATE_DONE) {
+				break;
+			}
+			if (c != NABU_MSG_ESCAPE) {
+				warnx("bad escape byte $%02X", c);
+				return false;
+			}
+		} else if (c == NABU_MSG_ESCAPE) {
+			have_escape = true;
+			continue;
+		}
+		if (pktlen == sizeof(pkt)) {
+			warnx("segment %u: packet overflow", segment);
+			return false;
+		}
+		pkt[pktlen++] = c;
+	}
+
+	if (pktlen < NABU_HEADERSIZE + NABU_FOOTERSIZE) {
+		warnx("segment %u: runt packet (%zu bytes)", segment, pktlen);
+		return false;
+	}
+
+	const struct nabu_pkthdr *hdr = (const void *)pkt;
+	*lastp = (hdr->type & 0x10) != 0;
+	segments++;
+	return true;
+}
+
+/*
+ * sim_boot --
+ *	Perform one complete boot sequence, returning the wall-clock
+ *	time it took in nanoseconds (0 on failure).
+ */
+static uint64_t
+sim_boot(void)
+{
+	uint64_t start;
+	unsigned int segment;
+	bool last = false;
+
+	rx_bytes = tx_bytes = 0;
+	segments = 0;
+
+	start = sim_now();
+	vnow = rx_free = start;
+
+	if (! sim_reset() || ! sim_change_channel()) {
+		return 0;
+	}
+	for (segment = 0; segment <= 0xff && !last; segment++) {
+		if (! sim_get_segment((uint8_t)segment, &last)) {
+			return 0;
+		}
+	}
+	if (! last) {
+		warnx("image has too many segments");
+		return 0;
+	}
+
+	/* Wait for the final byte to "arrive". */
+	sim_sleep_until(vnow);
+	return sim_now() - start;
+}
+
+/*
+ * sim_remove --
+ *	Remove one of the files (or directories) we created in
+ *	the scratch directory.
+ */
+static void
+sim_remove(const char *name, bool isdir)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s", sim_dir, name) < 0) {
+		return;
+	}
+	if ((isdir ? rmdir(path) : unlink(path)) < 0 && errno != ENOENT) {
+		warn("%s", path);
+	}
+	free(path);
+}
+
+static void
+sim_cleanup(void)
+{
+	int status;
+
+	if (sim_pid > 0) {
+		(void) kill(sim_pid, SIGTERM);
+		(void) waitpid(sim_pid, &status, 0);
+		sim_pid = -1;
+	}
+	if (sim_keep) {
+		fprintf(stderr, "Leaving files in %s\n", sim_dir);
+		return;
+	}
+	sim_remove("sim/000001.nabu", false);
+	sim_remove("sim", true);
+	sim_remove("nabud.conf", false);
+	sim_remove("nabud.log", false);
+	if (rmdir(sim_dir) < 0) {
+		warn("%s", sim_dir);
+	}
+}
+
+static void
+sim_write_file(const char *name, const void *buf, size_t len)
+{
+	char *path;
+	FILE *fp;
+
+	if (asprintf(&path, "%s/%s", sim_dir, name) < 0) {
+		errx(1, "asprintf failed");
+	}
+	fp = fopen(path, "w");
+	if (fp == NULL || fwrite(buf, 1, len, fp) != len || fclose(fp) != 0) {
+		err(1, "%s", path);
+	}
+	free(path);
+}
+
+static void
+sim_make_image(size_t size)
+{
+	uint8_t *buf;
+	char *path;
+	size_t i;
+
+	if (asprintf(&path, "%s/sim", sim_dir) < 0) {
+		errx(1, "asprintf failed");
+	}
+	if (mkdir(path, 0755) < 0) {
+		err(1, "%s", path);
+	}
+	free(path);
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		errx(1, "unable to allocate image");
+	}
+	srandom(0x4e414255);	/* reproducible contents */
+	for (i = 0; i < size; i++) {
+		buf[i] = (uint8_t)random();
+	}
+	sim_write_file("sim/000001.nabu", buf, size);
+	free(buf);
+}
+
+static void
+sim_make_config(const char *slave, long baud, long stop_bits,
+    bool flow_control)
+{
+	char *conf, bauds[32];
+	int len;
+
+	bauds[0] = '\0';
+	if (baud != 0) {
+		snprintf(bauds, sizeof(bauds), " \"Baud\": %ld,", baud);
+	}
+	len = asprintf(&conf,
+	    "{\n"
+	    "  \"Sources\": [ { \"Name\": \"Sim\", \"Location\": \"%s\" } ],\n"
+	    "  \"Channels\": [ { \"Name\": \"sim\", \"Number\": %d,"
+	    " \"Type\": \"nabu\", \"Source\": \"Sim\" } ],\n"
+	    "  \"Connections\": [ { \"Type\": \"Serial\", \"Port\": \"%s\","
+	    " \"Channel\": %d,%s \"StopBits\": %ld,"
+	    " \"FlowControl\": %s } ]\n"
+	    "}\n",
+	    sim_dir, SIM_CHANNEL, slave, SIM_CHANNEL, bauds, stop_bits,
+	    flow_control ? "true" : "false");
+	if (len < 0) {
+		errx(1, "asprintf failed");
+	}
+	sim_write_file("nabud.conf", conf, (size_t)len);
+	free(conf);
+}
+
+/*
+ * sim_check_control --
+ *	Make sure there isn't already a nabud listening on the
+ *	default control socket; ours would steal it.
+ */
+static void
+sim_check_control(void)
+{
+	struct sockaddr_un sun;
+	int sock;
+
+	sock = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return;
+	}
+	memset(&sun, 0, sizeof(sun));
+	strncpy(sun.sun_path, NABUCTL_PATH_DEFAULT, sizeof(sun.sun_path) - 1);
+	sun.sun_family = AF_LOCAL;
+	if (connect(sock, (struct sockaddr *)&sun, SUN_LEN(&sun)) == 0) {
+		errx(1, "a nabud is already running (%s); stop it first",
+		    NABUCTL_PATH_DEFAULT);
+	}
+	close(sock);
+}
+
+static void
+sim_start_nabud(const char *nabud)
+{
+	char *conf, *logfile;
+	int fd;
+
+	if (asprintf(&conf, "%s/nabud.conf", sim_dir) < 0 ||
+	    asprintf(&logfile, "%s/nabud.log", sim_dir) < 0) {
+		errx(1, "asprintf failed");
+	}
+
+	sim_pid = fork();
+	if (sim_pid < 0) {
+		err(1, "fork");
+	}
+	if (sim_pid == 0) {
+		fd = open(logfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0) {
+			(void) dup2(fd, STDOUT_FILENO);
+			(void) dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		close(sim_fd);
+		execl(nabud, nabud, "-f", "-c", conf, (char *)NULL);
+		fprintf(stderr, "exec %s: %s\n", nabud, strerror(errno));
+		_exit(127);
+	}
+	free(conf);
+	free(logfile);
+}
+
+/*
+ * sim_wait_ready --
+ *	Poke nabud with RESET until it answers.
+ */
+static bool
+sim_wait_ready(void)
+{
+	unsigned int tries;
+	int status;
+
+	for (tries = 0; tries < 50; tries++) {
+		if (waitpid(sim_pid, &status, WNOHANG) == sim_pid) {
+			sim_pid = -1;
+			warnx("nabud exited prematurely");
+			return false;
+		}
+		vnow = rx_free = sim_now();
+		if (sim_send_byte(NABU_MSG_RESET) &&
+		    sim_expect_ack() && sim_expect_confirmed()) {
+			return true;
+		}
+		sim_drain();
+	}
+	warnx("nabud did not respond");
+	return false;
+}
+
+static int
+sim_cmp(const void *v1, const void *v2)
+{
+	uint64_t a = *(const uint64_t *)v1;
+	uint64_t b = *(const uint64_t *)v2;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static void __attribute__((__noreturn__))
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: %s [-Fk] [-b baud] [-i imagesize] [-n runs]\n"
+	    "       %*s [-N nabud] [-s stopbits]\n",
+	    getprogname(), (int)strlen(getprogname()), "");
+	exit(1);
+}
+
+static long
+parse_number(const char *cp, const char *what, long min, long max)
+{
+	char *ep;
+	long val;
+
+	errno = 0;
+	val = strtol(cp, &ep, 0);
+	if (errno != 0 || *cp == '\0' || *ep != '\0' ||
+	    val < min || val > max) {
+		errx(1, "invalid %s: %s", what, cp);
+	}
+	return val;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *nabud = "../nabud/nabud";
+	long baud = 0, stop_bits = 2, image_size = 32768, nruns = 3;
+	bool flow_control = false;
+	uint64_t times[MAX_RUNS], line_ns;
+	struct termios t;
+	const char *slave;
+	int ch, slave_fd, rv = 1;
+	long i;
+
+	setprogname(argv[0]);
+
+	while ((ch = getopt(argc, argv, "b:Fi:kn:N:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			baud = parse_number(optarg, "baud rate", 1, 4000000);
+			break;
+
+		case 'F':
+			flow_control = true;
+			break;
+
+		case 'i':
+			image_size = parse_number(optarg, "image size", 1,
+			    255 * NABU_MAXPAYLOADSIZE);
+			break;
+
+		case 'k':
+			sim_keep = true;
+			break;
+
+		case 'n':
+			nruns = parse_number(optarg, "run count", 1, MAX_RUNS);
+			break;
+
+		case 'N':
+			nabud = optarg;
+			break;
+
+		case 's':
+			stop_bits = parse_number(optarg, "stop bits", 1, 2);
+			break;
+
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	if (optind != argc) {
+		usage();
+	}
+
+	if (access(nabud, X_OK) < 0) {
+		err(1, "%s", nabud);
+	}
+	sim_check_control();
+
+	/* 1 start bit + 8 data bits + stop bits. */
+	char_ns = (UINT64_C(1000000000) * (uint64_t)(9 + stop_bits)) /
+	    (uint64_t)(baud != 0 ? baud : NABU_NATIVE_BPS);
+
+	sim_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (sim_fd < 0) {
+		err(1, "posix_openpt");
+	}
+	if (grantpt(sim_fd) < 0 || unlockpt(sim_fd) < 0 ||
+	    (slave = ptsname(sim_fd)) == NULL) {
+		err(1, "unable to set up pty");
+	}
+	/*
+	 * Hold the slave open ourselves so that the master doesn't see
+	 * a hangup before nabud opens it (or between its open and ours
+	 * closing), and make sure nothing is cooked in the meantime.
+	 */
+	slave_fd = open(slave, O_RDWR | O_NOCTTY);
+	if (slave_fd < 0) {
+		err(1, "%s", slave);
+	}
+	if (tcgetattr(slave_fd, &t) == 0) {
+		cfmakeraw(&t);
+		(void) tcsetattr(slave_fd, TCSANOW, &t);
+	}
+
+	if (mkdtemp(sim_dir) == NULL) {
+		err(1, "mkdtemp");
+	}
+	sim_make_image((size_t)image_size);
+	sim_make_config(slave, baud, stop_bits, flow_control);
+	sim_start_nabud(nabud);
+
+	if (! sim_wait_ready()) {
+		sim_keep = true;
+		goto out;
+	}
+
+	printf("# %s: 8N%ld-%ld%s, %ld byte image\n", slave, stop_bits,
+	    baud != 0 ? baud : (long)NABU_NATIVE_BPS,
+	    flow_control ? "+RTS/CTS" : "", image_size);
+
+	line_ns = 0;
+	for (i = 0; i < nruns; i++) {
+		times[i] = sim_boot();
+		if (times[i] == 0) {
+			warnx("run %ld failed", i + 1);
+			sim_keep = true;
+			goto out;
+		}
+		line_ns = (rx_bytes + tx_bytes) * char_ns;
+		printf("run %ld: %.3f s, %u segments, %" PRIu64
+		    " bytes on the wire, %.0f payload bytes/s\n",
+		    i + 1, (double)times[i] / 1e9, segments,
+		    rx_bytes + tx_bytes,
+		    (double)image_size / ((double)times[i] / 1e9));
+	}
+
+	qsort(times, (size_t)nruns, sizeof(times[0]), sim_cmp);
+	printf("median: %.3f s (line time %.3f s, overhead %.1f%%)\n",
+	    (double)times[nruns / 2] / 1e9, (double)line_ns / 1e9,
+	    100.0 * ((double)times[nruns / 2] - (double)line_ns) /
+	    (double)line_ns);
+	rv = 0;
+
+ out:
+	sim_cleanup();
+	close(slave_fd);
+	close(sim_fd);
+	return rv;
+}
@@ -0,0 +1,594 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * chanpack --
+ *
+ * Build a channel pack archive (see libnabud/chanpack.h) from one or
+ * more directories of NABU images, e.g. a pakslurp mirror.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <err.h>	/* XXX HAVE_ERR_H-ize, please */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	NABU_PROTO_INLINES
+
+#include "libnabud/chanpack.h"
+#include "libnabud/log.h"
+#include "libnabud/missing.h"
+#include "libnabud/nabu_proto.h"
+#include "libnabud/pak.h"
+
+/*
+ * Encrypted PAK names are an MD5 hash of the image number, so we
+ * can't go backwards.  Instead, we generate the names of all of the
+ * images up to this number and look them up.  (Published cycles top
+ * out at 0x2FF.)
+ */
+#define	MAX_ENCRYPTED_IMAGE	0xfff
+
+struct pack_entry {
+	char		*dir;
+	char		*name;
+	uint8_t		*data;
+	size_t		length;
+	uint32_t	number;
+	unsigned int	type;
+	uint32_t	data_off;
+};
+
+static struct pack_entry *entries;
+static size_t nentries, maxentries;
+static char **encrypted_names;
+static bool verbose;
+
+static void __attribute__((__noreturn__))
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-mv] -o archive dir [dir ...]\n",
+	    getprogname());
+	fprintf(stderr, "       %s -l archive\n", getprogname());
+	fprintf(stderr, "       -l         list the contents of an archive\n");
+	fprintf(stderr, "       -m         each dir is a mirror of channel "
+			"directories\n");
+	fprintf(stderr, "       -o archive specifies the archive to create\n");
+	fprintf(stderr, "       -v         verbose\n");
+	exit(EXIT_FAILURE);
+}
+
+static const char *
+type_name(unsigned int type)
+{
+	switch (type) {
+	case CHANPACK_TYPE_NABU:	return "nabu";
+	case CHANPACK_TYPE_PAK:		return "pak";
+	default:			return "file";
+	}
+}
+
+/*
+ * parse_image_name --
+ *	Parse an "XXXXXX.<suffix>" image file name.
+ */
+static bool
+parse_image_name(const char *name, const char *suffix, uint32_t *numberp)
+{
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		if (! isxdigit((unsigned char)name[i])) {
+			return false;
+		}
+	}
+	if (strcasecmp(&name[6], suffix) != 0) {
+		return false;
+	}
+	*numberp = (uint32_t)strtoul(name, NULL, 16);
+	return true;
+}
+
+/*
+ * lookup_encrypted_name --
+ *	Map an encrypted PAK name back to an image number.
+ */
+static bool
+lookup_encrypted_name(const char *name, uint32_t *numberp)
+{
+	uint32_t i;
+
+	if (encrypted_names == NULL) {
+		encrypted_names = calloc(MAX_ENCRYPTED_IMAGE + 1,
+		    sizeof(*encrypted_names));
+		if (encrypted_names == NULL) {
+			err(EXIT_FAILURE, "calloc");
+		}
+		for (i = 0; i <= MAX_ENCRYPTED_IMAGE; i++) {
+			encrypted_names[i] = pak_encrypted_name(i);
+		}
+	}
+	for (i = 0; i <= MAX_ENCRYPTED_IMAGE; i++) {
+		if (encrypted_names[i] != NULL &&
+		    strcasecmp(encrypted_names[i], name) == 0) {
+			*numberp = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct pack_entry *
+find_entry(const char *dir, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nentries; i++) {
+		if (strcmp(entries[i].dir, dir) == 0 &&
+		    strcmp(entries[i].name, name) == 0) {
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+static uint8_t *
+read_file(const char *path, size_t *lengthp)
+{
+	struct stat sb;
+	uint8_t *data;
+	FILE *fp;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		warn("%s", path);
+		return NULL;
+	}
+	if (fstat(fileno(fp), &sb) < 0) {
+		warn("%s", path);
+		fclose(fp);
+		return NULL;
+	}
+	if (sb.st_size == 0 || sb.st_size > NABU_MAXSEGMENTSIZE) {
+		warnx("%s: size %lld is nonsensical; skipping.", path,
+		    (long long)sb.st_size);
+		fclose(fp);
+		return NULL;
+	}
+	if ((data = malloc((size_t)sb.st_size)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	if (fread(data, (size_t)sb.st_size, 1, fp) != 1) {
+		warn("%s", path);
+		free(data);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	*lengthp = (size_t)sb.st_size;
+	return data;
+}
+
+/*
+ * add_file --
+ *	Add a file from a channel directory.
+ */
+static void
+add_file(const char *dir, const char *dirpath, const char *fname)
+{
+	struct pack_entry *ent;
+	char *path, name[sizeof("000001.nabu")];
+	const char *ename = fname;
+	uint32_t number = CHANPACK_NUMBER_NAMED;
+	unsigned int type = CHANPACK_TYPE_OTHER;
+	bool encrypted = false;
+	uint8_t *data;
+	size_t length;
+
+	if (parse_image_name(fname, ".nabu", &number)) {
+		type = CHANPACK_TYPE_NABU;
+		snprintf(name, sizeof(name), "%06X.nabu", number);
+		ename = name;
+	} else if (parse_image_name(fname, ".pak", &number)) {
+		type = CHANPACK_TYPE_PAK;
+		snprintf(name, sizeof(name), "%06X.pak", number);
+		ename = name;
+	} else if (lookup_encrypted_name(fname, &number)) {
+		type = CHANPACK_TYPE_PAK;
+		encrypted = true;
+		snprintf(name, sizeof(name), "%06X.pak", number);
+		ename = name;
+	} else {
+		number = CHANPACK_NUMBER_NAMED;
+	}
+
+	if ((ent = find_entry(dir, ename)) != NULL) {
+		/* Prefer the unencrypted version of a PAK. */
+		if (encrypted) {
+			if (verbose) {
+				printf("%s/%s: have %s already; skipping.\n",
+				    dirpath, fname, ename);
+			}
+			return;
+		}
+		free(ent->data);
+		ent->data = NULL;
+	}
+
+	if (asprintf(&path, "%s/%s", dirpath, fname) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+	data = read_file(path, &length);
+	if (data == NULL) {
+		free(path);
+		return;
+	}
+	if (encrypted) {
+		if ((length % PAK_BLOCKSIZE) != 0 || ! pak_decrypt(data, length)) {
+			warnx("%s: unable to decrypt; skipping.", path);
+			free(data);
+			free(path);
+			return;
+		}
+	}
+	if (verbose) {
+		printf("%s -> %s/%s (%s, %zu bytes)\n", path, dir, ename,
+		    type_name(type), length);
+	}
+	free(path);
+
+	if (ent == NULL) {
+		if (nentries == maxentries) {
+			maxentries = maxentries ? maxentries * 2 : 256;
+			entries = realloc(entries,
+			    maxentries * sizeof(*entries));
+			if (entries == NULL) {
+				err(EXIT_FAILURE, "realloc");
+			}
+		}
+		ent = &entries[nentries++];
+		memset(ent, 0, sizeof(*ent));
+		if ((ent->dir = strdup(dir)) == NULL ||
+		    (ent->name = strdup(ename)) == NULL) {
+			err(EXIT_FAILURE, "strdup");
+		}
+	}
+	ent->data = data;
+	ent->length = length;
+	ent->number = number;
+	ent->type = type;
+}
+
+/*
+ * add_channel --
+ *	Add all of the files in a channel directory.
+ */
+static void
+add_channel(const char *dirpath)
+{
+	struct dirent *de;
+	struct stat sb;
+	const char *dir;
+	char *path, *copy;
+	DIR *d;
+	size_t len;
+
+	/* The channel is named after the last component of the path. */
+	if ((copy = strdup(dirpath)) == NULL) {
+		err(EXIT_FAILURE, "strdup");
+	}
+	while ((len = strlen(copy)) > 1 && copy[len - 1] == '/') {
+		copy[len - 1] = '\0';
+	}
+	dir = strrchr(copy, '/');
+	dir = dir != NULL ? dir + 1 : copy;
+
+	if ((d = opendir(dirpath)) == NULL) {
+		err(EXIT_FAILURE, "%s", dirpath);
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		if (asprintf(&path, "%s/%s", dirpath, de->d_name) < 0) {
+			err(EXIT_FAILURE, "asprintf");
+		}
+		if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode)) {
+			add_file(dir, dirpath, de->d_name);
+		}
+		free(path);
+	}
+	closedir(d);
+	free(copy);
+}
+
+/*
+ * add_mirror --
+ *	Add each sub-directory of a mirror (e.g. one created by
+ *	pakslurp) as a channel.
+ */
+static void
+add_mirror(const char *mirror)
+{
+	struct dirent *de;
+	struct stat sb;
+	char *path;
+	DIR *d;
+
+	if ((d = opendir(mirror)) == NULL) {
+		err(EXIT_FAILURE, "%s", mirror);
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		if (asprintf(&path, "%s/%s", mirror, de->d_name) < 0) {
+			err(EXIT_FAILURE, "asprintf");
+		}
+		if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+			add_channel(path);
+		}
+		free(path);
+	}
+	closedir(d);
+}
+
+static int
+entry_compare(const void *v1, const void *v2)
+{
+	const struct pack_entry *e1 = v1, *e2 = v2;
+	int rv = strcmp(e1->dir, e2->dir);
+
+	return rv != 0 ? rv : strcmp(e1->name, e2->name);
+}
+
+static void
+write_zeros(FILE *fp, size_t count)
+{
+	static const uint8_t zeros[CHANPACK_ALIGN];
+
+	if (count != 0 && fwrite(zeros, count, 1, fp) != 1) {
+		err(EXIT_FAILURE, "fwrite");
+	}
+}
+
+/*
+ * strtab_add --
+ *	Add a string to the string table, re-using an identical one
+ *	if it's already there (channel directory names are repeated
+ *	for every entry).
+ */
+static uint32_t
+strtab_add(char **strtabp, size_t *sizep, const char *str)
+{
+	size_t len = strlen(str) + 1, off;
+
+	for (off = 0; off < *sizep; off += strlen(*strtabp + off) + 1) {
+		if (strcmp(*strtabp + off, str) == 0) {
+			return (uint32_t)off;
+		}
+	}
+	if ((*strtabp = realloc(*strtabp, *sizep + len)) == NULL) {
+		err(EXIT_FAILURE, "realloc");
+	}
+	memcpy(*strtabp + *sizep, str, len);
+	off = *sizep;
+	*sizep += len;
+	return (uint32_t)off;
+}
+
+/*
+ * write_archive --
+ *	Write the archive.  It's written to a temporary file which is
+ *	then renamed into place, so that a running server that has
+ *	the old one mapped is not disturbed.
+ */
+static void
+write_archive(const char *archive)
+{
+	struct chanpack_header hdr;
+	struct chanpack_entry *index;
+	char *strtab = NULL, *tmppath;
+	size_t strtab_size = 0, i;
+	uint64_t off;
+	FILE *fp;
+
+	qsort(entries, nentries, sizeof(*entries), entry_compare);
+
+	if ((index = calloc(nentries ? nentries : 1, sizeof(*index))) == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+	for (i = 0; i < nentries; i++) {
+		nabu_set_uint32(index[i].dir_off,
+		    strtab_add(&strtab, &strtab_size, entries[i].dir));
+		nabu_set_uint32(index[i].name_off,
+		    strtab_add(&strtab, &strtab_size, entries[i].name));
+	}
+	if (strtab_size == 0) {
+		/* Must have at least a NUL. */
+		(void) strtab_add(&strtab, &strtab_size, "");
+	}
+
+	/* Lay out the payloads. */
+	off = sizeof(hdr) + nentries * sizeof(*index) + strtab_size;
+	for (i = 0; i < nentries; i++) {
+		off = (off + CHANPACK_ALIGN - 1) & ~(uint64_t)(CHANPACK_ALIGN - 1);
+		if (off + entries[i].length > UINT32_MAX) {
+			errx(EXIT_FAILURE, "Archive would be too large.");
+		}
+		entries[i].data_off = (uint32_t)off;
+		nabu_set_uint32(index[i].data_off, entries[i].data_off);
+		nabu_set_uint32(index[i].data_len, (uint32_t)entries[i].length);
+		nabu_set_uint32(index[i].number, entries[i].number);
+		index[i].type = (uint8_t)entries[i].type;
+		off += entries[i].length;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHANPACK_MAGIC, CHANPACK_MAGICLEN);
+	nabu_set_uint32(hdr.version, CHANPACK_VERSION);
+	nabu_set_uint32(hdr.nentries, (uint32_t)nentries);
+	nabu_set_uint32(hdr.index_off, sizeof(hdr));
+	nabu_set_uint32(hdr.strtab_off,
+	    (uint32_t)(sizeof(hdr) + nentries * sizeof(*index)));
+	nabu_set_uint32(hdr.strtab_size, (uint32_t)strtab_size);
+
+	if (asprintf(&tmppath, "%s.tmp", archive) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+	if ((fp = fopen(tmppath, "wb")) == NULL) {
+		err(EXIT_FAILURE, "%s", tmppath);
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    (nentries != 0 &&
+	     fwrite(index, sizeof(*index), nentries, fp) != nentries) ||
+	    fwrite(strtab, strtab_size, 1, fp) != 1) {
+		err(EXIT_FAILURE, "%s", tmppath);
+	}
+	off = sizeof(hdr) + nentries * sizeof(*index) + strtab_size;
+	for (i = 0; i < nentries; i++) {
+		write_zeros(fp, entries[i].data_off - off);
+		if (fwrite(entries[i].data, entries[i].length, 1, fp) != 1) {
+			err(EXIT_FAILURE, "%s", tmppath);
+		}
+		off = entries[i].data_off + entries[i].length;
+	}
+	if (fclose(fp) != 0) {
+		err(EXIT_FAILURE, "%s", tmppath);
+	}
+	if (rename(tmppath, archive) < 0) {
+		err(EXIT_FAILURE, "rename %s -> %s", tmppath, archive);
+	}
+
+	printf("%s: %zu entries, %llu bytes\n", archive, nentries,
+	    (unsigned long long)off);
+
+	free(tmppath);
+	free(strtab);
+	free(index);
+}
+
+/*
+ * list_archive --
+ *	List the contents of an archive.
+ */
+static void
+list_archive(const char *archive)
+{
+	struct chanpack *pack;
+	struct chanpack_ent ent;
+	uint32_t i;
+
+	if ((pack = chanpack_open(archive)) == NULL) {
+		/* Error already logged. */
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < pack->nentries; i++) {
+		chanpack_get(pack, i, &ent);
+		if (ent.number == CHANPACK_NUMBER_NAMED) {
+			printf("%-20s %-24s %-4s %6s %8zu\n", ent.dir, ent.name,
+			    type_name(ent.type), "-", ent.length);
+		} else {
+			printf("%-20s %-24s %-4s %06X %8zu\n", ent.dir,
+			    ent.name, type_name(ent.type), ent.number,
+			    ent.length);
+		}
+	}
+	chanpack_close(pack);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *archive = NULL;
+	bool list = false, mirror = false;
+	int ch, i;
+
+	setprogname(argv[0]);
+
+	while ((ch = getopt(argc, argv, "lmo:v")) != -1) {
+		switch (ch) {
+		case 'l':
+			list = true;
+			break;
+
+		case 'm':
+			mirror = true;
+			break;
+
+		case 'o':
+			archive = optarg;
+			break;
+
+		case 'v':
+			verbose = true;
+			break;
+
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (! log_init(NULL, LOG_OPT_FOREGROUND)) {
+		errx(EXIT_FAILURE, "log_init() failed");
+	}
+
+	if (list) {
+		if (argc != 1 || archive != NULL || mirror) {
+			usage();
+		}
+		list_archive(argv[0]);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (archive == NULL || argc == 0) {
+		usage();
+	}
+	for (i = 0; i < argc; i++) {
+		if (mirror) {
+			add_mirror(argv[i]);
+		} else {
+			add_channel(argv[i]);
+		}
+	}
+	if (nentries == 0) {
+		errx(EXIT_FAILURE, "No files found.");
+	}
+	write_archive(archive);
+
+	exit(EXIT_SUCCESS);
+}
@@ -48,6 +48,7 @@
 #include <inttypes.h>
 #endif
 #include <netdb.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -315,6 +316,7 @@ fetch_connect(struct url *url, int af, int verbose)
 	return (conn);
 }
 
+static pthread_mutex_t connection_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 static conn_t *connection_cache;
 static int cache_global_limit = 0;
 static int cache_per_host_limit = 0;
@@ -346,10 +348,12 @@ fetchConnectionCacheClose(void)
 {
 	conn_t *conn;
 
+	pthread_mutex_lock(&connection_cache_lock);
 	while ((conn = connection_cache) != NULL) {
 		connection_cache = conn->next_cached;
 		(*conn->cache_close)(conn);
 	}
+	pthread_mutex_unlock(&connection_cache_lock);
 }
 
 /*
@@ -361,7 +365,9 @@ fetch_cache_get(const struct url *url, int af)
 {
 	conn_t *conn, *last_conn = NULL;
 
-	for (conn = connection_cache; conn; conn = conn->next_cached) {
+	pthread_mutex_lock(&connection_cache_lock);
+	for (conn = connection_cache; conn;
+	    last_conn = conn, conn = conn->next_cached) {
 		if (conn->cache_url->port == url->port &&
 		    strcmp(conn->cache_url->scheme, url->scheme) == 0 &&
 		    strcmp(conn->cache_url->host, url->host) == 0 &&
@@ -373,9 +379,11 @@ fetch_cache_get(const struct url *url, int af)
 				last_conn->next_cached = conn->next_cached;
 			else
 				connection_cache = conn->next_cached;
+			pthread_mutex_unlock(&connection_cache_lock);
 			return conn;
 		}
 	}
+	pthread_mutex_unlock(&connection_cache_lock);
 
 	return NULL;
 }
@@ -388,7 +396,7 @@ fetch_cache_get(const struct url *url, int af)
 void
 fetch_cache_put(conn_t *conn, int (*closecb)(conn_t *))
 {
-	conn_t *iter, *last;
+	conn_t *iter, *next, *last;
 	int global_count, host_count;
 
 	if (conn->cache_url == NULL || cache_global_limit == 0) {
@@ -396,27 +404,31 @@ fetch_cache_put(conn_t *conn, int (*closecb)(conn_t *))
 		return;
 	}
 
+	pthread_mutex_lock(&connection_cache_lock);
 	global_count = host_count = 0;
 	last = NULL;
-	for (iter = connection_cache; iter;
-	    last = iter, iter = iter->next_cached) {
+	for (iter = connection_cache; iter; iter = next) {
+		next = iter->next_cached;
 		++global_count;
 		if (strcmp(conn->cache_url->host, iter->cache_url->host) == 0)
 			++host_count;
 		if (global_count < cache_global_limit &&
-		    host_count < cache_per_host_limit)
+		    host_count < cache_per_host_limit) {
+			last = iter;
 			continue;
+		}
 		--global_count;
 		if (last != NULL)
-			last->next_cached = iter->next_cached;
+			last->next_cached = next;
 		else
-			connection_cache = iter->next_cached;
+			connection_cache = next;
 		(*iter->cache_close)(iter);
 	}
 
 	conn->cache_close = closecb;
 	conn->next_cached = connection_cache;
 	connection_cache = conn;
+	pthread_mutex_unlock(&connection_cache_lock);
 }
 
 #ifdef HAVE_SECURETRANSPORT
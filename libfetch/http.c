@@ -305,6 +305,23 @@ http_writefn(void *v, const void *buf, size_t len)
 	return (fetch_write(io->conn, buf, len));
 }
 
+/*
+ * Has the reply body been read in full?  Only then can the connection
+ * be reused; otherwise the next request on it would read the rest of
+ * this body as its reply.
+ */
+static int
+http_body_done(struct httpio *io)
+{
+	if (io->error)
+		return (0);
+	if ((ssize_t)io->bufpos != io->buflen)
+		return (0);
+	if (io->chunked)
+		return (io->eof);
+	return (io->contentlength == 0);
+}
+
 /*
  * Close function
  */
@@ -313,7 +330,7 @@ http_closefn(void *v)
 {
 	struct httpio *io = (struct httpio *)v;
 
-	if (io->keep_alive) {
+	if (io->keep_alive && http_body_done(io)) {
 		int val;
 
 		val = 0;
@@ -1168,7 +1185,11 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 		goto ouch;
 	}
 
-	/* wrap it up in a fetchIO */
+	/* wrap it up in a fetchIO; a reply to HEAD has no body */
+	if (strcmp(op, "HEAD") == 0) {
+		chunked = 0;
+		clength = 0;
+	}
 	if ((f = http_funopen(conn, chunked, keep_alive, clength)) == NULL) {
 		fetch_syserr();
 		goto ouch;
@@ -30,49 +30,114 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <sys/uio.h>
+
 #include <arpa/inet.h>
 
 #include "atom.h"
 #include "log.h"
 
+/*
+ * atom_chunk_last --
+ *	Return the most recently allocated arena chunk.
+ */
+static struct atom_chunk *
+atom_chunk_last(struct atom_list *list)
+{
+	if (STAILQ_EMPTY(&list->chunks)) {
+		return NULL;
+	}
+	return STAILQ_LAST(&list->chunks, atom_chunk, link);
+}
+
+/*
+ * atom_arena_alloc --
+ *	Allocate contiguous space from the list's arena.  Space
+ *	is allocated sequentially, so consecutive allocations that
+ *	fit in the same chunk are adjacent.
+ */
+static uint8_t *
+atom_arena_alloc(struct atom_list *list, size_t len)
+{
+	struct atom_chunk *chunk = atom_chunk_last(list);
+	uint8_t *rv;
+
+	if (chunk == NULL || chunk->size - chunk->used < len) {
+		size_t size = ATOM_CHUNK_SIZE - sizeof(*chunk);
+		if (len > size) {
+			size = len;
+		}
+		chunk = malloc(sizeof(*chunk) + size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->size = size;
+		chunk->used = 0;
+		STAILQ_INSERT_TAIL(&list->chunks, chunk, link);
+		list->nchunks++;
+	}
+	rv = &chunk->data[chunk->used];
+	chunk->used += len;
+	return rv;
+}
+
+/*
+ * atom_arena_unalloc --
+ *	Give back space from the end of the most recent arena
+ *	allocation.
+ */
+static void
+atom_arena_unalloc(struct atom_list *list, size_t len)
+{
+	struct atom_chunk *chunk = atom_chunk_last(list);
+
+	assert(chunk != NULL && chunk->used >= len);
+	chunk->used -= len;
+}
+
 /*
  * atom_alloc --
- *	Allocate an atom.
+ *	Allocate an atom descriptor from the list's arena.
  */
 static struct atom *
-atom_alloc(const struct nabuctl_atom_header *hdr)
+atom_alloc(struct atom_list *list, const struct nabuctl_atom_header *hdr)
 {
-	struct atom *atom = calloc(1, sizeof(struct atom));
-	if (atom != NULL) {
-		if (hdr->length != 0 && !ATOM_DATA_INLINE_P(hdr->tag)) {
-			atom->external_data = calloc(1, hdr->length);
-			if (atom->external_data == NULL) {
-				free(atom);
-				return NULL;
-			}
+	struct atom_block *block = list->blocks;
+	struct atom *atom;
+
+	if (block == NULL || block->used == ATOM_BLOCK_NATOMS) {
+		block = malloc(sizeof(*block));
+		if (block == NULL) {
+			return NULL;
 		}
-		atom->hdr = *hdr;
+		block->used = 0;
+		block->next = list->blocks;
+		list->blocks = block;
 	}
+	atom = &block->atoms[block->used++];
+	atom->hdr = *hdr;
+	atom->data = NULL;
 	return atom;
 }
 
 /*
- * atom_free --
- *	Free an atom.
+ * atom_unalloc --
+ *	Give back the most recently allocated atom descriptor.
  */
 static void
-atom_free(struct atom *atom)
+atom_unalloc(struct atom_list *list, struct atom *atom)
 {
-	if (!ATOM_DATA_INLINE_P(atom->hdr.tag) &&
-	    atom->external_data != NULL) {
-		free(atom->external_data);
-	}
-	free(atom);
+	struct atom_block *block = list->blocks;
+
+	assert(block != NULL && block->used != 0 &&
+	       atom == &block->atoms[block->used - 1]);
+	block->used--;
 }
 
 /*
@@ -102,6 +167,7 @@ atom_objdesc(uint32_t tag)
 	switch (NABUCTL_OBJ(tag)) {
 	case NABUCTL_OBJ_CHANNEL:	return "CHANNEL";
 	case NABUCTL_OBJ_CONNECTION:	return "CONNECTION";
+	case NABUCTL_OBJ_EVENT:		return "EVENT";
 	default:			return "???";
 	}
 }
@@ -136,24 +202,13 @@ atom_length(struct atom *atom)
 	return atom->hdr.length;
 }
 
-/*
- * atom_consume --
- *	Consume the data from the atom.  Caller takes ownership
- *	if the buffer and is responsible for freeing it.
- */
-void *
-atom_consume(struct atom *atom)
-{
-	assert(!ATOM_DATA_INLINE_P(atom->hdr.tag));
-	void *rv = atom->external_data;
-	atom->external_data = NULL;
-	return rv;
-}
-
 /*
  * atom_dataref --
- *	Get a pointer to the atom data.  NOTE: The returned value
- *	is only valid for the life of the atom itself.
+ *	Get a pointer to the atom data.  NOTE: The data lives in
+ *	the list's arena (for a received list, the receive buffer),
+ *	so the returned value is only valid until the list is reset,
+ *	freed, or received into again.  Callers that need to keep
+ *	the data longer must copy it.
  */
 void *
 atom_dataref(struct atom *atom)
@@ -184,21 +239,7 @@ bool
 atom_bool_value(struct atom *atom)
 {
 	assert(NABUCTL_TYPE(atom->hdr.tag) == NABUCTL_TYPE_BOOL);
-	return atom->inline_data[0] != 0;
-}
-
-/*
- * atom_send_hdr --
- *	Send the atom header.
- */
-static void
-atom_send_hdr(struct conn_io *conn, const struct nabuctl_atom_header *hdr)
-{
-	struct nabuctl_atom_header buf = {
-		.tag = htonl(hdr->tag),
-		.length = htonl(hdr->length),
-	};
-	conn_io_send(conn, &buf, sizeof(buf));
+	return ((const uint8_t *)atom->data)[0] != 0;
 }
 
 /*
@@ -215,45 +256,23 @@ atom_send_error(struct conn_io *conn)
 }
 
 /*
- * atom_send --
- *	Send an atom.
+ * atom_hdr_check --
+ *	Sanity-check a received atom header.
  */
-static void
-atom_send(struct conn_io *conn, const struct atom *atom)
+static bool
+atom_hdr_check(struct conn_io *conn, const struct nabuctl_atom_header *hdr)
 {
-	atom_send_hdr(conn, &atom->hdr);
-	if (atom->hdr.length != 0) {
-		conn_io_send(conn, ATOM_DATA(atom), atom->hdr.length);
-	}
-}
-
-/*
- * atom_recv --
- *	Receive an atom.
- */
-static struct atom *
-atom_recv(struct conn_io *conn)
-{
-	struct nabuctl_atom_header hdr;
-
-	if (! conn_io_recv(conn, &hdr, sizeof(hdr))) {
-		log_error("[%s] Failed to receive atom header.",
-		    conn_io_name(conn));
-		return NULL;
-	}
-	hdr.tag = ntohl(hdr.tag);
-	hdr.length = ntohl(hdr.length);
 	log_debug(LOG_SUBSYS_ATOM, "Atom header: tag=0x%08x type=%s length=%u",
-	    hdr.tag, atom_typedesc(hdr.tag), hdr.length);
+	    hdr->tag, atom_typedesc(hdr->tag), hdr->length);
 
 	/* Sanity-check the data type vs payload. */
-	switch (NABUCTL_TYPE(hdr.tag)) {
+	switch (NABUCTL_TYPE(hdr->tag)) {
 	case NABUCTL_TYPE_VOID:
-		if (hdr.length != 0) {
+		if (hdr->length != 0) {
 			log_error("[%s] %s atom has length %u.",
-			    conn_io_name(conn), atom_typedesc(hdr.tag),
-			    hdr.length);
-			return NULL;
+			    conn_io_name(conn), atom_typedesc(hdr->tag),
+			    hdr->length);
+			return false;
 		}
 		break;
 
@@ -263,70 +282,42 @@ atom_recv(struct conn_io *conn)
 		 * Even an empty string has to have a nul.  Also
 		 * constrain size to something reasonable.
 		 */
-		if (hdr.length == 0 || hdr.length > 65536) {
+		if (hdr->length == 0 || hdr->length > 65536) {
 			log_error("[%s] %s atom unreasonable length %u.",
-			    conn_io_name(conn), atom_typedesc(hdr.tag),
-			    hdr.length);
-			return NULL;
+			    conn_io_name(conn), atom_typedesc(hdr->tag),
+			    hdr->length);
+			return false;
 		}
 		break;
 
 	case NABUCTL_TYPE_NUMBER:
 		/* As above, but also constrained length. */
-		if (hdr.length == 0 ||
-		    hdr.length > sizeof("0xffffffffffffffff")) {
+		if (hdr->length == 0 ||
+		    hdr->length > sizeof("0xffffffffffffffff")) {
 			log_error("[%s] %s atom unreasonable length %u.",
-			    conn_io_name(conn), atom_typedesc(hdr.tag),
-			    hdr.length);
-			return NULL;
+			    conn_io_name(conn), atom_typedesc(hdr->tag),
+			    hdr->length);
+			return false;
 		}
 		break;
 
 	case NABUCTL_TYPE_BOOL:
 		/* Boolean atoms must have a length of 1. */
-		if (hdr.length != 1) {
+		if (hdr->length != 1) {
 			log_error("[%s] %s atom has length %u.",
-			    conn_io_name(conn), atom_typedesc(hdr.tag),
-			    hdr.length);
-			return NULL;
+			    conn_io_name(conn), atom_typedesc(hdr->tag),
+			    hdr->length);
+			return false;
 		}
 		break;
 
 	default:
 		log_error("[%s] Unknown atom type 0x%08x length %u.",
-		    conn_io_name(conn), NABUCTL_TYPE(hdr.tag),
-		    hdr.length);
-		return NULL;
-	}
-
-	struct atom *atom = atom_alloc(&hdr);
-	if (atom == NULL) {
-		log_error("[%s] Unable to allocate %u byte atom.",
-		    conn_io_name(conn), hdr.length);
-		return NULL;
+		    conn_io_name(conn), NABUCTL_TYPE(hdr->tag),
+		    hdr->length);
+		return false;
 	}
-	if (atom->hdr.length != 0) {
-		if (! conn_io_recv(conn, ATOM_DATA(atom), atom->hdr.length)) {
-			log_error("[%s] Failed to receive %u byte atom "
-			    "data.", conn_io_name(conn), atom->hdr.length);
-			atom_free(atom);
-			return NULL;
-		}
-		/*
-		 * Strings and numbers must have a nul terminator.
-		 */
-		if (NABUCTL_TYPE(hdr.tag) == NABUCTL_TYPE_STRING ||
-		    NABUCTL_TYPE(hdr.tag) == NABUCTL_TYPE_NUMBER) {
-			const uint8_t *cp = ATOM_DATA(atom);
-			if (cp[hdr.length - 1] != '\0') {
-				log_error("[%s] %s atom is not nul-terminated.",
-				    conn_io_name(conn), atom_typedesc(hdr.tag));
-				atom_free(atom);
-				return NULL;
-			}
-		}
-	}
-	return atom;
+	return true;
 }
 
 /*
@@ -338,21 +329,63 @@ atom_list_init(struct atom_list *list)
 {
 	TAILQ_INIT(&list->list);
 	list->count = 0;
+	STAILQ_INIT(&list->chunks);
+	list->nchunks = 0;
+	list->blocks = NULL;
 }
 
 /*
  * atom_list_free --
- *	Free all of the atoms on the atom list.
+ *	Free all of the atoms on the atom list, along with the
+ *	arena backing them.
  */
 void
 atom_list_free(struct atom_list *list)
 {
-	struct atom *atom, *natom;
+	struct atom_chunk *chunk;
+	struct atom_block *block;
 
-	TAILQ_FOREACH_SAFE(atom, &list->list, link, natom) {
-		TAILQ_REMOVE(&list->list, atom, link);
-		list->count--;
-		atom_free(atom);
+	while ((chunk = STAILQ_FIRST(&list->chunks)) != NULL) {
+		STAILQ_REMOVE_HEAD(&list->chunks, link);
+		free(chunk);
+	}
+	while ((block = list->blocks) != NULL) {
+		list->blocks = block->next;
+		free(block);
+	}
+	atom_list_init(list);
+}
+
+/*
+ * atom_list_reset --
+ *	Free all of the atoms on the atom list, but keep the first
+ *	chunk of the arena around for re-use.  This is intended for
+ *	loops that build or receive one list after another.
+ */
+void
+atom_list_reset(struct atom_list *list)
+{
+	struct atom_chunk *chunk;
+	struct atom_block *block;
+
+	if ((chunk = STAILQ_FIRST(&list->chunks)) != NULL) {
+		STAILQ_REMOVE_HEAD(&list->chunks, link);
+	}
+	if ((block = list->blocks) != NULL) {
+		list->blocks = block->next;
+	}
+
+	atom_list_free(list);
+
+	if (chunk != NULL) {
+		chunk->used = 0;
+		STAILQ_INSERT_HEAD(&list->chunks, chunk, link);
+		list->nchunks = 1;
+	}
+	if (block != NULL) {
+		block->used = 0;
+		block->next = NULL;
+		list->blocks = block;
 	}
 }
 
@@ -373,23 +406,36 @@ atom_list_append(struct atom_list *list, uint32_t tag, const void *vbuf,
 		.tag = tag,
 		.length = (uint32_t)len,
 	};
+	const struct nabuctl_atom_header wire_hdr = {
+		.tag = htonl(tag),
+		.length = htonl((uint32_t)len),
+	};
 
-	struct atom *atom = atom_alloc(&hdr);
-	if (atom != NULL) {
-		if (vbuf != NULL) {
-			uint8_t *data = ATOM_DATA(atom);
-			if (NABUCTL_TYPE(tag) == NABUCTL_TYPE_BOOL) {
-				const bool *bp = vbuf;
-				data[0] = !!(*bp);
-			} else {
-				memcpy(data, vbuf, len);
-			}
+	struct atom *atom = atom_alloc(list, &hdr);
+	if (atom == NULL) {
+		return false;
+	}
+
+	uint8_t *wire = atom_arena_alloc(list, sizeof(wire_hdr) + len);
+	if (wire == NULL) {
+		atom_unalloc(list, atom);
+		return false;
+	}
+
+	memcpy(wire, &wire_hdr, sizeof(wire_hdr));
+	if (vbuf != NULL) {
+		uint8_t *data = wire + sizeof(wire_hdr);
+		if (NABUCTL_TYPE(tag) == NABUCTL_TYPE_BOOL) {
+			const bool *bp = vbuf;
+			data[0] = !!(*bp);
+		} else {
+			memcpy(data, vbuf, len);
 		}
-		TAILQ_INSERT_TAIL(&list->list, atom, link);
-		list->count++;
-		return true;
+		atom->data = data;
 	}
-	return false;
+	TAILQ_INSERT_TAIL(&list->list, atom, link);
+	list->count++;
+	return true;
 }
 
 /*
@@ -490,10 +536,24 @@ atom_list_next(struct atom_list *list, struct atom *atom)
 bool
 atom_list_send(struct conn_io *conn, struct atom_list *list)
 {
-	struct atom *atom;
-
-	TAILQ_FOREACH(atom, &list->list, link) {
-		atom_send(conn, atom);
+	struct iovec iov[16];
+	struct atom_chunk *chunk;
+	int iovcnt = 0;
+
+	/*
+	 * The atoms are already serialized in the arena, so just
+	 * gather up the chunks.
+	 */
+	STAILQ_FOREACH(chunk, &list->chunks, link) {
+		iov[iovcnt].iov_base = chunk->data;
+		iov[iovcnt].iov_len = chunk->used;
+		if (++iovcnt == (int)(sizeof(iov) / sizeof(iov[0]))) {
+			conn_io_sendv(conn, iov, iovcnt);
+			iovcnt = 0;
+		}
+	}
+	if (iovcnt != 0) {
+		conn_io_sendv(conn, iov, iovcnt);
 	}
 	return conn_io_state(conn) == CONN_STATE_OK;
 }
@@ -505,16 +565,75 @@ atom_list_send(struct conn_io *conn, struct atom_list *list)
 bool
 atom_list_recv(struct conn_io *conn, struct atom_list *list)
 {
+	struct nabuctl_atom_header wire_hdr, hdr;
 	struct atom *atom;
-	size_t total_size = 0;
+	uint8_t *wire;
+	size_t total_size = 0, resid;
 	uint32_t objtype = 0;
+	bool last;
+
+	if (! conn_io_recv(conn, &wire_hdr, sizeof(wire_hdr))) {
+		log_error("[%s] Failed to receive atom header.",
+		    conn_io_name(conn));
+		goto bad;
+	}
 
 	for (;;) {
-		atom = atom_recv(conn);
-		if (atom == NULL) {
+		hdr.tag = ntohl(wire_hdr.tag);
+		hdr.length = ntohl(wire_hdr.length);
+		if (! atom_hdr_check(conn, &hdr)) {
 			/* Error already logged. */
 			goto bad;
 		}
+
+		/*
+		 * If this atom doesn't terminate the list, read the
+		 * next atom's header along with this atom's data, so
+		 * that each atom costs a single receive.  The data is
+		 * received directly into the arena, right behind the
+		 * header, just as it would be laid out for sending.
+		 */
+		last = hdr.tag == NABUCTL_ERROR ||
+		    (hdr.tag == NABUCTL_DONE && objtype == 0);
+		resid = hdr.length + (last ? 0 : sizeof(wire_hdr));
+
+		atom = atom_alloc(list, &hdr);
+		wire = atom == NULL ? NULL
+		    : atom_arena_alloc(list, sizeof(wire_hdr) + resid);
+		if (wire == NULL) {
+			log_error("[%s] Unable to allocate %u byte atom.",
+			    conn_io_name(conn), hdr.length);
+			goto bad;
+		}
+		memcpy(wire, &wire_hdr, sizeof(wire_hdr));
+		if (resid != 0 &&
+		    ! conn_io_recv(conn, wire + sizeof(wire_hdr), resid)) {
+			log_error("[%s] Failed to receive %zu bytes of "
+			    "atom data.", conn_io_name(conn), resid);
+			goto bad;
+		}
+		if (hdr.length != 0) {
+			atom->data = wire + sizeof(wire_hdr);
+		}
+		if (! last) {
+			memcpy(&wire_hdr, wire + sizeof(wire_hdr) + hdr.length,
+			    sizeof(wire_hdr));
+			atom_arena_unalloc(list, sizeof(wire_hdr));
+		}
+
+		/*
+		 * Strings and numbers must have a nul terminator.
+		 */
+		if (NABUCTL_TYPE(hdr.tag) == NABUCTL_TYPE_STRING ||
+		    NABUCTL_TYPE(hdr.tag) == NABUCTL_TYPE_NUMBER) {
+			const uint8_t *cp = atom->data;
+			if (cp[hdr.length - 1] != '\0') {
+				log_error("[%s] %s atom is not nul-terminated.",
+				    conn_io_name(conn), atom_typedesc(hdr.tag));
+				goto bad;
+			}
+		}
+
 		TAILQ_INSERT_TAIL(&list->list, atom, link);
 		list->count++;
 
@@ -548,6 +667,7 @@ atom_list_recv(struct conn_io *conn, struct atom_list *list)
 
 		case NABUCTL_OBJ_CHANNEL:
 		case NABUCTL_OBJ_CONNECTION:
+		case NABUCTL_OBJ_EVENT:
 			/* We don't support nested objects. */
 			if (objtype != 0) {
 				log_error("[%s] Received %s object start "
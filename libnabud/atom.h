@@ -37,28 +37,48 @@
 struct atom {
 	TAILQ_ENTRY(atom) link;
 	struct nabuctl_atom_header hdr;
-	union {
-		void *external_data;
-		uint8_t inline_data[sizeof(void *)];
-	};
+	void		*data;		/* points into the list's arena */
 };
 
-#define	ATOM_DATA(atom)							\
-	(ATOM_DATA_INLINE_P((atom)->hdr.tag) ? (atom)->inline_data	\
-					     : (atom)->external_data)
+#define	ATOM_DATA(atom)		((atom)->data)
 
-#define	ATOM_DATA_INLINE_P(tag)						\
-	(NABUCTL_TYPE(tag) == NABUCTL_TYPE_BOOL)
+/*
+ * Atoms and their data are carved out of an arena owned by the
+ * atom list, so building or receiving a list doesn't do an
+ * allocation per atom.  When building a list, each atom is
+ * serialized (header + data, in wire format) into the arena as
+ * it is appended, so the whole list can be sent with a single
+ * gather-write.  When receiving a list, atom data is read directly
+ * into the arena and referenced in place.
+ */
+#define	ATOM_CHUNK_SIZE		4096
+#define	ATOM_BLOCK_NATOMS	32
+
+struct atom_chunk {
+	STAILQ_ENTRY(atom_chunk) link;
+	size_t		size;
+	size_t		used;
+	uint8_t		data[];
+};
+
+struct atom_block {
+	struct atom_block *next;
+	unsigned int	used;
+	struct atom	atoms[ATOM_BLOCK_NATOMS];
+};
 
 struct atom_list {
 	TAILQ_HEAD(, atom) list;
 	unsigned int count;
+
+	STAILQ_HEAD(, atom_chunk) chunks;
+	unsigned int nchunks;
+	struct atom_block *blocks;
 };
 
 uint32_t	atom_data_type(struct atom *);
 uint32_t	atom_tag(struct atom *);
 size_t		atom_length(struct atom *);
-void *		atom_consume(struct atom *);
 void *		atom_dataref(struct atom *);
 uint64_t	atom_number_value(struct atom *);
 bool		atom_bool_value(struct atom *);
@@ -68,6 +88,7 @@ const char *	atom_objdesc(uint32_t);
 
 void		atom_list_init(struct atom_list *);
 void		atom_list_free(struct atom_list *);
+void		atom_list_reset(struct atom_list *);
 bool		atom_list_append(struct atom_list *, uint32_t,
 		    const void *, size_t);
 bool		atom_list_append_string(struct atom_list *, uint32_t,
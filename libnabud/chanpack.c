@@ -0,0 +1,291 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Channel pack archives.  See chanpack.h for the format.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	NABU_PROTO_INLINES
+
+#include "chanpack.h"
+#include "log.h"
+#include "nabu_proto.h"
+
+/*
+ * chanpack_probe --
+ *	Returns true if the specified path looks like a channel pack.
+ */
+bool
+chanpack_probe(const char *path)
+{
+	char magic[CHANPACK_MAGICLEN];
+	struct stat sb;
+	bool rv = false;
+	int fd;
+
+	if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		return false;
+	}
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return false;
+	}
+	if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+	    memcmp(magic, CHANPACK_MAGIC, sizeof(magic)) == 0) {
+		rv = true;
+	}
+	close(fd);
+	return rv;
+}
+
+static const char *
+chanpack_entry_dir(const struct chanpack *pack, uint32_t idx)
+{
+	return pack->strtab + nabu_get_uint32(pack->index[idx].dir_off);
+}
+
+static const char *
+chanpack_entry_name(const struct chanpack *pack, uint32_t idx)
+{
+	return pack->strtab + nabu_get_uint32(pack->index[idx].name_off);
+}
+
+static int
+chanpack_compare(const char *dir1, const char *name1,
+    const char *dir2, const char *name2)
+{
+	int rv = strcmp(dir1, dir2);
+	return rv != 0 ? rv : strcmp(name1, name2);
+}
+
+/*
+ * chanpack_validate --
+ *	Check that everything in the index is within the bounds of
+ *	the file, so that lookups don't need to.
+ */
+static bool
+chanpack_validate(struct chanpack *pack)
+{
+	const struct chanpack_header *hdr = (const void *)pack->base;
+	uint64_t index_off, strtab_off, strtab_size, data_off;
+	uint32_t i;
+
+	if (pack->size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, CHANPACK_MAGIC, CHANPACK_MAGICLEN) != 0) {
+		log_error("%s: not a channel pack.", pack->path);
+		return false;
+	}
+	if (nabu_get_uint32(hdr->version) != CHANPACK_VERSION) {
+		log_error("%s: unsupported channel pack version %u.",
+		    pack->path, nabu_get_uint32(hdr->version));
+		return false;
+	}
+
+	pack->nentries = nabu_get_uint32(hdr->nentries);
+	index_off = nabu_get_uint32(hdr->index_off);
+	strtab_off = nabu_get_uint32(hdr->strtab_off);
+	strtab_size = nabu_get_uint32(hdr->strtab_size);
+
+	if (index_off + (uint64_t)pack->nentries *
+			sizeof(struct chanpack_entry) > pack->size ||
+	    strtab_off + strtab_size > pack->size ||
+	    strtab_size == 0 ||
+	    pack->base[strtab_off + strtab_size - 1] != '\0') {
+		log_error("%s: channel pack index is corrupt.", pack->path);
+		return false;
+	}
+	pack->index = (const void *)(pack->base + index_off);
+	pack->strtab = (const char *)pack->base + strtab_off;
+
+	for (i = 0; i < pack->nentries; i++) {
+		const struct chanpack_entry *ent = &pack->index[i];
+
+		data_off = nabu_get_uint32(ent->data_off);
+		if (nabu_get_uint32(ent->dir_off) >= strtab_size ||
+		    nabu_get_uint32(ent->name_off) >= strtab_size ||
+		    data_off + nabu_get_uint32(ent->data_len) > pack->size) {
+			log_error("%s: channel pack entry %u is corrupt.",
+			    pack->path, i);
+			return false;
+		}
+		if (i != 0 &&
+		    chanpack_compare(chanpack_entry_dir(pack, i - 1),
+				     chanpack_entry_name(pack, i - 1),
+				     chanpack_entry_dir(pack, i),
+				     chanpack_entry_name(pack, i)) >= 0) {
+			log_error("%s: channel pack index is not sorted.",
+			    pack->path);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * chanpack_open --
+ *	Open and map a channel pack.
+ */
+struct chanpack *
+chanpack_open(const char *path)
+{
+	struct chanpack *pack;
+	struct stat sb;
+	void *base;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		log_error("Unable to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0) {
+		log_error("Unable to stat %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (!S_ISREG(sb.st_mode) || sb.st_size <= 0 ||
+	    (uint64_t)sb.st_size > SIZE_MAX) {
+		log_error("%s: not a channel pack.", path);
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		log_error("Unable to map %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	pack = calloc(1, sizeof(*pack));
+	if (pack == NULL || (pack->path = strdup(path)) == NULL) {
+		log_error("Unable to allocate channel pack descriptor.");
+		free(pack);
+		munmap(base, (size_t)sb.st_size);
+		return NULL;
+	}
+	pack->base = base;
+	pack->size = (size_t)sb.st_size;
+	pack->dev = sb.st_dev;
+	pack->ino = sb.st_ino;
+	pack->mtime = sb.st_mtime;
+
+	if (! chanpack_validate(pack)) {
+		chanpack_close(pack);
+		return NULL;
+	}
+	return pack;
+}
+
+/*
+ * chanpack_close --
+ *	Unmap and free a channel pack.
+ */
+void
+chanpack_close(struct chanpack *pack)
+{
+	if (pack != NULL) {
+		munmap(pack->base, pack->size);
+		free(pack->path);
+		free(pack);
+	}
+}
+
+/*
+ * chanpack_changed --
+ *	Returns true if the file backing the channel pack has been
+ *	replaced or modified since it was opened.
+ */
+bool
+chanpack_changed(const struct chanpack *pack)
+{
+	struct stat sb;
+
+	if (stat(pack->path, &sb) < 0) {
+		return true;
+	}
+	return sb.st_dev != pack->dev || sb.st_ino != pack->ino ||
+	    sb.st_mtime != pack->mtime;
+}
+
+/*
+ * chanpack_get --
+ *	Decode the specified index entry.
+ */
+void
+chanpack_get(const struct chanpack *pack, uint32_t idx,
+    struct chanpack_ent *entp)
+{
+	const struct chanpack_entry *ent = &pack->index[idx];
+
+	entp->dir = chanpack_entry_dir(pack, idx);
+	entp->name = chanpack_entry_name(pack, idx);
+	entp->data = pack->base + nabu_get_uint32(ent->data_off);
+	entp->length = nabu_get_uint32(ent->data_len);
+	entp->number = nabu_get_uint32(ent->number);
+	entp->type = ent->type;
+}
+
+/*
+ * chanpack_lookup --
+ *	Look up the named file in the specified channel directory.
+ */
+bool
+chanpack_lookup(const struct chanpack *pack, const char *dir,
+    const char *name, struct chanpack_ent *entp)
+{
+	uint32_t lo = 0, hi = pack->nentries, mid;
+	int rv;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rv = chanpack_compare(dir, name,
+		    chanpack_entry_dir(pack, mid),
+		    chanpack_entry_name(pack, mid));
+		if (rv == 0) {
+			chanpack_get(pack, mid, entp);
+			return true;
+		}
+		if (rv < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,121 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef chanpack_h_included
+#define	chanpack_h_included
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A channel pack is a single-file archive of one or more channels'
+ * worth of images, built offline by chanpack(1).  It is laid out so
+ * that the server can simply mmap(2) it and serve images directly
+ * out of the mapping:
+ *
+ *	header
+ *	index		nentries entries, sorted by (dir, name)
+ *	string table	NUL-terminated directory and file names
+ *	payloads	each aligned to CHANPACK_ALIGN
+ *
+ * An entry is identified by the channel directory it was found in
+ * and its file name (e.g. "cycle1" and "000001.pak"), which are the
+ * same names the server would use to find the file in a directory
+ * tree.  PAK payloads are stored already decrypted and are always
+ * named by their plain "XXXXXX.pak" names.
+ *
+ * All multi-byte values are little-endian, and all offsets are from
+ * the start of the file.
+ */
+
+#define	CHANPACK_MAGIC		"NABUCPK1"
+#define	CHANPACK_MAGICLEN	8
+#define	CHANPACK_VERSION	1
+#define	CHANPACK_ALIGN		16
+
+struct chanpack_header {
+	uint8_t		magic[CHANPACK_MAGICLEN];
+	uint8_t		version[4];
+	uint8_t		nentries[4];
+	uint8_t		index_off[4];
+	uint8_t		strtab_off[4];
+	uint8_t		strtab_size[4];
+	uint8_t		reserved[4];
+};
+
+#define	CHANPACK_TYPE_NABU	0
+#define	CHANPACK_TYPE_PAK	1
+#define	CHANPACK_TYPE_OTHER	2
+
+#define	CHANPACK_NUMBER_NAMED	0xffffffffU
+
+struct chanpack_entry {
+	uint8_t		data_off[4];
+	uint8_t		data_len[4];
+	uint8_t		number[4];	/* or CHANPACK_NUMBER_NAMED */
+	uint8_t		dir_off[4];	/* string table offset */
+	uint8_t		name_off[4];	/* string table offset */
+	uint8_t		type;		/* CHANPACK_TYPE_* */
+	uint8_t		reserved[3];
+};
+
+/* A validated, mapped channel pack. */
+struct chanpack {
+	char		*path;
+	uint8_t		*base;
+	size_t		size;
+	const struct chanpack_entry *index;
+	uint32_t	nentries;
+	const char	*strtab;
+
+	/* To notice if the file has been replaced. */
+	dev_t		dev;
+	ino_t		ino;
+	time_t		mtime;
+};
+
+/* A decoded index entry. */
+struct chanpack_ent {
+	const char	*dir;
+	const char	*name;
+	uint8_t		*data;
+	size_t		length;
+	uint32_t	number;
+	unsigned int	type;
+};
+
+bool	chanpack_probe(const char *);
+struct chanpack *chanpack_open(const char *);
+void	chanpack_close(struct chanpack *);
+bool	chanpack_changed(const struct chanpack *);
+void	chanpack_get(const struct chanpack *, uint32_t, struct chanpack_ent *);
+bool	chanpack_lookup(const struct chanpack *, const char *, const char *,
+	    struct chanpack_ent *);
+
+#endif /* chanpack_h_included */
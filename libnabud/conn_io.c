@@ -30,6 +30,10 @@
  * Shared by NABU connections and control connections.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -44,6 +48,11 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/uio.h>
+#ifdef HAVE_LINUX_SENDFILE
+#include <sys/sendfile.h>
+#endif /* HAVE_LINUX_SENDFILE */
+
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
@@ -103,6 +112,30 @@ conn_io_shutdown(void)
 	pthread_mutex_unlock(&conn_io_list_mutex);
 }
 
+/*
+ * conn_io_enumerate --
+ *	Enumerate all connections.  The callback is invoked with
+ *	the list lock held, so it must not block or create/destroy
+ *	connections.
+ */
+bool
+conn_io_enumerate(bool (*func)(struct conn_io *, void *), void *ctx)
+{
+	struct conn_io *conn;
+	bool rv = true;
+
+	pthread_mutex_lock(&conn_io_list_mutex);
+	LIST_FOREACH(conn, &conn_io_list, link) {
+		if (! (*func)(conn, ctx)) {
+			rv = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conn_io_list_mutex);
+
+	return rv;
+}
+
 /*
  * conn_io_set_nbio --
  *	Set non-blocking I/O on the specified file descriptor.
@@ -218,11 +251,93 @@ conn_io_fini(struct conn_io *conn)
 	if (conn->fd != -1) {
 		close(conn->fd);
 	}
+	if (conn->record != NULL) {
+		fclose(conn->record);
+	}
 	if (conn->name != NULL) {
 		free(conn->name);
 	}
 }
 
+static uint64_t
+conn_io_record_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+	    (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * conn_io_record --
+ *	Start recording the byte streams of this connection to
+ *	the specified file.  Must be called before the connection
+ *	is started.
+ */
+bool
+conn_io_record(struct conn_io *conn, const char *path)
+{
+	FILE *fp;
+
+	assert(conn->record == NULL);
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		log_error("[%s] Unable to create session recording %s: %s",
+		    conn->name, path, strerror(errno));
+		return false;
+	}
+	if (fwrite(CONN_IO_REC_MAGIC, CONN_IO_REC_MAGICLEN, 1, fp) != 1) {
+		log_error("[%s] Unable to write session recording %s: %s",
+		    conn->name, path, strerror(errno));
+		fclose(fp);
+		return false;
+	}
+	log_info("[%s] Recording session to %s.", conn->name, path);
+
+	conn->record = fp;
+	conn->record_start = conn_io_record_now();
+	return true;
+}
+
+/*
+ * conn_io_record_data --
+ *	Append a record to the session recording.  If writing the
+ *	recording fails, we just stop recording; the session itself
+ *	is more important.
+ */
+static void
+conn_io_record_data(struct conn_io *conn, uint8_t dir, const void *buf,
+    size_t len)
+{
+	uint8_t hdr[CONN_IO_REC_HDRLEN];
+	uint64_t t;
+	int i;
+
+	if (conn->record == NULL || len == 0) {
+		return;
+	}
+
+	t = conn_io_record_now() - conn->record_start;
+	for (i = 0; i < 8; i++) {
+		hdr[i] = (uint8_t)(t >> (i * 8));
+	}
+	for (i = 0; i < 4; i++) {
+		hdr[8 + i] = (uint8_t)((uint32_t)len >> (i * 8));
+	}
+	hdr[12] = dir;
+
+	if (fwrite(hdr, sizeof(hdr), 1, conn->record) != 1 ||
+	    fwrite(buf, len, 1, conn->record) != 1 ||
+	    fflush(conn->record) != 0) {
+		log_error("[%s] Session recording failed: %s; stopping.",
+		    conn->name, strerror(errno));
+		fclose(conn->record);
+		conn->record = NULL;
+	}
+}
+
 /*
  * conn_io_accept --
  *	Wait for a connection and accept it.
@@ -425,7 +540,10 @@ conn_io_send(struct conn_io *conn, const void *vbuf, size_t len)
 		}
 
 		actual = write(conn->fd, curptr, resid);
-		if (actual < 0 && errno != EAGAIN) {
+		if (actual < 0) {
+			if (errno == EAGAIN) {
+				continue;
+			}
 			log_error("[%s] write() failed: %s", conn->name,
 			    strerror(errno));
 			conn->state = CONN_STATE_ABORTED;
@@ -438,6 +556,9 @@ conn_io_send(struct conn_io *conn, const void *vbuf, size_t len)
 			return;
 		}
 
+		conn_io_record_data(conn, CONN_IO_REC_SEND, curptr,
+		    (size_t)actual);
+
 		resid -= actual;
 		curptr += actual;
 		if (resid == 0) {
@@ -446,6 +567,217 @@ conn_io_send(struct conn_io *conn, const void *vbuf, size_t len)
 	}
 }
 
+/*
+ * conn_io_sendv --
+ *	Gather-send data on the connection.  Same semantics as
+ *	conn_io_send().  The iovec array is modified as data
+ *	is sent.
+ */
+void
+conn_io_sendv(struct conn_io *conn, struct iovec *iov, int iovcnt)
+{
+	struct timespec deadline;
+	ssize_t actual;
+
+	/* Skip any leading empty vectors. */
+	while (iovcnt != 0 && iov->iov_len == 0) {
+		iov++;
+		iovcnt--;
+	}
+	if (iovcnt == 0) {
+		return;
+	}
+
+	conn_io_deadline(conn, &deadline);
+
+	for (;;) {
+		/* Wait for the connection to accept writes. */
+		if (! conn_io_wait(conn, &deadline, false)) {
+			/* Error already logged. */
+			return;
+		}
+
+		actual = writev(conn->fd, iov, iovcnt);
+		if (actual < 0) {
+			if (errno == EAGAIN) {
+				continue;
+			}
+			log_error("[%s] writev() failed: %s", conn->name,
+			    strerror(errno));
+			conn->state = CONN_STATE_ABORTED;
+			return;
+		}
+		if (actual == 0) {
+			log_debug(LOG_SUBSYS_CONN_IO,
+			    "[%s] Got End-of-File", conn->name);
+			conn->state = CONN_STATE_EOF;
+			return;
+		}
+
+		while (iovcnt != 0 && (size_t)actual >= iov->iov_len) {
+			conn_io_record_data(conn, CONN_IO_REC_SEND,
+			    iov->iov_base, iov->iov_len);
+			actual -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt == 0) {
+			return;
+		}
+		conn_io_record_data(conn, CONN_IO_REC_SEND, iov->iov_base,
+		    (size_t)actual);
+		iov->iov_base = (uint8_t *)iov->iov_base + actual;
+		iov->iov_len -= actual;
+	}
+}
+
+#ifdef HAVE_LINUX_SENDFILE
+/*
+ * conn_io_sendfile_linux --
+ *	Send the header with MSG_MORE so that it is coalesced with the
+ *	file data, and then let the kernel copy the file data directly
+ *	to the socket.  Returns false if this isn't a socket, in which
+ *	case nothing has been sent.  Otherwise, returns true and the
+ *	number of file bytes sent in *sentp, which is short if the file
+ *	ended early, the file can't be used with sendfile(), or the
+ *	connection failed.
+ */
+static bool
+conn_io_sendfile_linux(struct conn_io *conn, const void *vhdr,
+    size_t hdrlen, int fd, off_t offset, size_t len, size_t *sentp)
+{
+	const uint8_t *hdr = vhdr;
+	struct timespec deadline;
+	ssize_t actual;
+	size_t resid;
+	bool first = true;
+	bool need_wait;
+
+	*sentp = 0;
+
+	conn_io_deadline(conn, &deadline);
+
+	while (hdrlen != 0) {
+		if (! conn_io_wait(conn, &deadline, false)) {
+			/* Error already logged. */
+			return true;
+		}
+		actual = send(conn->fd, hdr, hdrlen, MSG_MORE);
+		if (actual < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			if (first && errno == ENOTSOCK) {
+				return false;
+			}
+			log_error("[%s] send() failed: %s", conn->name,
+			    strerror(errno));
+			conn->state = CONN_STATE_ABORTED;
+			return true;
+		}
+		first = false;
+		hdr += actual;
+		hdrlen -= actual;
+	}
+
+	/*
+	 * The header just went out, so there's almost certainly room
+	 * for more; only wait if the socket says otherwise.  This keeps
+	 * the common case to the same number of system calls as the
+	 * copying path.
+	 */
+	need_wait = false;
+	for (resid = len; resid != 0;) {
+		if (need_wait && ! conn_io_wait(conn, &deadline, false)) {
+			/* Error already logged. */
+			break;
+		}
+		need_wait = true;
+		actual = sendfile(conn->fd, fd, &offset, resid);
+		if (actual < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			if (resid == len && (errno == EINVAL ||
+					     errno == ENOSYS)) {
+				/* Let the caller copy it instead. */
+				break;
+			}
+			log_error("[%s] sendfile() failed: %s", conn->name,
+			    strerror(errno));
+			conn->state = CONN_STATE_ABORTED;
+			break;
+		}
+		if (actual == 0) {
+			/* File ended early. */
+			break;
+		}
+		resid -= actual;
+	}
+	*sentp = len - resid;
+	return true;
+}
+#endif /* HAVE_LINUX_SENDFILE */
+
+/*
+ * conn_io_sendfile --
+ *	Send a header followed by len bytes of file data starting at
+ *	offset.  Where the platform supports it, the file data goes
+ *	from the file to the connection without being copied through
+ *	user space.  Since the header has already committed us to the
+ *	length, the data is padded with zeros if the file ends early.
+ *	Same semantics as conn_io_send() otherwise.
+ */
+void
+conn_io_sendfile(struct conn_io *conn, const void *hdr, size_t hdrlen,
+    int fd, off_t offset, size_t len)
+{
+	static const uint8_t zeros[512];
+	uint8_t buf[1024];
+	size_t sent = 0;
+	ssize_t actual;
+
+#ifdef HAVE_LINUX_SENDFILE
+	/*
+	 * Session recording needs to see the data, so it always
+	 * takes the copying path.
+	 */
+	if (conn->record == NULL &&
+	    conn_io_sendfile_linux(conn, hdr, hdrlen, fd, offset, len,
+				   &sent)) {
+		hdrlen = 0;
+		offset += sent;
+		len -= sent;
+	}
+#endif /* HAVE_LINUX_SENDFILE */
+
+	if (hdrlen != 0) {
+		conn_io_send(conn, hdr, hdrlen);
+	}
+
+	/* Copy whatever the kernel didn't send for us. */
+	while (len != 0 && conn->state == CONN_STATE_OK) {
+		actual = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf),
+		    offset);
+		if (actual < 0 && errno == EINTR) {
+			continue;
+		}
+		if (actual <= 0) {
+			break;
+		}
+		conn_io_send(conn, buf, (size_t)actual);
+		offset += actual;
+		len -= actual;
+	}
+
+	/* Pad out anything the file couldn't provide. */
+	while (len != 0 && conn->state == CONN_STATE_OK) {
+		size_t chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+		conn_io_send(conn, zeros, chunk);
+		len -= chunk;
+	}
+}
+
 /*
  * conn_io_send_byte --
  *	Convenience wrapper around conn_io_send() that handles
@@ -488,7 +820,10 @@ conn_io_recv(struct conn_io *conn, void *vbuf, size_t len)
 		}
 
 		actual = read(conn->fd, curptr, resid);
-		if (actual < 0 && errno != EAGAIN) {
+		if (actual < 0) {
+			if (errno == EAGAIN) {
+				continue;
+			}
 			log_error("[%s] read() failed: %s", conn->name,
 			    strerror(errno));
 			conn->state = CONN_STATE_ABORTED;
@@ -501,6 +836,9 @@ conn_io_recv(struct conn_io *conn, void *vbuf, size_t len)
 			return false;
 		}
 
+		conn_io_record_data(conn, CONN_IO_REC_RECV, curptr,
+		    (size_t)actual);
+
 		resid -= actual;
 		curptr += actual;
 		if (resid == 0) {
@@ -27,14 +27,18 @@
 #ifndef conn_io_h_included
 #define	conn_io_h_included
 
+#include <sys/types.h>
 #include <sys/socket.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
 #include "nbsd_queue.h"
 
+struct iovec;
+
 typedef enum {
 	CONN_STATE_OK		=	0,
 	CONN_STATE_EOF		=	1,
@@ -67,8 +71,37 @@ struct conn_io {
 	 * when the connection is cancelled.
 	 */
 	int		cancel_fds[2];
+
+	/* Session recording, if enabled. */
+	FILE		*record;
+	uint64_t	record_start;
+
+	/*
+	 * Endpoint is handed to the new instance when the server
+	 * is upgraded in-place (listeners and serial ports).
+	 */
+	bool		handoff;
 };
 
+/*
+ * Session recording file format.  The file begins with the magic
+ * string, followed by a series of records, each of which is a
+ * header followed by the data:
+ *
+ *	uint64_t	time (nanoseconds since recording started)
+ *	uint32_t	length of data
+ *	uint8_t		direction
+ *
+ * All multi-byte values are little-endian.  The direction is from
+ * the perspective of the server: RECV is data from the peer, SEND
+ * is data to the peer.
+ */
+#define	CONN_IO_REC_MAGIC	"NABUREC1"
+#define	CONN_IO_REC_MAGICLEN	8
+#define	CONN_IO_REC_HDRLEN	13
+#define	CONN_IO_REC_RECV	'R'
+#define	CONN_IO_REC_SEND	'S'
+
 #define	conn_io_name(c)		(c)->name
 #define	conn_io_state(c)	(c)->state
 #define	conn_io_set_state(c, s)	(c)->state = (s)
@@ -76,6 +109,7 @@ struct conn_io {
 bool	conn_io_init(struct conn_io *, char *, int);
 bool	conn_io_start(struct conn_io *, void *(*)(void *), void *);
 void	conn_io_fini(struct conn_io *);
+bool	conn_io_record(struct conn_io *, const char *);
 
 int	conn_io_polltimo(struct conn_io *conn, const struct timespec *deadline,
 	    bool is_recv);
@@ -86,6 +120,9 @@ bool	conn_io_accept(struct conn_io *, struct sockaddr *, socklen_t *,
 	    int *);
 
 void	conn_io_send(struct conn_io *, const void *, size_t);
+void	conn_io_sendv(struct conn_io *, struct iovec *, int);
+void	conn_io_sendfile(struct conn_io *, const void *, size_t, int, off_t,
+	    size_t);
 void	conn_io_send_byte(struct conn_io *, uint8_t);
 bool	conn_io_recv(struct conn_io *, void *, size_t);
 bool	conn_io_recv_byte(struct conn_io *, uint8_t *);
@@ -97,5 +134,6 @@ void	conn_io_stop_watchdog(struct conn_io *);
 
 void	conn_io_cancel(struct conn_io *);
 void	conn_io_shutdown(void);
+bool	conn_io_enumerate(bool (*)(struct conn_io *, void *), void *);
 
 #endif /* conn_io_h_included */
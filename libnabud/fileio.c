@@ -42,9 +42,16 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef HAVE_OPENAT2
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#endif /* HAVE_OPENAT2 */
+
 #include "fileio.h"
 #include "log.h"
 #include "missing.h"
+#include "nbsd_queue.h"
 
 #include "libfetch/fetch.h"
 
@@ -331,10 +338,181 @@ check_local_root_escape(const char *location)
 	return depth < 0;
 }
 
+/*
+ * Cache of directory descriptors for local roots.  When we have one,
+ * locations are looked up relative to it with openat2(RESOLVE_BENEATH),
+ * so the kernel enforces that the lookup cannot escape the local root
+ * and we avoid walking the full path from "/" on every open.
+ *
+ * A descriptor pins the directory it was opened on, so the cache is
+ * flushed whenever the configuration is (re-)loaded; a storage area
+ * that was renamed or re-created is then picked up afresh.  Lookups
+ * hold a reference on their entry, so a flushed entry's descriptor
+ * is not closed until the last lookup using it is done.
+ */
+struct fileio_root {
+	LIST_ENTRY(fileio_root) link;
+	unsigned int	refcnt;
+	bool		stale;
+	int		fd;
+	char		path[];
+};
+
+#ifdef HAVE_OPENAT2
+static LIST_HEAD(, fileio_root) fileio_roots =
+    LIST_HEAD_INITIALIZER(fileio_roots);
+static pthread_mutex_t fileio_roots_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool fileio_openat2_unavailable;
+
+/*
+ * fileio_local_root_free --
+ *	Close and free a local root entry.
+ */
+static void
+fileio_local_root_free(struct fileio_root *root)
+{
+	log_debug(LOG_SUBSYS_FILEIO,
+	    "Closing LOCAL-ROOT '%s' at fd %d.", root->path, root->fd);
+	close(root->fd);
+	free(root);
+}
+
+/*
+ * fileio_local_root_get --
+ *	Get a reference to the cached directory descriptor for the
+ *	specified local root, opening it if necessary.  Returns NULL
+ *	if the descriptor is not available, in which case the caller
+ *	should fall back to path-based resolution.
+ */
+static struct fileio_root *
+fileio_local_root_get(const char *local_root)
+{
+	struct fileio_root *root;
+
+	pthread_mutex_lock(&fileio_roots_lock);
+
+	if (fileio_openat2_unavailable) {
+		root = NULL;
+		goto out;
+	}
+
+	LIST_FOREACH(root, &fileio_roots, link) {
+		if (strcmp(root->path, local_root) == 0) {
+			root->refcnt++;
+			goto out;
+		}
+	}
+
+	root = malloc(sizeof(*root) + strlen(local_root) + 1);
+	if (root == NULL) {
+		goto out;
+	}
+	root->fd = open(local_root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (root->fd < 0) {
+		log_debug(LOG_SUBSYS_FILEIO,
+		    "Unable to open LOCAL-ROOT '%s': %s", local_root,
+		    strerror(errno));
+		free(root);
+		root = NULL;
+		goto out;
+	}
+	root->refcnt = 1;
+	root->stale = false;
+	strcpy(root->path, local_root);
+	LIST_INSERT_HEAD(&fileio_roots, root, link);
+	log_debug(LOG_SUBSYS_FILEIO,
+	    "Cached LOCAL-ROOT '%s' at fd %d.", local_root, root->fd);
+
+ out:
+	pthread_mutex_unlock(&fileio_roots_lock);
+	return root;
+}
+#endif /* HAVE_OPENAT2 */
+
+/*
+ * fileio_local_root_put --
+ *	Release a reference obtained from fileio_local_root_get().
+ *	Preserves errno.
+ */
+static void
+fileio_local_root_put(struct fileio_root *root)
+{
+#ifdef HAVE_OPENAT2
+	int error = errno;
+
+	if (root == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&fileio_roots_lock);
+	if (--root->refcnt == 0 && root->stale) {
+		fileio_local_root_free(root);
+	}
+	pthread_mutex_unlock(&fileio_roots_lock);
+	errno = error;
+#endif /* HAVE_OPENAT2 */
+}
+
+/*
+ * fileio_local_roots_flush --
+ *	Forget all of the cached local root directory descriptors.
+ *	Called when the configuration is (re-)loaded.
+ */
+void
+fileio_local_roots_flush(void)
+{
+#ifdef HAVE_OPENAT2
+	struct fileio_root *root, *nroot;
+
+	pthread_mutex_lock(&fileio_roots_lock);
+	LIST_FOREACH_SAFE(root, &fileio_roots, link, nroot) {
+		LIST_REMOVE(root, link);
+		root->stale = true;
+		if (root->refcnt == 0) {
+			fileio_local_root_free(root);
+		}
+	}
+	pthread_mutex_unlock(&fileio_roots_lock);
+#endif /* HAVE_OPENAT2 */
+}
+
+#ifdef HAVE_OPENAT2
+
+/*
+ * fileio_local_openat2_disable --
+ *	The kernel we're running on doesn't have openat2(); use
+ *	path-based resolution from now on.
+ */
+static void
+fileio_local_openat2_disable(void)
+{
+	pthread_mutex_lock(&fileio_roots_lock);
+	if (! fileio_openat2_unavailable) {
+		log_debug(LOG_SUBSYS_FILEIO,
+		    "openat2() not available; using path-based resolution.");
+		fileio_openat2_unavailable = true;
+	}
+	pthread_mutex_unlock(&fileio_roots_lock);
+}
+#endif /* HAVE_OPENAT2 */
+
+/*
+ * fileio_local_resolve_path --
+ *	Resolve a location into a local path, applying the local root
+ *	if one is specified.  If rootp is not NULL, the caller is
+ *	prepared to resolve the location relative to a cached local
+ *	root directory descriptor; in that case, *rootp gets a
+ *	reference to it (or NULL if there isn't one), which the caller
+ *	must release with fileio_local_root_put(), and *relpathp gets
+ *	the location relative to it.  When a descriptor is returned,
+ *	the escape check is left to the kernel.
+ */
 static int
 fileio_local_resolve_path(const char *location, const char *local_root,
-    int flags, char **fnamep)
+    int flags, char **fnamep, struct fileio_root **rootp,
+    const char **relpathp)
 {
+	struct fileio_root *root = NULL;
+	const char *relpath;
 	char *fname;
 
 	if ((flags & FILEIO_O_LOCAL_ROOT) != 0 && local_root == NULL) {
@@ -376,7 +554,12 @@ fileio_local_resolve_path(const char *location, const char *local_root,
 			    local_root);
 			return EINVAL;
 		}
-		if (check_local_root_escape(location)) {
+#ifdef HAVE_OPENAT2
+		if (rootp != NULL) {
+			root = fileio_local_root_get(local_root);
+		}
+#endif /* HAVE_OPENAT2 */
+		if (root == NULL && check_local_root_escape(location)) {
 			return EPERM;
 		}
 		/* local_root/location\0 */
@@ -392,17 +575,84 @@ fileio_local_resolve_path(const char *location, const char *local_root,
 		fname = strdup(location);
 	}
 	if (fname == NULL) {
+		fileio_local_root_put(root);
 		return ENOMEM;
 	}
 
+	if (rootp != NULL) {
+		relpath = location;
+		if (root != NULL) {
+			/* Relative to the root; "/" is the root itself. */
+			while (*relpath == '/') {
+				relpath++;
+			}
+			if (*relpath == '\0') {
+				relpath = ".";
+			}
+		}
+		*rootp = root;
+		*relpathp = relpath;
+	}
+
 	*fnamep = fname;
 	return 0;
 }
 
+/*
+ * fileio_local_open --
+ *	Open a resolved local path.  If we have a local root directory
+ *	descriptor, use openat2(RESOLVE_BENEATH) relative to it.
+ */
+static int
+fileio_local_open(struct fileio_root *root, const char *relpath,
+    const char *path, int open_flags)
+{
+#ifdef HAVE_OPENAT2
+	if (root != NULL) {
+		struct open_how how = {
+			.flags = open_flags,
+			.mode = (open_flags & O_CREAT) ? 0666 : 0,
+			.resolve = RESOLVE_BENEATH,
+		};
+		int fd;
+
+#ifdef O_LARGEFILE
+		how.flags |= O_LARGEFILE;
+#endif
+		fd = (int)syscall(SYS_openat2, root->fd, relpath, &how,
+		    sizeof(how));
+		if (fd >= 0) {
+			return fd;
+		}
+		if (errno == EXDEV) {
+			/* Lookup tried to escape the local root. */
+			errno = EPERM;
+			return -1;
+		}
+		if (errno != ENOSYS) {
+			return -1;
+		}
+
+		/*
+		 * Old kernel; we skipped the escape check because we
+		 * expected the kernel to do it, so do it now.
+		 */
+		fileio_local_openat2_disable();
+		if (check_local_root_escape(relpath)) {
+			errno = EPERM;
+			return -1;
+		}
+	}
+#endif /* HAVE_OPENAT2 */
+	return open(path, open_flags, 0666);
+}
+
 static bool
 fileio_local_io_open(struct fileio *f, const char *location,
     const char *local_root)
 {
+	struct fileio_root *root = NULL;
+	const char *relpath = NULL;
 	int error;
 
 	int open_flags = fileio_accmode_to_o_flags(f);
@@ -450,16 +700,19 @@ fileio_local_io_open(struct fileio *f, const char *location,
 	}
 #endif /* HAVE_O_DIRECTORY */
 
-	error = fileio_local_resolve_path(location, local_root, f->flags,
-	    &f->location);
-	if (error != 0) {
-		errno = error;
-		return false;
+	if (f->location == NULL) {
+		error = fileio_local_resolve_path(location, local_root,
+		    f->flags, &f->location, &root, &relpath);
+		if (error != 0) {
+			errno = error;
+			return false;
+		}
 	}
 
 	/* If open fails, caller will free f->location. */
 
-	f->local.fd = open(f->location, open_flags, 0666);
+	f->local.fd = fileio_local_open(root, relpath, f->location,
+	    open_flags);
 	if (f->local.fd < 0) {
 #ifdef HAVE_EFTYPE
 		/*
@@ -477,8 +730,10 @@ fileio_local_io_open(struct fileio *f, const char *location,
 			    "Downgrading access mode for '%s'", location);
 			goto again;
 		}
+		fileio_local_root_put(root);
 		return false;
 	}
+	fileio_local_root_put(root);
 
 	struct stat sb;
 	if (fstat(f->local.fd, &sb) < 0) {
@@ -565,14 +820,36 @@ static bool
 fileio_local_io_getattr_location(const char *location, int flags,
     const char *local_root, struct fileio_attrs *attrs)
 {
+	struct fileio_root *root = NULL;
 	struct stat sb;
+	const char *relpath;
 	char *path = NULL;
 	bool rv = false;
 	int error;
 
 	error = fileio_local_resolve_path(location, local_root, flags,
-	    &path);
+	    &path, &root, &relpath);
 	if (error == 0) {
+#ifdef HAVE_OPENAT2
+		if (root != NULL) {
+			int fd = fileio_local_open(root, relpath, path,
+			    O_PATH | O_CLOEXEC);
+			if (fd >= 0) {
+				if (fstat(fd, &sb) == 0) {
+					fileio_stat_to_attrs(path, &sb,
+					    attrs);
+					rv = true;
+				} else {
+					error = errno;
+				}
+				close(fd);
+			} else {
+				error = errno;
+			}
+			fileio_local_root_put(root);
+			goto out;
+		}
+#endif /* HAVE_OPENAT2 */
 		if (stat(path, &sb) == 0) {
 			fileio_stat_to_attrs(path, &sb, attrs);
 			rv = true;
@@ -580,6 +857,9 @@ fileio_local_io_getattr_location(const char *location, int flags,
 			error = errno;
 		}
 	}
+#ifdef HAVE_OPENAT2
+ out:
+#endif /* HAVE_OPENAT2 */
 	if (path != NULL) {
 		free(path);
 	}
@@ -676,6 +956,27 @@ static const struct fileio_ops fileio_local_ops = {
 /*
  * Remote wrappers.
  */
+
+/*
+ * fileio_fetch_errno --
+ *	Map the last libfetch error to an errno value, so that callers
+ *	can tell "the server said no" from "couldn't reach the server".
+ */
+static int
+fileio_fetch_errno(void)
+{
+	switch (fetchLastErrCode) {
+	case FETCH_UNAVAIL:	return ENOENT;
+	case FETCH_AUTH:	return EACCES;
+	case FETCH_MEMORY:	return ENOMEM;
+	case FETCH_URL:		return EINVAL;
+	case FETCH_TIMEOUT:	return ETIMEDOUT;
+	case FETCH_RESOLV:	return EHOSTUNREACH;
+	case FETCH_PROTO:	return EPROTO;
+	default:		return EIO;
+	}
+}
+
 static bool
 fileio_remote_io_open(struct fileio *f, const char *location,
     const char *local_root)
@@ -713,14 +1014,16 @@ fileio_remote_io_open(struct fileio *f, const char *location,
 
 	f->remote.fio = fetchXGetURL(f->location, &f->remote.ust, "");
 	if (f->remote.fio == NULL) {
+		errno = fileio_fetch_errno();
 		return false;
 	}
 
-	if (f->remote.ust.size < 0) {	/* XXX */
-		fetchIO_close(f->remote.fio);
-		return false;
-	}
-
+	/*
+	 * Note that ust.size may be -1 here if the server did not
+	 * provide a Content-Length (e.g. a chunked HTTP transfer).
+	 * Consumers have to use fileio_stream_file() (or the size-
+	 * agnostic fileio_load_file()) in that case.
+	 */
 	return true;
 }
 
@@ -887,7 +1190,8 @@ fileio_resolve_path(const char *location, const char *local_root, int oflags)
 		return NULL;
 	}
 
-	error = fileio_local_resolve_path(location, local_root, oflags, &path);
+	error = fileio_local_resolve_path(location, local_root, oflags, &path,
+	    NULL, NULL);
 	if (error != 0) {
 		errno = error;
 		return NULL;
@@ -930,6 +1234,22 @@ fileio_location(struct fileio *f)
 	return f->location;
 }
 
+/*
+ * fileio_local_fd --
+ *	Return the underlying descriptor of a local regular file, for
+ *	callers that can hand it directly to the kernel (e.g. sendfile()).
+ *	Returns -1 for remote files and directories.  The descriptor
+ *	remains owned by the fileio object.
+ */
+int
+fileio_local_fd(struct fileio *f)
+{
+	if (f->ops != &fileio_local_ops || f->local.is_directory) {
+		return -1;
+	}
+	return f->local.fd;
+}
+
 /*
  * fileio_getattr --
  *	Get attributes of a file.
@@ -1084,6 +1404,148 @@ fileio_pwrite(struct fileio *f, const void *buf, size_t len, off_t offset)
 	return actual;
 }
 
+/* Size of the bounce buffer used for streaming loads. */
+#define	FILEIO_STREAM_CHUNKSIZE	(16U * 1024)
+
+/* Initial allocation when loading a file of unknown size. */
+#define	FILEIO_LOAD_INITSIZE	(64U * 1024)
+
+/*
+ * fileio_stream_file --
+ *	Read a file in chunks, passing each chunk to the specified
+ *	function as it arrives.  Unlike fileio_load_file(), this does
+ *	not need to know the size of the file in advance, and so works
+ *	for chunked HTTP transfers.  If the function returns false, or
+ *	the file exceeds maxsize (0 == no limit), the stream is aborted.
+ *	The total number of bytes read is returned in *filesizep.
+ */
+bool
+fileio_stream_file(struct fileio *f, size_t maxsize,
+    bool (*func)(void *, const void *, size_t), void *arg,
+    size_t *filesizep)
+{
+	size_t filesize = 0;
+	uint8_t *chunk;
+	ssize_t actual;
+	bool rv = false;
+
+	if ((chunk = malloc(FILEIO_STREAM_CHUNKSIZE)) == NULL) {
+		log_error("Unable to allocate chunk buffer for %s",
+		    fileio_location(f));
+		return false;
+	}
+
+	for (;;) {
+		actual = fileio_read(f, chunk, FILEIO_STREAM_CHUNKSIZE);
+		if (actual < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("Unable to read %s: %s",
+			    fileio_location(f), strerror(errno));
+			goto out;
+		}
+		if (actual == 0) {
+			/* EOF. */
+			break;
+		}
+		if (maxsize != 0 && (size_t)actual > maxsize - filesize) {
+			log_error("Size of %s exceeds maximum (%zu).",
+			    fileio_location(f), maxsize);
+			goto out;
+		}
+		filesize += actual;
+		if (! (*func)(arg, chunk, (size_t)actual)) {
+			/* Error already logged. */
+			goto out;
+		}
+	}
+
+	log_debug(LOG_SUBSYS_FILEIO, "Streamed %zu bytes from %s.",
+	    filesize, fileio_location(f));
+	*filesizep = filesize;
+	rv = true;
+ out:
+	free(chunk);
+	return rv;
+}
+
+struct fileio_load_buf {
+	struct fileio	*f;
+	uint8_t		*data;
+	size_t		length;
+	size_t		allocsize;
+	size_t		extra;
+};
+
+static bool
+fileio_load_file_chunk(void *arg, const void *chunk, size_t len)
+{
+	struct fileio_load_buf *lb = arg;
+	size_t need = lb->length + len + lb->extra;
+
+	if (need > lb->allocsize) {
+		size_t newsize = lb->allocsize;
+		uint8_t *newdata;
+
+		while (newsize < need) {
+			newsize *= 2;
+		}
+		newdata = realloc(lb->data, newsize);
+		if (newdata == NULL) {
+			log_error("Unable to allocate %zu bytes for %s",
+			    newsize, fileio_location(lb->f));
+			return false;
+		}
+		lb->data = newdata;
+		lb->allocsize = newsize;
+	}
+	memcpy(lb->data + lb->length, chunk, len);
+	lb->length += len;
+	return true;
+}
+
+/*
+ * fileio_load_file_unsized --
+ *	Load a file whose size is not known in advance, growing
+ *	the buffer as data arrives.
+ */
+static void *
+fileio_load_file_unsized(struct fileio *f, size_t extra, size_t maxsize,
+    size_t *filesizep)
+{
+	struct fileio_load_buf lb = {
+		.f = f,
+		.allocsize = FILEIO_LOAD_INITSIZE,
+		.extra = extra,
+	};
+	size_t filesize;
+
+	if (maxsize != 0 && maxsize + extra < lb.allocsize) {
+		lb.allocsize = maxsize + extra;
+	}
+	if ((lb.data = malloc(lb.allocsize)) == NULL) {
+		log_error("Unable to allocate %zu bytes for %s",
+		    lb.allocsize, fileio_location(f));
+		return NULL;
+	}
+
+	if (! fileio_stream_file(f, maxsize, fileio_load_file_chunk, &lb,
+				 &filesize)) {
+		free(lb.data);
+		return NULL;
+	}
+	if (filesize == 0) {
+		log_error("Size of %s (0) is nonsensical.",
+		    fileio_location(f));
+		free(lb.data);
+		return NULL;
+	}
+
+	*filesizep = filesize;
+	return lb.data;
+}
+
 /*
  * fileio_load_file --
  *	Load a file from the specified fileio.
@@ -1106,10 +1568,9 @@ fileio_load_file(struct fileio *f, struct fileio_attrs *attrs, size_t extra,
 	}
 
 	if (attrs->size < 0) {
-		/* XXX Support for chunked transfer encodings. */
-		log_error("Size for %s is unavailable.",
-		    fileio_location(f));
-		return NULL;
+		log_debug(LOG_SUBSYS_FILEIO,
+		    "Size of %s is unknown; streaming.", fileio_location(f));
+		return fileio_load_file_unsized(f, extra, maxsize, filesizep);
 	} else if (attrs->size == 0 ||
 		   (maxsize != 0 && attrs->size > maxsize)) {
 		log_error("Size of %s (%lld) is nonsensical.",
@@ -57,6 +57,7 @@ bool		fileio_getattr_location(const char *, int, const char *,
 					struct fileio_attrs *);
 bool		fileio_truncate(struct fileio *, off_t);
 const char *	fileio_location(struct fileio *);
+int		fileio_local_fd(struct fileio *);
 
 #define	FILEIO_O_ACCMODE	0x0007	/* access mode mask */
 #define	FILEIO_O_RDONLY		0x0000
@@ -76,7 +77,12 @@ void	*fileio_load_file(struct fileio *, struct fileio_attrs *, size_t,
 void	*fileio_load_file_from_location(const char *, int, size_t, size_t,
 					struct fileio_attrs *, size_t *);
 
+bool	fileio_stream_file(struct fileio *, size_t,
+			   bool (*)(void *, const void *, size_t), void *,
+			   size_t *);
+
 char	*fileio_resolve_path(const char *, const char *, int);
 bool	fileio_location_is_local(const char *, size_t);
+void	fileio_local_roots_flush(void);
 
 #endif /* fileio_h_included */
@@ -0,0 +1,357 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Asynchronous file I/O, built on top of the synchronous fileio
+ * API and a small pool of worker threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fileio.h"
+#include "fileio_async.h"
+#include "log.h"
+#include "nbsd_queue.h"
+
+/* Default number of I/O threads. */
+#define	FILEIO_ASYNC_NTHREADS	4
+
+typedef enum {
+	FILEIO_ASYNC_OPEN,
+	FILEIO_ASYNC_READ,
+	FILEIO_ASYNC_LOAD,
+	FILEIO_ASYNC_GETATTR,
+} fileio_async_op;
+
+struct fileio_async_req {
+	STAILQ_ENTRY(fileio_async_req) link;
+	fileio_async_op		op;
+	fileio_async_callback_t	callback;
+	void			*arg;
+
+	char			*location;	/* open, load, getattr */
+	char			*local_root;	/* open, getattr */
+	int			flags;		/* open, load, getattr */
+
+	struct fileio		*fileio;	/* read */
+	void			*buf;		/* read */
+	size_t			len;		/* read */
+	off_t			offset;		/* read; < 0 == sequential */
+
+	size_t			extra;		/* load */
+	size_t			maxsize;	/* load */
+};
+
+static pthread_mutex_t fileio_async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fileio_async_cv = PTHREAD_COND_INITIALIZER;
+static STAILQ_HEAD(, fileio_async_req) fileio_async_queue =
+    STAILQ_HEAD_INITIALIZER(fileio_async_queue);
+static unsigned int fileio_async_nthreads;
+
+static void
+fileio_async_req_free(struct fileio_async_req *req)
+{
+	if (req->location != NULL) {
+		free(req->location);
+	}
+	if (req->local_root != NULL) {
+		free(req->local_root);
+	}
+	free(req);
+}
+
+/*
+ * fileio_async_perform --
+ *	Perform a request on behalf of an I/O thread.
+ */
+static void
+fileio_async_perform(struct fileio_async_req *req,
+    struct fileio_async_result *res)
+{
+	ssize_t actual;
+
+	memset(res, 0, sizeof(*res));
+
+	switch (req->op) {
+	case FILEIO_ASYNC_OPEN:
+		res->fileio = fileio_open(req->location, req->flags,
+		    req->local_root, &res->attrs);
+		if (res->fileio == NULL) {
+			res->error = errno;
+		}
+		break;
+
+	case FILEIO_ASYNC_READ:
+		do {
+			if (req->offset < 0) {
+				actual = fileio_read(req->fileio, req->buf,
+				    req->len);
+			} else {
+				actual = fileio_pread(req->fileio, req->buf,
+				    req->len, req->offset);
+			}
+		} while (actual < 0 && errno == EINTR);
+		if (actual < 0) {
+			res->error = errno;
+		} else {
+			res->data = req->buf;
+			res->length = (size_t)actual;
+		}
+		break;
+
+	case FILEIO_ASYNC_LOAD:
+		errno = 0;
+		res->data = fileio_load_file_from_location(req->location,
+		    req->flags, req->extra, req->maxsize, &res->attrs,
+		    &res->length);
+		if (res->data == NULL) {
+			/* Not all failure paths set errno. */
+			res->error = errno != 0 ? errno : EIO;
+		}
+		break;
+
+	case FILEIO_ASYNC_GETATTR:
+		if (! fileio_getattr_location(req->location, req->flags,
+					      req->local_root, &res->attrs)) {
+			res->error = errno;
+		}
+		break;
+
+	default:
+		abort();
+	}
+}
+
+/*
+ * fileio_async_thread --
+ *	Worker thread that services async requests.
+ */
+static void *
+fileio_async_thread(void *arg)
+{
+	struct fileio_async_result res;
+	struct fileio_async_req *req;
+
+	for (;;) {
+		pthread_mutex_lock(&fileio_async_lock);
+		while ((req = STAILQ_FIRST(&fileio_async_queue)) == NULL) {
+			pthread_cond_wait(&fileio_async_cv,
+			    &fileio_async_lock);
+		}
+		STAILQ_REMOVE_HEAD(&fileio_async_queue, link);
+		pthread_mutex_unlock(&fileio_async_lock);
+
+		fileio_async_perform(req, &res);
+		(*req->callback)(&res, req->arg);
+		fileio_async_req_free(req);
+	}
+	return NULL;
+}
+
+/*
+ * fileio_async_init --
+ *	Start the async I/O threads.  This is optional; if not called,
+ *	the default number of threads is started on first use.  Calling
+ *	it again with a larger number grows the pool.
+ */
+bool
+fileio_async_init(unsigned int nthreads)
+{
+	pthread_t thread;
+	bool rv = true;
+	int error;
+
+	if (nthreads == 0) {
+		nthreads = FILEIO_ASYNC_NTHREADS;
+	}
+
+	pthread_mutex_lock(&fileio_async_lock);
+	while (fileio_async_nthreads < nthreads) {
+		error = pthread_create(&thread, NULL, fileio_async_thread,
+		    NULL);
+		if (error != 0) {
+			log_error("Unable to create async I/O thread: %s",
+			    strerror(error));
+			rv = fileio_async_nthreads != 0;
+			break;
+		}
+		pthread_detach(thread);
+		fileio_async_nthreads++;
+	}
+	pthread_mutex_unlock(&fileio_async_lock);
+
+	log_debug(LOG_SUBSYS_FILEIO, "%u async I/O threads running.",
+	    fileio_async_nthreads);
+	return rv;
+}
+
+static struct fileio_async_req *
+fileio_async_req_alloc(fileio_async_op op, const char *location,
+    const char *local_root, fileio_async_callback_t callback, void *arg)
+{
+	struct fileio_async_req *req;
+
+	req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		goto bad;
+	}
+	req->op = op;
+	req->callback = callback;
+	req->arg = arg;
+	if (location != NULL &&
+	    (req->location = strdup(location)) == NULL) {
+		goto bad;
+	}
+	if (local_root != NULL &&
+	    (req->local_root = strdup(local_root)) == NULL) {
+		goto bad;
+	}
+	return req;
+
+ bad:
+	log_error("Unable to allocate async I/O request.");
+	if (req != NULL) {
+		fileio_async_req_free(req);
+	}
+	errno = ENOMEM;
+	return NULL;
+}
+
+static bool
+fileio_async_enqueue(struct fileio_async_req *req)
+{
+	bool started;
+
+	pthread_mutex_lock(&fileio_async_lock);
+	started = fileio_async_nthreads != 0;
+	pthread_mutex_unlock(&fileio_async_lock);
+
+	if (! started && ! fileio_async_init(0)) {
+		fileio_async_req_free(req);
+		errno = EAGAIN;
+		return false;
+	}
+
+	pthread_mutex_lock(&fileio_async_lock);
+	STAILQ_INSERT_TAIL(&fileio_async_queue, req, link);
+	pthread_cond_signal(&fileio_async_cv);
+	pthread_mutex_unlock(&fileio_async_lock);
+
+	return true;
+}
+
+/*
+ * fileio_async_open --
+ *	Asynchronous fileio_open().
+ */
+bool
+fileio_async_open(const char *location, int flags, const char *local_root,
+    fileio_async_callback_t callback, void *arg)
+{
+	struct fileio_async_req *req;
+
+	req = fileio_async_req_alloc(FILEIO_ASYNC_OPEN, location, local_root,
+	    callback, arg);
+	if (req == NULL) {
+		return false;
+	}
+	req->flags = flags;
+	return fileio_async_enqueue(req);
+}
+
+/*
+ * fileio_async_read --
+ *	Asynchronous fileio_read() (offset < 0) or fileio_pread().
+ *	The caller must not touch the fileio or the buffer until
+ *	the callback is invoked.
+ */
+bool
+fileio_async_read(struct fileio *f, void *buf, size_t len, off_t offset,
+    fileio_async_callback_t callback, void *arg)
+{
+	struct fileio_async_req *req;
+
+	req = fileio_async_req_alloc(FILEIO_ASYNC_READ, NULL, NULL,
+	    callback, arg);
+	if (req == NULL) {
+		return false;
+	}
+	req->fileio = f;
+	req->buf = buf;
+	req->len = len;
+	req->offset = offset;
+	return fileio_async_enqueue(req);
+}
+
+/*
+ * fileio_async_load --
+ *	Asynchronous fileio_load_file_from_location().
+ */
+bool
+fileio_async_load(const char *location, int oflags, size_t extra,
+    size_t maxsize, fileio_async_callback_t callback, void *arg)
+{
+	struct fileio_async_req *req;
+
+	req = fileio_async_req_alloc(FILEIO_ASYNC_LOAD, location, NULL,
+	    callback, arg);
+	if (req == NULL) {
+		return false;
+	}
+	req->flags = oflags;
+	req->extra = extra;
+	req->maxsize = maxsize;
+	return fileio_async_enqueue(req);
+}
+
+/*
+ * fileio_async_getattr --
+ *	Asynchronous fileio_getattr_location().
+ */
+bool
+fileio_async_getattr(const char *location, int flags, const char *local_root,
+    fileio_async_callback_t callback, void *arg)
+{
+	struct fileio_async_req *req;
+
+	req = fileio_async_req_alloc(FILEIO_ASYNC_GETATTR, location,
+	    local_root, callback, arg);
+	if (req == NULL) {
+		return false;
+	}
+	req->flags = flags;
+	return fileio_async_enqueue(req);
+}
@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef fileio_async_h_included
+#define	fileio_async_h_included
+
+#include "fileio.h"
+
+/*
+ * Asynchronous wrappers around the fileio API.  Requests are queued
+ * to a small pool of I/O threads and the caller's callback is invoked
+ * on one of those threads when the operation completes.  The callback
+ * owns result->fileio (open) and result->data (load).
+ */
+
+struct fileio_async_result {
+	int			error;		/* 0 or errno value */
+	struct fileio		*fileio;	/* open */
+	struct fileio_attrs	attrs;		/* open, getattr, load */
+	void			*data;		/* load, read */
+	size_t			length;		/* load, read */
+};
+
+typedef void (*fileio_async_callback_t)(struct fileio_async_result *,
+					void *);
+
+bool	fileio_async_init(unsigned int);
+
+bool	fileio_async_open(const char *, int, const char *,
+			  fileio_async_callback_t, void *);
+bool	fileio_async_read(struct fileio *, void *, size_t, off_t,
+			  fileio_async_callback_t, void *);
+bool	fileio_async_load(const char *, int, size_t, size_t,
+			  fileio_async_callback_t, void *);
+bool	fileio_async_getattr(const char *, int, const char *,
+			     fileio_async_callback_t, void *);
+
+#endif /* fileio_async_h_included */
@@ -0,0 +1,281 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-connection binary flight recorder.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "flightrec.h"
+
+#define	FLIGHTREC_MASK		(FLIGHTREC_NENTRIES - 1)
+
+#ifdef HAVE_STATIC_ASSERT
+_Static_assert((FLIGHTREC_NENTRIES & FLIGHTREC_MASK) == 0,
+    "FLIGHTREC_NENTRIES must be a power of 2");
+#endif
+
+static const char * const flightrec_event_names[FLIGHTREC_EV_COUNT] = {
+	[FLIGHTREC_EV_NONE]		= "none",
+	[FLIGHTREC_EV_CONN_START]	= "conn-start",
+	[FLIGHTREC_EV_CONN_END]		= "conn-end",
+	[FLIGHTREC_EV_MSG]		= "msg",
+	[FLIGHTREC_EV_MSG_UNEXPECTED]	= "msg-unexpected",
+	[FLIGHTREC_EV_RECV_ERROR]	= "recv-error",
+	[FLIGHTREC_EV_SEGMENT_REQ]	= "segment-req",
+	[FLIGHTREC_EV_SEGMENT_SENT]	= "segment-sent",
+	[FLIGHTREC_EV_TIME_SENT]	= "time-sent",
+	[FLIGHTREC_EV_UNAUTHORIZED]	= "unauthorized",
+	[FLIGHTREC_EV_ACK_FAILED]	= "ack-failed",
+	[FLIGHTREC_EV_IMAGE_LOAD_FAILED]= "image-load-failed",
+	[FLIGHTREC_EV_CHANNEL]		= "channel",
+	[FLIGHTREC_EV_NHACP_REQ]	= "nhacp-req",
+	[FLIGHTREC_EV_RETRONET_REQ]	= "retronet-req",
+};
+
+/*
+ * flightrec_record --
+ *	Record an event.  Only the thread that owns the recorder
+ *	may call this.
+ */
+void
+flightrec_record(struct flightrec *fr, uint8_t event, uint8_t code,
+    uint32_t image, uint16_t segment, uint16_t length)
+{
+	uint32_t idx = __atomic_load_n(&fr->next, __ATOMIC_RELAXED);
+	struct flightrec_entry *e = &fr->entries[idx & FLIGHTREC_MASK];
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	e->ts = (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+	    (uint64_t)ts.tv_nsec;
+	e->image = image;
+	e->segment = segment;
+	e->length = length;
+	e->event = event;
+	e->code = code;
+
+	/* Publish the entry. */
+	__atomic_store_n(&fr->next, idx + 1, __ATOMIC_RELEASE);
+}
+
+static void
+flightrec_put(uint8_t *cp, uint64_t v, unsigned int nbytes)
+{
+	while (nbytes-- != 0) {
+		cp[nbytes] = (uint8_t)v;
+		v >>= 8;
+	}
+}
+
+static uint64_t
+flightrec_get(const uint8_t *cp, unsigned int nbytes)
+{
+	uint64_t v = 0;
+
+	while (nbytes-- != 0) {
+		v = (v << 8) | *cp++;
+	}
+	return v;
+}
+
+/*
+ * flightrec_snapshot --
+ *	Serialize the contents of the recorder, oldest entry first,
+ *	into the provided buffer.  This may be called from any thread
+ *	while the owner continues to record; entries that were
+ *	overwritten while the copy was in progress are discarded.
+ *	Returns the number of bytes written to the buffer.
+ */
+size_t
+flightrec_snapshot(struct flightrec *fr, void *vbuf, size_t buflen)
+{
+	uint8_t *buf = vbuf;
+	uint32_t start, end, idx;
+	size_t n = 0;
+
+	end = __atomic_load_n(&fr->next, __ATOMIC_ACQUIRE);
+	start = end > FLIGHTREC_NENTRIES ? end - FLIGHTREC_NENTRIES : 0;
+
+	for (idx = start; idx != end; idx++) {
+		const struct flightrec_entry *e =
+		    &fr->entries[idx & FLIGHTREC_MASK];
+		uint8_t *cp;
+
+		if (n + FLIGHTREC_WIRE_SIZE > buflen) {
+			break;
+		}
+		cp = &buf[n];
+		flightrec_put(&cp[0],  e->ts, 8);
+		flightrec_put(&cp[8],  e->image, 4);
+		flightrec_put(&cp[12], e->segment, 2);
+		flightrec_put(&cp[14], e->length, 2);
+		cp[16] = e->event;
+		cp[17] = e->code;
+		n += FLIGHTREC_WIRE_SIZE;
+	}
+
+	/*
+	 * Writing entry index i clobbers entry (i - NENTRIES), and
+	 * the writer may be in the middle of writing entry "next".
+	 * Anything at or below (next - NENTRIES) may therefore be
+	 * torn; drop those from the front of the snapshot.
+	 */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint32_t now = __atomic_load_n(&fr->next, __ATOMIC_RELAXED);
+	if (now - start >= FLIGHTREC_NENTRIES) {
+		uint32_t stale = now - start - FLIGHTREC_NENTRIES + 1;
+		size_t skip = (size_t)stale * FLIGHTREC_WIRE_SIZE;
+
+		if (skip >= n) {
+			return 0;
+		}
+		memmove(buf, buf + skip, n - skip);
+		n -= skip;
+	}
+	return n;
+}
+
+/*
+ * flightrec_event_name --
+ *	Return the printable name of an event.
+ */
+const char *
+flightrec_event_name(uint8_t event)
+{
+	if (event >= FLIGHTREC_EV_COUNT ||
+	    flightrec_event_names[event] == NULL) {
+		return "???";
+	}
+	return flightrec_event_names[event];
+}
+
+/*
+ * flightrec_decode --
+ *	Decode the entry at the specified index of a serialized
+ *	snapshot.
+ */
+bool
+flightrec_decode(const void *vbuf, size_t buflen, size_t idx,
+    struct flightrec_entry *e)
+{
+	const uint8_t *cp = vbuf;
+
+	if (idx >= buflen / FLIGHTREC_WIRE_SIZE) {
+		return false;
+	}
+	cp += idx * FLIGHTREC_WIRE_SIZE;
+
+	e->ts      = flightrec_get(&cp[0], 8);
+	e->image   = (uint32_t)flightrec_get(&cp[8], 4);
+	e->segment = (uint16_t)flightrec_get(&cp[12], 2);
+	e->length  = (uint16_t)flightrec_get(&cp[14], 2);
+	e->event   = cp[16];
+	e->code    = cp[17];
+	return true;
+}
+
+/*
+ * flightrec_print --
+ *	Print a serialized snapshot in human-readable form.  Timestamps
+ *	are shown relative to the most recent entry.
+ */
+void
+flightrec_print(FILE *fp, const void *buf, size_t buflen)
+{
+	struct flightrec_entry e, last;
+	size_t count = buflen / FLIGHTREC_WIRE_SIZE;
+	size_t i;
+
+	if (count == 0 || !flightrec_decode(buf, buflen, count - 1, &last)) {
+		fprintf(fp, "(no trace entries)\n");
+		return;
+	}
+
+	for (i = 0; flightrec_decode(buf, buflen, i, &e); i++) {
+		uint64_t delta = last.ts - e.ts;
+
+		fprintf(fp, "-%" PRIu64 ".%06" PRIu64 " %-17s",
+		    delta / UINT64_C(1000000000),
+		    (delta % UINT64_C(1000000000)) / 1000,
+		    flightrec_event_name(e.event));
+
+		switch (e.event) {
+		case FLIGHTREC_EV_CONN_END:
+			fprintf(fp, " state=%u", e.code);
+			break;
+
+		case FLIGHTREC_EV_MSG:
+		case FLIGHTREC_EV_MSG_UNEXPECTED:
+		case FLIGHTREC_EV_RECV_ERROR:
+		case FLIGHTREC_EV_RETRONET_REQ:
+			fprintf(fp, " 0x%02x", e.code);
+			break;
+
+		case FLIGHTREC_EV_SEGMENT_REQ:
+			fprintf(fp, " image=%06X segment=%u",
+			    e.image, e.segment);
+			break;
+
+		case FLIGHTREC_EV_SEGMENT_SENT:
+			fprintf(fp, " image=%06X segment=%u length=%u%s",
+			    e.image, e.segment, e.length,
+			    e.code ? " (last)" : "");
+			break;
+
+		case FLIGHTREC_EV_ACK_FAILED:
+			fprintf(fp, " length=%u", e.length);
+			break;
+
+		case FLIGHTREC_EV_IMAGE_LOAD_FAILED:
+			fprintf(fp, " image=%06X", e.image);
+			break;
+
+		case FLIGHTREC_EV_CHANNEL:
+			fprintf(fp, " 0x%04x", e.image);
+			break;
+
+		case FLIGHTREC_EV_NHACP_REQ:
+			fprintf(fp, " type=0x%02x", e.code);
+			break;
+
+		default:
+			break;
+		}
+		fprintf(fp, "\n");
+	}
+}
@@ -0,0 +1,99 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef flightrec_h_included
+#define	flightrec_h_included
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A small, always-on "flight recorder" for NABU connections.  Each
+ * connection owns a fixed-size ring of compact binary trace entries
+ * that records the protocol events of interest (messages received,
+ * segments requested and sent, ACK failures, etc.).  The connection
+ * thread is the only writer; recording an event is a timestamp and a
+ * handful of stores, so it's cheap enough to leave enabled all the
+ * time.  When a NABU wedges, the ring can be pulled out of a running
+ * server with nabuctl and decoded after the fact.
+ */
+
+#define	FLIGHTREC_EV_NONE		0
+#define	FLIGHTREC_EV_CONN_START		1	/* connection loop started */
+#define	FLIGHTREC_EV_CONN_END		2	/* code = conn_state */
+#define	FLIGHTREC_EV_MSG		3	/* code = message byte */
+#define	FLIGHTREC_EV_MSG_UNEXPECTED	4	/* code = message byte */
+#define	FLIGHTREC_EV_RECV_ERROR		5	/* code = message byte */
+#define	FLIGHTREC_EV_SEGMENT_REQ	6	/* image, segment */
+#define	FLIGHTREC_EV_SEGMENT_SENT	7	/* image, segment, length,
+						   code = 1 if last */
+#define	FLIGHTREC_EV_TIME_SENT		8
+#define	FLIGHTREC_EV_UNAUTHORIZED	9
+#define	FLIGHTREC_EV_ACK_FAILED		10	/* length = packet length */
+#define	FLIGHTREC_EV_IMAGE_LOAD_FAILED	11	/* image */
+#define	FLIGHTREC_EV_CHANNEL		12	/* image = channel */
+#define	FLIGHTREC_EV_NHACP_REQ		13	/* code = request type */
+#define	FLIGHTREC_EV_RETRONET_REQ	14	/* code = message byte */
+#define	FLIGHTREC_EV_COUNT		15
+
+struct flightrec_entry {
+	uint64_t	ts;		/* CLOCK_MONOTONIC, nanoseconds */
+	uint32_t	image;
+	uint16_t	segment;
+	uint16_t	length;
+	uint8_t		event;
+	uint8_t		code;
+};
+
+/*
+ * Entries are serialized for transport as fixed-size records in
+ * network byte order, oldest first:
+ *
+ *	ts (8) image (4) segment (2) length (2) event (1) code (1)
+ */
+#define	FLIGHTREC_WIRE_SIZE	18
+
+#define	FLIGHTREC_NENTRIES	1024	/* must be a power of 2 */
+
+struct flightrec {
+	uint32_t	next;		/* index of next entry to write */
+	struct flightrec_entry entries[FLIGHTREC_NENTRIES];
+};
+
+#define	FLIGHTREC_MAXSNAPSHOT	(FLIGHTREC_NENTRIES * FLIGHTREC_WIRE_SIZE)
+
+void	flightrec_record(struct flightrec *, uint8_t, uint8_t, uint32_t,
+	    uint16_t, uint16_t);
+size_t	flightrec_snapshot(struct flightrec *, void *, size_t);
+
+const char *flightrec_event_name(uint8_t);
+bool	flightrec_decode(const void *, size_t, size_t,
+	    struct flightrec_entry *);
+void	flightrec_print(FILE *, const void *, size_t);
+
+#endif /* flightrec_h_included */
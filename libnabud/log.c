@@ -37,20 +37,61 @@
 #include <stdint.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "log.h"
 #include "missing.h"
+#include "nbsd_queue.h"
 
 /* XXX use syslog_r(3) if available. */
 #include <pthread.h>
 static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_once_t log_syslog_init_once = PTHREAD_ONCE_INIT;
 static bool log_using_syslog;
-static uint32_t log_debug_subsys_enabled;
+uint32_t log_debug_mask;
 
 static unsigned int log_options;
 static FILE *log_file;
 
+/*
+ * Asynchronous logging.
+ *
+ * Each thread that logs gets its own single-producer / single-consumer
+ * ring of pre-formatted messages.  Producers never take a lock; they
+ * format directly into the next free slot and publish it by advancing
+ * the head index.  A dedicated logger thread drains all of the rings
+ * and writes the messages out in batches.  If a ring is full, the
+ * message is dropped and counted, and the logger thread reports the
+ * number of dropped messages when it next drains that ring.
+ */
+#define	LOG_RING_NSLOTS		128		/* power of 2 */
+#define	LOG_RING_MSGSIZE	400
+#define	LOG_BATCH_SIZE		8192
+#define	LOG_IDLE_MS		100
+
+struct log_ring_slot {
+	log_type	type;
+	const char	*func;		/* always a string literal */
+	char		msg[LOG_RING_MSGSIZE];
+};
+
+struct log_ring {
+	LIST_ENTRY(log_ring) link;
+	uint32_t	head;		/* written by producer */
+	uint32_t	tail;		/* written by consumer */
+	uint32_t	dropped;
+	bool		orphaned;	/* owning thread has exited */
+	struct log_ring_slot slots[LOG_RING_NSLOTS];
+};
+
+static pthread_key_t log_ring_key;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, log_ring) log_rings = LIST_HEAD_INITIALIZER(log_rings);
+static pthread_cond_t log_async_cv = PTHREAD_COND_INITIALIZER;
+static pthread_t log_async_thread;
+static bool log_async_running;
+static bool log_async_stopping;
+
 static const char *log_typenames[] = {
 	[LOG_TYPE_INFO]		=	"INFO",
 	[LOG_TYPE_DEBUG]	=	"DEBUG",
@@ -154,14 +195,152 @@ log_debug_enable(const char *name)
 
 	log_options |= LOG_OPT_DEBUG;
 	if (d->subsys == LOG_SUBSYS_ANY) {
-		log_debug_subsys_enabled |= UINT32_MAX;
+		__atomic_fetch_or(&log_debug_mask, UINT32_MAX,
+		    __ATOMIC_RELAXED);
 	} else {
-		log_debug_subsys_enabled |= (1U << d->subsys);
+		__atomic_fetch_or(&log_debug_mask,
+		    LOG_DEBUG_ENABLED_BIT | (1U << d->subsys),
+		    __ATOMIC_RELAXED);
 	}
 
 	return true;
 }
 
+/*
+ * Rate limit parameters, indexed by subsystem + 1 (so that
+ * LOG_SUBSYS_ANY is slot 0).  A rate of 0 means "unlimited".
+ * A burst of 0 in a specific subsystem means "use the default
+ * burst" (that of LOG_SUBSYS_ANY, or LOG_RATELIMIT_DEFAULT_BURST
+ * if that is 0, too).
+ */
+#define	LOG_RL_SLOT(s)		((s) + 1)
+#define	LOG_RL_NSLOTS		LOG_RL_SLOT(LOG_NSUBSYS)
+
+static unsigned int log_rl_rate[LOG_RL_NSLOTS] = {
+	[LOG_RL_SLOT(LOG_SUBSYS_ANY)] = LOG_RATELIMIT_DEFAULT_RATE,
+};
+static unsigned int log_rl_burst[LOG_RL_NSLOTS] = {
+	[LOG_RL_SLOT(LOG_SUBSYS_ANY)] = LOG_RATELIMIT_DEFAULT_BURST,
+};
+static bool log_rl_set[LOG_RL_NSLOTS];
+
+/*
+ * log_ratelimit_set --
+ *	Set the rate limit parameters for the named subsystem.
+ *	"any" / "all" sets the default used by subsystems that
+ *	have not been configured explicitly.
+ */
+bool
+log_ratelimit_set(const char *name, unsigned int rate, unsigned int burst)
+{
+	const struct log_subsys_desc *d = log_subsys_lookup(name);
+
+	if (d == NULL || d->name[0] == '\0') {
+		return false;
+	}
+
+	/*
+	 * This is done while loading the configuration; a check that
+	 * races with it just sees the old values.
+	 */
+	unsigned int slot = LOG_RL_SLOT(d->subsys);
+	__atomic_store_n(&log_rl_rate[slot], rate, __ATOMIC_RELAXED);
+	__atomic_store_n(&log_rl_burst[slot], burst, __ATOMIC_RELAXED);
+	__atomic_store_n(&log_rl_set[slot], true, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * log_ratelimit_params --
+ *	Get the effective rate limit parameters for a subsystem.
+ */
+static void
+log_ratelimit_params(log_subsys subsys, unsigned int *ratep,
+    unsigned int *burstp)
+{
+	unsigned int slot = LOG_RL_SLOT(subsys);
+
+	if (! __atomic_load_n(&log_rl_set[slot], __ATOMIC_ACQUIRE)) {
+		slot = LOG_RL_SLOT(LOG_SUBSYS_ANY);
+	}
+	*ratep = __atomic_load_n(&log_rl_rate[slot], __ATOMIC_RELAXED);
+	*burstp = __atomic_load_n(&log_rl_burst[slot], __ATOMIC_RELAXED);
+	if (*burstp == 0) {
+		*burstp = __atomic_load_n(
+		    &log_rl_burst[LOG_RL_SLOT(LOG_SUBSYS_ANY)],
+		    __ATOMIC_RELAXED);
+	}
+	if (*burstp == 0) {
+		*burstp = LOG_RATELIMIT_DEFAULT_BURST;
+	}
+}
+
+/*
+ * log_ratelimit_check --
+ *	Check a call site's token bucket.  Returns true if the
+ *	message should be logged.  If messages from this call
+ *	site were suppressed, a summary is logged before returning
+ *	true.
+ */
+bool
+log_ratelimit_check(struct log_ratelimit *rl, log_subsys subsys,
+    const char *func)
+{
+	unsigned int rate, burst, suppressed = 0;
+	struct timespec ts;
+	uint64_t now, cost, cap;
+	bool ok;
+
+	assert(subsys >= LOG_SUBSYS_ANY && subsys < LOG_NSUBSYS);
+
+	log_ratelimit_params(subsys, &rate, &burst);
+	if (rate == 0) {
+		return true;
+	}
+
+	/*
+	 * Credit accumulates in nanoseconds; each message costs
+	 * 1/rate seconds worth, and the bucket holds "burst" of them.
+	 */
+	cost = UINT64_C(1000000000) / rate;
+	cap = cost * burst;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+	    (uint64_t)ts.tv_nsec;
+
+	pthread_mutex_lock(&rl->lock);
+	if (! rl->primed) {
+		rl->credit = cap;
+		rl->primed = true;
+	} else {
+		rl->credit += now - rl->last;
+		if (rl->credit > cap) {
+			rl->credit = cap;
+		}
+	}
+	rl->last = now;
+
+	if (rl->credit >= cost) {
+		rl->credit -= cost;
+		suppressed = rl->suppressed;
+		rl->suppressed = 0;
+		ok = true;
+	} else {
+		rl->suppressed++;
+		ok = false;
+	}
+	pthread_mutex_unlock(&rl->lock);
+
+	if (suppressed != 0) {
+		log_message(LOG_TYPE_ERROR, subsys, func,
+		    "%u similar message%s suppressed.", suppressed,
+		    suppressed == 1 ? "" : "s");
+	}
+	return ok;
+}
+
 /*
  * log_init --
  *	Initialize the logging interface.
@@ -170,6 +349,10 @@ bool
 log_init(const char *path, unsigned int options)
 {
 	log_options |= options;
+	if (log_options & LOG_OPT_DEBUG) {
+		__atomic_fetch_or(&log_debug_mask, LOG_DEBUG_ENABLED_BIT,
+		    __ATOMIC_RELAXED);
+	}
 
 	/* If we're in the foreground, always log to stdout. */
 	if (log_options & LOG_OPT_FOREGROUND) {
@@ -196,6 +379,300 @@ log_init(const char *path, unsigned int options)
 	return true;
 }
 
+/*
+ * log_emit --
+ *	Write a formatted message to the log destination.
+ */
+static void
+log_emit(log_type type, const char *func, const char *msg)
+{
+	if (log_file) {
+		fprintf(log_file, "%s: %s: %s\n", log_typenames[type],
+		    func, msg);
+		fflush(log_file);
+	} else {
+		pthread_once(&log_syslog_init_once, log_syslog_init);
+		pthread_mutex_lock(&log_lock);
+		syslog(log_type_to_syslog[type], "%s: %s: %s",
+		    log_typenames[type], func, msg);
+		pthread_mutex_unlock(&log_lock);
+	}
+}
+
+/*
+ * log_ring_thread_exit --
+ *	Thread-specific data destructor for a thread's log ring.
+ *	The logger thread frees the ring once it has been drained.
+ */
+static void
+log_ring_thread_exit(void *v)
+{
+	struct log_ring *ring = v;
+
+	__atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * log_ring_get --
+ *	Get the calling thread's log ring, allocating it if needed.
+ */
+static struct log_ring *
+log_ring_get(void)
+{
+	struct log_ring *ring = pthread_getspecific(log_ring_key);
+
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(*ring));
+		if (ring == NULL) {
+			return NULL;
+		}
+		pthread_mutex_lock(&log_rings_lock);
+		LIST_INSERT_HEAD(&log_rings, ring, link);
+		pthread_mutex_unlock(&log_rings_lock);
+		pthread_setspecific(log_ring_key, ring);
+	}
+	return ring;
+}
+
+/*
+ * log_ring_put --
+ *	Format a message into the calling thread's log ring.  Returns
+ *	false if the ring could not be used, in which case the caller
+ *	should log synchronously.
+ */
+static bool
+log_ring_put(log_type type, const char *func, const char *fmt, va_list ap)
+{
+	struct log_ring *ring = log_ring_get();
+	struct log_ring_slot *slot;
+	uint32_t head, tail;
+	int rv;
+
+	if (ring == NULL) {
+		return false;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail == LOG_RING_NSLOTS) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	slot = &ring->slots[head & (LOG_RING_NSLOTS - 1)];
+	slot->type = type;
+	slot->func = func;
+	rv = vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+	if (rv < 0) {
+		/* Nothing to publish. */
+		return true;
+	}
+	if (rv >= (int)sizeof(slot->msg)) {
+		/* Note that the message was truncated. */
+		memcpy(&slot->msg[sizeof(slot->msg) - 4], "...", 4);
+	}
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* No lock; a lost wakeup just costs us LOG_IDLE_MS latency. */
+	pthread_cond_signal(&log_async_cv);
+	return true;
+}
+
+/*
+ * log_batch_flush --
+ *	Write out a batch of messages accumulated for the log file.
+ */
+static void
+log_batch_flush(char *batch, size_t *lenp)
+{
+	if (*lenp != 0) {
+		fwrite(batch, 1, *lenp, log_file);
+		fflush(log_file);
+		*lenp = 0;
+	}
+}
+
+/*
+ * log_batch_add --
+ *	Add a message to the current batch.  Syslog has no notion of
+ *	batches, so for syslog we just send it along.
+ */
+static void
+log_batch_add(char *batch, size_t *lenp, log_type type, const char *func,
+    const char *msg)
+{
+	int rv;
+
+	if (log_file == NULL) {
+		log_emit(type, func, msg);
+		return;
+	}
+
+	for (;;) {
+		rv = snprintf(batch + *lenp, LOG_BATCH_SIZE - *lenp,
+		    "%s: %s: %s\n", log_typenames[type], func, msg);
+		if (rv < 0) {
+			return;
+		}
+		if ((size_t)rv < LOG_BATCH_SIZE - *lenp) {
+			*lenp += rv;
+			return;
+		}
+		if (*lenp == 0) {
+			/* Can't ever fit; write it directly. */
+			log_emit(type, func, msg);
+			return;
+		}
+		log_batch_flush(batch, lenp);
+	}
+}
+
+/*
+ * log_rings_drain --
+ *	Drain all of the log rings.  Returns the number of messages
+ *	written.
+ */
+static unsigned int
+log_rings_drain(char *batch)
+{
+	struct log_ring *ring, *nring;
+	struct log_ring_slot *slot;
+	unsigned int count = 0;
+	uint32_t head, tail, dropped;
+	size_t len = 0;
+	char msg[64];
+
+	pthread_mutex_lock(&log_rings_lock);
+	LIST_FOREACH_SAFE(ring, &log_rings, link, nring) {
+		bool orphaned =
+		    __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+
+		tail = ring->tail;
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++, count++) {
+			slot = &ring->slots[tail & (LOG_RING_NSLOTS - 1)];
+			log_batch_add(batch, &len, slot->type, slot->func,
+			    slot->msg);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_exchange_n(&ring->dropped, 0,
+		    __ATOMIC_RELAXED);
+		if (dropped != 0) {
+			snprintf(msg, sizeof(msg),
+			    "%u log messages dropped.", dropped);
+			log_batch_add(batch, &len, LOG_TYPE_ERROR, __func__,
+			    msg);
+			count++;
+		}
+
+		if (orphaned) {
+			LIST_REMOVE(ring, link);
+			free(ring);
+		}
+	}
+	pthread_mutex_unlock(&log_rings_lock);
+
+	if (log_file != NULL) {
+		log_batch_flush(batch, &len);
+	}
+	return count;
+}
+
+/*
+ * log_async_thread_func --
+ *	The logger thread.
+ */
+static void *
+log_async_thread_func(void *arg)
+{
+	static char batch[LOG_BATCH_SIZE];
+	struct timespec deadline;
+	bool stopping;
+
+	for (;;) {
+		if (log_rings_drain(batch) != 0) {
+			continue;
+		}
+
+		pthread_mutex_lock(&log_lock);
+		stopping = log_async_stopping;
+		if (! stopping) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LOG_IDLE_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&log_async_cv, &log_lock,
+			    &deadline);
+		}
+		pthread_mutex_unlock(&log_lock);
+
+		if (stopping) {
+			/* One last pass to pick up any stragglers. */
+			log_rings_drain(batch);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * log_async_start --
+ *	Start asynchronous logging.  Must be called after any fork()
+ *	(e.g. daemon(3)) since the logger thread does not survive it.
+ */
+bool
+log_async_start(void)
+{
+	int error;
+
+	if (log_async_running) {
+		return true;
+	}
+
+	error = pthread_key_create(&log_ring_key, log_ring_thread_exit);
+	if (error != 0) {
+		log_error("pthread_key_create() failed: %s",
+		    strerror(error));
+		return false;
+	}
+
+	error = pthread_create(&log_async_thread, NULL,
+	    log_async_thread_func, NULL);
+	if (error != 0) {
+		log_error("Unable to create logger thread: %s",
+		    strerror(error));
+		pthread_key_delete(log_ring_key);
+		return false;
+	}
+
+	__atomic_store_n(&log_async_running, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * log_async_stop --
+ *	Stop asynchronous logging, flushing any pending messages.
+ */
+static void
+log_async_stop(void)
+{
+	if (! log_async_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	log_async_stopping = true;
+	pthread_cond_signal(&log_async_cv);
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_join(log_async_thread, NULL);
+	__atomic_store_n(&log_async_running, false, __ATOMIC_RELEASE);
+}
+
 /*
  * log_fini --
  *	Finish using the logging interface.
@@ -203,6 +680,8 @@ log_init(const char *path, unsigned int options)
 void
 log_fini(void)
 {
+	log_async_stop();
+
 	pthread_mutex_lock(&log_lock);
 	if (log_using_syslog) {
 		closelog();
@@ -218,13 +697,14 @@ log_fini(void)
 static bool
 log_debug_subsys_is_enabled(log_subsys subsys)
 {
-	assert(subsys >= LOG_SUBSYS_ANY && subsys < LOG_NSUBSYS);
+#ifdef HAVE_STATIC_ASSERT
+	_Static_assert(LOG_NSUBSYS < 31,
+	    "Subsystem bits collide with LOG_DEBUG_ENABLED_BIT.");
+#endif /* HAVE_STATIC_ASSERT */
 
-	if (subsys == LOG_SUBSYS_ANY) {
-		return true;
-	}
+	assert(subsys >= LOG_SUBSYS_ANY && subsys < LOG_NSUBSYS);
 
-	return !!(log_debug_subsys_enabled & (1U << subsys));
+	return log_debug_is_enabled(subsys);
 }
 
 /*
@@ -242,11 +722,22 @@ log_message(log_type type, log_subsys subsys, const char *func,
 
 	assert(log_type_is_valid(type));
 
-	if (type == LOG_TYPE_DEBUG) {
-		if ((log_options & LOG_OPT_DEBUG) == 0) {
-			return;
-		}
-		if (!log_debug_subsys_is_enabled(subsys)) {
+	if (type == LOG_TYPE_DEBUG && !log_debug_subsys_is_enabled(subsys)) {
+		return;
+	}
+
+	/*
+	 * Fatal messages are always logged synchronously; we're about
+	 * to abort() and the logger thread won't get to them.
+	 */
+	if (type != LOG_TYPE_FATAL &&
+	    __atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE)) {
+		bool queued;
+
+		va_start(ap, fmt);
+		queued = log_ring_put(type, func, fmt, ap);
+		va_end(ap);
+		if (queued) {
 			return;
 		}
 	}
@@ -259,17 +750,7 @@ log_message(log_type type, log_subsys subsys, const char *func,
 		return;
 	}
 
-	if (log_file) {
-		fprintf(log_file, "%s: %s: %s\n", log_typenames[type],
-		    func, caller_string);
-		fflush(log_file);
-	} else {
-		pthread_once(&log_syslog_init_once, log_syslog_init);
-		pthread_mutex_lock(&log_lock);
-		syslog(log_type_to_syslog[type], "%s: %s: %s",
-		    log_typenames[type], func, caller_string);
-		pthread_mutex_unlock(&log_lock);
-	}
+	log_emit(type, func, caller_string);
 	free(caller_string);
 
 	if (type == LOG_TYPE_FATAL) {
@@ -27,7 +27,13 @@
 #ifndef log_h_included
 #define	log_h_included
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 typedef enum {
@@ -63,16 +69,82 @@ bool	log_init(const char *, unsigned int);
 void	log_message(log_type, log_subsys, const char *, const char *, ...)
 	    __attribute__((__format__(__printf__, 4, 5)));
 void	log_fini(void);
+bool	log_async_start(void);
 
 bool	log_debug_enable(const char *);
 void	log_subsys_list(FILE *, const char *);
 
+/*
+ * Per-call-site rate limiting for messages on paths that a misbehaving
+ * peer can drive as fast as it can send bytes.  Each call site gets a
+ * token bucket; the refill rate and burst size come from the call
+ * site's subsystem (LOG_SUBSYS_ANY provides the default).  When a
+ * message is let through after others have been dropped, a summary
+ * of how many were suppressed is logged first.
+ */
+struct log_ratelimit {
+	pthread_mutex_t	lock;
+	uint64_t	last;		/* time of last refill (ns) */
+	uint64_t	credit;		/* accumulated credit (ns) */
+	unsigned int	suppressed;
+	bool		primed;
+};
+
+#define	LOG_RATELIMIT_INITIALIZER	{ .lock = PTHREAD_MUTEX_INITIALIZER }
+
+#define	LOG_RATELIMIT_DEFAULT_RATE	10	/* messages per second */
+#define	LOG_RATELIMIT_DEFAULT_BURST	20
+
+bool	log_ratelimit_set(const char *, unsigned int, unsigned int);
+bool	log_ratelimit_check(struct log_ratelimit *, log_subsys, const char *);
+
+/*
+ * Mask of subsystems with debug logging enabled, plus a bit that
+ * indicates debug logging is enabled at all (for LOG_SUBSYS_ANY).
+ * log_debug() checks this inline, so a disabled debug message costs
+ * a load and a test, and its arguments are never evaluated.
+ *
+ * If configured with --disable-debug-logging, debug messages are
+ * compiled out entirely (but still type-checked).
+ */
+#define	LOG_DEBUG_ENABLED_BIT	(1U << 31)
+extern uint32_t log_debug_mask;
+
+static inline bool
+log_debug_is_enabled(log_subsys subsys)
+{
+#ifdef NABUD_DISABLE_DEBUG_LOGGING
+	(void)subsys;
+	return false;
+#else
+	uint32_t mask = __atomic_load_n(&log_debug_mask, __ATOMIC_RELAXED);
+
+	if (subsys == LOG_SUBSYS_ANY) {
+		return (mask & LOG_DEBUG_ENABLED_BIT) != 0;
+	}
+	return (mask & (1U << subsys)) != 0;
+#endif
+}
+
 #define	log_info(...)		\
 	log_message(LOG_TYPE_INFO, LOG_SUBSYS_ANY, __func__, __VA_ARGS__)
-#define	log_debug(s, ...)		\
-	log_message(LOG_TYPE_DEBUG, (s), __func__, __VA_ARGS__)
+#define	log_debug(s, ...)						\
+do {									\
+	if (log_debug_is_enabled(s)) {					\
+		log_message(LOG_TYPE_DEBUG, (s), __func__,		\
+			    __VA_ARGS__);				\
+	}								\
+} while (/*CONSTCOND*/0)
 #define	log_error(...)		\
 	log_message(LOG_TYPE_ERROR, LOG_SUBSYS_ANY, __func__, __VA_ARGS__)
+#define	log_error_ratelimited(s, ...)					\
+do {									\
+	static struct log_ratelimit log_rl_ = LOG_RATELIMIT_INITIALIZER;\
+	if (log_ratelimit_check(&log_rl_, (s), __func__)) {		\
+		log_message(LOG_TYPE_ERROR, (s), __func__,		\
+			    __VA_ARGS__);				\
+	}								\
+} while (/*CONSTCOND*/0)
 #define	log_fatal(...)		\
 	/* This one doesn't return; trick the compiler */		\
 	for (log_message(LOG_TYPE_FATAL, LOG_SUBSYS_ANY, __func__,	\
@@ -70,6 +70,7 @@ struct nabuctl_atom_header {
 #define	NABUCTL_OBJ(x)		((x) & (0xffU << 16))
 #define	NABUCTL_OBJ_CHANNEL	(1U << 16) /* channel fields follow */
 #define	NABUCTL_OBJ_CONNECTION	(2U << 16) /* connection fields follow */
+#define	NABUCTL_OBJ_EVENT	(3U << 16) /* event fields follow */
 
 #define	NABUCTL_FLD(x)		(NABUCTL_TYPE(x) | NABUCTL_OBJ(x) | \
 				 ((x) & (0xffU << 8)))
@@ -92,6 +93,8 @@ struct nabuctl_atom_header {
 		(NABUCTL_TYPE_STRING | NABUCTL_OBJ_CHANNEL | (7U << 8))
 #define	NABUCTL_CHAN_RETRONET_EXTENSIONS \
 		(NABUCTL_TYPE_BOOL   | NABUCTL_OBJ_CHANNEL | (8U << 8))
+#define	NABUCTL_CHAN_SOURCE_HEALTH	\
+		(NABUCTL_TYPE_STRING | NABUCTL_OBJ_CHANNEL | (9U << 8))
 /*
  * Fields within a connection object.
  */
@@ -115,6 +118,50 @@ struct nabuctl_atom_header {
 		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_CONNECTION | (9U << 8))
 #define	NABUCTL_CONN_FLOW_CONTROL	\
 		(NABUCTL_TYPE_BOOL   | NABUCTL_OBJ_CONNECTION | (10U << 8))
+/*
+ * Fields within an event object.  Only TYPE and TIME are always
+ * present; the rest depend on the event type.  The counter fields
+ * are deltas since the previous COUNTERS event.
+ */
+#define	NABUCTL_EVENT_TYPE		\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (1U << 8))
+#define	NABUCTL_EVENT_TIME		\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (2U << 8))
+#define	NABUCTL_EVENT_CONN		\
+		(NABUCTL_TYPE_STRING | NABUCTL_OBJ_EVENT | (3U << 8))
+#define	NABUCTL_EVENT_CHANNEL		\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (4U << 8))
+#define	NABUCTL_EVENT_IMAGE		\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (5U << 8))
+#define	NABUCTL_EVENT_DETAIL		\
+		(NABUCTL_TYPE_STRING | NABUCTL_OBJ_EVENT | (6U << 8))
+#define	NABUCTL_EVENT_INTERVAL		\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (7U << 8))
+#define	NABUCTL_EVENT_SEGMENTS_SENT	\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (8U << 8))
+#define	NABUCTL_EVENT_IMAGE_LOADS	\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (9U << 8))
+#define	NABUCTL_EVENT_IMAGE_LOAD_FAILURES \
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (10U << 8))
+#define	NABUCTL_EVENT_CACHE_EVICTIONS	\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (11U << 8))
+#define	NABUCTL_EVENT_DROPPED		\
+		(NABUCTL_TYPE_NUMBER | NABUCTL_OBJ_EVENT | (12U << 8))
+
+/*
+ * Event types (value of NABUCTL_EVENT_TYPE).
+ */
+#define	NABUCTL_EV_CONN_UP		1	/* CONN, DETAIL (type) */
+#define	NABUCTL_EV_CONN_DOWN		2	/* CONN */
+#define	NABUCTL_EV_CHANNEL_CHANGE	3	/* CONN, CHANNEL */
+#define	NABUCTL_EV_IMAGE_LOAD_START	4	/* CONN, CHANNEL, IMAGE */
+#define	NABUCTL_EV_IMAGE_LOAD_DONE	5	/* CONN, CHANNEL, IMAGE,
+						   DETAIL (name) */
+#define	NABUCTL_EV_IMAGE_LOAD_FAILED	6	/* CONN, CHANNEL, IMAGE */
+#define	NABUCTL_EV_CACHE_EVICT		7	/* CHANNEL, DETAIL (name) */
+#define	NABUCTL_EV_COUNTERS		8	/* INTERVAL (ms), counters,
+						   DROPPED */
+#define	NABUCTL_EV_SOURCE_STATE		9	/* DETAIL (source state) */
 
 /*
  * NABUCTL_REQ_HELLO
@@ -185,6 +232,31 @@ struct nabuctl_atom_header {
  */
 #define	NABUCTL_REQ_LIST_CONNECTIONS	(NABUCTL_TYPE_VOID | 3)
 
+/*
+ * NABUCTL_REQ_SUBSCRIBE
+ *
+ * Arguments: none.
+ *
+ * Returns: a stream of event objects, each in its own reply, sent
+ * as events happen.  A COUNTERS event is sent periodically even if
+ * nothing else is happening.  Once subscribed, the control connection
+ * is dedicated to the event stream until the client disconnects.
+ *
+ *	nabuctl -> nabud
+ *		NABUCTL_REQ_SUBSCRIBE
+ *		NABUCTL_DONE			done with REQUEST
+ *
+ *	nabuctl <- nabud
+ *		NABUCTL_DONE			done with reply (subscribed)
+ *
+ *	nabuctl <- nabud			(repeats)
+ *		NABUCTL_OBJ_EVENT
+ *		[event fields]
+ *		NABUCTL_DONE			done with EVENT
+ *		NABUCTL_DONE			done with reply
+ */
+#define	NABUCTL_REQ_SUBSCRIBE		(NABUCTL_TYPE_VOID | 4)
+
 /*
  * NABUCTL_REQ_CHAN_CLEAR_CACHE
  *
@@ -276,4 +348,24 @@ struct nabuctl_atom_header {
  */
 #define	NABUCTL_REQ_CONN_SELECT_FILE	(NABUCTL_TYPE_STRING | 42)
 
+/*
+ * NABUCTL_REQ_CONN_TRACE
+ *
+ * Arguments: connection name.
+ *
+ * Returns: flight recorder snapshot blob (see flightrec.h for the
+ * record format).
+ *
+ *	nabuctl -> nabud
+ *		NABUCTL_REQ_CONN_TRACE
+ *		[connection name]
+ *		NABUCTL_DONE			done with REQUEST
+ *
+ *	nabuctl <- nabud
+ *		NABUCTL_TYPE_BLOB
+ *		[trace data]
+ *		NABUCTL_DONE			done with reply
+ */
+#define	NABUCTL_REQ_CONN_TRACE		(NABUCTL_TYPE_STRING | 43)
+
 #endif /* nabuctl_proto_h_included */
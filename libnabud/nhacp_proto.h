@@ -84,6 +84,13 @@
 
 #define	NHACP_OPTION_CRC8		0x0001	/* Use CRC-8/WCDMA FCS */
 
+/*
+ * nabud-specific options live at the top of the option word to stay
+ * clear of the ones defined by the spec.  A server that doesn't
+ * support a requested option ignores the HELLO entirely.
+ */
+#define	NHACP_OPTION_NABUD_BLOCKV	0x8000	/* vectored block I/O */
+
 #define	NHACP_SESSION_SYSTEM		0x00	/* Special "system" session */
 #define	NHACP_SESSION_CREATE		0xff	/* Create a new session */
 
@@ -106,6 +113,9 @@
 #define	NHACP_REQ_REMOVE		0x10
 #define	NHACP_REQ_RENAME		0x11
 #define	NHACP_REQ_MKDIR			0x12
+/* nabud extensions; require NHACP_OPTION_NABUD_BLOCKV */
+#define	NHACP_REQ_NABUD_STORAGE_GET_BLOCKV 0xe0
+#define	NHACP_REQ_NABUD_STORAGE_PUT_BLOCKV 0xe1
 #define	NHACP_REQ_END_PROTOCOL_0_0	0xef
 #define	NHACP_REQ_GOODBYE		0xef
 
@@ -119,6 +129,18 @@
 #define	NHACP_O_EXCL		0x0020	/* fail create if file already exists */
 #define	NHACP_O_TRUNC		0x0040	/* truncate existing file to 0 */
 
+/*
+ * Vectored block I/O (nabud extension).  A STORAGE-GET-BLOCKV or
+ * STORAGE-PUT-BLOCKV request names up to NHACP_NABUD_BLOCKV_MAX
+ * (fdesc, block number) pairs that share one block length; the
+ * PUT variant is followed by the data for each block, in order.
+ * The server streams back one reply per entry, in order, exactly
+ * as if each block had been a STORAGE-GET-BLOCK (DATA-BUFFER or
+ * ERROR) or STORAGE-PUT-BLOCK (OK or ERROR) request of its own.
+ * Only a count of 0 or more than the maximum draws a single ERROR.
+ */
+#define	NHACP_NABUD_BLOCKV_MAX	32
+
 /* REMOVE-FILE flags */
 #define	NHACP_REMOVE_FILE	0x0000	/* remove a regular file */
 #define	NHACP_REMOVE_DIR	0x0001	/* remove a directory */
@@ -145,6 +167,11 @@ struct nhacp_string {
 	uint8_t		bytes[];
 };
 
+struct nhacp_blockv_entry {
+	uint8_t		fdesc;
+	uint8_t		block_number[4];/* u32 */
+};
+
 /* attribute flags */
 #define	NHACP_AF_RD		0x0001	/* file is readable */
 #define	NHACP_AF_WR		0x0002	/* file is writable */
@@ -268,6 +295,19 @@ struct nhacp_request {
 			uint8_t		type;
 			struct nhacp_string url;
 		} mkdir;
+		struct nhacp_request_nabud_storage_get_blockv {
+			uint8_t		type;
+			uint8_t		block_length[2];/* u16 */
+			uint8_t		count;
+			struct nhacp_blockv_entry entries[];
+		} nabud_storage_get_blockv;
+		struct nhacp_request_nabud_storage_put_blockv {
+			uint8_t		type;
+			uint8_t		block_length[2];/* u16 */
+			uint8_t		count;
+			struct nhacp_blockv_entry entries[];
+			/* count * block_length bytes of data follow */
+		} nabud_storage_put_blockv;
 		struct nhacp_request_goodbye {	/* END-PROTOCOL in 0.0 */
 			uint8_t		type;
 		} goodbye;
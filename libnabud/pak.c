@@ -0,0 +1,196 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * NabuRetroNet PAK file support.  This is shared by the server and
+ * the offline tools that fetch and pack images.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_OPENSSL)
+#include <openssl/md5.h>
+#endif
+
+#include "log.h"
+#include "nabu_proto.h"
+#include "pak.h"
+
+/*
+ * pak_cipher_init --
+ *	Set up a PAK decryption context.
+ */
+bool
+pak_cipher_init(struct pak_cipher *pc)
+{
+#if defined(HAVE_COMMONCRYPTO_H)
+	uint8_t iv[] = NABU_PAK_IV;
+	uint8_t key[] = NABU_PAK_KEY;
+	CCCryptorStatus status;
+
+	status = CCCryptorCreate(kCCDecrypt, kCCAlgorithmDES, 0,
+	    key, sizeof(key), iv, &pc->cryptor);
+	if (status != kCCSuccess) {
+		log_error("CCCryptorCreate() failed: %d", status);
+		return false;
+	}
+	return true;
+#elif defined(HAVE_OPENSSL)
+	DES_cblock iv = NABU_PAK_IV;
+	DES_cblock key = NABU_PAK_KEY;
+
+	DES_set_key_unchecked(&key, &pc->ks);
+	memcpy(&pc->iv, &iv, sizeof(iv));
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * pak_cipher_update --
+ *	Decrypt a block-aligned run of PAK data in-place.
+ */
+bool
+pak_cipher_update(struct pak_cipher *pc, uint8_t *buf, size_t len)
+{
+	assert((len % PAK_BLOCKSIZE) == 0);
+
+#if defined(HAVE_COMMONCRYPTO_H)
+	CCCryptorStatus status;
+	size_t actual;
+
+	status = CCCryptorUpdate(pc->cryptor, buf, len, buf, len, &actual);
+	if (status != kCCSuccess) {
+		log_error("CCCryptorUpdate() failed: %d", status);
+		return false;
+	}
+	return true;
+#elif defined(HAVE_OPENSSL)
+	/* DES_ncbc_encrypt() updates the IV for the next call. */
+	DES_ncbc_encrypt((const unsigned char *)buf,
+	    (unsigned char *)buf, (long)len, &pc->ks, &pc->iv, 0);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * pak_cipher_fini --
+ *	Tear down a PAK decryption context.
+ */
+void
+pak_cipher_fini(struct pak_cipher *pc)
+{
+#if defined(HAVE_COMMONCRYPTO_H)
+	CCCryptorRelease(pc->cryptor);
+#elif defined(HAVE_OPENSSL)
+	memset(pc, 0, sizeof(*pc));
+#endif
+}
+
+/*
+ * pak_decrypt --
+ *	Decrypt a complete PAK buffer in-place.  The buffer length
+ *	must be a multiple of the DES block size.
+ */
+bool
+pak_decrypt(uint8_t *buf, size_t len)
+{
+	struct pak_cipher pc;
+	bool rv;
+
+	if ((len % PAK_BLOCKSIZE) != 0 || ! pak_cipher_init(&pc)) {
+		return false;
+	}
+	rv = pak_cipher_update(&pc, buf, len);
+	pak_cipher_fini(&pc);
+
+	return rv;
+}
+
+#define	ENCRYPTED_PAK_NAME_SIZE	\
+	sizeof("FE-A1-04-B7-3D-67-F8-8B-26-4C-0C-81-9B-F6-24-58.npak")
+
+/*
+ * pak_encrypted_name --
+ *	Generate a NabuRetroNet encrypted PAK name from the given
+ *	image number.
+ */
+char *
+pak_encrypted_name(uint32_t image)
+{
+#if defined(HAVE_COMMONCRYPTO_H) || defined(HAVE_OPENSSL)
+	char namestr[sizeof("000001nabu")];
+	char pakname[ENCRYPTED_PAK_NAME_SIZE];
+
+	MD5_CTX ctx;
+	unsigned char digest[MD5_DIGEST_LENGTH];
+
+	snprintf(namestr, sizeof(namestr), "%06Xnabu", image);
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, namestr, sizeof(namestr) - 1);
+	MD5_Final(digest, &ctx);
+
+	snprintf(pakname, sizeof(pakname),
+	    "%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X.npak",
+	    digest[0],  digest[1],  digest[2],  digest[3],
+	    digest[4],  digest[5],  digest[6],  digest[7],
+	    digest[8],  digest[9],  digest[10], digest[11],
+	    digest[12], digest[13], digest[14], digest[15]);
+
+	return strdup(pakname);
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * pak_name --
+ *	Generate a PAK image name.
+ */
+char *
+pak_name(uint32_t image, bool encrypted)
+{
+	char namestr[sizeof("000001.pak")];
+
+	if (encrypted) {
+		return pak_encrypted_name(image);
+	}
+
+	snprintf(namestr, sizeof(namestr), "%06X.pak", image);
+	return strdup(namestr);
+}
@@ -0,0 +1,76 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef pak_h_included
+#define	pak_h_included
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(HAVE_COMMONCRYPTO_H)
+#define	COMMON_DIGEST_FOR_OPENSSL
+#include <CommonCrypto/CommonCrypto.h>
+#elif defined(HAVE_OPENSSL)
+#include <openssl/des.h>
+#endif
+
+/*
+ * NabuRetroNet PAK files: DES-CBC encrypted NABU images, which the
+ * NabuRetroNet servers publish under MD5-derived names.
+ */
+
+#define	PAK_BLOCKSIZE		8
+
+/*
+ * PAK decryption context.  DES-CBC can be decrypted incrementally,
+ * so a PAK can be decrypted in-place, one block-aligned run of data
+ * at a time, as it arrives.
+ */
+struct pak_cipher {
+#if defined(HAVE_COMMONCRYPTO_H)
+	CCCryptorRef	cryptor;
+#elif defined(HAVE_OPENSSL)
+	DES_key_schedule ks;
+	DES_cblock	iv;
+#else
+	int		dummy;
+#endif
+};
+
+bool	pak_cipher_init(struct pak_cipher *);
+bool	pak_cipher_update(struct pak_cipher *, uint8_t *, size_t);
+void	pak_cipher_fini(struct pak_cipher *);
+bool	pak_decrypt(uint8_t *, size_t);
+
+char	*pak_name(uint32_t, bool);
+char	*pak_encrypted_name(uint32_t);
+
+#endif /* pak_h_included */
@@ -0,0 +1,1447 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nabuclient bench -- a multi-client load generator for nabud.
+ *
+ * Each simulated NABU gets its own thread and connection, and runs
+ * a boot sequence: RESET, CHANGE_CHANNEL, and then every segment
+ * of each of the specified images, as many times as requested.
+ * At the end, we report the aggregate throughput and the per-segment
+ * latency distribution.
+ *
+ * nabuclient bench-storage -- the same idea for the storage extensions.
+ *
+ * Each client opens its own file using NHACP STORAGE-OPEN or RetroNet
+ * FILE-OPEN, fills it, and then runs a sequential or random read or
+ * write pattern against it for the requested duration.  RetroNet
+ * writes have no reply, so each one is followed by FH-SIZE to give
+ * us something to time; that round-trip is part of the reported
+ * latency.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <assert.h>
+#include <errno.h>
+#include <err.h>	/* XXX HAVE_ERR_H-ize, please */
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define	NABU_PROTO_INLINES
+
+#include "libnabud/crc8_cdma2000.h"
+#include "libnabud/missing.h"
+#include "libnabud/nabu_proto.h"
+#include "libnabud/nhacp_proto.h"
+#include "libnabud/retronet_proto.h"
+
+#include "bench.h"
+
+struct bench_client {
+	pthread_t	thread;
+	unsigned int	idx;
+	int		sock;
+
+	/* Receive buffer, so we're not doing a read() per byte. */
+	uint8_t		rbuf[4096];
+	size_t		rlen;
+	size_t		roff;
+
+	/* Storage benchmark state. */
+	uint8_t		*txbuf;
+	uint8_t		*rxmsg;
+	uint32_t	rng;
+	uint32_t	seq;
+	uint8_t		fdesc;
+
+	/* Results. */
+	uint64_t	ops;		/* segments or storage operations */
+	uint64_t	trips;		/* storage request/reply round trips */
+	uint64_t	bytes;
+	uint64_t	*lat;		/* nanoseconds */
+	size_t		nlat;
+	size_t		lat_cap;
+	bool		failed;
+};
+
+static struct addrinfo *bench_ai;
+static uint16_t bench_channel = 1;
+static unsigned int bench_rounds = 1;
+static uint32_t *bench_images;
+static unsigned int bench_nimages;
+
+static pthread_mutex_t bench_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_start_cv = PTHREAD_COND_INITIALIZER;
+static unsigned int bench_ready;
+static bool bench_go;
+static uint64_t bench_duration;		/* 0 == run to completion */
+static uint64_t bench_deadline;
+
+static const uint8_t ack_seq[] = NABU_MSGSEQ_ACK;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+	    (uint64_t)ts.tv_nsec;
+}
+
+static bool
+bench_send(struct bench_client *bc, const void *vbuf, size_t len)
+{
+	const uint8_t *buf = vbuf;
+	ssize_t actual;
+
+	while (len != 0) {
+		actual = write(bc->sock, buf, len);
+		if (actual <= 0) {
+			if (actual < 0 && errno == EINTR) {
+				continue;
+			}
+			warnx("client %u: write failed: %s", bc->idx,
+			    actual == 0 ? "disconnected" : strerror(errno));
+			return false;
+		}
+		buf += actual;
+		len -= (size_t)actual;
+	}
+	return true;
+}
+
+static bool
+bench_send_byte(struct bench_client *bc, uint8_t val)
+{
+	return bench_send(bc, &val, 1);
+}
+
+static bool
+bench_recv_byte(struct bench_client *bc, uint8_t *valp)
+{
+	ssize_t actual;
+
+	if (bc->roff == bc->rlen) {
+		for (;;) {
+			actual = read(bc->sock, bc->rbuf, sizeof(bc->rbuf));
+			if (actual > 0) {
+				break;
+			}
+			if (actual < 0 && errno == EINTR) {
+				continue;
+			}
+			warnx("client %u: read failed: %s", bc->idx,
+			    actual == 0 ? "disconnected" : strerror(errno));
+			return false;
+		}
+		bc->rlen = (size_t)actual;
+		bc->roff = 0;
+	}
+	*valp = bc->rbuf[bc->roff++];
+	return true;
+}
+
+static bool
+bench_expect(struct bench_client *bc, const uint8_t *seq, size_t len,
+    const char *what)
+{
+	uint8_t c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (! bench_recv_byte(bc, &c)) {
+			return false;
+		}
+		if (c != seq[i]) {
+			warnx("client %u: expected %s, got $%02X", bc->idx,
+			    what, c);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+bench_expect_ack(struct bench_client *bc)
+{
+	return bench_expect(bc, ack_seq, sizeof(ack_seq), "ACK");
+}
+
+static bool
+bench_expect_confirmed(struct bench_client *bc)
+{
+	static const uint8_t confirmed = NABU_STATE_CONFIRMED;
+
+	return bench_expect(bc, &confirmed, 1, "CONFIRMED");
+}
+
+static bool
+bench_reset(struct bench_client *bc)
+{
+	return bench_send_byte(bc, NABU_MSG_RESET) &&
+	       bench_expect_ack(bc) &&
+	       bench_expect_confirmed(bc);
+}
+
+static bool
+bench_change_channel(struct bench_client *bc)
+{
+	uint8_t msg[2];
+
+	nabu_set_uint16(msg, bench_channel);
+	return bench_send_byte(bc, NABU_MSG_CHANGE_CHANNEL) &&
+	       bench_expect_ack(bc) &&
+	       bench_send(bc, msg, sizeof(msg)) &&
+	       bench_expect_confirmed(bc);
+}
+
+static void
+bench_record_latency(struct bench_client *bc, uint64_t ns)
+{
+	if (bc->nlat == bc->lat_cap) {
+		size_t newcap = bc->lat_cap ? bc->lat_cap * 2 : 1024;
+		uint64_t *newlat = realloc(bc->lat, newcap * sizeof(*newlat));
+		if (newlat == NULL) {
+			return;
+		}
+		bc->lat = newlat;
+		bc->lat_cap = newcap;
+	}
+	bc->lat[bc->nlat++] = ns;
+}
+
+/*
+ * bench_get_segment --
+ *	Request a single segment and receive the packet.  Sets
+ *	*lastp if it was the last segment of the image.
+ */
+static bool
+bench_get_segment(struct bench_client *bc, uint32_t image, uint8_t segment,
+    bool *lastp)
+{
+	uint8_t pkt[NABU_MAXPACKETSIZE];
+	size_t pktlen = 0;
+	bool have_escape = false;
+	uint8_t msg[4], c;
+	uint64_t start;
+
+	start = bench_now();
+
+	if (! bench_send_byte(bc, NABU_MSG_PACKET_REQUEST) ||
+	    ! bench_expect_ack(bc)) {
+		return false;
+	}
+	msg[0] = segment;
+	nabu_set_uint24(&msg[1], image);
+	if (! bench_send(bc, msg, sizeof(msg)) ||
+	    ! bench_expect_confirmed(bc)) {
+		return false;
+	}
+
+	if (! bench_recv_byte(bc, &c)) {
+		return false;
+	}
+	if (c != NABU_SERVICE_AUTHORIZED) {
+		warnx("client %u: segment %u of image %06X: %s", bc->idx,
+		    segment, image, c == NABU_SERVICE_UNAUTHORIZED ?
+		    "UNAUTHORIZED" : "unexpected reply");
+		if (c == NABU_SERVICE_UNAUTHORIZED) {
+			(void) bench_send(bc, ack_seq, sizeof(ack_seq));
+		}
+		return false;
+	}
+	if (! bench_send(bc, ack_seq, sizeof(ack_seq))) {
+		return false;
+	}
+
+	for (;;) {
+		if (! bench_recv_byte(bc, &c)) {
+			return false;
+		}
+		if (have_escape) {
+			have_escape = false;
+			if (c == NABU_STATE_DONE) {
+				break;
+			}
+			if (c != NABU_MSG_ESCAPE) {
+				warnx("client %u: bad escape byte $%02X",
+				    bc->idx, c);
+				return false;
+			}
+		} else if (c == NABU_MSG_ESCAPE) {
+			have_escape = true;
+			continue;
+		}
+		if (pktlen == sizeof(pkt)) {
+			warnx("client %u: packet overflow", bc->idx);
+			return false;
+		}
+		pkt[pktlen++] = c;
+	}
+
+	bench_record_latency(bc, bench_now() - start);
+
+	if (pktlen < NABU_HEADERSIZE + NABU_FOOTERSIZE) {
+		warnx("client %u: runt packet (%zu bytes)", bc->idx, pktlen);
+		return false;
+	}
+
+	const struct nabu_pkthdr *hdr = (const void *)pkt;
+	*lastp = (hdr->type & 0x10) != 0;
+
+	bc->ops++;
+	bc->bytes += pktlen - NABU_HEADERSIZE - NABU_FOOTERSIZE;
+	return true;
+}
+
+static bool
+bench_connect(struct bench_client *bc)
+{
+	struct addrinfo *ai;
+	int on = 1;
+
+	for (ai = bench_ai; ai != NULL; ai = ai->ai_next) {
+		bc->sock = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol);
+		if (bc->sock < 0) {
+			continue;
+		}
+		if (connect(bc->sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+			(void) setsockopt(bc->sock, IPPROTO_TCP, TCP_NODELAY,
+			    &on, sizeof(on));
+			return true;
+		}
+		close(bc->sock);
+		bc->sock = -1;
+	}
+	warn("client %u: unable to connect", bc->idx);
+	return false;
+}
+
+/*
+ * bench_wait_for_start --
+ *	Tell the main thread we're ready, and wait for everyone
+ *	else to be ready, too.
+ */
+static void
+bench_wait_for_start(void)
+{
+	pthread_mutex_lock(&bench_start_lock);
+	bench_ready++;
+	pthread_cond_broadcast(&bench_start_cv);
+	while (! bench_go) {
+		pthread_cond_wait(&bench_start_cv, &bench_start_lock);
+	}
+	pthread_mutex_unlock(&bench_start_lock);
+}
+
+static void *
+bench_client_thread(void *arg)
+{
+	struct bench_client *bc = arg;
+	unsigned int round, i;
+	unsigned int segment;
+	bool last;
+
+	bench_wait_for_start();
+
+	for (round = 0; round < bench_rounds; round++) {
+		if (! bench_reset(bc) || ! bench_change_channel(bc)) {
+			goto bad;
+		}
+		for (i = 0; i < bench_nimages; i++) {
+			for (segment = 0, last = false; !last; segment++) {
+				if (segment > 0xff) {
+					warnx("client %u: image %06X has "
+					    "too many segments", bc->idx,
+					    bench_images[i]);
+					goto bad;
+				}
+				if (! bench_get_segment(bc, bench_images[i],
+						(uint8_t)segment, &last)) {
+					goto bad;
+				}
+			}
+		}
+	}
+	return NULL;
+
+ bad:
+	bc->failed = true;
+	return NULL;
+}
+
+/*
+ * Storage benchmark.
+ */
+typedef enum {
+	SB_PROTO_NHACP,
+	SB_PROTO_RETRONET,
+} sb_proto;
+
+typedef enum {
+	SB_SEQREAD,
+	SB_RANDREAD,
+	SB_SEQWRITE,
+	SB_RANDWRITE,
+	SB_INSERT,
+} sb_pattern;
+
+static const char * const sb_pattern_names[] = {
+	[SB_SEQREAD]	= "seqread",
+	[SB_RANDREAD]	= "randread",
+	[SB_SEQWRITE]	= "seqwrite",
+	[SB_RANDWRITE]	= "randwrite",
+	[SB_INSERT]	= "insert",
+};
+static const size_t sb_pattern_count =
+    sizeof(sb_pattern_names) / sizeof(sb_pattern_names[0]);
+
+static sb_proto sb_protocol = SB_PROTO_NHACP;
+static sb_pattern sb_workload = SB_SEQREAD;
+static bool sb_crc;
+static uint16_t sb_blksize = 1024;
+static uint32_t sb_nblocks = 256;
+static unsigned int sb_vector = 1;	/* blocks per NHACP request */
+static const char *sb_prefix = "bench-storage";
+
+#define	SB_MSGBUF_SIZE	(NHACP_MTU + 16)
+
+static char *
+sb_file_name(const struct bench_client *bc)
+{
+	char *name;
+
+	if (asprintf(&name, "%s-%u.dat", sb_prefix, bc->idx) < 0) {
+		return NULL;
+	}
+	return name;
+}
+
+/*
+ * sb_next_block --
+ *	Pick the next block according to the workload.
+ */
+static uint32_t
+sb_next_block(struct bench_client *bc)
+{
+	switch (sb_workload) {
+	case SB_RANDREAD:
+	case SB_RANDWRITE:
+	case SB_INSERT:
+		/* xorshift32 */
+		bc->rng ^= bc->rng << 13;
+		bc->rng ^= bc->rng >> 17;
+		bc->rng ^= bc->rng << 5;
+		return bc->rng % sb_nblocks;
+
+	default:
+		return bc->seq++ % sb_nblocks;
+	}
+}
+
+static void
+sb_fill(struct bench_client *bc, uint8_t *buf, uint32_t blk)
+{
+	memset(buf, (int)((blk + bc->idx) & 0xff), sb_blksize);
+}
+
+/*
+ * NHACP messages are assembled in txbuf:
+ *
+ *	[0]	NABU_MSG_NHACP_REQUEST
+ *	[1]	session ID
+ *	[2..3]	length
+ *	[4...]	body, optionally followed by CRC-8
+ */
+#define	SB_NHACP_BODY(bc)	(&(bc)->txbuf[4])
+
+static bool
+sb_nhacp_send(struct bench_client *bc, uint16_t bodylen)
+{
+	uint16_t length = bodylen + (sb_crc ? 1 : 0);
+	uint8_t crc;
+
+	bc->txbuf[0] = NABU_MSG_NHACP_REQUEST;
+	bc->txbuf[1] = NHACP_SESSION_SYSTEM;
+	nabu_set_uint16(&bc->txbuf[2], length);
+	if (sb_crc) {
+		crc = crc8_cdma2000_init();
+		crc = crc8_cdma2000_update(bc->txbuf, 4 + bodylen, crc);
+		bc->txbuf[4 + bodylen] = crc8_cdma2000_fini(crc);
+	}
+	return bench_send(bc, bc->txbuf, 4 + (size_t)length);
+}
+
+/*
+ * sb_nhacp_recv --
+ *	Receive an NHACP response into rxmsg (starting with the
+ *	length field), verifying the CRC if enabled.  Returns the
+ *	response type, or 0 (with *lenp set to 0) on failure.
+ */
+static uint8_t
+sb_nhacp_recv(struct bench_client *bc, uint16_t *lenp)
+{
+	uint16_t length, i;
+	uint8_t crc;
+
+	*lenp = 0;
+	if (! bench_recv_byte(bc, &bc->rxmsg[0]) ||
+	    ! bench_recv_byte(bc, &bc->rxmsg[1])) {
+		return 0;
+	}
+	length = nabu_get_uint16(bc->rxmsg);
+	if (length == 0 || length > NHACP_MTU + 1) {
+		warnx("client %u: bad NHACP response length %u",
+		    bc->idx, length);
+		return 0;
+	}
+	for (i = 0; i < length; i++) {
+		if (! bench_recv_byte(bc, &bc->rxmsg[2 + i])) {
+			return 0;
+		}
+	}
+	if (sb_crc) {
+		crc = crc8_cdma2000_init();
+		crc = crc8_cdma2000_update(bc->rxmsg, 2 + (size_t)length,
+		    crc);
+		if (crc8_cdma2000_fini(crc) != 0) {
+			warnx("client %u: NHACP response CRC error", bc->idx);
+			return 0;
+		}
+		length--;
+	}
+	*lenp = length;
+	return bc->rxmsg[2];
+}
+
+static bool
+sb_nhacp_expect(struct bench_client *bc, uint8_t type, const char *what)
+{
+	uint16_t length;
+	uint8_t got;
+
+	got = sb_nhacp_recv(bc, &length);
+	if (got == type) {
+		return true;
+	}
+	if (got == NHACP_RESP_ERROR && length >= 3) {
+		warnx("client %u: %s: NHACP error %u", bc->idx, what,
+		    nabu_get_uint16(&bc->rxmsg[3]));
+	} else if (got != 0) {
+		warnx("client %u: %s: unexpected response $%02X",
+		    bc->idx, what, got);
+	}
+	return false;
+}
+
+static bool
+sb_nhacp_hello(struct bench_client *bc)
+{
+	uint8_t *body = SB_NHACP_BODY(bc);
+
+	body[0] = NHACP_REQ_HELLO;
+	body[1] = 'A';
+	body[2] = 'C';
+	body[3] = 'P';
+	nabu_set_uint16(&body[4], NHACP_VERS_0_1);
+	nabu_set_uint16(&body[6], (sb_crc ? NHACP_OPTION_CRC8 : 0) |
+	    (sb_vector > 1 ? NHACP_OPTION_NABUD_BLOCKV : 0));
+	if (sb_vector > 1) {
+		/*
+		 * A server that doesn't support the option ignores the
+		 * HELLO, so don't wait forever for the reply.
+		 */
+		struct timeval tv = { .tv_sec = 5 };
+		(void) setsockopt(bc->sock, SOL_SOCKET, SO_RCVTIMEO,
+		    &tv, sizeof(tv));
+	}
+	if (! sb_nhacp_send(bc, 8) ||
+	    ! sb_nhacp_expect(bc, NHACP_RESP_SESSION_STARTED, "HELLO")) {
+		if (sb_vector > 1) {
+			warnx("client %u: server does not appear to support "
+			    "vectored block I/O", bc->idx);
+		}
+		return false;
+	}
+	if (sb_vector > 1) {
+		struct timeval tv = { .tv_sec = 0 };
+		(void) setsockopt(bc->sock, SOL_SOCKET, SO_RCVTIMEO,
+		    &tv, sizeof(tv));
+	}
+	return true;
+}
+
+static bool
+sb_nhacp_open(struct bench_client *bc, const char *name)
+{
+	uint8_t *body = SB_NHACP_BODY(bc);
+	size_t namelen = strlen(name);
+
+	body[0] = NHACP_REQ_STORAGE_OPEN;
+	body[1] = 0xff;			/* server picks fdesc */
+	nabu_set_uint16(&body[2],
+	    NHACP_O_RDWR | NHACP_O_CREAT | NHACP_O_TRUNC);
+	body[4] = (uint8_t)namelen;
+	memcpy(&body[5], name, namelen);
+	if (! sb_nhacp_send(bc, (uint16_t)(5 + namelen)) ||
+	    ! sb_nhacp_expect(bc, NHACP_RESP_STORAGE_LOADED,
+			      "STORAGE-OPEN")) {
+		return false;
+	}
+	bc->fdesc = bc->rxmsg[3];
+	return true;
+}
+
+static bool
+sb_nhacp_get_block(struct bench_client *bc, uint32_t blk)
+{
+	uint8_t *body = SB_NHACP_BODY(bc);
+
+	body[0] = NHACP_REQ_STORAGE_GET_BLOCK;
+	body[1] = bc->fdesc;
+	nabu_set_uint32(&body[2], blk);
+	nabu_set_uint16(&body[6], sb_blksize);
+	if (! sb_nhacp_send(bc, 8) ||
+	    ! sb_nhacp_expect(bc, NHACP_RESP_DATA_BUFFER, "GET-BLOCK")) {
+		return false;
+	}
+	if (nabu_get_uint16(&bc->rxmsg[3]) != sb_blksize) {
+		warnx("client %u: GET-BLOCK %u: short block", bc->idx, blk);
+		return false;
+	}
+	return true;
+}
+
+static bool
+sb_nhacp_put_block(struct bench_client *bc, uint32_t blk)
+{
+	uint8_t *body = SB_NHACP_BODY(bc);
+
+	body[0] = NHACP_REQ_STORAGE_PUT_BLOCK;
+	body[1] = bc->fdesc;
+	nabu_set_uint32(&body[2], blk);
+	nabu_set_uint16(&body[6], sb_blksize);
+	sb_fill(bc, &body[8], blk);
+	return sb_nhacp_send(bc, (uint16_t)(8 + sb_blksize)) &&
+	       sb_nhacp_expect(bc, NHACP_RESP_OK, "PUT-BLOCK");
+}
+
+/*
+ * sb_nhacp_put_vector --
+ *	How many blocks fit in a STORAGE-PUT-BLOCKV request.
+ */
+static unsigned int
+sb_nhacp_put_vector(void)
+{
+	unsigned int n = (NHACP_MTU - 1 -
+	    sizeof(struct nhacp_request_nabud_storage_put_blockv)) /
+	    (sizeof(struct nhacp_blockv_entry) + sb_blksize);
+
+	return n < sb_vector ? n : sb_vector;
+}
+
+/*
+ * sb_nhacp_blockv --
+ *	Read or write the next n blocks with a single vectored
+ *	request, and collect the per-block replies.
+ */
+static bool
+sb_nhacp_blockv(struct bench_client *bc, unsigned int n, bool is_put)
+{
+	uint8_t *body = SB_NHACP_BODY(bc);
+	uint8_t *entry = &body[4];
+	uint8_t *data = &body[4 + n * sizeof(struct nhacp_blockv_entry)];
+	unsigned int i;
+	uint32_t blk;
+
+	body[0] = is_put ? NHACP_REQ_NABUD_STORAGE_PUT_BLOCKV :
+			   NHACP_REQ_NABUD_STORAGE_GET_BLOCKV;
+	nabu_set_uint16(&body[1], sb_blksize);
+	body[3] = (uint8_t)n;
+	for (i = 0; i < n; i++) {
+		blk = sb_next_block(bc);
+		entry[0] = bc->fdesc;
+		nabu_set_uint32(&entry[1], blk);
+		entry += sizeof(struct nhacp_blockv_entry);
+		if (is_put) {
+			sb_fill(bc, data, blk);
+			data += sb_blksize;
+		}
+	}
+	if (! sb_nhacp_send(bc, (uint16_t)(is_put ? data - body :
+						      entry - body))) {
+		return false;
+	}
+	for (i = 0; i < n; i++) {
+		if (is_put) {
+			if (! sb_nhacp_expect(bc, NHACP_RESP_OK,
+					      "PUT-BLOCKV")) {
+				return false;
+			}
+			continue;
+		}
+		if (! sb_nhacp_expect(bc, NHACP_RESP_DATA_BUFFER,
+				      "GET-BLOCKV")) {
+			return false;
+		}
+		if (nabu_get_uint16(&bc->rxmsg[3]) != sb_blksize) {
+			warnx("client %u: GET-BLOCKV: short block", bc->idx);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+sb_nhacp_finish(struct bench_client *bc, const char *name)
+{
+	uint8_t *body = SB_NHACP_BODY(bc);
+	size_t namelen = strlen(name);
+
+	body[0] = NHACP_REQ_FILE_CLOSE;
+	body[1] = bc->fdesc;
+	if (! sb_nhacp_send(bc, 2)) {
+		return false;
+	}
+
+	body[0] = NHACP_REQ_REMOVE;
+	nabu_set_uint16(&body[1], NHACP_REMOVE_FILE);
+	body[3] = (uint8_t)namelen;
+	memcpy(&body[4], name, namelen);
+	if (! sb_nhacp_send(bc, (uint16_t)(4 + namelen)) ||
+	    ! sb_nhacp_expect(bc, NHACP_RESP_OK, "REMOVE")) {
+		return false;
+	}
+
+	body[0] = NHACP_REQ_GOODBYE;
+	return sb_nhacp_send(bc, 1);
+}
+
+/*
+ * RetroNet messages are assembled in txbuf: the message type
+ * followed by the request.
+ */
+static bool
+sb_rn_open(struct bench_client *bc, const char *name)
+{
+	size_t namelen = strlen(name);
+	uint8_t *cp = bc->txbuf;
+
+	/* Start from an empty file. */
+	*cp++ = NABU_MSG_RN_FILE_DELETE;
+	*cp++ = (uint8_t)namelen;
+	memcpy(cp, name, namelen);
+	cp += namelen;
+
+	*cp++ = NABU_MSG_RN_FILE_OPEN;
+	*cp++ = (uint8_t)namelen;
+	memcpy(cp, name, namelen);
+	cp += namelen;
+	nabu_set_uint16(cp, RN_FILE_OPEN_RW);
+	cp += 2;
+	*cp++ = 0xff;			/* server picks handle */
+
+	return bench_send(bc, bc->txbuf, (size_t)(cp - bc->txbuf)) &&
+	       bench_recv_byte(bc, &bc->fdesc) &&
+	       bc->fdesc != 0xff;
+}
+
+static bool
+sb_rn_fh_size(struct bench_client *bc, int32_t *sizep)
+{
+	uint8_t msg[2] = { NABU_MSG_RN_FH_SIZE, bc->fdesc };
+	uint8_t repl[4];
+	unsigned int i;
+
+	if (! bench_send(bc, msg, sizeof(msg))) {
+		return false;
+	}
+	for (i = 0; i < sizeof(repl); i++) {
+		if (! bench_recv_byte(bc, &repl[i])) {
+			return false;
+		}
+	}
+	*sizep = (int32_t)nabu_get_uint32(repl);
+	return *sizep >= 0;
+}
+
+static bool
+sb_rn_read(struct bench_client *bc, uint32_t blk)
+{
+	uint8_t *cp = bc->txbuf;
+	uint8_t lenbuf[2], c;
+	uint16_t len, i;
+
+	*cp++ = NABU_MSG_RN_FH_READ;
+	*cp++ = bc->fdesc;
+	nabu_set_uint32(cp, blk * sb_blksize);
+	cp += 4;
+	nabu_set_uint16(cp, sb_blksize);
+	cp += 2;
+
+	if (! bench_send(bc, bc->txbuf, (size_t)(cp - bc->txbuf)) ||
+	    ! bench_recv_byte(bc, &lenbuf[0]) ||
+	    ! bench_recv_byte(bc, &lenbuf[1])) {
+		return false;
+	}
+	len = nabu_get_uint16(lenbuf);
+	for (i = 0; i < len; i++) {
+		if (! bench_recv_byte(bc, &c)) {
+			return false;
+		}
+	}
+	if (len != sb_blksize) {
+		warnx("client %u: FH-READ %u: short read", bc->idx, blk);
+		return false;
+	}
+	return true;
+}
+
+static bool
+sb_rn_write(struct bench_client *bc, uint8_t op, uint32_t blk, bool sync)
+{
+	uint8_t *cp = bc->txbuf;
+	int32_t size;
+
+	*cp++ = op;
+	*cp++ = bc->fdesc;
+	if (op != NABU_MSG_RN_FH_APPEND) {
+		nabu_set_uint32(cp, blk * sb_blksize);
+		cp += 4;
+	}
+	nabu_set_uint16(cp, sb_blksize);
+	cp += 2;
+	sb_fill(bc, cp, blk);
+	cp += sb_blksize;
+
+	if (! bench_send(bc, bc->txbuf, (size_t)(cp - bc->txbuf))) {
+		return false;
+	}
+	/* No reply; FH-SIZE acts as the completion barrier. */
+	return ! sync || sb_rn_fh_size(bc, &size);
+}
+
+static bool
+sb_rn_finish(struct bench_client *bc, const char *name)
+{
+	size_t namelen = strlen(name);
+	uint8_t *cp = bc->txbuf;
+	uint8_t repl[4];
+	unsigned int i;
+
+	*cp++ = NABU_MSG_RN_FH_CLOSE;
+	*cp++ = bc->fdesc;
+	*cp++ = NABU_MSG_RN_FILE_DELETE;
+	*cp++ = (uint8_t)namelen;
+	memcpy(cp, name, namelen);
+	cp += namelen;
+
+	/* Wait for the delete to happen before we disconnect. */
+	*cp++ = NABU_MSG_RN_FILE_SIZE;
+	*cp++ = (uint8_t)namelen;
+	memcpy(cp, name, namelen);
+	cp += namelen;
+
+	if (! bench_send(bc, bc->txbuf, (size_t)(cp - bc->txbuf))) {
+		return false;
+	}
+	for (i = 0; i < sizeof(repl); i++) {
+		if (! bench_recv_byte(bc, &repl[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * sb_setup --
+ *	Open and fill this client's file.
+ */
+static bool
+sb_setup(struct bench_client *bc, const char *name)
+{
+	uint32_t blk;
+	int32_t size;
+
+	if (sb_protocol == SB_PROTO_NHACP) {
+		if (! sb_nhacp_hello(bc) || ! sb_nhacp_open(bc, name)) {
+			return false;
+		}
+		for (blk = 0; blk < sb_nblocks; blk++) {
+			if (! sb_nhacp_put_block(bc, blk)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	if (! bench_change_channel(bc) || ! sb_rn_open(bc, name)) {
+		warnx("client %u: unable to open %s (is RetroNet enabled "
+		    "on channel %u?)", bc->idx, name, bench_channel);
+		return false;
+	}
+	for (blk = 0; blk < sb_nblocks; blk++) {
+		if (! sb_rn_write(bc, NABU_MSG_RN_FH_APPEND, blk, false)) {
+			return false;
+		}
+	}
+	if (! sb_rn_fh_size(bc, &size) ||
+	    (uint32_t)size != sb_nblocks * sb_blksize) {
+		warnx("client %u: file setup failed", bc->idx);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * sb_do_op --
+ *	Do one request/reply round trip.  Returns the number of
+ *	blocks transferred, or 0 on failure.
+ */
+static unsigned int
+sb_do_op(struct bench_client *bc)
+{
+	unsigned int n;
+	uint32_t blk;
+
+	switch (sb_workload) {
+	case SB_SEQREAD:
+	case SB_RANDREAD:
+		if (sb_protocol == SB_PROTO_NHACP && sb_vector > 1) {
+			return sb_nhacp_blockv(bc, sb_vector, false) ?
+			    sb_vector : 0;
+		}
+		blk = sb_next_block(bc);
+		return (sb_protocol == SB_PROTO_NHACP ?
+		    sb_nhacp_get_block(bc, blk) : sb_rn_read(bc, blk)) ?
+		    1 : 0;
+
+	case SB_SEQWRITE:
+	case SB_RANDWRITE:
+		n = sb_protocol == SB_PROTO_NHACP ? sb_nhacp_put_vector() : 1;
+		if (n > 1) {
+			return sb_nhacp_blockv(bc, n, true) ? n : 0;
+		}
+		blk = sb_next_block(bc);
+		return (sb_protocol == SB_PROTO_NHACP ?
+		    sb_nhacp_put_block(bc, blk) :
+		    sb_rn_write(bc, NABU_MSG_RN_FH_REPLACE, blk, true)) ?
+		    1 : 0;
+
+	case SB_INSERT:
+		blk = sb_next_block(bc);
+		return sb_rn_write(bc, NABU_MSG_RN_FH_INSERT, blk, true) ?
+		    1 : 0;
+	}
+	return 0;
+}
+
+static void *
+sb_client_thread(void *arg)
+{
+	struct bench_client *bc = arg;
+	char *name = sb_file_name(bc);
+	bool ok;
+	uint64_t start;
+	unsigned int n;
+
+	bc->txbuf = malloc(SB_MSGBUF_SIZE);
+	bc->rxmsg = malloc(SB_MSGBUF_SIZE);
+	bc->rng = 0x9e3779b9u ^ (bc->idx * 0x85ebca6bu);
+	if (bc->rng == 0) {
+		bc->rng = 1;
+	}
+
+	ok = name != NULL && bc->txbuf != NULL && bc->rxmsg != NULL &&
+	    sb_setup(bc, name);
+	if (! ok) {
+		bc->failed = true;
+	}
+
+	bench_wait_for_start();
+
+	while (ok && bench_now() < bench_deadline) {
+		start = bench_now();
+		if ((n = sb_do_op(bc)) == 0) {
+			bc->failed = true;
+			ok = false;
+			break;
+		}
+		bench_record_latency(bc, bench_now() - start);
+		bc->ops += n;
+		bc->trips++;
+		bc->bytes += (uint64_t)n * sb_blksize;
+	}
+
+	if (ok) {
+		if (sb_protocol == SB_PROTO_NHACP) {
+			ok = sb_nhacp_finish(bc, name);
+		} else {
+			ok = sb_rn_finish(bc, name);
+		}
+		if (! ok) {
+			bc->failed = true;
+		}
+	}
+
+	free(name);
+	free(bc->txbuf);
+	free(bc->rxmsg);
+	return NULL;
+}
+
+static int
+bench_lat_cmp(const void *v1, const void *v2)
+{
+	uint64_t a = *(const uint64_t *)v1;
+	uint64_t b = *(const uint64_t *)v2;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static double
+bench_percentile(const uint64_t *lat, size_t nlat, double pct)
+{
+	size_t idx;
+
+	if (nlat == 0) {
+		return 0.0;
+	}
+	idx = (size_t)(pct / 100.0 * (double)nlat);
+	if (idx >= nlat) {
+		idx = nlat - 1;
+	}
+	return (double)lat[idx] / 1000.0;	/* microseconds */
+}
+
+/*
+ * bench_launch --
+ *	Connect all of the clients and start their threads.  We
+ *	connect everyone up front so that isn't part of the timing.
+ */
+static bool
+bench_launch(struct bench_client *clients, unsigned int nclients,
+    void *(*func)(void *))
+{
+	unsigned int i;
+	int error;
+
+	for (i = 0; i < nclients; i++) {
+		clients[i].idx = i;
+		if (! bench_connect(&clients[i])) {
+			return false;
+		}
+		error = pthread_create(&clients[i].thread, NULL,
+		    func, &clients[i]);
+		if (error != 0) {
+			warnx("pthread_create: %s", strerror(error));
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * bench_run --
+ *	Wait for all of the clients to be ready, let them go, and
+ *	wait for them to finish.  Returns the elapsed time.
+ */
+static uint64_t
+bench_run(struct bench_client *clients, unsigned int nclients)
+{
+	uint64_t start;
+	unsigned int i;
+
+	pthread_mutex_lock(&bench_start_lock);
+	while (bench_ready != nclients) {
+		pthread_cond_wait(&bench_start_cv, &bench_start_lock);
+	}
+	bench_go = true;
+	start = bench_now();
+	if (bench_duration != 0) {
+		bench_deadline = start + bench_duration;
+	}
+	pthread_cond_broadcast(&bench_start_cv);
+	pthread_mutex_unlock(&bench_start_lock);
+
+	for (i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+	}
+	return bench_now() - start;
+}
+
+/*
+ * bench_report --
+ *	Report the aggregate results.  Returns the number of clients
+ *	that failed.
+ */
+static unsigned int
+bench_report(struct bench_client *clients, unsigned int nclients,
+    uint64_t elapsed, const char *what, const char *What)
+{
+	unsigned int nfailed = 0, i;
+	uint64_t ops = 0, bytes = 0;
+	uint64_t *lat;
+	size_t nlat = 0;
+	double secs;
+
+	for (i = 0; i < nclients; i++) {
+		ops += clients[i].ops;
+		bytes += clients[i].bytes;
+		nlat += clients[i].nlat;
+		if (clients[i].failed) {
+			nfailed++;
+		}
+		close(clients[i].sock);
+	}
+
+	lat = calloc(nlat ? nlat : 1, sizeof(*lat));
+	if (lat == NULL) {
+		errx(EXIT_FAILURE, "out of memory");
+	}
+	for (i = 0, nlat = 0; i < nclients; i++) {
+		memcpy(&lat[nlat], clients[i].lat,
+		    clients[i].nlat * sizeof(*lat));
+		nlat += clients[i].nlat;
+		free(clients[i].lat);
+	}
+	qsort(lat, nlat, sizeof(*lat), bench_lat_cmp);
+
+	secs = (double)elapsed / 1e9;
+	printf("%" PRIu64 " %s, %" PRIu64 " payload bytes "
+	    "in %.3f seconds.\n", ops, what, bytes, secs);
+	printf("%12.1f %s/sec\n", (double)ops / secs, what);
+	printf("%12.3f MB/sec\n", (double)bytes / 1e6 / secs);
+	printf("%s latency (us): p50 %.1f  p99 %.1f  p999 %.1f  "
+	    "max %.1f\n", What,
+	    bench_percentile(lat, nlat, 50.0),
+	    bench_percentile(lat, nlat, 99.0),
+	    bench_percentile(lat, nlat, 99.9),
+	    nlat ? (double)lat[nlat - 1] / 1000.0 : 0.0);
+	if (nfailed != 0) {
+		printf("%u client%s failed.\n", nfailed,
+		    nfailed == 1 ? "" : "s");
+	}
+
+	free(lat);
+	return nfailed;
+}
+
+static void __attribute__((__noreturn__))
+bench_usage(void)
+{
+	fprintf(stderr, "usage: %s bench [-c channel] [-n clients] "
+	    "[-r rounds] host port image [image ...]\n", getprogname());
+	exit(EXIT_FAILURE);
+}
+
+static long
+bench_parse_number(const char *cp, const char *what, long min, long max,
+    int base)
+{
+	char *ep;
+	long val;
+
+	errno = 0;
+	val = strtol(cp, &ep, base);
+	if (errno != 0 || *cp == '\0' || *ep != '\0' ||
+	    val < min || val > max) {
+		errx(EXIT_FAILURE, "invalid %s: %s", what, cp);
+	}
+	return val;
+}
+
+int
+bench_main(int argc, char *argv[])
+{
+	struct bench_client *clients;
+	unsigned int nclients = 1, nfailed, i;
+	uint64_t elapsed;
+	int ch, error;
+
+	while ((ch = getopt(argc, argv, "c:n:r:")) != -1) {
+		switch (ch) {
+		case 'c':
+			bench_channel = (uint16_t)bench_parse_number(optarg,
+			    "channel", 1, 255, 10);
+			break;
+
+		case 'n':
+			nclients = (unsigned int)bench_parse_number(optarg,
+			    "client count", 1, 4096, 10);
+			break;
+
+		case 'r':
+			bench_rounds = (unsigned int)bench_parse_number(optarg,
+			    "round count", 1, 1000000, 10);
+			break;
+
+		default:
+			bench_usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 3) {
+		bench_usage();
+		/* NOTREACHED */
+	}
+
+	const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+		.ai_flags = AI_NUMERICSERV,
+	};
+	error = getaddrinfo(argv[0], argv[1], &hints, &bench_ai);
+	if (error != 0) {
+		errx(EXIT_FAILURE, "Host %s port %s: %s", argv[0], argv[1],
+		    gai_strerror(error));
+	}
+
+	bench_nimages = (unsigned int)(argc - 2);
+	bench_images = calloc(bench_nimages, sizeof(*bench_images));
+	clients = calloc(nclients, sizeof(*clients));
+	if (bench_images == NULL || clients == NULL) {
+		errx(EXIT_FAILURE, "out of memory");
+	}
+	for (i = 0; i < bench_nimages; i++) {
+		bench_images[i] = (uint32_t)bench_parse_number(argv[i + 2],
+		    "image number", 1, NABU_IMAGE_TIME - 1, 16);
+	}
+
+	if (! bench_launch(clients, nclients, bench_client_thread)) {
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Running %u client%s x %u round%s against %s port %s "
+	    "(channel %u, %u image%s).\n",
+	    nclients, nclients == 1 ? "" : "s",
+	    bench_rounds, bench_rounds == 1 ? "" : "s",
+	    argv[0], argv[1], bench_channel,
+	    bench_nimages, bench_nimages == 1 ? "" : "s");
+
+	elapsed = bench_run(clients, nclients);
+	nfailed = bench_report(clients, nclients, elapsed, "segments",
+	    "Segment");
+
+	free(clients);
+	free(bench_images);
+	freeaddrinfo(bench_ai);
+
+	return nfailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void __attribute__((__noreturn__))
+bench_storage_usage(void)
+{
+	fprintf(stderr, "usage: %s bench-storage [-C] [-b blocksize] "
+	    "[-c channel] [-d seconds]\n"
+	    "       %*s [-f prefix] [-n clients] [-p nhacp|retronet] "
+	    "[-s blocks] [-v vector]\n"
+	    "       %*s [-w seqread|randread|seqwrite|randwrite|insert] "
+	    "host port\n",
+	    getprogname(), (int)strlen(getprogname()) + 14, "",
+	    (int)strlen(getprogname()) + 14, "");
+	exit(EXIT_FAILURE);
+}
+
+int
+bench_storage_main(int argc, char *argv[])
+{
+	struct bench_client *clients;
+	unsigned int nclients = 1, nfailed;
+	unsigned int seconds = 5;
+	uint64_t elapsed;
+	size_t i;
+	int ch, error;
+
+	while ((ch = getopt(argc, argv, "b:c:Cd:f:n:p:s:v:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			sb_blksize = (uint16_t)bench_parse_number(optarg,
+			    "block size", 1, NHACP_MAX_PAYLOAD, 10);
+			break;
+
+		case 'c':
+			bench_channel = (uint16_t)bench_parse_number(optarg,
+			    "channel", 1, 255, 10);
+			break;
+
+		case 'C':
+			sb_crc = true;
+			break;
+
+		case 'd':
+			seconds = (unsigned int)bench_parse_number(optarg,
+			    "duration", 1, 3600, 10);
+			break;
+
+		case 'f':
+			sb_prefix = optarg;
+			if (strlen(sb_prefix) > 200) {
+				errx(EXIT_FAILURE, "file prefix too long");
+			}
+			break;
+
+		case 'n':
+			nclients = (unsigned int)bench_parse_number(optarg,
+			    "client count", 1, 255, 10);
+			break;
+
+		case 'p':
+			if (strcmp(optarg, "nhacp") == 0) {
+				sb_protocol = SB_PROTO_NHACP;
+			} else if (strcmp(optarg, "retronet") == 0) {
+				sb_protocol = SB_PROTO_RETRONET;
+			} else {
+				bench_storage_usage();
+			}
+			break;
+
+		case 's':
+			sb_nblocks = (uint32_t)bench_parse_number(optarg,
+			    "block count", 1, 65536, 10);
+			break;
+
+		case 'v':
+			sb_vector = (unsigned int)bench_parse_number(optarg,
+			    "vector size", 1, NHACP_NABUD_BLOCKV_MAX, 10);
+			break;
+
+		case 'w':
+			for (i = 0; i < sb_pattern_count; i++) {
+				if (strcmp(optarg, sb_pattern_names[i]) == 0) {
+					break;
+				}
+			}
+			if (i == sb_pattern_count) {
+				bench_storage_usage();
+			}
+			sb_workload = (sb_pattern)i;
+			break;
+
+		default:
+			bench_storage_usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2) {
+		bench_storage_usage();
+		/* NOTREACHED */
+	}
+	if (sb_protocol == SB_PROTO_NHACP && sb_workload == SB_INSERT) {
+		errx(EXIT_FAILURE, "the insert workload is RetroNet-only");
+	}
+	if (sb_protocol == SB_PROTO_RETRONET && sb_crc) {
+		errx(EXIT_FAILURE, "RetroNet does not support CRC");
+	}
+	if (sb_protocol == SB_PROTO_RETRONET && sb_vector > 1) {
+		errx(EXIT_FAILURE, "vectored block I/O is NHACP-only");
+	}
+	if ((uint64_t)sb_nblocks * sb_blksize > INT32_MAX) {
+		errx(EXIT_FAILURE, "file would be too large");
+	}
+
+	const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+		.ai_flags = AI_NUMERICSERV,
+	};
+	error = getaddrinfo(argv[0], argv[1], &hints, &bench_ai);
+	if (error != 0) {
+		errx(EXIT_FAILURE, "Host %s port %s: %s", argv[0], argv[1],
+		    gai_strerror(error));
+	}
+
+	clients = calloc(nclients, sizeof(*clients));
+	if (clients == NULL) {
+		errx(EXIT_FAILURE, "out of memory");
+	}
+	bench_duration = (uint64_t)seconds * UINT64_C(1000000000);
+
+	if (! bench_launch(clients, nclients, sb_client_thread)) {
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Running %u client%s for %u second%s against %s port %s "
+	    "(%s %s%s%s, %u x %u byte blocks).\n",
+	    nclients, nclients == 1 ? "" : "s",
+	    seconds, seconds == 1 ? "" : "s", argv[0], argv[1],
+	    sb_protocol == SB_PROTO_NHACP ? "NHACP" : "RetroNet",
+	    sb_pattern_names[sb_workload], sb_crc ? " +CRC-8" : "",
+	    sb_vector > 1 ? " +BLOCKV" : "",
+	    sb_nblocks, sb_blksize);
+
+	elapsed = bench_run(clients, nclients);
+	nfailed = bench_report(clients, nclients, elapsed, "ops",
+	    "Round trip");
+
+	/*
+	 * Report how many round trips the blocks took, which is what
+	 * vectored block I/O saves; on a serial link, that's where the
+	 * time goes.
+	 */
+	uint64_t ops = 0, trips = 0;
+	for (i = 0; i < nclients; i++) {
+		ops += clients[i].ops;
+		trips += clients[i].trips;
+	}
+	if (trips != 0) {
+		printf("%" PRIu64 " round trips, %.2f blocks per round trip "
+		    "(%" PRIu64 " round trips saved).\n", trips,
+		    (double)ops / (double)trips, ops - trips);
+	}
+
+	free(clients);
+	freeaddrinfo(bench_ai);
+
+	return nfailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -67,6 +67,9 @@
 #include "libnabud/nhacp_proto.h"
 #include "libnabud/retronet_proto.h"
 
+#include "bench.h"
+#include "replay.h"
+
 static int	client_sock;
 
 static const char nabuclient_version[] = VERSION;
@@ -1552,6 +1555,10 @@ command_nhacp_hello(int argc, char *argv[])
 			nhacp_session = NHACP_SESSION_CREATE;
 			continue;
 		}
+		if (strcmp(argv[i], "blockv") == 0) {
+			nhacp_options |= NHACP_OPTION_NABUD_BLOCKV;
+			continue;
+		}
 		printf("Unknown start option: %s\n", argv[i]);
 		cli_throw();
 	}
@@ -1757,6 +1764,92 @@ command_nhacp_storage_put_block(int argc, char *argv[])
 	return false;
 }
 
+/*
+ * nhacp_parse_blockv --
+ *	Parse the "slot blkno [slot blkno ...]" arguments of the
+ *	vectored block commands into the request entries.
+ */
+static uint8_t
+nhacp_parse_blockv(int argc, char *argv[], struct nhacp_blockv_entry *entries)
+{
+	uint8_t count = 0;
+
+	if (argc < 2 || (argc & 1) != 0 ||
+	    argc / 2 > NHACP_NABUD_BLOCKV_MAX) {
+		printf("Args, bro.\n");
+		cli_throw();
+	}
+	for (int i = 0; i < argc; i += 2, count++) {
+		entries[count].fdesc = stext_parse_slot(argv[i]);
+		nabu_set_uint32(entries[count].block_number,
+		    stext_parse_offset(argv[i + 1]));
+	}
+	return count;
+}
+
+static bool
+command_nhacp_storage_get_blockv(int argc, char *argv[])
+{
+	if (argc < 4) {
+		printf("Args, bro.\n");
+		cli_throw();
+	}
+
+	uint16_t blklen = nhacp_parse_length(argv[1]);
+	uint8_t count = nhacp_parse_blockv(argc - 2, &argv[2],
+	    nhacp_buf.request.nabud_storage_get_blockv.entries);
+
+	nabu_set_uint16(nhacp_buf.request.nabud_storage_get_blockv.block_length,
+	    blklen);
+	nhacp_buf.request.nabud_storage_get_blockv.count = count;
+
+	printf("Sending: NHACP_REQ_NABUD_STORAGE_GET_BLOCKV.\n");
+	nhacp_send(NHACP_REQ_NABUD_STORAGE_GET_BLOCKV,
+	    sizeof(nhacp_buf.request.nabud_storage_get_blockv) +
+	    count * sizeof(struct nhacp_blockv_entry));
+
+	/* One reply per block. */
+	for (uint8_t i = 0; i < count; i++) {
+		nhacp_decode_reply();
+	}
+	return false;
+}
+
+static bool
+command_nhacp_storage_put_blockv(int argc, char *argv[])
+{
+	if (argc < 5) {
+		printf("Args, bro.\n");
+		cli_throw();
+	}
+
+	uint16_t blklen = nhacp_parse_length(argv[1]);
+	uint8_t val = stext_parse_slot(argv[2]);	/* good enough */
+	uint8_t count = nhacp_parse_blockv(argc - 3, &argv[3],
+	    nhacp_buf.request.nabud_storage_put_blockv.entries);
+	size_t length = sizeof(nhacp_buf.request.nabud_storage_put_blockv) +
+	    count * (sizeof(struct nhacp_blockv_entry) + blklen);
+
+	if (length > NHACP_MTU - 1) {
+		printf("Request too large (%zu bytes).\n", length);
+		cli_throw();
+	}
+
+	nabu_set_uint16(nhacp_buf.request.nabud_storage_put_blockv.block_length,
+	    blklen);
+	nhacp_buf.request.nabud_storage_put_blockv.count = count;
+	memset(&nhacp_buf.request.nabud_storage_put_blockv.entries[count],
+	    val, (size_t)count * blklen);
+
+	printf("Sending: NHACP_REQ_NABUD_STORAGE_PUT_BLOCKV.\n");
+	nhacp_send(NHACP_REQ_NABUD_STORAGE_PUT_BLOCKV, (uint16_t)length);
+
+	for (uint8_t i = 0; i < count; i++) {
+		nhacp_decode_reply();
+	}
+	return false;
+}
+
 static bool
 command_nhacp_file_close(int argc, char *argv[])
 {
@@ -2120,6 +2213,10 @@ static const struct cmdtab cmdtab[] = {
 				.func = command_nhacp_storage_get_block },
 	{ .name = "nhacp-storage-put-block",
 				.func = command_nhacp_storage_put_block },
+	{ .name = "nhacp-storage-get-blockv",
+				.func = command_nhacp_storage_get_blockv },
+	{ .name = "nhacp-storage-put-blockv",
+				.func = command_nhacp_storage_put_blockv },
 	{ .name = "nhacp-get-date-time", .func = command_nhacp_get_date_time },
 	{ .name = "nhacp-file-close",	.func = command_nhacp_file_close },
 	{ .name = "nhacp-get-error-details",
@@ -2152,6 +2249,14 @@ usage(void)
 {
 	fprintf(stderr, "%s version %s\n", getprogname(), nabuclient_version);
 	fprintf(stderr, "usage: %s host port\n", getprogname());
+	fprintf(stderr, "       %s bench [-c channel] [-n clients] "
+	    "[-r rounds] host port image [image ...]\n", getprogname());
+	fprintf(stderr, "       %s bench-storage [-C] [-b blocksize] "
+	    "[-c channel] [-d seconds] [-f prefix]\n"
+	    "           [-n clients] [-p nhacp|retronet] [-s blocks] "
+	    "[-w workload] host port\n", getprogname());
+	fprintf(stderr, "       %s replay [-kt] [-n count] host port "
+	    "recording\n", getprogname());
 	exit(EXIT_FAILURE);
 }
 
@@ -2163,6 +2268,19 @@ main(int argc, char *argv[])
 
 	setprogname(argv[0]);
 
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		(void) signal(SIGPIPE, SIG_IGN);
+		exit(bench_main(argc - 1, argv + 1));
+	}
+	if (argc > 1 && strcmp(argv[1], "bench-storage") == 0) {
+		(void) signal(SIGPIPE, SIG_IGN);
+		exit(bench_storage_main(argc - 1, argv + 1));
+	}
+	if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+		(void) signal(SIGPIPE, SIG_IGN);
+		exit(replay_main(argc - 1, argv + 1));
+	}
+
 	if (argc != 3) {
 		usage();
 		/* NOTREACHED */
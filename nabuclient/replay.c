@@ -0,0 +1,454 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nabuclient replay -- play back a recorded session against nabud.
+ *
+ * nabud can record the raw byte streams of a connection (see the
+ * RecordSessions connection property).  Here we connect to a server
+ * and re-issue everything the NABU sent, either with the original
+ * timing or as fast as the server will go, and check that everything
+ * the server sends back matches the recording byte for byte.
+ *
+ * The server must be configured the same way it was when the session
+ * was recorded (same channel, images, and storage area contents) for
+ * the responses to match.  Some responses legitimately differ from
+ * run to run (the time packet, NHACP DATE-TIME, file timestamps in
+ * directory listings); use -k to keep going past mismatches and just
+ * count them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "libnabud/conn_io.h"
+#include "libnabud/missing.h"
+
+#include "replay.h"
+
+/* How long to wait for the server to say something. */
+#define	REPLAY_TIMEOUT_MS	10000
+
+struct replay_rec {
+	uint64_t	time;
+	const uint8_t	*data;
+	uint32_t	len;
+	uint8_t		dir;
+};
+
+static struct replay_rec *replay_recs;
+static size_t	replay_nrecs;
+static uint8_t	*replay_file;
+
+static bool	replay_timed;
+static bool	replay_keep_going;
+
+static int	replay_sock = -1;
+static uint8_t	rbuf[4096];
+static size_t	rlen, roff;
+
+/* Statistics for a single run. */
+static uint64_t	replay_sent, replay_received, replay_mismatches;
+
+static uint64_t
+replay_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+	    (uint64_t)ts.tv_nsec;
+}
+
+static void
+replay_sleep_until(uint64_t when)
+{
+	struct timespec ts;
+
+	if (when <= replay_now()) {
+		return;
+	}
+	ts.tv_sec = (time_t)(when / UINT64_C(1000000000));
+	ts.tv_nsec = (long)(when % UINT64_C(1000000000));
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR) {
+		/* keep sleeping */
+	}
+}
+
+static uint64_t
+replay_get_le(const uint8_t *cp, int nbytes)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = nbytes - 1; i >= 0; i--) {
+		v = (v << 8) | cp[i];
+	}
+	return v;
+}
+
+/*
+ * replay_load --
+ *	Load a session recording and index its records.
+ */
+static void
+replay_load(const char *path)
+{
+	struct replay_rec *rec;
+	struct stat sb;
+	size_t off, cap = 0;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL || fstat(fileno(fp), &sb) < 0) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+	replay_file = malloc(sb.st_size != 0 ? (size_t)sb.st_size : 1);
+	if (replay_file == NULL) {
+		errx(EXIT_FAILURE, "out of memory");
+	}
+	if (fread(replay_file, 1, (size_t)sb.st_size, fp) !=
+	    (size_t)sb.st_size) {
+		err(EXIT_FAILURE, "%s: read failed", path);
+	}
+	fclose(fp);
+
+	if ((size_t)sb.st_size < CONN_IO_REC_MAGICLEN ||
+	    memcmp(replay_file, CONN_IO_REC_MAGIC,
+		   CONN_IO_REC_MAGICLEN) != 0) {
+		errx(EXIT_FAILURE, "%s: not a session recording", path);
+	}
+
+	for (off = CONN_IO_REC_MAGICLEN; off < (size_t)sb.st_size;) {
+		if ((size_t)sb.st_size - off < CONN_IO_REC_HDRLEN) {
+			warnx("%s: truncated record header at offset %zu; "
+			    "ignoring the remainder", path, off);
+			break;
+		}
+		if (replay_nrecs == cap) {
+			cap = cap ? cap * 2 : 256;
+			replay_recs = realloc(replay_recs,
+			    cap * sizeof(*replay_recs));
+			if (replay_recs == NULL) {
+				errx(EXIT_FAILURE, "out of memory");
+			}
+		}
+		rec = &replay_recs[replay_nrecs];
+		rec->time = replay_get_le(&replay_file[off], 8);
+		rec->len = (uint32_t)replay_get_le(&replay_file[off + 8], 4);
+		rec->dir = replay_file[off + 12];
+		off += CONN_IO_REC_HDRLEN;
+
+		if (rec->dir != CONN_IO_REC_RECV &&
+		    rec->dir != CONN_IO_REC_SEND) {
+			errx(EXIT_FAILURE, "%s: bad record direction $%02X "
+			    "at offset %zu", path, rec->dir,
+			    off - CONN_IO_REC_HDRLEN);
+		}
+		if ((size_t)sb.st_size - off < rec->len) {
+			warnx("%s: truncated record at offset %zu; "
+			    "ignoring the remainder", path,
+			    off - CONN_IO_REC_HDRLEN);
+			break;
+		}
+		rec->data = &replay_file[off];
+		off += rec->len;
+		replay_nrecs++;
+	}
+}
+
+static bool
+replay_connect(struct addrinfo *ai0)
+{
+	struct addrinfo *ai;
+	int on = 1;
+
+	for (ai = ai0; ai != NULL; ai = ai->ai_next) {
+		replay_sock = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol);
+		if (replay_sock < 0) {
+			continue;
+		}
+		if (connect(replay_sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+			(void) setsockopt(replay_sock, IPPROTO_TCP,
+			    TCP_NODELAY, &on, sizeof(on));
+			rlen = roff = 0;
+			return true;
+		}
+		close(replay_sock);
+		replay_sock = -1;
+	}
+	warn("unable to connect");
+	return false;
+}
+
+static bool
+replay_send(const uint8_t *buf, size_t len)
+{
+	ssize_t actual;
+
+	replay_sent += len;
+	while (len != 0) {
+		actual = write(replay_sock, buf, len);
+		if (actual <= 0) {
+			if (actual < 0 && errno == EINTR) {
+				continue;
+			}
+			warnx("write failed: %s",
+			    actual == 0 ? "disconnected" : strerror(errno));
+			return false;
+		}
+		buf += actual;
+		len -= (size_t)actual;
+	}
+	return true;
+}
+
+static bool
+replay_recv_byte(uint8_t *valp)
+{
+	struct pollfd pfd;
+	ssize_t actual;
+	int rv;
+
+	if (roff == rlen) {
+		pfd.fd = replay_sock;
+		pfd.events = POLLIN;
+		for (;;) {
+			rv = poll(&pfd, 1, REPLAY_TIMEOUT_MS);
+			if (rv < 0 && errno == EINTR) {
+				continue;
+			}
+			if (rv <= 0) {
+				warnx("timed out waiting for the server");
+				return false;
+			}
+			actual = read(replay_sock, rbuf, sizeof(rbuf));
+			if (actual > 0) {
+				break;
+			}
+			if (actual < 0 && errno == EINTR) {
+				continue;
+			}
+			warnx("read failed: %s",
+			    actual == 0 ? "disconnected" : strerror(errno));
+			return false;
+		}
+		rlen = (size_t)actual;
+		roff = 0;
+	}
+	*valp = rbuf[roff++];
+	return true;
+}
+
+/*
+ * replay_expect --
+ *	Receive a recorded response from the server and compare it.
+ *	Returns false if we should stop.
+ */
+static bool
+replay_expect(size_t idx, const struct replay_rec *rec)
+{
+	bool reported = false;
+	uint32_t i;
+	uint8_t c;
+
+	for (i = 0; i < rec->len; i++) {
+		if (! replay_recv_byte(&c)) {
+			warnx("record %zu: expected %u more bytes",
+			    idx, rec->len - i);
+			return false;
+		}
+		replay_received++;
+		if (c == rec->data[i]) {
+			continue;
+		}
+		replay_mismatches++;
+		if (! reported) {
+			warnx("record %zu (t=%.6f): byte %u: expected $%02X, "
+			    "got $%02X", idx, (double)rec->time / 1e9, i,
+			    rec->data[i], c);
+			reported = true;
+		}
+		if (! replay_keep_going) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * replay_run --
+ *	Play back the session once.
+ */
+static bool
+replay_run(struct addrinfo *ai0)
+{
+	const struct replay_rec *rec;
+	uint64_t start;
+	size_t i;
+	bool rv = true;
+
+	replay_sent = replay_received = replay_mismatches = 0;
+
+	if (! replay_connect(ai0)) {
+		return false;
+	}
+
+	start = replay_now();
+	for (i = 0; i < replay_nrecs && rv; i++) {
+		rec = &replay_recs[i];
+		if (rec->dir == CONN_IO_REC_RECV) {
+			if (replay_timed) {
+				replay_sleep_until(start + rec->time);
+			}
+			rv = replay_send(rec->data, rec->len);
+		} else {
+			rv = replay_expect(i, rec);
+		}
+	}
+
+	close(replay_sock);
+	replay_sock = -1;
+
+	return rv && replay_mismatches == 0;
+}
+
+static void __attribute__((__noreturn__))
+replay_usage(void)
+{
+	fprintf(stderr, "usage: %s replay [-kt] [-n count] host port "
+	    "recording\n", getprogname());
+	exit(EXIT_FAILURE);
+}
+
+int
+replay_main(int argc, char *argv[])
+{
+	struct addrinfo *ai0;
+	unsigned int count = 1, i, nfailed = 0;
+	uint64_t start, elapsed, recorded;
+	char *ep;
+	long val;
+	int ch, error;
+
+	while ((ch = getopt(argc, argv, "kn:t")) != -1) {
+		switch (ch) {
+		case 'k':
+			replay_keep_going = true;
+			break;
+
+		case 'n':
+			errno = 0;
+			val = strtol(optarg, &ep, 10);
+			if (errno != 0 || *optarg == '\0' || *ep != '\0' ||
+			    val < 1 || val > 1000000) {
+				errx(EXIT_FAILURE, "invalid count: %s",
+				    optarg);
+			}
+			count = (unsigned int)val;
+			break;
+
+		case 't':
+			replay_timed = true;
+			break;
+
+		default:
+			replay_usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 3) {
+		replay_usage();
+		/* NOTREACHED */
+	}
+
+	const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+		.ai_flags = AI_NUMERICSERV,
+	};
+	error = getaddrinfo(argv[0], argv[1], &hints, &ai0);
+	if (error != 0) {
+		errx(EXIT_FAILURE, "Host %s port %s: %s", argv[0], argv[1],
+		    gai_strerror(error));
+	}
+
+	replay_load(argv[2]);
+	recorded = replay_nrecs != 0 ? replay_recs[replay_nrecs - 1].time : 0;
+
+	printf("Replaying %s (%zu records, %.3f s recorded) against "
+	    "%s port %s %s.\n", argv[2], replay_nrecs,
+	    (double)recorded / 1e9, argv[0], argv[1],
+	    replay_timed ? "with original timing" : "as fast as possible");
+
+	for (i = 0; i < count; i++) {
+		start = replay_now();
+		if (! replay_run(ai0)) {
+			nfailed++;
+		}
+		elapsed = replay_now() - start;
+		printf("run %u: %.3f s, %" PRIu64 " bytes sent, %" PRIu64
+		    " bytes received (%.1f KB/s), %" PRIu64 " mismatched\n",
+		    i + 1, (double)elapsed / 1e9, replay_sent,
+		    replay_received,
+		    (double)replay_received / 1024.0 /
+		    ((double)elapsed / 1e9), replay_mismatches);
+		if (nfailed != 0 && ! replay_keep_going) {
+			break;
+		}
+	}
+
+	freeaddrinfo(ai0);
+	free(replay_recs);
+	free(replay_file);
+
+	return nfailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -45,11 +45,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libnabud/atom.h"
 #include "libnabud/cli.h"
 #include "libnabud/conn_io.h"
+#include "libnabud/flightrec.h"
 #include "libnabud/listing.h"
 #include "libnabud/log.h"
 #include "libnabud/missing.h"
@@ -63,14 +65,6 @@ static const char nabuctl_version[] = VERSION;
  * RANDOM USEFUL STUFF
  *****************************************************************************/
 
-#define	FREE(x)								\
-do {									\
-	if ((x) != NULL) {						\
-		free((x));						\
-		x = NULL;						\
-	}								\
-} while (/*CONSTCOND*/0)
-
 static int
 number_display_width(unsigned int number)
 {
@@ -223,12 +217,16 @@ struct channel_desc {
 	char		*default_file;
 	char		*type;
 	char		*source;
+	char		*source_health;
 	struct listing	*listing;
 	unsigned int	number;
 	bool		retronet_enabled;
 };
 static TAILQ_HEAD(, channel_desc) channel_list =
     TAILQ_HEAD_INITIALIZER(channel_list);
+
+/* The descriptors' strings point into this reply. */
+static struct atom_list channel_atoms;
 static int channel_number_width;
 static int channel_name_width;
 
@@ -246,12 +244,6 @@ channel_desc_alloc(void)
 static void
 channel_desc_free(struct channel_desc *chan)
 {
-	FREE(chan->name);
-	FREE(chan->path);
-	FREE(chan->list_url);
-	FREE(chan->default_file);
-	FREE(chan->type);
-	FREE(chan->source);
 	free(chan);
 }
 
@@ -264,6 +256,7 @@ channel_list_reset(void)
 		TAILQ_REMOVE(&channel_list, chan, link);
 		channel_desc_free(chan);
 	}
+	atom_list_free(&channel_atoms);
 	channel_number_width = 0;
 	channel_name_width = 0;
 }
@@ -341,25 +334,25 @@ channel_deserialize(struct atom_list *reply_list, struct atom *atom)
 	while ((atom = atom_list_next(reply_list, atom)) != NULL) {
 		switch (atom_tag(atom)) {
 		case NABUCTL_CHAN_NAME:
-			chan->name = atom_consume(atom);
+			chan->name = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CHAN_NAME=%s", chan->name);
 			break;
 
 		case NABUCTL_CHAN_PATH:
-			chan->path = atom_consume(atom);
+			chan->path = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CHAN_PATH=%s", chan->path);
 			break;
 
 		case NABUCTL_CHAN_LISTURL:
-			chan->list_url = atom_consume(atom);
+			chan->list_url = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CHAN_LIST_URL=%s", chan->list_url);
 			break;
 
 		case NABUCTL_CHAN_DEFAULT_FILE:
-			chan->default_file = atom_consume(atom);
+			chan->default_file = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CHAN_DEFAULT_FILE=%s",
 			    chan->default_file);
@@ -379,17 +372,24 @@ channel_deserialize(struct atom_list *reply_list, struct atom *atom)
 			break;
 
 		case NABUCTL_CHAN_TYPE:
-			chan->type = atom_consume(atom);
+			chan->type = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CHAN_TYPE=%s", chan->type);
 			break;
 
 		case NABUCTL_CHAN_SOURCE:
-			chan->source = atom_consume(atom);
+			chan->source = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CHAN_SOURCE=%s", chan->source);
 			break;
 
+		case NABUCTL_CHAN_SOURCE_HEALTH:
+			chan->source_health = atom_dataref(atom);
+			log_debug(LOG_SUBSYS_CONTROL,
+			    "Got NABUCTL_CHAN_SOURCE_HEALTH=%s",
+			    chan->source_health);
+			break;
+
 		case NABUCTL_CHAN_RETRONET_EXTENSIONS:
 			chan->retronet_enabled = atom_bool_value(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
@@ -430,11 +430,11 @@ channel_list_fetch(void)
 		cli_throw();
 	}
 
-	server_recv(&rr.reply_list);
 	channel_list_reset();
+	server_recv(&channel_atoms);
 
 	for (atom = NULL;;) {
-		atom = atom_list_next(&rr.reply_list, atom);
+		atom = atom_list_next(&channel_atoms, atom);
 		if (atom == NULL) {
 			log_error("Unexpected end of atom list.");
 			cli_throw();
@@ -447,7 +447,7 @@ channel_list_fetch(void)
 
 		case NABUCTL_OBJ_CHANNEL:
 			log_debug(LOG_SUBSYS_CONTROL, "Deserializing channel.");
-			atom = channel_deserialize(&rr.reply_list, atom);
+			atom = channel_deserialize(&channel_atoms, atom);
 			if (atom == NULL) {
 				/* Error already reported. */
 				cli_throw();
@@ -564,8 +564,14 @@ channel_fetch_listing(uint32_t channel)
 	if (atom_tag(atom) == NABUCTL_ERROR) {
 		printf("*** Error fetching listing! ***\n");
 	} else if (atom_tag(atom) == NABUCTL_TYPE_BLOB) {
-		chan->listing = listing_create(atom_consume(atom),
-		    atom_length(atom));
+		/* The listing is parsed in place and kept; it needs a copy. */
+		char *data = malloc(atom_length(atom));
+		if (data == NULL) {
+			printf("*** Unable to allocate listing! ***\n");
+			goto out;
+		}
+		memcpy(data, atom_dataref(atom), atom_length(atom));
+		chan->listing = listing_create(data, atom_length(atom));
 	}
  out:
 	rr_done(&rr);
@@ -623,6 +629,9 @@ struct connection_desc {
 };
 static TAILQ_HEAD(, connection_desc) connection_list =
     TAILQ_HEAD_INITIALIZER(connection_list);
+
+/* The descriptors' strings point into this reply. */
+static struct atom_list connection_atoms;
 static int connection_count;
 static int connection_number_width;
 static int connection_type_width;
@@ -641,11 +650,6 @@ connection_desc_alloc(void)
 static void
 connection_desc_free(struct connection_desc *conn)
 {
-	FREE(conn->name);
-	FREE(conn->type);
-	FREE(conn->state);
-	FREE(conn->selected_file);
-	FREE(conn->file_root);
 	free(conn);
 }
 
@@ -658,6 +662,7 @@ connection_list_reset(void)
 		TAILQ_REMOVE(&connection_list, conn, link);
 		connection_desc_free(conn);
 	}
+	atom_list_free(&connection_atoms);
 	connection_count = 0;
 	connection_number_width = 0;
 	connection_type_width = 0;
@@ -713,19 +718,19 @@ connection_deserialize(struct atom_list *reply_list, struct atom *atom)
 	while ((atom = atom_list_next(reply_list, atom)) != NULL) {
 		switch (atom_tag(atom)) {
 		case NABUCTL_CONN_NAME:
-			conn->name = atom_consume(atom);
+			conn->name = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CONN_NAME=%s", conn->name);
 			break;
 
 		case NABUCTL_CONN_TYPE:
-			conn->type = atom_consume(atom);
+			conn->type = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CONN_TYPE=%s", conn->type);
 			break;
 
 		case NABUCTL_CONN_STATE:
-			conn->state = atom_consume(atom);
+			conn->state = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CONN_STATE=%s", conn->state);
 			break;
@@ -744,7 +749,7 @@ connection_deserialize(struct atom_list *reply_list, struct atom *atom)
 			break;
 
 		case NABUCTL_CONN_SELECTED_FILE:
-			conn->selected_file = atom_consume(atom);
+			conn->selected_file = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CONN_SELECTED_FILE=%s",
 			    conn->selected_file);
@@ -758,7 +763,7 @@ connection_deserialize(struct atom_list *reply_list, struct atom *atom)
 			break;
 
 		case NABUCTL_CONN_FILE_ROOT:
-			conn->file_root = atom_consume(atom);
+			conn->file_root = atom_dataref(atom);
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Got NABUCTL_CONN_FILE_ROOT=%s",
 			    conn->file_root);
@@ -822,11 +827,11 @@ connection_list_fetch(void)
 		cli_throw();
 	}
 
-	server_recv(&rr.reply_list);
 	connection_list_reset();
+	server_recv(&connection_atoms);
 
 	for (atom = NULL;;) {
-		atom = atom_list_next(&rr.reply_list, atom);
+		atom = atom_list_next(&connection_atoms, atom);
 		if (atom == NULL) {
 			log_error("Unexpected end of atom list.");
 			cli_throw();
@@ -840,7 +845,7 @@ connection_list_fetch(void)
 		case NABUCTL_OBJ_CONNECTION:
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "Deserializing connection.");
-			atom = connection_deserialize(&rr.reply_list, atom);
+			atom = connection_deserialize(&connection_atoms, atom);
 			if (atom == NULL) {
 				/* Error already reported. */
 				cli_throw();
@@ -999,6 +1004,190 @@ connection_select_file(uint32_t connection, uint32_t fileno)
 	rr_done(&rr);
 }
 
+static void
+connection_trace(uint32_t connection)
+{
+	struct req_repl rr;
+	struct atom *atom;
+
+	struct connection_desc *conn = connection_lookup(connection);
+	assert(conn != NULL);
+
+	rr_init(&rr);
+
+	if (atom_list_append_string(&rr.req_list,
+				    NABUCTL_REQ_CONN_TRACE,
+				    conn->name) &&
+	    atom_list_append_done(&rr.req_list)) {
+		server_send(&rr.req_list);
+	} else {
+		rr_req_build_failed(&rr);
+		goto out;
+	}
+
+	server_recv(&rr.reply_list);
+	atom = atom_list_next(&rr.reply_list, NULL);
+	if (atom_tag(atom) == NABUCTL_ERROR) {
+		printf("*** Failed to fetch trace! ***\n");
+	} else if (atom_tag(atom) == NABUCTL_TYPE_BLOB) {
+		printf("%s: %zu trace entries.\n", conn->name,
+		    atom_length(atom) / FLIGHTREC_WIRE_SIZE);
+		flightrec_print(stdout, atom_dataref(atom), atom_length(atom));
+	} else {
+		printf("%s: No trace entries.\n", conn->name);
+	}
+ out:
+	rr_done(&rr);
+}
+
+/*****************************************************************************
+ * EVENT STUFF
+ *****************************************************************************/
+
+static const char *
+event_type_name(uint64_t type)
+{
+	switch (type) {
+	case NABUCTL_EV_CONN_UP:		return "conn-up";
+	case NABUCTL_EV_CONN_DOWN:		return "conn-down";
+	case NABUCTL_EV_CHANNEL_CHANGE:		return "channel-change";
+	case NABUCTL_EV_IMAGE_LOAD_START:	return "image-load-start";
+	case NABUCTL_EV_IMAGE_LOAD_DONE:	return "image-load-done";
+	case NABUCTL_EV_IMAGE_LOAD_FAILED:	return "image-load-failed";
+	case NABUCTL_EV_CACHE_EVICT:		return "cache-evict";
+	case NABUCTL_EV_COUNTERS:		return "counters";
+	case NABUCTL_EV_SOURCE_STATE:		return "source-state";
+	default:				return "???";
+	}
+}
+
+static void
+event_display(struct atom_list *reply_list, struct atom *first)
+{
+	char timestr[sizeof("HH:MM:SS")];
+	uint64_t evtime = 0, evtype = 0;
+	struct atom *atom;
+	struct tm tm;
+	time_t secs;
+
+	/* Time and type go first, regardless of the order received. */
+	for (atom = first; atom != NULL;
+	     atom = atom_list_next(reply_list, atom)) {
+		if (atom_tag(atom) == NABUCTL_EVENT_TIME) {
+			evtime = atom_number_value(atom);
+		} else if (atom_tag(atom) == NABUCTL_EVENT_TYPE) {
+			evtype = atom_number_value(atom);
+		}
+	}
+	secs = (time_t)(evtime / 1000);
+	localtime_r(&secs, &tm);
+	strftime(timestr, sizeof(timestr), "%H:%M:%S", &tm);
+	printf("%s.%03u %-18s", timestr, (unsigned int)(evtime % 1000),
+	    event_type_name(evtype));
+
+	for (atom = first; atom != NULL;
+	     atom = atom_list_next(reply_list, atom)) {
+		switch (atom_tag(atom)) {
+		case NABUCTL_EVENT_CONN:
+			printf(" [%s]", (char *)atom_dataref(atom));
+			break;
+
+		case NABUCTL_EVENT_CHANNEL:
+			printf(" channel=%llu",
+			    (unsigned long long)atom_number_value(atom));
+			break;
+
+		case NABUCTL_EVENT_IMAGE:
+			printf(" image=%06llX",
+			    (unsigned long long)atom_number_value(atom));
+			break;
+
+		case NABUCTL_EVENT_DETAIL:
+			printf(" %s", (char *)atom_dataref(atom));
+			break;
+
+		case NABUCTL_EVENT_INTERVAL:
+			printf(" interval=%llums",
+			    (unsigned long long)atom_number_value(atom));
+			break;
+
+		case NABUCTL_EVENT_SEGMENTS_SENT:
+			printf(" segments=%llu",
+			    (unsigned long long)atom_number_value(atom));
+			break;
+
+		case NABUCTL_EVENT_IMAGE_LOADS:
+			printf(" loads=%llu",
+			    (unsigned long long)atom_number_value(atom));
+			break;
+
+		case NABUCTL_EVENT_IMAGE_LOAD_FAILURES:
+			printf(" load-failures=%llu",
+			    (unsigned long long)atom_number_value(atom));
+			break;
+
+		case NABUCTL_EVENT_CACHE_EVICTIONS:
+			printf(" evictions=%llu",
+			    (unsigned long long)atom_number_value(atom));
+			break;
+
+		case NABUCTL_EVENT_DROPPED:
+			if (atom_number_value(atom) != 0) {
+				printf(" dropped=%llu", (unsigned long long)
+				    atom_number_value(atom));
+			}
+			break;
+
+		default:
+			/* Ignore fields we don't understand. */
+			break;
+		}
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static void
+event_subscribe(void)
+{
+	struct req_repl rr;
+	struct atom *atom;
+
+	rr_init(&rr);
+
+	if (atom_list_append_void(&rr.req_list, NABUCTL_REQ_SUBSCRIBE) &&
+	    atom_list_append_done(&rr.req_list)) {
+		server_send(&rr.req_list);
+	} else {
+		rr_req_build_failed(&rr);
+		goto out;
+	}
+
+	server_recv(&rr.reply_list);
+	atom = atom_list_next(&rr.reply_list, NULL);
+	if (atom_tag(atom) == NABUCTL_ERROR) {
+		printf("*** Failed to subscribe to events! ***\n");
+		goto out;
+	}
+
+	printf("Subscribed to events; press ^C to exit.\n");
+
+	/*
+	 * The server now sends us events until we go away.  If
+	 * the server goes away, server_recv() will bail us out.
+	 */
+	for (;;) {
+		atom_list_reset(&rr.reply_list);
+		server_recv(&rr.reply_list);
+		atom = atom_list_next(&rr.reply_list, NULL);
+		if (atom_tag(atom) == NABUCTL_OBJ_EVENT) {
+			event_display(&rr.reply_list, atom);
+		}
+	}
+ out:
+	rr_done(&rr);
+}
+
 /*****************************************************************************
  * COMMAND STUFF
  *****************************************************************************/
@@ -1012,6 +1201,14 @@ command_exit(int argc, char *argv[])
 static bool
 channel_print_cb(struct channel_desc *chan, void *ctx)
 {
+	if (chan->source_health != NULL &&
+	    strncmp(chan->source_health, "closed", 6) != 0) {
+		/* Call attention to unhealthy sources. */
+		printf("%-*u - %-*s (%s: %s)\n", channel_number_width,
+		    chan->number, channel_name_width, chan->name,
+		    chan->source, chan->source_health);
+		return true;
+	}
 	printf("%-*u - %-*s (%s)\n", channel_number_width, chan->number,
 	    channel_name_width, chan->name,
 	    chan->source);
@@ -1095,6 +1292,9 @@ show_one_channel(struct channel_desc *chan)
 	printf("Channel %u:\n", chan->number);
 	printf("        Name: %s\n", chan->name);
 	printf("      Source: %s\n", chan->source);
+	if (chan->source_health != NULL) {
+		printf("Source state: %s\n", chan->source_health);
+	}
 	printf("        Path: %s\n", chan->path);
 	printf("        Type: %s\n", chan->type);
 	if (chan->default_file != NULL) {
@@ -1246,6 +1446,7 @@ command_connection_usage(int argc, char *argv[])
 	printf("\tconnection <number> channel <number>\n");
 	printf("\tconnection <number> listing\n");
 	printf("\tconnection <number> file <number>\n");
+	printf("\tconnection <number> trace\n");
 	return false;
 }
 
@@ -1345,11 +1546,25 @@ command_connection_listing(int argc, char *argv[])
 	return false;
 }
 
+static bool
+command_connection_trace(int argc, char *argv[])
+{
+	uint32_t conn;
+
+	if (! connection_parse(argv[1], &conn)) {
+		/* Error already reported. */
+		return false;
+	}
+	connection_trace(conn);
+	return false;
+}
+
 static const struct cmdtab connection_cmdtab[] = {
 	{ .name = "cancel",		.func = command_connection_cancel },
 	{ .name = "channel",		.func = command_connection_channel },
 	{ .name = "listing",		.func = command_connection_listing },
 	{ .name = "file",		.func = command_connection_file },
+	{ .name = "trace",		.func = command_connection_trace },
 
 	CMDTAB_EOL(command_connection_usage)
 };
@@ -1419,6 +1634,13 @@ command_channel(int argc, char *argv[])
 	return cli_subcommand(channel_cmdtab, argc, argv, 2);
 }
 
+static bool
+command_subscribe(int argc, char *argv[])
+{
+	event_subscribe();
+	return false;
+}
+
 static bool	command_help(int, char *[]);
 
 static const struct cmdtab cmdtab[] = {
@@ -1433,6 +1655,7 @@ static const struct cmdtab cmdtab[] = {
 
 	{ .name = "list",		.func = command_list },
 	{ .name = "show",		.func = command_show },
+	{ .name = "subscribe",		.func = command_subscribe },
 
 	CMDTAB_EOL(cli_command_unknown)
 };
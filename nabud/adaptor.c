@@ -80,8 +80,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "libnabud/nhacp_proto.h"
 
 #include "adaptor.h"
+#include "admit.h"
 #include "conn.h"
+#include "event.h"
 #include "image.h"
+#include "metrics.h"
 #include "nhacp.h"
 #include "retronet.h"
 
@@ -93,7 +96,7 @@ static const uint8_t nabu_msg_finished[] = NABU_MSGSEQ_FINISHED;
  *	Copy the provided buffer into the connection's pktbuf,
  *	escaping any byte that's the Escape value.
  */
-static void
+void
 adaptor_escape_packet(struct nabu_connection *conn, const uint8_t *buf,
     size_t len)
 {
@@ -120,7 +123,9 @@ adaptor_expect_byte(struct nabu_connection *conn, uint8_t val)
 	uint8_t c;
 
 	if (! conn_recv_byte(conn, &c)) {
-		log_error("[%s] Receive error.", conn_name(conn));
+		conn_trace(conn, RECV_ERROR, val, 0, 0, 0);
+		log_error_ratelimited(LOG_SUBSYS_ADAPTOR,
+		    "[%s] Receive error.", conn_name(conn));
 		return false;
 	}
 
@@ -185,6 +190,7 @@ adaptor_send_confirmed(struct nabu_connection *conn)
 static void
 adaptor_send_unauthorized(struct nabu_connection *conn)
 {
+	conn_trace(conn, UNAUTHORIZED, 0, 0, 0, 0);
 	log_debug(LOG_SUBSYS_ADAPTOR,
 	    "[%s] Sending UNAUTHORIZED.", conn_name(conn));
 	conn_send_byte(conn, NABU_SERVICE_UNAUTHORIZED);
@@ -194,7 +200,9 @@ adaptor_send_unauthorized(struct nabu_connection *conn)
 		log_debug(LOG_SUBSYS_ADAPTOR,
 		    "[%s] Received ACK.", conn_name(conn));
 	} else {
-		log_error("[%s] NABU failed to ACK.", conn_name(conn));
+		conn_trace(conn, ACK_FAILED, 0, 0, 0, 0);
+		log_error_ratelimited(LOG_SUBSYS_ADAPTOR,
+		    "[%s] NABU failed to ACK.", conn_name(conn));
 	}
 }
 
@@ -220,8 +228,12 @@ adaptor_send_packet(struct nabu_connection *conn, uint8_t *buf, size_t len)
 		conn_send(conn, conn->pktbuf, conn->pktlen);
 		conn_send(conn, nabu_msg_finished,
 		    sizeof(nabu_msg_finished));
+		metrics_count(METRIC_PACKETS_SENT);
+		metrics_add(METRIC_BYTES_SENT, conn->pktlen);
 	} else {
-		log_error("[%s] NABU failed to ACK.", conn_name(conn));
+		conn_trace(conn, ACK_FAILED, 0, 0, 0, (uint16_t)len);
+		log_error_ratelimited(LOG_SUBSYS_ADAPTOR,
+		    "[%s] NABU failed to ACK.", conn_name(conn));
 	}
 	free(buf);
 }
@@ -447,6 +459,7 @@ adaptor_msg_channel_status(struct nabu_connection *conn)
 	struct image_channel *chan = conn_get_channel(conn);
 
 	if (chan != NULL) {
+		image_channel_release(chan);
 		log_debug(LOG_SUBSYS_ADAPTOR,
 		    "[%s] Sending NABU_SIGNAL_STATUS_YES.",
 		    conn_name(conn));
@@ -550,8 +563,10 @@ adaptor_msg_packet_request(struct nabu_connection *conn)
 		return;
 	}
 
+	uint64_t start = metrics_timestamp();
 	uint16_t segment = msg[0];
 	uint32_t image = nabu_get_uint24(&msg[1]);
+	conn_trace(conn, SEGMENT_REQ, 0, image, segment, 0);
 	log_debug(LOG_SUBSYS_ADAPTOR,
 	    "[%s] NABU requested segment %u of image %06X.",
 	    conn_name(conn), segment, image);
@@ -565,6 +580,7 @@ adaptor_msg_packet_request(struct nabu_connection *conn)
 			log_debug(LOG_SUBSYS_ADAPTOR,
 			    "[%s] Sending time packet.", conn_name(conn));
 			adaptor_send_time(conn);
+			conn_trace(conn, TIME_SENT, 0, image, segment, 0);
 			return;
 		}
 		log_error(
@@ -576,6 +592,7 @@ adaptor_msg_packet_request(struct nabu_connection *conn)
 
 	struct nabu_image *img = image_load(conn, image);
 	if (img == NULL) {
+		conn_trace(conn, IMAGE_LOAD_FAILED, 0, image, segment, 0);
 		log_error("[%s] Unable to load image %06X.",
 		    conn_name(conn), image);
 		adaptor_send_unauthorized(conn);
@@ -585,8 +602,13 @@ adaptor_msg_packet_request(struct nabu_connection *conn)
 	log_debug(LOG_SUBSYS_ADAPTOR,
 	    "[%s] Sending segment %u of image %06X.",
 	    conn_name(conn), segment, image);
-	image_unload(conn, img,
-	    adaptor_send_image(conn, image, segment, img));
+	conn->pktlen = 0;
+	bool last = adaptor_send_image(conn, image, segment, img);
+	conn_trace(conn, SEGMENT_SENT, last, image, segment,
+	    (uint16_t)conn->pktlen);
+	event_count(EVENT_CTR_SEGMENTS_SENT);
+	metrics_observe(METRIC_HIST_SEGMENT_LATENCY, start);
+	image_unload(conn, img, last);
 }
 
 /*
@@ -615,6 +637,7 @@ adaptor_msg_change_channel(struct nabu_connection *conn)
 	int16_t channel = (int16_t)nabu_get_uint16(msg);
 	log_info("[%s] NABU selected channel 0x%04x.", conn_name(conn),
 	    channel);
+	conn_trace(conn, CHANNEL, 0, (uint16_t)channel, 0, 0);
 
 	image_channel_select(conn, channel);
 
@@ -659,7 +682,8 @@ adaptor_msg_classic(struct nabu_connection *conn, uint8_t msg)
 	uint8_t idx = HANDLER_INDEX(msg);
 	if (idx > adaptor_msg_type_count ||
 	    adaptor_msg_types[idx].handler == NULL) {
-		log_error("[%s] Unknown classic message type 0x%02x.",
+		log_error_ratelimited(LOG_SUBSYS_ADAPTOR,
+		    "[%s] Unknown classic message type 0x%02x.",
 		    conn_name(conn), msg);
 		return false;
 	}
@@ -680,6 +704,7 @@ adaptor_event_loop(struct nabu_connection *conn)
 	uint8_t msg;
 
 	log_info("[%s] Connection starting.", conn_name(conn));
+	conn_trace(conn, CONN_START, 0, 0, 0, 0);
 
 	for (;;) {
 		/* We want to block "forever" waiting for requests. */
@@ -690,6 +715,8 @@ adaptor_event_loop(struct nabu_connection *conn)
 		if (! conn_recv_byte(conn, &msg)) {
 			if (! conn_check_state(conn)) {
 				/* Error already logged. */
+				conn_trace(conn, CONN_END, conn_state(conn),
+				    0, 0, 0);
 				break;
 			}
 			log_debug(LOG_SUBSYS_ADAPTOR,
@@ -703,6 +730,15 @@ adaptor_event_loop(struct nabu_connection *conn)
 		 * I/O to take longer than 10 seconds.
 		 */
 		conn_start_watchdog(conn, 10);
+		conn_trace(conn, MSG, msg, 0, 0, 0);
+
+		/* Shed the peer if it's running away. */
+		if (! admit_request(conn)) {
+			/* Error already logged. */
+			conn_set_state(conn, CONN_STATE_ABORTED);
+			conn_trace(conn, CONN_END, conn_state(conn), 0, 0, 0);
+			break;
+		}
 
 		/* First check for a classic message. */
 		if (adaptor_msg_classic(conn, msg)) {
@@ -713,6 +749,7 @@ adaptor_event_loop(struct nabu_connection *conn)
 		/* Check for a RetroNet request. */
 		if (retronet_request(conn, msg)) {
 			/* Yup! */
+			conn_trace(conn, RETRONET_REQ, msg, 0, 0, 0);
 			continue;
 		}
 
@@ -722,7 +759,9 @@ adaptor_event_loop(struct nabu_connection *conn)
 			continue;
 		}
 
-		log_error("[%s] Got unexpected message 0x%02x.",
+		conn_trace(conn, MSG_UNEXPECTED, msg, 0, 0, 0);
+		log_error_ratelimited(LOG_SUBSYS_ADAPTOR,
+		    "[%s] Got unexpected message 0x%02x.",
 		    conn_name(conn), msg);
 	}
 }
@@ -27,8 +27,13 @@
 #ifndef adaptor_h_included
 #define	adaptor_h_included
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct nabu_connection;
 
 void	adaptor_event_loop(struct nabu_connection *conn);
+void	adaptor_escape_packet(struct nabu_connection *, const uint8_t *,
+	    size_t);
 
 #endif /* adaptor_h_included */
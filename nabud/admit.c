@@ -0,0 +1,401 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Admission control for TCP connections.  A single misbehaving
+ * emulator (or a port scanner) on a TCP listener can otherwise open
+ * as many connections as it likes and keep every one of them busy,
+ * tying up threads and the image cache lock at the expense of every
+ * other NABU.
+ *
+ * Each TCP listener can have an admission policy that limits:
+ *
+ *	- The number of concurrent connections accepted from the
+ *	  listener.
+ *
+ *	- The rate at which a single peer (source address) may open
+ *	  new connections.
+ *
+ *	- The rate at which a single peer may issue requests, summed
+ *	  over all of its connections to the listener.
+ *
+ * Peer records belong to the policy, so listeners with different
+ * limits keep separate accounts for the same address.
+ *
+ * Connections that would exceed a limit are closed as soon as they
+ * are accepted.  Requests that exceed the rate are delayed until the
+ * peer's bucket refills, but if that would take too long, the peer
+ * is assumed to be running away and the connection is dropped.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libnabud/log.h"
+#include "libnabud/missing.h"
+#include "libnabud/nbsd_queue.h"
+
+#include "admit.h"
+#include "conn.h"
+#include "metrics.h"
+
+#define	NS_PER_SEC		UINT64_C(1000000000)
+
+/* Longest we'll delay a request before giving up on the peer. */
+#define	ADMIT_MAX_DELAY		(NS_PER_SEC / 2)
+
+/* Peers with no connections are forgotten after this long. */
+#define	ADMIT_PEER_IDLE		(300 * NS_PER_SEC)
+
+#define	ADMIT_NBUCKETS		64
+
+struct admit_peer;
+
+struct admit_policy {
+	unsigned int	max_conns;	/* concurrent connections */
+	unsigned int	conn_rate;	/* new connections / minute / peer */
+	unsigned int	req_rate;	/* requests / second / peer */
+	unsigned int	active;		/* atomic */
+	unsigned int	refcnt;		/* atomic */
+
+	pthread_mutex_t	peers_lock;
+	LIST_HEAD(, admit_peer) peers[ADMIT_NBUCKETS];
+};
+
+/*
+ * Token bucket.  Credit accumulates in nanoseconds (like the log
+ * rate limiter); each event costs 1/rate worth.  Credit may go
+ * negative when a request is admitted with a delay.
+ */
+struct admit_bucket {
+	uint64_t	last;
+	int64_t		credit;
+	bool		primed;
+};
+
+struct admit_peer {
+	LIST_ENTRY(admit_peer) link;
+	char		*host;
+	unsigned int	refcnt;
+	uint64_t	last_used;
+	struct admit_bucket conn_bucket;
+	struct admit_bucket req_bucket;
+};
+
+/*
+ * admit_now --
+ *	Get the current time, in nanoseconds.
+ */
+static uint64_t
+admit_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * admit_hash --
+ *	Hash a peer address string.
+ */
+static unsigned int
+admit_hash(const char *host)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+
+	for (; *host != '\0'; host++) {
+		h = (h ^ (uint8_t)*host) * 16777619U;
+	}
+	return h % ADMIT_NBUCKETS;
+}
+
+/*
+ * admit_bucket_take --
+ *	Take a token from a bucket whose tokens cost "cost" ns each
+ *	and which holds "burst" of them.  Returns 0 if a token was
+ *	available, or the number of ns the caller would need to wait
+ *	for one.  If that is no more than "max_wait", the token is
+ *	taken anyway (putting the bucket in debt).
+ */
+static uint64_t
+admit_bucket_take(struct admit_bucket *b, uint64_t now, uint64_t cost,
+    unsigned int burst, uint64_t max_wait)
+{
+	int64_t cap = (int64_t)(cost * burst);
+	uint64_t wait;
+
+	if (! b->primed) {
+		b->credit = cap;
+		b->primed = true;
+	} else {
+		b->credit += (int64_t)(now - b->last);
+		if (b->credit > cap) {
+			b->credit = cap;
+		}
+	}
+	b->last = now;
+
+	if (b->credit >= (int64_t)cost) {
+		b->credit -= (int64_t)cost;
+		return 0;
+	}
+	wait = (uint64_t)((int64_t)cost - b->credit);
+	if (wait <= max_wait) {
+		b->credit -= (int64_t)cost;
+	}
+	return wait;
+}
+
+/*
+ * admit_peer_lookup --
+ *	Find (or create) a policy's record for a peer.  Also
+ *	garbage-collects stale records from the same hash bucket.
+ *	Must be called with the policy's peers lock held.
+ */
+static struct admit_peer *
+admit_peer_lookup(struct admit_policy *policy, const char *host, uint64_t now)
+{
+	struct admit_peer *peer, *npeer, *found = NULL;
+	unsigned int bucket = admit_hash(host);
+
+	LIST_FOREACH_SAFE(peer, &policy->peers[bucket], link, npeer) {
+		if (strcmp(peer->host, host) == 0) {
+			found = peer;
+		} else if (peer->refcnt == 0 &&
+			   now - peer->last_used > ADMIT_PEER_IDLE) {
+			LIST_REMOVE(peer, link);
+			free(peer->host);
+			free(peer);
+		}
+	}
+	if (found != NULL) {
+		return found;
+	}
+
+	peer = calloc(1, sizeof(*peer));
+	if (peer == NULL || (peer->host = strdup(host)) == NULL) {
+		free(peer);
+		return NULL;
+	}
+	LIST_INSERT_HEAD(&policy->peers[bucket], peer, link);
+	return peer;
+}
+
+/*
+ * admit_policy_create --
+ *	Create an admission policy for a listener.  Returns NULL if
+ *	no limits are specified.
+ */
+struct admit_policy *
+admit_policy_create(unsigned int max_conns, unsigned int conn_rate,
+    unsigned int req_rate)
+{
+	struct admit_policy *policy;
+	unsigned int i;
+
+	if (max_conns == 0 && conn_rate == 0 && req_rate == 0) {
+		return NULL;
+	}
+
+	policy = calloc(1, sizeof(*policy));
+	if (policy == NULL) {
+		log_error("Unable to allocate admission policy.");
+		return NULL;
+	}
+	policy->max_conns = max_conns;
+	policy->conn_rate = conn_rate;
+	policy->req_rate = req_rate;
+	policy->refcnt = 1;
+
+	pthread_mutex_init(&policy->peers_lock, NULL);
+	for (i = 0; i < ADMIT_NBUCKETS; i++) {
+		LIST_INIT(&policy->peers[i]);
+	}
+
+	return policy;
+}
+
+/*
+ * admit_policy_release --
+ *	Release a reference to an admission policy.
+ */
+void
+admit_policy_release(struct admit_policy *policy)
+{
+	struct admit_peer *peer;
+	unsigned int i;
+
+	if (policy == NULL ||
+	    __atomic_sub_fetch(&policy->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	/* No connections remain, so no peer records are in use. */
+	for (i = 0; i < ADMIT_NBUCKETS; i++) {
+		while ((peer = LIST_FIRST(&policy->peers[i])) != NULL) {
+			LIST_REMOVE(peer, link);
+			free(peer->host);
+			free(peer);
+		}
+	}
+	pthread_mutex_destroy(&policy->peers_lock);
+	free(policy);
+}
+
+/*
+ * admit_connection --
+ *	Check if a new connection from the specified peer should be
+ *	admitted.  On success, the connection holds a reference to
+ *	the policy and to the peer record (returned in *peerp) until
+ *	admit_connection_done() is called.
+ */
+bool
+admit_connection(struct admit_policy *policy, const char *host,
+    struct admit_peer **peerp)
+{
+	struct admit_peer *peer;
+	unsigned int active;
+	uint64_t now;
+
+	*peerp = NULL;
+	if (policy == NULL) {
+		return true;
+	}
+
+	active = __atomic_add_fetch(&policy->active, 1, __ATOMIC_RELAXED);
+	if (policy->max_conns != 0 && active > policy->max_conns) {
+		__atomic_sub_fetch(&policy->active, 1, __ATOMIC_RELAXED);
+		metrics_count(METRIC_ADMIT_REJECTED_MAX_CONNS);
+		log_error_ratelimited(LOG_SUBSYS_ANY,
+		    "Rejecting connection from %s: "
+		    "listener is at its limit of %u connections.",
+		    host, policy->max_conns);
+		return false;
+	}
+
+	now = admit_now();
+	pthread_mutex_lock(&policy->peers_lock);
+	peer = admit_peer_lookup(policy, host, now);
+	if (peer == NULL) {
+		/* Fail open; this isn't the peer's fault. */
+		pthread_mutex_unlock(&policy->peers_lock);
+		log_error("Unable to allocate peer record for %s.", host);
+		__atomic_add_fetch(&policy->refcnt, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+	peer->last_used = now;
+	if (policy->conn_rate != 0 &&
+	    admit_bucket_take(&peer->conn_bucket, now,
+			      (60 * NS_PER_SEC) / policy->conn_rate,
+			      policy->conn_rate, 0) != 0) {
+		pthread_mutex_unlock(&policy->peers_lock);
+		__atomic_sub_fetch(&policy->active, 1, __ATOMIC_RELAXED);
+		metrics_count(METRIC_ADMIT_REJECTED_CONN_RATE);
+		log_error_ratelimited(LOG_SUBSYS_ANY,
+		    "Rejecting connection from %s: "
+		    "more than %u connections per minute.",
+		    host, policy->conn_rate);
+		return false;
+	}
+	peer->refcnt++;
+	pthread_mutex_unlock(&policy->peers_lock);
+
+	__atomic_add_fetch(&policy->refcnt, 1, __ATOMIC_RELAXED);
+	*peerp = peer;
+	return true;
+}
+
+/*
+ * admit_connection_done --
+ *	Release the resources held by an admitted connection.
+ */
+void
+admit_connection_done(struct admit_policy *policy, struct admit_peer *peer)
+{
+	if (peer != NULL) {
+		pthread_mutex_lock(&policy->peers_lock);
+		peer->refcnt--;
+		peer->last_used = admit_now();
+		pthread_mutex_unlock(&policy->peers_lock);
+	}
+	if (policy != NULL) {
+		__atomic_sub_fetch(&policy->active, 1, __ATOMIC_RELAXED);
+		admit_policy_release(policy);
+	}
+}
+
+/*
+ * admit_request --
+ *	Account for a request on the specified connection, delaying
+ *	it if the peer is over its request rate.  Returns false if
+ *	the peer is so far over its rate that the connection should
+ *	be dropped.
+ */
+bool
+admit_request(struct nabu_connection *conn)
+{
+	struct admit_policy *policy = conn->admit_policy;
+	struct admit_peer *peer = conn->admit_peer;
+	struct timespec ts;
+	uint64_t now, wait;
+
+	if (policy == NULL || peer == NULL || policy->req_rate == 0) {
+		return true;
+	}
+
+	now = admit_now();
+	pthread_mutex_lock(&policy->peers_lock);
+	peer->last_used = now;
+	wait = admit_bucket_take(&peer->req_bucket, now,
+	    NS_PER_SEC / policy->req_rate, policy->req_rate,
+	    ADMIT_MAX_DELAY);
+	pthread_mutex_unlock(&policy->peers_lock);
+
+	if (wait == 0) {
+		return true;
+	}
+	if (wait > ADMIT_MAX_DELAY) {
+		metrics_count(METRIC_ADMIT_REJECTED_REQ_RATE);
+		log_error_ratelimited(LOG_SUBSYS_ADAPTOR,
+		    "[%s] Dropping connection: more than %u requests "
+		    "per second.", conn_name(conn), policy->req_rate);
+		return false;
+	}
+
+	metrics_count(METRIC_ADMIT_THROTTLED_REQUESTS);
+	ts.tv_sec = (time_t)(wait / NS_PER_SEC);
+	ts.tv_nsec = (long)(wait % NS_PER_SEC);
+	nanosleep(&ts, NULL);
+
+	return true;
+}
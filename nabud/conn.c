@@ -45,6 +45,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <netinet/in.h>
@@ -53,15 +54,20 @@
 
 #include "libnabud/log.h"
 #include "libnabud/missing.h"
+#include "libnabud/nabuctl_proto.h"
 
 #include "adaptor.h"
+#include "admit.h"
 #include "conn.h"
+#include "event.h"
 #ifdef HAVE_LINUX_TERMIOS2
 #include "conn_linux.h"
 #endif
 #include "image.h"
+#include "metrics.h"
 #include "retronet.h"
 #include "nhacp.h"
+#include "upgrade.h"
 
 static pthread_mutex_t conn_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t conn_list_enum_cv = PTHREAD_COND_INITIALIZER;
@@ -69,6 +75,24 @@ static TAILQ_HEAD(, nabu_connection) conn_list =
     TAILQ_HEAD_INITIALIZER(conn_list);
 unsigned int conn_count;
 
+static const struct {
+	metric_counter	opened;
+	metric_counter	closed;
+} conn_type_metrics[] = {
+	[CONN_TYPE_LISTENER] = {
+		.opened = METRIC_CONN_OPENED_LISTENER,
+		.closed = METRIC_CONN_CLOSED_LISTENER,
+	},
+	[CONN_TYPE_SERIAL] = {
+		.opened = METRIC_CONN_OPENED_SERIAL,
+		.closed = METRIC_CONN_CLOSED_SERIAL,
+	},
+	[CONN_TYPE_TCP] = {
+		.opened = METRIC_CONN_OPENED_TCP,
+		.closed = METRIC_CONN_CLOSED_TCP,
+	},
+};
+
 static void
 conn_insert(struct nabu_connection *conn)
 {
@@ -79,6 +103,15 @@ conn_insert(struct nabu_connection *conn)
 	conn->on_list = true;
 	conn_count++;
 	pthread_mutex_unlock(&conn_list_mutex);
+
+	assert(conn->type > CONN_TYPE_INVALID &&
+	    conn->type <= CONN_TYPE_TCP);
+	metrics_count(conn_type_metrics[conn->type].opened);
+
+	event_post(NABUCTL_EV_CONN_UP, conn_name(conn), 0, EVENT_NO_IMAGE,
+	    conn->type == CONN_TYPE_LISTENER ? "Listener" :
+	    conn->type == CONN_TYPE_SERIAL   ? "Serial" :
+	    conn->type == CONN_TYPE_TCP      ? "TCP" : NULL);
 }
 
 static void
@@ -93,7 +126,14 @@ conn_remove(struct nabu_connection *conn)
 		TAILQ_REMOVE(&conn_list, conn, link);
 		conn->on_list = false;
 		conn_count--;
+		/* conn_reload_end() may be waiting for us to go away. */
+		pthread_cond_broadcast(&conn_list_enum_cv);
 		pthread_mutex_unlock(&conn_list_mutex);
+
+		metrics_count(conn_type_metrics[conn->type].closed);
+
+		event_post(NABUCTL_EV_CONN_DOWN, conn_name(conn), 0,
+		    EVENT_NO_IMAGE, NULL);
 	}
 }
 
@@ -128,6 +168,143 @@ conn_enumerate(bool (*func)(struct nabu_connection *, void *), void *ctx)
 	return rv;
 }
 
+/*
+ * conn_reload_begin --
+ *	Start reloading the configuration.  Every connection that
+ *	was created from the configuration is marked stale; the ones
+ *	that are still present (unchanged) in the new configuration
+ *	are kept by conn_reload_keep(), and the rest are shut down
+ *	by conn_reload_end().
+ */
+void
+conn_reload_begin(void)
+{
+	struct nabu_connection *conn;
+
+	pthread_mutex_lock(&conn_list_mutex);
+	TAILQ_FOREACH(conn, &conn_list, link) {
+		conn->stale = conn->config_key != NULL;
+	}
+	pthread_mutex_unlock(&conn_list_mutex);
+}
+
+/*
+ * conn_reload_keep --
+ *	Keep the connection(s) that match the specified configuration
+ *	key.  Returns true if there were any.
+ */
+bool
+conn_reload_keep(const char *key)
+{
+	struct nabu_connection *conn;
+	bool found = false;
+
+	pthread_mutex_lock(&conn_list_mutex);
+	TAILQ_FOREACH(conn, &conn_list, link) {
+		if (conn->config_key != NULL &&
+		    strcmp(conn->config_key, key) == 0) {
+			conn->stale = false;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&conn_list_mutex);
+
+	return found;
+}
+
+/*
+ * conn_reload_end --
+ *	Shut down the connections that are no longer configured,
+ *	and wait (for a little while) for them to go away so that
+ *	any ports they were using can be re-used.  Clients already
+ *	accepted from a removed TCP listener are left alone.
+ */
+void
+conn_reload_end(void)
+{
+	struct nabu_connection *conn;
+	struct timespec deadline;
+	bool waiting;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 5;
+
+	pthread_mutex_lock(&conn_list_mutex);
+	TAILQ_FOREACH(conn, &conn_list, link) {
+		if (conn->stale) {
+			log_info("[%s] Removing connection.",
+			    conn_name(conn));
+			conn_cancel(conn);
+		}
+	}
+	for (;;) {
+		waiting = false;
+		TAILQ_FOREACH(conn, &conn_list, link) {
+			if (conn->stale) {
+				waiting = true;
+				break;
+			}
+		}
+		if (! waiting) {
+			break;
+		}
+		if (pthread_cond_timedwait(&conn_list_enum_cv,
+		    &conn_list_mutex, &deadline) == ETIMEDOUT) {
+			log_error("Timed out waiting for connections "
+			    "to shut down.");
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conn_list_mutex);
+}
+
+static bool
+conn_channel_replace_cb(struct nabu_connection *conn, void *ctx)
+{
+	struct image_channel **chans = ctx;
+	struct image_channel *oldchan = chans[0], *newchan = chans[1];
+	bool changed = false;
+
+	pthread_mutex_lock(&conn->mutex);
+	if (conn->l_channel == oldchan) {
+		if (newchan != NULL) {
+			image_channel_retain(newchan);
+		}
+		conn->l_channel = newchan;
+		conn->retronet_enabled =
+		    newchan != NULL && newchan->retronet_enabled;
+		changed = true;
+	}
+	pthread_mutex_unlock(&conn->mutex);
+
+	if (changed) {
+		/* The caller still holds a reference to the old one. */
+		image_channel_release(oldchan);
+		log_info("[%s] Channel %u %s.", conn_name(conn),
+		    oldchan->number, newchan != NULL ? "updated" : "removed");
+		event_post(NABUCTL_EV_CHANNEL_CHANGE, conn_name(conn),
+		    newchan != NULL ? newchan->number : 0,
+		    EVENT_NO_IMAGE, NULL);
+	}
+	return true;
+}
+
+/*
+ * conn_channel_replace --
+ *	Move all connections using the specified channel over to
+ *	its replacement (which may be NULL if the channel is going
+ *	away entirely).  The selected file is left as-is; it names
+ *	a file, not an image in the old channel's cache.
+ */
+void
+conn_channel_replace(struct image_channel *oldchan,
+    struct image_channel *newchan)
+{
+	struct image_channel *chans[2] = { oldchan, newchan };
+
+	conn_enumerate(conn_channel_replace_cb, chans);
+}
+
 /*
  * conn_thread --
  *	Worker thread that handles NABU connections.
@@ -149,6 +326,50 @@ conn_thread(void *arg)
 	return NULL;
 }
 
+/*
+ * conn_record_start --
+ *	Start recording a session.  Each session gets its own
+ *	file, named after the connection and the time it started
+ *	(plus our PID and a sequence number to keep them unique).
+ */
+static void
+conn_record_start(struct nabu_connection *conn)
+{
+	static unsigned int record_seq;
+	char tbuf[sizeof("YYYYmmdd-HHMMSS")];
+	char *name, *cp, *path;
+	struct tm tm;
+	time_t now;
+
+	name = strdup(conn_name(conn));
+	if (name == NULL) {
+		return;
+	}
+	for (cp = name; *cp != '\0'; cp++) {
+		if (*cp == '/' || *cp == ':') {
+			*cp = '_';
+		}
+	}
+
+	now = time(NULL);
+	strftime(tbuf, sizeof(tbuf), "%Y%m%d-%H%M%S",
+	    localtime_r(&now, &tm));
+
+	if (asprintf(&path, "%s/%s-%s-%u-%u.rec", conn->record_dir,
+		     name[0] == '_' ? name + 1 : name, tbuf,
+		     (unsigned int)getpid(),
+		     __atomic_fetch_add(&record_seq, 1,
+					__ATOMIC_RELAXED)) < 0) {
+		log_error("[%s] Unable to allocate recording path.",
+		    conn_name(conn));
+	} else {
+		/* Error already logged on failure. */
+		(void) conn_io_record(&conn->io, path);
+		free(path);
+	}
+	free(name);
+}
+
 /*
  * conn_create_common --
  *	Common connection-creation duties.
@@ -164,12 +385,26 @@ conn_create_common(char *name, int fd, const struct conn_add_args *args,
 		log_error("[%s] Unable to allocate connection structure.",
 		    name);
 		close(fd);
+		if (type == CONN_TYPE_TCP) {
+			admit_connection_done(args->admit_policy,
+			    args->admit_peer);
+		}
 		return;
 	}
 
 	conn->type = type;
 	LIST_INIT(&conn->nhacp_sessions);
 
+	if (conn->type == CONN_TYPE_LISTENER) {
+		conn->admit_policy = admit_policy_create(args->max_connections,
+		    args->connection_rate, args->request_rate);
+	} else if (conn->type == CONN_TYPE_TCP) {
+		conn->admit_policy = args->admit_policy;
+		conn->admit_peer = args->admit_peer;
+	}
+
+	conn->max_images = args->max_images;
+
 	/* Not exactly "common", but hey, we allocate the conn here. */
 	if (conn->type == CONN_TYPE_SERIAL) {
 		conn->baud = args->baud;
@@ -178,18 +413,29 @@ conn_create_common(char *name, int fd, const struct conn_add_args *args,
 	}
 
 	conn->file_root = args->file_root;
+	if (args->record_dir != NULL) {
+		conn->record_dir = strdup(args->record_dir);
+	}
+	if (args->config_key != NULL) {
+		conn->config_key = strdup(args->config_key);
+	}
 	pthread_mutex_init(&conn->mutex, NULL);
 
 	if (! conn_io_init(&conn->io, name, fd)) {
 		/* Error already logged. */
 		goto bad;
 	}
+	conn->io.handoff = type != CONN_TYPE_TCP;
 
 	if (conn->file_root != NULL) {
 		log_info("[%s] Using '%s' for local storage.",
 		    conn_name(conn), conn->file_root);
 	}
 
+	if (conn->record_dir != NULL && type != CONN_TYPE_LISTENER) {
+		conn_record_start(conn);
+	}
+
 	/*
 	 * If a channel was specified, set it now.
 	 */
@@ -309,7 +555,10 @@ conn_add_serial(struct conn_add_args *args)
 
 	log_info("Creating Serial connection on %s.", args->port);
 
-	fd = open(args->port, O_RDWR | O_NONBLOCK | O_NOCTTY);
+	fd = upgrade_take_fd(args->port);
+	if (fd < 0) {
+		fd = open(args->port, O_RDWR | O_NONBLOCK | O_NOCTTY);
+	}
 	if (fd < 0) {
 		log_error("Unable to open %s: %s", args->port, strerror(errno));
 		return;
@@ -319,9 +568,11 @@ conn_add_serial(struct conn_add_args *args)
 	 * The native protocol is 8N1 @ 111860 baud, but it's much
 	 * more reliable if we use 2 stop bits.  Otherwise, the NABU
 	 * can get out of sync when receiving a stream of bytes in
-	 * a packet.
+	 * a packet.  So that's the default unless configured otherwise.
 	 */
-	args->stop_bits = 2;	/* Configure this, eventually. */
+	if (args->stop_bits == 0) {
+		args->stop_bits = 2;
+	}
 
 	if (args->baud != 0) {
 		if (! conn_serial_setparam(fd, args)) {
@@ -386,10 +637,6 @@ conn_tcp_thread(void *arg)
 			break;
 		}
 
-		/* Disable Nagle. */
-		v = 1;
-		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
-
 		/* Get the numeric peer name string. */
 		v = getnameinfo((struct sockaddr *)&peerss,
 		    peersslen, host, sizeof(host), NULL, 0,
@@ -401,19 +648,33 @@ conn_tcp_thread(void *arg)
 			continue;
 		}
 
+		/* Shed the connection now if it's over the limits. */
+		memset(&args, 0, sizeof(args));
+		if (! admit_connection(conn->admit_policy, host,
+				       &args.admit_peer)) {
+			/* Error already logged. */
+			close(sock);
+			continue;
+		}
+		args.admit_policy = conn->admit_policy;
+
+		/* Disable Nagle. */
+		v = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+
 		log_info("[%s] Creating TCP connection for %s.",
 		    conn_name(conn), host);
 
 		pthread_mutex_lock(&conn->mutex);
 		chan = conn->l_channel;
+		args.channel = chan != NULL ? chan->number : 0;
 		pthread_mutex_unlock(&conn->mutex);
 
-		memset(&args, 0, sizeof(args));
-
-		args.channel = chan != NULL ? chan->number : 0;
 		args.file_root = conn->file_root != NULL ?
 		    strdup(conn->file_root) : NULL;
 		args.selected_file = conn_get_selected_file(conn);
+		args.record_dir = conn->record_dir;
+		args.max_images = conn->max_images;
 
 		conn_create_common(strdup(host), sock, &args,
 		    CONN_TYPE_TCP, conn_thread);
@@ -466,6 +727,14 @@ conn_add_tcp(const struct conn_add_args *args)
 		    ai->ai_family == AF_INET6 ? "6" : "?",
 		    port);
 
+		/* Already listening if we were handed it by an upgrade. */
+		sock = upgrade_take_fd(name);
+		if (sock >= 0) {
+			conn_create_common(strdup(name), sock, args,
+			    CONN_TYPE_LISTENER, conn_tcp_thread);
+			continue;
+		}
+
 		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 		if (sock >= 0) {
 			if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
@@ -502,14 +771,26 @@ conn_destroy(struct nabu_connection *conn)
 {
 	conn_remove(conn);
 
-	image_release(conn_set_last_image(conn, NULL));
+	conn_image_flush(conn);
 	conn_reboot(conn);
 
+	if (conn->l_channel != NULL) {
+		image_channel_release(conn->l_channel);
+	}
+
+	if (conn->type == CONN_TYPE_LISTENER) {
+		admit_policy_release(conn->admit_policy);
+	} else {
+		admit_connection_done(conn->admit_policy, conn->admit_peer);
+	}
+
 	pthread_mutex_destroy(&conn->mutex);
 
 	conn_io_fini(&conn->io);
 
 	free(conn->file_root);
+	free(conn->record_dir);
+	free(conn->config_key);
 	free(conn);
 }
 
@@ -534,65 +815,153 @@ conn_reboot(struct nabu_connection *conn)
 }
 
 /*
- * conn_get_last_image --
- *	Return the last image used by the connection.
+ * conn_image_matches --
+ *	Check if a working set entry is the requested image.
+ */
+static bool
+conn_image_matches(const struct conn_image *ent, struct image_channel *chan,
+    uint32_t image, const char *name)
+{
+	const struct nabu_image *img = ent->img;
+
+	if (img->channel != chan || img->number != image) {
+		return false;
+	}
+	return image != IMAGE_NUMBER_NAMED || strcmp(img->name, name) == 0;
+}
+
+/*
+ * conn_image_lookup --
+ *	Look up an image in the connection's working set and make it
+ *	the most-recently used.  The working set's retain is borrowed
+ *	by the caller; only the connection's own thread changes the
+ *	working set, so the image can't go away underneath it.
  */
 struct nabu_image *
-conn_get_last_image(struct nabu_connection *conn)
+conn_image_lookup(struct nabu_connection *conn, struct image_channel *chan,
+    uint32_t image, const char *name)
 {
-	struct nabu_image *img;
+	struct conn_image ent;
+	uint32_t gen = __atomic_load_n(&chan->cache_generation,
+	    __ATOMIC_ACQUIRE);
+	unsigned int i;
 
 	pthread_mutex_lock(&conn->mutex);
-	img = conn->l_last_image;
+	for (i = 0; i < conn->l_nimages; i++) {
+		if (conn_image_matches(&conn->l_images[i], chan, image,
+				       name)) {
+			break;
+		}
+	}
+	if (i == conn->l_nimages || conn->l_images[i].generation != gen) {
+		pthread_mutex_unlock(&conn->mutex);
+		return NULL;
+	}
+	ent = conn->l_images[i];
+	memmove(&conn->l_images[1], &conn->l_images[0],
+	    i * sizeof(conn->l_images[0]));
+	conn->l_images[0] = ent;
 	pthread_mutex_unlock(&conn->mutex);
 
-	return img;
+	return ent.img;
 }
 
 /*
- * conn_set_last_image --
- *	Set the specified image as the most-recent.  Returns
- *	the old value.
+ * conn_image_insert --
+ *	Insert an image into the connection's working set as the
+ *	most-recently used, taking over the caller's retain.  Returns
+ *	the image that was pushed out (a stale copy of the same image,
+ *	or the least-recently used one), if any; the caller must drop
+ *	its retain.
  */
 struct nabu_image *
-conn_set_last_image(struct nabu_connection *conn, struct nabu_image *img)
+conn_image_insert(struct nabu_connection *conn, struct nabu_image *img)
 {
-	struct nabu_image *oimg;
+	struct nabu_image *oimg = NULL;
+	unsigned int i, max_images;
+
+	max_images = conn->max_images != 0 ? conn->max_images
+					   : CONN_IMAGES_DEFAULT;
 
 	pthread_mutex_lock(&conn->mutex);
-	oimg = conn->l_last_image;
-	conn->l_last_image = img;
+	for (i = 0; i < conn->l_nimages; i++) {
+		if (conn_image_matches(&conn->l_images[i], img->channel,
+				       img->number, img->name)) {
+			break;
+		}
+	}
+	if (i < conn->l_nimages) {
+		oimg = conn->l_images[i].img;
+		assert(oimg != img);
+	} else if (conn->l_nimages == max_images) {
+		i = conn->l_nimages - 1;
+		oimg = conn->l_images[i].img;
+	} else {
+		i = conn->l_nimages++;
+	}
+	memmove(&conn->l_images[1], &conn->l_images[0],
+	    i * sizeof(conn->l_images[0]));
+	conn->l_images[0].img = img;
+	conn->l_images[0].generation =
+	    __atomic_load_n(&img->channel->cache_generation, __ATOMIC_ACQUIRE);
 	pthread_mutex_unlock(&conn->mutex);
 
 	return oimg;
 }
 
 /*
- * conn_set_last_image_if --
- *	Like conn_set_last_image(), but only if the last image
- *	matches the specified match value.
+ * conn_image_remove --
+ *	Remove an image from the connection's working set.  Returns
+ *	true if it was there, in which case the caller must drop the
+ *	working set's retain.
  */
-struct nabu_image *
-conn_set_last_image_if(struct nabu_connection *conn, struct nabu_image *match,
-    struct nabu_image *img)
+bool
+conn_image_remove(struct nabu_connection *conn, struct nabu_image *img)
 {
-	struct nabu_image *oimg;
+	unsigned int i;
+	bool rv = false;
 
 	pthread_mutex_lock(&conn->mutex);
-	if (conn->l_last_image == match) {
-		oimg = conn->l_last_image;
-		conn->l_last_image = img;
-	} else {
-		oimg = NULL;
+	for (i = 0; i < conn->l_nimages; i++) {
+		if (conn->l_images[i].img == img) {
+			conn->l_nimages--;
+			memmove(&conn->l_images[i], &conn->l_images[i + 1],
+			    (conn->l_nimages - i) * sizeof(conn->l_images[0]));
+			rv = true;
+			break;
+		}
 	}
 	pthread_mutex_unlock(&conn->mutex);
 
-	return oimg;
+	return rv;
+}
+
+/*
+ * conn_image_flush --
+ *	Empty the connection's working set.
+ */
+void
+conn_image_flush(struct nabu_connection *conn)
+{
+	struct conn_image images[CONN_IMAGES_MAX];
+	unsigned int i, nimages;
+
+	pthread_mutex_lock(&conn->mutex);
+	nimages = conn->l_nimages;
+	memcpy(images, conn->l_images, nimages * sizeof(images[0]));
+	conn->l_nimages = 0;
+	pthread_mutex_unlock(&conn->mutex);
+
+	/* The image cache lock nests outside ours. */
+	for (i = 0; i < nimages; i++) {
+		image_release(images[i].img);
+	}
 }
 
 /*
  * conn_get_channel --
- *	Return the connection's currently-selected channel.
+ *	Return the connection's currently-selected channel, with a
+ *	retain that the caller must drop with image_channel_release().
  */
 struct image_channel *
 conn_get_channel(struct nabu_connection *conn)
@@ -601,6 +970,9 @@ conn_get_channel(struct nabu_connection *conn)
 
 	pthread_mutex_lock(&conn->mutex);
 	chan = conn->l_channel;
+	if (chan != NULL) {
+		image_channel_retain(chan);
+	}
 	pthread_mutex_unlock(&conn->mutex);
 
 	return chan;
@@ -613,22 +985,33 @@ conn_get_channel(struct nabu_connection *conn)
 void
 conn_set_channel(struct nabu_connection *conn, struct image_channel *chan)
 {
+	struct image_channel *ochan;
 	char *selected_file;
 
 	/*
 	 * Changing the channel clears the selected file.
 	 */
 
+	if (chan != NULL) {
+		image_channel_retain(chan);
+	}
 	pthread_mutex_lock(&conn->mutex);
+	ochan = conn->l_channel;
 	conn->l_channel = chan;
-	conn->retronet_enabled = chan->retronet_enabled;
+	conn->retronet_enabled = chan != NULL && chan->retronet_enabled;
 	selected_file = conn->l_selected_file;
 	conn->l_selected_file = NULL;
 	pthread_mutex_unlock(&conn->mutex);
 
+	if (ochan != NULL) {
+		image_channel_release(ochan);
+	}
 	if (selected_file != NULL) {
 		free(selected_file);
 	}
+
+	event_post(NABUCTL_EV_CHANNEL_CHANGE, conn_name(conn),
+	    chan != NULL ? chan->number : 0, EVENT_NO_IMAGE, NULL);
 }
 
 /*
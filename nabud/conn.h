@@ -32,6 +32,7 @@
 #include <stdint.h>
 
 #include "libnabud/conn_io.h"
+#include "libnabud/flightrec.h"
 #include "libnabud/nabu_proto.h"
 #include "libnabud/nbsd_queue.h"
 
@@ -42,8 +43,28 @@ typedef enum {
 	CONN_TYPE_TCP		=	3,
 } conn_type;
 
+struct admit_peer;
+struct admit_policy;
+struct image_channel;
+struct nabu_image;
 struct nabu_segment;
 
+/*
+ * Each connection keeps a small working set of the images it has used
+ * recently, most-recent first, so that a program that alternates
+ * between a main image and its overlays doesn't have to go back to
+ * the channel cache for every segment.  Each entry holds a retain on
+ * its image.  The cache generation is used to notice that the channel
+ * cache has been cleared out from under us.
+ */
+#define	CONN_IMAGES_DEFAULT	4
+#define	CONN_IMAGES_MAX		16
+
+struct conn_image {
+	struct nabu_image *img;
+	uint32_t	generation;
+};
+
 struct nabu_connection {
 	/* I/O context */
 	struct conn_io	io;
@@ -81,6 +102,28 @@ struct nabu_connection {
 	 */
 	char		*file_root;
 
+	/*
+	 * Directory in which to record sessions, if enabled.
+	 */
+	char		*record_dir;
+
+	/*
+	 * Key that identifies the configuration stanza that created
+	 * this connection (NULL for connections accepted from a
+	 * listener), and whether it has been seen during a reload.
+	 * Protected by the connection list mutex.
+	 */
+	char		*config_key;
+	bool		stale;
+
+	/*
+	 * Admission control policy (listeners and the connections
+	 * accepted from them) and the peer record charged for this
+	 * connection's requests.
+	 */
+	struct admit_policy *admit_policy;
+	struct admit_peer *admit_peer;
+
 	/*
 	 * NHACP extensions context.
 	 */
@@ -92,11 +135,21 @@ struct nabu_connection {
 	struct retronet_context *retronet;
 	bool		retronet_enabled;
 
+	/*
+	 * Flight recorder.  Written only by the connection thread;
+	 * may be snapshotted by anyone.
+	 */
+	struct flightrec trace;
+
+	/* Size of the image working set (below). */
+	unsigned int	max_images;
+
 	/* Lock that protects the data below. */
 	pthread_mutex_t mutex;
 
-	/* Last image used. */
-	struct nabu_image *l_last_image;
+	/* Working set of recently-used images. */
+	struct conn_image l_images[CONN_IMAGES_MAX];
+	unsigned int	l_nimages;
 
 	/* Selected channel. */
 	struct image_channel *l_channel;
@@ -109,10 +162,22 @@ struct conn_add_args {
 	char		*port;
 	char		*file_root;
 	char		*selected_file;
+	const char	*record_dir;
+	const char	*config_key;
 	unsigned int	channel;
 	unsigned int	baud;
 	unsigned int	stop_bits;
+	unsigned int	max_images;	/* 0 == CONN_IMAGES_DEFAULT */
 	bool		flow_control;
+
+	/* TCP listener admission control (0 == no limit). */
+	unsigned int	max_connections;
+	unsigned int	connection_rate;
+	unsigned int	request_rate;
+
+	/* Admission state for connections accepted from a listener. */
+	struct admit_policy *admit_policy;
+	struct admit_peer *admit_peer;
 };
 
 extern unsigned int conn_count;
@@ -124,24 +189,36 @@ void	conn_destroy(struct nabu_connection *);
 
 bool	conn_enumerate(bool (*)(struct nabu_connection *, void *), void *);
 
-struct nabu_image *conn_get_last_image(struct nabu_connection *);
-struct nabu_image *conn_set_last_image(struct nabu_connection *,
-				       struct nabu_image *);
-struct nabu_image *conn_set_last_image_if(struct nabu_connection *,
-				       struct nabu_image *,
-				       struct nabu_image *);
+void	conn_reload_begin(void);
+bool	conn_reload_keep(const char *);
+void	conn_reload_end(void);
+void	conn_channel_replace(struct image_channel *, struct image_channel *);
+
+struct nabu_image *conn_image_lookup(struct nabu_connection *,
+				    struct image_channel *, uint32_t,
+				    const char *);
+struct nabu_image *conn_image_insert(struct nabu_connection *,
+				    struct nabu_image *);
+bool	conn_image_remove(struct nabu_connection *, struct nabu_image *);
+void	conn_image_flush(struct nabu_connection *);
 
 struct image_channel *conn_get_channel(struct nabu_connection *);
 void	conn_set_channel(struct nabu_connection *, struct image_channel *);
 char	*conn_get_selected_file(struct nabu_connection *);
 void	conn_set_selected_file(struct nabu_connection *, char *);
 
+#define	conn_trace(c, ev, code, image, seg, len)			\
+	flightrec_record(&(c)->trace, FLIGHTREC_EV_ ## ev, (code),	\
+	    (image), (seg), (len))
+
 #define	conn_name(c)		conn_io_name(&(c)->io)
 #define	conn_state(c)		conn_io_state(&(c)->io)
 #define	conn_set_state(c, s)	conn_io_set_state(&(c)->io, (s))
 
 #define	conn_send(c, b, l)	conn_io_send(&(c)->io, (b), (l))
 #define	conn_send_byte(c, b)	conn_io_send_byte(&(c)->io, (b))
+#define	conn_sendfile(c, h, hl, fd, o, l)				\
+	conn_io_sendfile(&(c)->io, (h), (hl), (fd), (o), (l))
 #define	conn_recv(c, b, l)	conn_io_recv(&(c)->io, (b), (l))
 #define	conn_recv_byte(c, b)	conn_io_recv_byte(&(c)->io, (b))
 
@@ -54,7 +54,9 @@
 
 #include "conn.h"
 #include "control.h"
+#include "event.h"
 #include "image.h"
+#include "upgrade.h"
 
 #define	FNAME_BUFSIZE	256
 
@@ -83,6 +85,7 @@ static bool
 control_serialize_channel(struct image_channel *chan, void *ctx)
 {
 	struct atom_list *list = ctx;
+	char health[64];
 	const char *cp;
 	bool rv;
 
@@ -120,6 +123,11 @@ control_serialize_channel(struct image_channel *chan, void *ctx)
 	rv = rv && atom_list_append_string(list, NABUCTL_CHAN_SOURCE,
 	    chan->source->name);
 
+	if (image_source_health(chan->source, health, sizeof(health))) {
+		rv = rv && atom_list_append_string(list,
+		    NABUCTL_CHAN_SOURCE_HEALTH, health);
+	}
+
 	rv = rv && atom_list_append_bool(list, NABUCTL_CHAN_RETRONET_EXTENSIONS,
 	    chan->retronet_enabled);
 
@@ -162,10 +170,14 @@ control_serialize_connection(struct nabu_connection *conn, void *ctx)
 	    conn_name(conn));
 
 	struct image_channel *chan;
+	unsigned int channel = 0;
 	char selected_file[FNAME_BUFSIZE] = { 0 };
 
 	pthread_mutex_lock(&conn->mutex);
 	chan = conn->l_channel;
+	if (chan != NULL) {
+		channel = chan->number;
+	}
 	if (conn->l_selected_file != NULL) {
 		strncpy(selected_file, conn->l_selected_file,
 		    sizeof(selected_file) - 1);
@@ -175,9 +187,9 @@ control_serialize_connection(struct nabu_connection *conn, void *ctx)
 	}
 	pthread_mutex_unlock(&conn->mutex);
 
-	if (chan != NULL) {
+	if (channel != 0) {
 		rv = rv && atom_list_append_number(list, NABUCTL_CONN_CHANNEL,
-		    chan->number);
+		    channel);
 	}
 
 	if (selected_file[0] != '\0') {
@@ -207,6 +219,65 @@ control_serialize_connection(struct nabu_connection *conn, void *ctx)
 	return rv;
 }
 
+/*
+ * control_serialize_event --
+ *	Serialize an event object.
+ */
+static bool
+control_serialize_event(const struct event *ev, struct atom_list *list)
+{
+	bool rv;
+
+	rv = atom_list_append_void(list, NABUCTL_OBJ_EVENT);
+
+	rv = rv && atom_list_append_number(list, NABUCTL_EVENT_TYPE, ev->type);
+
+	rv = rv && atom_list_append_number(list, NABUCTL_EVENT_TIME, ev->time);
+
+	if (ev->conn[0] != '\0') {
+		rv = rv && atom_list_append_string(list, NABUCTL_EVENT_CONN,
+		    ev->conn);
+	}
+
+	if (ev->channel != 0) {
+		rv = rv && atom_list_append_number(list, NABUCTL_EVENT_CHANNEL,
+		    ev->channel);
+	}
+
+	if (ev->image != EVENT_NO_IMAGE) {
+		rv = rv && atom_list_append_number(list, NABUCTL_EVENT_IMAGE,
+		    ev->image);
+	}
+
+	if (ev->detail[0] != '\0') {
+		rv = rv && atom_list_append_string(list, NABUCTL_EVENT_DETAIL,
+		    ev->detail);
+	}
+
+	if (ev->type == NABUCTL_EV_COUNTERS) {
+		rv = rv && atom_list_append_number(list,
+		    NABUCTL_EVENT_INTERVAL, ev->interval);
+		rv = rv && atom_list_append_number(list,
+		    NABUCTL_EVENT_SEGMENTS_SENT,
+		    ev->counters[EVENT_CTR_SEGMENTS_SENT]);
+		rv = rv && atom_list_append_number(list,
+		    NABUCTL_EVENT_IMAGE_LOADS,
+		    ev->counters[EVENT_CTR_IMAGE_LOADS]);
+		rv = rv && atom_list_append_number(list,
+		    NABUCTL_EVENT_IMAGE_LOAD_FAILURES,
+		    ev->counters[EVENT_CTR_IMAGE_LOAD_FAILURES]);
+		rv = rv && atom_list_append_number(list,
+		    NABUCTL_EVENT_CACHE_EVICTIONS,
+		    ev->counters[EVENT_CTR_CACHE_EVICTIONS]);
+		rv = rv && atom_list_append_number(list,
+		    NABUCTL_EVENT_DROPPED, ev->dropped);
+	}
+
+	rv = rv && atom_list_append_done(list);
+
+	return rv;
+}
+
 /*
  * control_req_hello --
  *	Handle a HELLO request.
@@ -278,6 +349,10 @@ struct connection_req_context {
 	union {
 		struct image_channel *chan;
 		char *selected_file;
+		struct {
+			void *buf;
+			size_t len;
+		} trace;
 	};
 	uint32_t	op;
 	bool		found;
@@ -306,6 +381,11 @@ control_req_connection_cb(struct nabu_connection *conn, void *v)
 		conn_set_selected_file(conn, ctx->selected_file);
 		break;
 
+	case NABUCTL_REQ_CONN_TRACE:
+		ctx->trace.len = flightrec_snapshot(&conn->trace,
+		    ctx->trace.buf, ctx->trace.len);
+		break;
+
 	default:
 		break;
 	}
@@ -373,7 +453,11 @@ control_req_connection_change_channel(struct conn_io *conn, struct atom *req,
 		goto bad;
 	}
 
-	return conntrol_req_connection_process(&ctx, reply_list);
+	bool rv = conntrol_req_connection_process(&ctx, reply_list);
+	if (ctx.chan != NULL) {
+		image_channel_release(ctx.chan);
+	}
+	return rv;
 }
 
 /*
@@ -397,7 +481,11 @@ control_req_connection_select_file(struct conn_io *conn, struct atom *req,
 		return atom_list_append_error(reply_list);
 	}
 
-	ctx.selected_file = atom_consume(file_atom);
+	/* The connection keeps the name, so it needs its own copy. */
+	ctx.selected_file = strdup(atom_dataref(file_atom));
+	if (ctx.selected_file == NULL) {
+		return atom_list_append_error(reply_list);
+	}
 	rv = conntrol_req_connection_process(&ctx, reply_list);
 	if (! ctx.found) {
 		free(ctx.selected_file);
@@ -405,6 +493,85 @@ control_req_connection_select_file(struct conn_io *conn, struct atom *req,
 	return rv;
 }
 
+/*
+ * control_req_connection_trace --
+ *	Handle a CONN TRACE request.
+ */
+static bool
+control_req_connection_trace(struct atom *req, struct atom_list *reply_list)
+{
+	struct connection_req_context ctx = {
+		.name = atom_dataref(req),
+		.op = NABUCTL_REQ_CONN_TRACE,
+		.trace = {
+			.len = FLIGHTREC_MAXSNAPSHOT,
+		},
+	};
+	bool rv = true;
+
+	ctx.trace.buf = malloc(ctx.trace.len);
+	if (ctx.trace.buf == NULL) {
+		log_error("Unable to allocate trace snapshot buffer.");
+		return atom_list_append_error(reply_list);
+	}
+
+	conn_enumerate(control_req_connection_cb, &ctx);
+
+	if (! ctx.found) {
+		rv = atom_list_append_error(reply_list);
+	} else {
+		if (ctx.trace.len != 0) {
+			rv = atom_list_append(reply_list, NABUCTL_TYPE_BLOB,
+			    ctx.trace.buf, ctx.trace.len);
+		}
+		rv = rv && atom_list_append_done(reply_list);
+	}
+	free(ctx.trace.buf);
+	return rv;
+}
+
+/*
+ * control_req_subscribe --
+ *	Handle a SUBSCRIBE request.  This takes over the control
+ *	connection; we stream events to the client until it goes
+ *	away, and then return false to end the connection.
+ */
+static bool
+control_req_subscribe(struct conn_io *conn, struct atom_list *reply_list)
+{
+	struct event_subscriber *sub;
+	struct event *ev;
+	bool ok;
+
+	sub = event_subscribe();
+	if (sub == NULL) {
+		/* Error already logged. */
+		return atom_list_append_error(reply_list);
+	}
+
+	log_info("[%s] Client subscribed to events.", conn_io_name(conn));
+
+	ok = atom_list_append_done(reply_list) &&
+	    atom_list_send(conn, reply_list);
+
+	while (ok) {
+		if ((ev = event_next(sub)) == NULL) {
+			continue;
+		}
+		atom_list_reset(reply_list);
+		ok = control_serialize_event(ev, reply_list) &&
+		    atom_list_append_done(reply_list) &&
+		    atom_list_send(conn, reply_list);
+		event_free(ev);
+	}
+
+	event_unsubscribe(sub);
+	atom_list_reset(reply_list);
+
+	log_info("[%s] Event subscription ended.", conn_io_name(conn));
+	return false;
+}
+
 /*
  * control_req_channel_clear_cache --
  *	Handle a CHAN CLEAR CACHE request.
@@ -416,6 +583,7 @@ control_req_channel_clear_cache(struct atom *req, struct atom_list *reply_list)
 	struct image_channel *chan = image_channel_lookup((unsigned int)val);
 	if (chan != NULL) {
 		image_cache_clear(chan);
+		image_channel_release(chan);
 		return atom_list_append_done(reply_list);
 	}
 	return atom_list_append_error(reply_list);
@@ -438,6 +606,7 @@ control_req_channel_fetch_listing(struct atom *req,
 	bool rv = true;
 	size_t datalen;
 	char *data = image_channel_copy_listing(chan, &datalen);
+	image_channel_release(chan);
 	if (data != NULL) {
 		rv = atom_list_append(reply_list, NABUCTL_TYPE_BLOB,
 		    data, datalen);
@@ -461,8 +630,8 @@ control_connection_thread(void *arg)
 	atom_list_init(&reply_list);
 
 	for (ok = true; ok;) {
-		atom_list_free(&req_list);
-		atom_list_free(&reply_list);
+		atom_list_reset(&req_list);
+		atom_list_reset(&reply_list);
 
 		if (! atom_list_recv(conn, &req_list)) {
 			/* Error already logged */
@@ -500,6 +669,13 @@ control_connection_thread(void *arg)
 			ok = control_req_list_connections(&reply_list);
 			break;
 
+		case NABUCTL_REQ_SUBSCRIBE:
+			log_debug(LOG_SUBSYS_CONTROL,
+			    "[%s] Got NABUCTL_REQ_SUBSCRIBE.",
+			    conn_io_name(conn));
+			ok = control_req_subscribe(conn, &reply_list);
+			break;
+
 		case NABUCTL_REQ_CONN_CANCEL:
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "[%s] Got NABUCTL_REQ_CONN_CANCEL.",
@@ -523,6 +699,13 @@ control_connection_thread(void *arg)
 			    req, &req_list, &reply_list);
 			break;
 
+		case NABUCTL_REQ_CONN_TRACE:
+			log_debug(LOG_SUBSYS_CONTROL,
+			    "[%s] Got NABUCTL_REQ_CONN_TRACE.",
+			    conn_io_name(conn));
+			ok = control_req_connection_trace(req, &reply_list);
+			break;
+
 		case NABUCTL_REQ_CHAN_CLEAR_CACHE:
 			log_debug(LOG_SUBSYS_CONTROL,
 			    "[%s] Got NABUCTL_REQ_CHAN_CLEAR_CACHE.",
@@ -725,6 +908,17 @@ control_init(const char *path)
 	sun.sun_family = AF_LOCAL;
 
 	log_info("Creating control channel at %s", path);
+
+	/* Already listening if we were handed it by an upgrade. */
+	if ((sock = upgrade_take_fd(path)) >= 0) {
+		conn = calloc(1, sizeof(*conn));
+		if (conn == NULL ||
+		    ! conn_io_init(conn, strdup(path), sock)) {
+			goto bad;
+		}
+		goto start;
+	}
+
 	if (unlink(path) < 0) {
 		if (errno != ENOENT) {
 			log_error("unlink(%s) failed: %s", path,
@@ -789,6 +983,8 @@ control_init(const char *path)
 		goto bad;
 	}
 
+ start:
+	conn->handoff = true;
 	if (! conn_io_start(conn, control_listen_thread, conn)) {
 		/* Error already logged. */
 		conn_io_fini(conn);
@@ -0,0 +1,273 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Event notifications for control clients that have subscribed to
+ * them.  Interesting things that happen in the server are posted
+ * here and queued to every subscriber; if there are no subscribers,
+ * posting an event is just a load and a test.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libnabud/log.h"
+#include "libnabud/nabuctl_proto.h"
+#include "libnabud/nbsd_queue.h"
+
+#include "event.h"
+
+/* Maximum number of events queued to a subscriber. */
+#define	EVENT_QUEUE_MAX		256
+
+/* How often COUNTERS events are generated. */
+#define	EVENT_COUNTERS_INTERVAL_MS	10000
+
+struct event_subscriber {
+	LIST_ENTRY(event_subscriber) link;
+	STAILQ_HEAD(, event) queue;
+	unsigned int	qlen;
+	uint64_t	dropped;
+	pthread_cond_t	cv;
+
+	/* For computing counter deltas. */
+	uint64_t	last_counters[EVENT_NCOUNTERS];
+	uint64_t	last_counters_time;
+};
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, event_subscriber) event_subscribers =
+    LIST_HEAD_INITIALIZER(event_subscribers);
+static unsigned int event_nsubscribers;
+
+static uint64_t event_counters[EVENT_NCOUNTERS];
+
+/*
+ * event_now --
+ *	Return the current time in milliseconds since the Epoch.
+ */
+static uint64_t
+event_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * event_count --
+ *	Bump an event counter.
+ */
+void
+event_count(event_counter ctr)
+{
+	assert(ctr >= 0 && ctr < EVENT_NCOUNTERS);
+	__atomic_fetch_add(&event_counters[ctr], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * event_post --
+ *	Post an event to all subscribers.
+ */
+void
+event_post(uint32_t type, const char *conn, unsigned int channel,
+    uint32_t image, const char *detail)
+{
+	struct event_subscriber *sub;
+	struct event proto, *ev;
+
+	if (__atomic_load_n(&event_nsubscribers, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	memset(&proto, 0, sizeof(proto));
+	proto.type = type;
+	proto.time = event_now();
+	if (conn != NULL) {
+		strncpy(proto.conn, conn, sizeof(proto.conn) - 1);
+	}
+	proto.channel = channel;
+	proto.image = image;
+	if (detail != NULL) {
+		strncpy(proto.detail, detail, sizeof(proto.detail) - 1);
+	}
+
+	pthread_mutex_lock(&event_lock);
+	LIST_FOREACH(sub, &event_subscribers, link) {
+		if (sub->qlen == EVENT_QUEUE_MAX ||
+		    (ev = malloc(sizeof(*ev))) == NULL) {
+			sub->dropped++;
+			continue;
+		}
+		*ev = proto;
+		STAILQ_INSERT_TAIL(&sub->queue, ev, link);
+		sub->qlen++;
+		pthread_cond_signal(&sub->cv);
+	}
+	pthread_mutex_unlock(&event_lock);
+}
+
+/*
+ * event_subscribe --
+ *	Create a new event subscription.
+ */
+struct event_subscriber *
+event_subscribe(void)
+{
+	struct event_subscriber *sub;
+	unsigned int i;
+
+	sub = calloc(1, sizeof(*sub));
+	if (sub == NULL) {
+		log_error("Unable to allocate event subscriber.");
+		return NULL;
+	}
+	STAILQ_INIT(&sub->queue);
+	pthread_cond_init(&sub->cv, NULL);
+
+	pthread_mutex_lock(&event_lock);
+	for (i = 0; i < EVENT_NCOUNTERS; i++) {
+		sub->last_counters[i] =
+		    __atomic_load_n(&event_counters[i], __ATOMIC_RELAXED);
+	}
+	sub->last_counters_time = event_now();
+	LIST_INSERT_HEAD(&event_subscribers, sub, link);
+	event_nsubscribers++;
+	pthread_mutex_unlock(&event_lock);
+
+	return sub;
+}
+
+/*
+ * event_unsubscribe --
+ *	Tear down an event subscription.
+ */
+void
+event_unsubscribe(struct event_subscriber *sub)
+{
+	struct event *ev;
+
+	pthread_mutex_lock(&event_lock);
+	LIST_REMOVE(sub, link);
+	event_nsubscribers--;
+	pthread_mutex_unlock(&event_lock);
+
+	while ((ev = STAILQ_FIRST(&sub->queue)) != NULL) {
+		STAILQ_REMOVE_HEAD(&sub->queue, link);
+		free(ev);
+	}
+	pthread_cond_destroy(&sub->cv);
+	free(sub);
+}
+
+/*
+ * event_counters_locked --
+ *	Generate a COUNTERS event for the subscriber.
+ */
+static struct event *
+event_counters_locked(struct event_subscriber *sub, uint64_t now)
+{
+	struct event *ev;
+	unsigned int i;
+
+	ev = calloc(1, sizeof(*ev));
+	if (ev == NULL) {
+		/* Try again next interval. */
+		sub->last_counters_time = now;
+		return NULL;
+	}
+	ev->type = NABUCTL_EV_COUNTERS;
+	ev->time = now;
+	ev->image = EVENT_NO_IMAGE;
+	ev->interval = now - sub->last_counters_time;
+	for (i = 0; i < EVENT_NCOUNTERS; i++) {
+		uint64_t val =
+		    __atomic_load_n(&event_counters[i], __ATOMIC_RELAXED);
+		ev->counters[i] = val - sub->last_counters[i];
+		sub->last_counters[i] = val;
+	}
+	ev->dropped = sub->dropped;
+	sub->dropped = 0;
+	sub->last_counters_time = now;
+
+	return ev;
+}
+
+/*
+ * event_next --
+ *	Wait for the next event for this subscriber.  If no event
+ *	arrives before it's time for the next counters update, the
+ *	COUNTERS event is returned.  Caller must free the event with
+ *	event_free().
+ */
+struct event *
+event_next(struct event_subscriber *sub)
+{
+	struct timespec deadline;
+	struct event *ev;
+	uint64_t now, when;
+
+	pthread_mutex_lock(&event_lock);
+	for (;;) {
+		if ((ev = STAILQ_FIRST(&sub->queue)) != NULL) {
+			STAILQ_REMOVE_HEAD(&sub->queue, link);
+			sub->qlen--;
+			break;
+		}
+
+		now = event_now();
+		when = sub->last_counters_time + EVENT_COUNTERS_INTERVAL_MS;
+		if (now >= when) {
+			ev = event_counters_locked(sub, now);
+			break;
+		}
+
+		deadline.tv_sec = (time_t)(when / 1000);
+		deadline.tv_nsec = (long)(when % 1000) * 1000000L;
+		pthread_cond_timedwait(&sub->cv, &event_lock, &deadline);
+	}
+	pthread_mutex_unlock(&event_lock);
+
+	return ev;
+}
+
+/*
+ * event_free --
+ *	Free an event returned by event_next().
+ */
+void
+event_free(struct event *ev)
+{
+	free(ev);
+}
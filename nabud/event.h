@@ -0,0 +1,75 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef event_h_included
+#define	event_h_included
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libnabud/nbsd_queue.h"
+
+typedef enum {
+	EVENT_CTR_SEGMENTS_SENT		= 0,
+	EVENT_CTR_IMAGE_LOADS,
+	EVENT_CTR_IMAGE_LOAD_FAILURES,
+	EVENT_CTR_CACHE_EVICTIONS,
+
+	EVENT_NCOUNTERS
+} event_counter;
+
+#define	EVENT_NO_IMAGE		UINT32_MAX
+
+#define	EVENT_CONN_NAME_MAX	64
+#define	EVENT_DETAIL_MAX	64
+
+struct event {
+	STAILQ_ENTRY(event) link;
+	uint32_t	type;		/* NABUCTL_EV_* */
+	uint64_t	time;		/* ms since the Epoch */
+	char		conn[EVENT_CONN_NAME_MAX];	/* "" == none */
+	unsigned int	channel;	/* 0 == none */
+	uint32_t	image;		/* EVENT_NO_IMAGE == none */
+	char		detail[EVENT_DETAIL_MAX];	/* "" == none */
+
+	/* NABUCTL_EV_COUNTERS only. */
+	uint64_t	interval;	/* ms */
+	uint64_t	counters[EVENT_NCOUNTERS];
+	uint64_t	dropped;
+};
+
+struct event_subscriber;
+
+void	event_post(uint32_t, const char *, unsigned int, uint32_t,
+	    const char *);
+void	event_count(event_counter);
+
+struct event_subscriber *event_subscribe(void);
+void	event_unsubscribe(struct event_subscriber *);
+struct event *event_next(struct event_subscriber *);
+void	event_free(struct event *);
+
+#endif /* event_h_included */
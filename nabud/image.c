@@ -35,6 +35,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -44,19 +45,17 @@
 #include <string.h>
 #include <unistd.h>
 
-#if defined(HAVE_COMMONCRYPTO_H)
-#define	COMMON_DIGEST_FOR_OPENSSL
-#include <CommonCrypto/CommonCrypto.h>
-#elif defined(HAVE_OPENSSL)
-#include <openssl/des.h>
-#include <openssl/md5.h>
-#endif
-
+#include "libnabud/chanpack.h"
 #include "libnabud/fileio.h"
+#include "libnabud/fileio_async.h"
 #include "libnabud/log.h"
+#include "libnabud/nabuctl_proto.h"
+#include "libnabud/pak.h"
 
 #include "conn.h"
+#include "event.h"
 #include "image.h"
+#include "metrics.h"
 
 static LIST_HEAD(, image_source) image_sources =
     LIST_HEAD_INITIALIZER(image_sources);
@@ -66,6 +65,18 @@ static TAILQ_HEAD(, image_channel) image_channels =
     TAILQ_HEAD_INITIALIZER(image_channels);
 unsigned int image_channel_count;
 
+/*
+ * The source and channel lists only change when the configuration
+ * is (re)loaded.  Sources and channels are reference counted: the
+ * lists hold a reference, as does each connection that has the
+ * channel selected, each image loaded from it, and each fetch in
+ * flight on it.  A channel holds a reference on its source.  One
+ * that is removed by a reload is freed when the last of those goes
+ * away.
+ */
+static pthread_mutex_t image_channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool image_reloading;
+
 static pthread_mutex_t image_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 static size_t image_cache_size;
 
@@ -111,7 +122,10 @@ image_free(struct nabu_image *img)
 		assert(img->refcnt == 0);
 		assert(img->cached == false);
 		free(img->name);
-		free(img->data);
+		if (! img->is_mapped) {
+			free(img->data);
+		}
+		image_channel_release(img->channel);
 		free(img);
 	}
 }
@@ -130,15 +144,20 @@ image_release(struct nabu_image *img)
 }
 
 /*
- * image_source_lookup --
- *	Look up an image source by name.
+ * image_source_lookup_locked --
+ *	Look up an image source by name.  Sources that have not
+ *	(yet) been seen during a reload are ignored; a channel
+ *	can only refer to a source in the new configuration.
  */
 static struct image_source *
-image_source_lookup(const char *name)
+image_source_lookup_locked(const char *name)
 {
 	struct image_source *imgsrc;
 
 	LIST_FOREACH(imgsrc, &image_sources, link) {
+		if (imgsrc->stale) {
+			continue;
+		}
 		if (strcmp(imgsrc->name, name) == 0) {
 			return imgsrc;
 		}
@@ -146,43 +165,202 @@ image_source_lookup(const char *name)
 	return NULL;
 }
 
+/*
+ * image_source_retain --
+ *	Retain (increment the refcnt) on the specified source.
+ */
+static void
+image_source_retain(struct image_source *imgsrc)
+{
+	__atomic_add_fetch(&imgsrc->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * image_source_release --
+ *	Release the specified source, freeing it (and unmapping its
+ *	channel pack) if this was the last reference.
+ */
+static void
+image_source_release(struct image_source *imgsrc)
+{
+	unsigned int i;
+
+	if (__atomic_sub_fetch(&imgsrc->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	log_debug(LOG_SUBSYS_IMAGE, "Freeing Source %s.", imgsrc->name);
+	if (imgsrc->pack != NULL) {
+		chanpack_close(imgsrc->pack);
+	}
+	/* mirrors[0].root is imgsrc->root. */
+	for (i = 0; i < imgsrc->nmirrors; i++) {
+		free(imgsrc->mirrors[i].root);
+	}
+	free(imgsrc->mirrors);
+	free(imgsrc->name);
+	free(imgsrc);
+}
+
+/*
+ * image_source_retire_locked --
+ *	Remove a source from service and drop the list's reference.
+ */
+static void
+image_source_retire_locked(struct image_source *imgsrc)
+{
+	LIST_REMOVE(imgsrc, link);
+	image_source_count--;
+	log_info("Removing Source %s at %s", imgsrc->name, imgsrc->root);
+	image_source_release(imgsrc);
+}
+
+/*
+ * image_source_mirrors_match --
+ *	Check if a source has the same set of locations as the
+ *	arguments.  Mirrors are ignored for a channel pack, so
+ *	only its Location needs to match.
+ */
+static bool
+image_source_mirrors_match(const struct image_source *imgsrc,
+    const struct image_add_source_args *args)
+{
+	unsigned int i;
+
+	if (strcmp(imgsrc->root, args->root) != 0) {
+		return false;
+	}
+	if (imgsrc->pack != NULL) {
+		return true;
+	}
+	if (imgsrc->nmirrors != args->nmirrors + 1) {
+		return false;
+	}
+	for (i = 0; i < args->nmirrors; i++) {
+		if (strcmp(imgsrc->mirrors[i + 1].root,
+			   args->mirrors[i]) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
 /*
  * image_add_source --
- *	Add an image source.
+ *	Add an image source.  During a reload, an existing source
+ *	with the same name and location is kept as-is.
  */
 void
 image_add_source(const struct image_add_source_args *args)
 {
-	if (image_source_lookup(args->name) != NULL) {
+	struct image_source *imgsrc;
+	unsigned int i;
+
+	pthread_mutex_lock(&image_channels_lock);
+
+	if (image_source_lookup_locked(args->name) != NULL) {
 		log_error("Image source %s alreadty exists.", args->name);
 		goto bad;
 	}
 
-	struct image_source *imgsrc = calloc(1, sizeof(*imgsrc));
-	if (imgsrc != NULL) {
-		imgsrc->name = args->name;
-		imgsrc->root = args->root;
-		LIST_INSERT_HEAD(&image_sources, imgsrc, link);
-		image_source_count++;
-		log_info("Adding Source %s at %s",
-		    imgsrc->name, imgsrc->root);
-	} else {
+	if (image_reloading) {
+		LIST_FOREACH(imgsrc, &image_sources, link) {
+			if (imgsrc->stale &&
+			    strcmp(imgsrc->name, args->name) == 0) {
+				break;
+			}
+		}
+		if (imgsrc != NULL) {
+			/* A rebuilt channel pack counts as a change. */
+			if (image_source_mirrors_match(imgsrc, args) &&
+			    (imgsrc->pack == NULL ||
+			     ! chanpack_changed(imgsrc->pack))) {
+				/* Unchanged; keep the one we have. */
+				imgsrc->stale = false;
+				pthread_mutex_unlock(&image_channels_lock);
+				free(args->name);
+				free(args->root);
+				goto out;
+			}
+			image_source_retire_locked(imgsrc);
+		}
+	}
+
+	imgsrc = calloc(1, sizeof(*imgsrc));
+	if (imgsrc == NULL) {
 		log_error("Unable to allocate image source descriptor for %s",
 		    args->name);
 		goto bad;
 	}
-	return;
+
+	/*
+	 * If the location is a channel pack, map it now; we serve
+	 * images directly out of the mapping.  It's unmapped when
+	 * the last reference to the source is released.
+	 */
+	if (chanpack_probe(args->root)) {
+		imgsrc->pack = chanpack_open(args->root);
+		if (imgsrc->pack == NULL) {
+			/* Error already logged. */
+			free(imgsrc);
+			goto bad;
+		}
+		if (args->nmirrors != 0) {
+			log_error("Ignoring Mirrors of Source %s; "
+			    "%s is a channel pack.", args->name, args->root);
+		}
+	}
+
+	/* The primary Location is always mirror 0. */
+	imgsrc->nmirrors = imgsrc->pack != NULL ? 1 : args->nmirrors + 1;
+	imgsrc->mirrors = calloc(imgsrc->nmirrors, sizeof(*imgsrc->mirrors));
+	if (imgsrc->mirrors == NULL) {
+		log_error("Unable to allocate mirrors for %s", args->name);
+		if (imgsrc->pack != NULL) {
+			chanpack_close(imgsrc->pack);
+		}
+		free(imgsrc);
+		goto bad;
+	}
+	imgsrc->name = args->name;
+	imgsrc->root = args->root;
+	imgsrc->refcnt = 1;		/* the list's reference */
+	imgsrc->remote = imgsrc->pack == NULL &&
+	    ! fileio_location_is_local(imgsrc->root, strlen(imgsrc->root));
+	imgsrc->mirrors[0].root = args->root;
+	for (i = 1; i < imgsrc->nmirrors; i++) {
+		imgsrc->mirrors[i].root = args->mirrors[i - 1];
+		args->mirrors[i - 1] = NULL;
+	}
+	LIST_INSERT_HEAD(&image_sources, imgsrc, link);
+	image_source_count++;
+	if (imgsrc->pack != NULL) {
+		log_info("Adding Source %s at %s (channel pack, %u images)",
+		    imgsrc->name, imgsrc->root, imgsrc->pack->nentries);
+	} else {
+		log_info("Adding Source %s at %s",
+		    imgsrc->name, imgsrc->root);
+	}
+	for (i = 1; i < imgsrc->nmirrors; i++) {
+		log_info("Adding mirror of Source %s at %s",
+		    imgsrc->name, imgsrc->mirrors[i].root);
+	}
+	pthread_mutex_unlock(&image_channels_lock);
+	goto out;
+
  bad:
+	pthread_mutex_unlock(&image_channels_lock);
 	free(args->name);
 	free(args->root);
+ out:
+	for (i = 0; i < args->nmirrors; i++) {
+		free(args->mirrors[i]);
+	}
+	free(args->mirrors);
 }
 
-/*
- * image_channel_lookup --
- *	Look up an image channel by number.
- */
-struct image_channel *
-image_channel_lookup(unsigned int number)
+static struct image_channel *
+image_channel_lookup_locked(unsigned int number)
 {
 	struct image_channel *chan;
 
@@ -194,6 +372,62 @@ image_channel_lookup(unsigned int number)
 	return NULL;
 }
 
+/*
+ * image_channel_lookup --
+ *	Look up an image channel by number.  Gains a retain on the
+ *	channel, if found; drop it with image_channel_release().
+ */
+struct image_channel *
+image_channel_lookup(unsigned int number)
+{
+	struct image_channel *chan;
+
+	pthread_mutex_lock(&image_channels_lock);
+	chan = image_channel_lookup_locked(number);
+	if (chan != NULL) {
+		image_channel_retain(chan);
+	}
+	pthread_mutex_unlock(&image_channels_lock);
+
+	return chan;
+}
+
+/*
+ * image_channel_retain --
+ *	Retain (increment the refcnt) on the specified channel.
+ */
+void
+image_channel_retain(struct image_channel *chan)
+{
+	__atomic_add_fetch(&chan->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * image_channel_release --
+ *	Release the specified channel, freeing it if this was the
+ *	last reference.
+ */
+void
+image_channel_release(struct image_channel *chan)
+{
+	if (__atomic_sub_fetch(&chan->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	/* Every cached image holds a reference. */
+	assert(LIST_EMPTY(&chan->image_cache));
+
+	log_debug(LOG_SUBSYS_IMAGE, "Freeing channel %u (%s).",
+	    chan->number, chan->name);
+	free(chan->listing);
+	free(chan->name);
+	free(chan->path);
+	free(chan->list_url);
+	free(chan->default_file);
+	image_source_release(chan->source);
+	free(chan);
+}
+
 /*
  * image_channel_enumerate --
  *	Enumerate all of the channels.
@@ -202,13 +436,70 @@ bool
 image_channel_enumerate(bool (*func)(struct image_channel *, void *), void *ctx)
 {
 	struct image_channel *chan;
+	bool rv = true;
 
+	pthread_mutex_lock(&image_channels_lock);
 	TAILQ_FOREACH(chan, &image_channels, link) {
 		if (! (*func)(chan, ctx)) {
-			return false;
+			rv = false;
+			break;
 		}
 	}
-	return true;
+	pthread_mutex_unlock(&image_channels_lock);
+
+	return rv;
+}
+
+static bool
+image_strings_match(const char *s1, const char *s2)
+{
+	if (s1 == NULL || s2 == NULL) {
+		return s1 == s2;
+	}
+	return strcmp(s1, s2) == 0;
+}
+
+/*
+ * image_channel_retire --
+ *	Take a channel out of service, drop its cache, move any
+ *	connections using it to its replacement (if any), and drop
+ *	the list's reference.  Called with the channels lock held.
+ */
+static void
+image_channel_retire_locked(struct image_channel *chan,
+    struct image_channel *newchan)
+{
+	pthread_mutex_lock(&image_cache_lock);
+	chan->retired = true;
+	pthread_mutex_unlock(&image_cache_lock);
+
+	if (newchan == NULL) {
+		image_channel_count--;
+		log_info("Removing channel %u (%s on %s)",
+		    chan->number, chan->name, chan->source->name);
+	}
+
+	image_cache_clear(chan);
+	conn_channel_replace(chan, newchan);
+	image_channel_release(chan);
+}
+
+/*
+ * image_add_channel_args_free --
+ *	Free the strings in a set of channel arguments that the
+ *	channel didn't take.
+ */
+static void
+image_add_channel_args_free(const struct image_add_channel_args *args)
+{
+	free(args->name);
+	free(args->source);
+	if (args->list_url != NULL) {
+		free(args->list_url);
+	}
+	if (args->default_file) {
+		free(args->default_file);
+	}
 }
 
 /*
@@ -218,21 +509,30 @@ image_channel_enumerate(bool (*func)(struct image_channel *, void *), void *ctx)
 void
 image_add_channel(const struct image_add_channel_args *args)
 {
-	struct image_channel *chan = NULL;
+	struct image_channel *chan = NULL, *ochan = NULL;
 	size_t pathlen;
 	char *pathstr = NULL;
 	const char *relpath = args->relpath;
 
-	struct image_source *imgsrc = image_source_lookup(args->source);
+	pthread_mutex_lock(&image_channels_lock);
+
+	struct image_source *imgsrc = image_source_lookup_locked(args->source);
 	if (imgsrc == NULL) {
 		log_error("Unknown image source: %s", args->source);
 		goto bad;
 	}
 
-	if ((chan = image_channel_lookup(args->number)) != NULL) {
-		log_error("Channel %u already exists (%s on %s).",
-		    args->number, chan->name, chan->source->name);
-		goto bad;
+	if ((chan = image_channel_lookup_locked(args->number)) != NULL) {
+		if (chan->stale) {
+			/* Reloading; we might be replacing this one. */
+			ochan = chan;
+			chan = NULL;
+		} else {
+			log_error("Channel %u already exists (%s on %s).",
+			    args->number, chan->name, chan->source->name);
+			chan = NULL;
+			goto bad;
+		}
 	}
 
 	if (relpath != NULL) {
@@ -257,7 +557,29 @@ image_add_channel(const struct image_add_channel_args *args)
 	}
 	snprintf(pathstr, pathlen, "%s/%s", imgsrc->root, relpath);
 
+	/*
+	 * If the channel is unchanged by a reload, keep the one we
+	 * have, along with its image cache.
+	 */
+	if (ochan != NULL &&
+	    ochan->source == imgsrc &&
+	    ochan->type == args->type &&
+	    ochan->retronet_enabled == args->retronet_enabled &&
+	    strcmp(ochan->name, args->name) == 0 &&
+	    strcmp(ochan->path, pathstr) == 0 &&
+	    image_strings_match(ochan->list_url, args->list_url) &&
+	    image_strings_match(ochan->default_file, args->default_file)) {
+		ochan->stale = false;
+		pthread_mutex_unlock(&image_channels_lock);
+		free(chan);
+		free(pathstr);
+		image_add_channel_args_free(args);
+		return;
+	}
+
+	image_source_retain(imgsrc);
 	chan->source = imgsrc;
+	chan->refcnt = 1;		/* the list's reference */
 	chan->type = args->type;
 	chan->name = args->name;
 	chan->path = pathstr;
@@ -265,11 +587,20 @@ image_add_channel(const struct image_add_channel_args *args)
 	chan->default_file = args->default_file;
 	chan->number = args->number;
 	chan->retronet_enabled = args->retronet_enabled;
-	TAILQ_INSERT_TAIL(&image_channels, chan, link);
-	image_channel_count++;
-	log_info("Adding %s channel %u (%s on %s) at %s",
-	    chan->type == IMAGE_CHANNEL_PAK ? "pak" : "nabu",
-	    chan->number, chan->name, chan->source->name, chan->path);
+	if (ochan != NULL) {
+		TAILQ_INSERT_AFTER(&image_channels, ochan, chan, link);
+		TAILQ_REMOVE(&image_channels, ochan, link);
+		log_info("Replacing %s channel %u (%s on %s) at %s",
+		    chan->type == IMAGE_CHANNEL_PAK ? "pak" : "nabu",
+		    chan->number, chan->name, chan->source->name, chan->path);
+		image_channel_retire_locked(ochan, chan);
+	} else {
+		TAILQ_INSERT_TAIL(&image_channels, chan, link);
+		image_channel_count++;
+		log_info("Adding %s channel %u (%s on %s) at %s",
+		    chan->type == IMAGE_CHANNEL_PAK ? "pak" : "nabu",
+		    chan->number, chan->name, chan->source->name, chan->path);
+	}
 	if (chan->list_url != NULL) {
 		log_info("Channel %u has a listing at: %s",
 		    chan->number, chan->list_url);
@@ -282,133 +613,528 @@ image_add_channel(const struct image_add_channel_args *args)
 		log_info("Channel %u has RetroNet enabled.",
 		    chan->number);
 	}
+	pthread_mutex_unlock(&image_channels_lock);
 	return;
  bad:
+	pthread_mutex_unlock(&image_channels_lock);
 	if (chan != NULL) {
 		free(chan);
 	}
 	if (pathstr != NULL) {
 		free(pathstr);
 	}
-	free(args->name);
-	free(args->source);
-	if (args->list_url != NULL) {
-		free(args->list_url);
-	}
-	if (args->default_file) {
-		free(args->default_file);
-	}
+	image_add_channel_args_free(args);
 }
 
 /*
- * image_cache_lookup_locked --
- *	Look up an image in the channel's image cache.  Gains a retain
- *	on the image, if found.
+ * image_reload_begin --
+ *	Start reloading the configuration.  Every source and channel
+ *	is marked stale; the ones that are re-added unchanged are
+ *	kept, and the rest are removed by image_reload_end().
  */
-static struct nabu_image *
-image_cache_lookup_locked(struct image_channel *chan, uint32_t image)
+void
+image_reload_begin(void)
 {
-	struct nabu_image *img;
+	struct image_source *imgsrc;
+	struct image_channel *chan;
 
-	LIST_FOREACH(img, &chan->image_cache, link) {
-		if (img->number == IMAGE_NUMBER_NAMED) {
-			continue;
-		}
-		if (img->number == image) {
-			image_retain_locked(img);
-			return img;
-		}
+	pthread_mutex_lock(&image_channels_lock);
+	image_reloading = true;
+	LIST_FOREACH(imgsrc, &image_sources, link) {
+		imgsrc->stale = true;
 	}
-	return NULL;
+	TAILQ_FOREACH(chan, &image_channels, link) {
+		chan->stale = true;
+	}
+	pthread_mutex_unlock(&image_channels_lock);
 }
 
 /*
- * image_cache_lookup_named_locked --
- *	Look up an image in the channel's image cache by name.
- *	This is used for named file selections.  Gains a retain
- *	on the image, if found.
+ * image_reload_end --
+ *	Finish reloading the configuration.
  */
-static struct nabu_image *
-image_cache_lookup_named_locked(struct image_channel *chan,
-    const char *name)
+void
+image_reload_end(void)
 {
-	struct nabu_image *img;
-
-	LIST_FOREACH(img, &chan->image_cache, link) {
-		if (img->number != IMAGE_NUMBER_NAMED) {
-			continue;
+	struct image_source *imgsrc, *nimgsrc;
+	struct image_channel *chan, *nchan;
+
+	pthread_mutex_lock(&image_channels_lock);
+	TAILQ_FOREACH_SAFE(chan, &image_channels, link, nchan) {
+		if (chan->stale) {
+			TAILQ_REMOVE(&image_channels, chan, link);
+			image_channel_retire_locked(chan, NULL);
 		}
-		if (strcmp(img->name, name) == 0) {
-			image_retain_locked(img);
-			return img;
+	}
+	LIST_FOREACH_SAFE(imgsrc, &image_sources, link, nimgsrc) {
+		if (imgsrc->stale) {
+			image_source_retire_locked(imgsrc);
 		}
 	}
-	return NULL;
+	image_reloading = false;
+	pthread_mutex_unlock(&image_channels_lock);
 }
 
 /*
- * image_cache_insert_locked --
- *	Insert an image into the image cache.  If the image
- *	already exists, we end up releasing the new one and
- *	using the one from the cache.
- *
- *	The image returned has 2 retains:
- *
- *	-> For new images, we start with a retain count of 1 (the
- *	   caller's retain) and the image cache also gains a retain.
- *
- *	-> For collisions, we start with a retain count of 1 (the
- *	   image cache's retain) and the gain another for the caller.
+ * Circuit breaker for remote sources.  See the comment above struct
+ * image_breaker.
  */
-static struct nabu_image *
-image_cache_insert_locked(struct image_channel *chan, struct nabu_image *newimg)
-{
-	struct nabu_image *img;
+static pthread_mutex_t image_breaker_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	assert(newimg->cached == false);
+#define	IMAGE_BREAKER_THRESHOLD	3	/* consecutive failures to trip */
+#define	IMAGE_BREAKER_COOLDOWN	5	/* initial cool-down (seconds) */
+#define	IMAGE_BREAKER_MAXCOOL	300	/* maximum cool-down (seconds) */
 
-	if (newimg->number == IMAGE_NUMBER_NAMED) {
-		img = image_cache_lookup_named_locked(chan, newimg->name);
-	} else {
-		img = image_cache_lookup_locked(chan, newimg->number);
-	}
-	if (img == NULL) {
-		image_retain_locked(newimg);
-		LIST_INSERT_HEAD(&chan->image_cache, newimg, link);
-		image_cache_size += newimg->length;
-		newimg->cached = true;
+static const char *image_breaker_state_names[] = {
+	[IMAGE_BREAKER_CLOSED]		=	"closed",
+	[IMAGE_BREAKER_OPEN]		=	"open",
+	[IMAGE_BREAKER_HALF_OPEN]	=	"half-open",
+};
 
-		log_info("Cached %s on Channel %u; "
-		    "total cache size: %zu", newimg->name, chan->number,
-		        image_cache_size);
-		img = newimg;
-	} else {
-		assert(img->cached == true);
+/*
+ * image_error_is_unhealthy --
+ *	Returns true if the error from a fetch suggests that the
+ *	source itself is in trouble (as opposed to, say, the file
+ *	simply not being there).
+ */
+static bool
+image_error_is_unhealthy(int error)
+{
+	switch (error) {
+	case 0:
+	case ENOENT:
+	case EACCES:
+	case EINVAL:
+	case ENOMEM:
+	case ECANCELED:
+		return false;
+
+	default:
+		return true;
 	}
-	return img;
 }
 
 /*
- * image_cache_remove_locked --
- *	Remove an image from its channel's image cache.  Caller is
- *	responsible for dropping the retain if non-NULL is returned.
+ * image_breaker_set_state_locked --
+ *	Move a source's breaker to a new state.
  */
-static struct nabu_image *
-image_cache_remove_locked(struct nabu_image *img)
+static void
+image_breaker_set_state_locked(struct image_source *imgsrc,
+    image_breaker_state state)
 {
-	if (img->cached) {
-		image_cache_size -= img->length;
-		log_debug(LOG_SUBSYS_IMAGE,
+	char detail[64];
+
+	imgsrc->breaker.state = state;
+	snprintf(detail, sizeof(detail), "%s %s", imgsrc->name,
+	    image_breaker_state_names[state]);
+	event_post(NABUCTL_EV_SOURCE_STATE, NULL, 0, EVENT_NO_IMAGE, detail);
+}
+
+/*
+ * image_breaker_admit --
+ *	Check if a request may be sent to a source.  When the breaker
+ *	is open and the cool-down has expired, the request that gets
+ *	here first becomes the probe.
+ */
+static bool
+image_breaker_admit(struct image_source *imgsrc)
+{
+	struct image_breaker *br = &imgsrc->breaker;
+	bool rv = true;
+
+	if (! imgsrc->remote) {
+		return true;
+	}
+
+	pthread_mutex_lock(&image_breaker_lock);
+	switch (br->state) {
+	case IMAGE_BREAKER_CLOSED:
+		break;
+
+	case IMAGE_BREAKER_OPEN:
+		if (metrics_timestamp() >= br->retry_time) {
+			log_info("Probing Source %s.", imgsrc->name);
+			image_breaker_set_state_locked(imgsrc,
+			    IMAGE_BREAKER_HALF_OPEN);
+			break;
+		}
+		rv = false;
+		break;
+
+	case IMAGE_BREAKER_HALF_OPEN:
+		/* Only one probe at a time. */
+		rv = false;
+		break;
+	}
+	pthread_mutex_unlock(&image_breaker_lock);
+
+	if (! rv) {
+		metrics_count(METRIC_SOURCE_FAST_FAILS);
+		errno = EHOSTDOWN;
+	}
+	return rv;
+}
+
+/*
+ * image_breaker_record --
+ *	Record the outcome of a request that image_breaker_admit()
+ *	let through.
+ */
+static void
+image_breaker_record(struct image_source *imgsrc, bool ok)
+{
+	struct image_breaker *br = &imgsrc->breaker;
+	unsigned int cooldown;
+
+	if (! imgsrc->remote) {
+		return;
+	}
+
+	pthread_mutex_lock(&image_breaker_lock);
+	if (ok) {
+		br->failures = 0;
+		br->trips = 0;
+		if (br->state != IMAGE_BREAKER_CLOSED) {
+			log_info("Source %s has recovered.", imgsrc->name);
+			image_breaker_set_state_locked(imgsrc,
+			    IMAGE_BREAKER_CLOSED);
+		}
+		goto out;
+	}
+
+	switch (br->state) {
+	case IMAGE_BREAKER_CLOSED:
+		if (++br->failures < IMAGE_BREAKER_THRESHOLD) {
+			goto out;
+		}
+		break;
+
+	case IMAGE_BREAKER_OPEN:
+		/* A straggler from before we tripped. */
+		goto out;
+
+	case IMAGE_BREAKER_HALF_OPEN:
+		/* The probe failed. */
+		break;
+	}
+
+	cooldown = IMAGE_BREAKER_COOLDOWN << (br->trips < 6 ? br->trips : 6);
+	if (cooldown > IMAGE_BREAKER_MAXCOOL) {
+		cooldown = IMAGE_BREAKER_MAXCOOL;
+	}
+	br->trips++;
+	br->retry_time = metrics_timestamp() +
+	    (uint64_t)cooldown * UINT64_C(1000000000);
+	log_error("Source %s is unhealthy; failing fast for %u seconds.",
+	    imgsrc->name, cooldown);
+	image_breaker_set_state_locked(imgsrc, IMAGE_BREAKER_OPEN);
+	metrics_count(METRIC_SOURCE_BREAKER_TRIPS);
+ out:
+	pthread_mutex_unlock(&image_breaker_lock);
+}
+
+/*
+ * image_breaker_cancel --
+ *	Give back a request that image_breaker_admit() let through
+ *	but that was never sent.  If it was the probe, the next
+ *	request gets to probe instead.
+ */
+static void
+image_breaker_cancel(struct image_source *imgsrc)
+{
+	struct image_breaker *br = &imgsrc->breaker;
+
+	if (! imgsrc->remote) {
+		return;
+	}
+
+	pthread_mutex_lock(&image_breaker_lock);
+	if (br->state == IMAGE_BREAKER_HALF_OPEN) {
+		/* retry_time has passed, so admit will probe again. */
+		image_breaker_set_state_locked(imgsrc, IMAGE_BREAKER_OPEN);
+	}
+	pthread_mutex_unlock(&image_breaker_lock);
+}
+
+/*
+ * image_source_health --
+ *	Describe a source's health for display.  Returns false if
+ *	there's nothing to say (i.e. the source is local).
+ */
+bool
+image_source_health(struct image_source *imgsrc, char *buf, size_t buflen)
+{
+	struct image_breaker *br = &imgsrc->breaker;
+	uint64_t now;
+
+	if (! imgsrc->remote) {
+		return false;
+	}
+
+	pthread_mutex_lock(&image_breaker_lock);
+	now = metrics_timestamp();
+	if (br->state == IMAGE_BREAKER_OPEN && br->retry_time > now) {
+		snprintf(buf, buflen, "%s (retry in %" PRIu64 "s)",
+		    image_breaker_state_names[br->state],
+		    (br->retry_time - now + UINT64_C(999999999)) /
+		    UINT64_C(1000000000));
+	} else if (br->state == IMAGE_BREAKER_CLOSED && br->failures != 0) {
+		snprintf(buf, buflen, "%s (%u failures)",
+		    image_breaker_state_names[br->state], br->failures);
+	} else {
+		snprintf(buf, buflen, "%s",
+		    image_breaker_state_names[br->state]);
+	}
+	pthread_mutex_unlock(&image_breaker_lock);
+	return true;
+}
+
+/*
+ * image_channel_listing_source --
+ *	Return the source whose breaker guards the channel's listing,
+ *	or NULL if the listing doesn't live on the channel's source.
+ */
+static struct image_source *
+image_channel_listing_source(struct image_channel *chan)
+{
+	struct image_source *imgsrc = chan->source;
+	const char *root;
+	size_t rootlen;
+	unsigned int i;
+
+	for (i = 0; i < imgsrc->nmirrors; i++) {
+		root = imgsrc->mirrors[i].root;
+		rootlen = strlen(root);
+		if (rootlen != 0 && root[rootlen - 1] == '/') {
+			rootlen--;
+		}
+		/* http://host must not claim http://host2/... */
+		if (strncmp(chan->list_url, root, rootlen) == 0 &&
+		    (chan->list_url[rootlen] == '/' ||
+		     chan->list_url[rootlen] == '\0')) {
+			return imgsrc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * image_channel_listing_loaded --
+ *	Completion callback for an asynchronous listing prefetch.
+ */
+static void
+image_channel_listing_loaded(struct fileio_async_result *res, void *arg)
+{
+	struct image_channel *chan = arg;
+	struct image_source *imgsrc = image_channel_listing_source(chan);
+	char *data = res->data;
+	size_t allocsize;
+
+	if (imgsrc != NULL) {
+		image_breaker_record(imgsrc,
+		    ! image_error_is_unhealthy(res->error));
+	}
+	if (res->error != 0) {
+		log_info("[%s] Unable to prefetch listing from %s: %s",
+		    chan->name, chan->list_url, strerror(res->error));
+		image_channel_release(chan);
+		return;
+	}
+
+	/* We asked for 2 extra bytes to ensure there's a \n\0 at the end. */
+	allocsize = res->length + 2;
+	data[res->length] = '\n';
+	data[res->length + 1] = '\0';
+
+	pthread_mutex_lock(&image_cache_lock);
+	if (chan->listing == NULL && ! chan->retired) {
+		chan->listing = data;
+		chan->listing_size = allocsize;
+		data = NULL;
+	}
+	pthread_mutex_unlock(&image_cache_lock);
+
+	if (data != NULL) {
+		/* Somebody beat us to it. */
+		free(data);
+	} else {
+		log_info("[%s] Cached %zu bytes of listing data.",
+		    chan->name, allocsize);
+	}
+	image_channel_release(chan);
+}
+
+/*
+ * image_channel_prefetch_listings --
+ *	Warm up the listing cache by fetching every channel's listing
+ *	concurrently in the background.
+ */
+void
+image_channel_prefetch_listings(void)
+{
+	struct image_channel *chan;
+	struct image_source *imgsrc;
+
+	pthread_mutex_lock(&image_channels_lock);
+	TAILQ_FOREACH(chan, &image_channels, link) {
+		if (chan->list_url == NULL || chan->listing != NULL) {
+			continue;
+		}
+		imgsrc = image_channel_listing_source(chan);
+		if (imgsrc != NULL && ! image_breaker_admit(imgsrc)) {
+			log_info("[%s] Not prefetching listing; Source %s "
+			    "is unhealthy.", chan->name, imgsrc->name);
+			continue;
+		}
+		log_debug(LOG_SUBSYS_IMAGE,
+		    "[%s] Prefetching listing from %s",
+		    chan->name, chan->list_url);
+		/* The prefetch holds a reference until it completes. */
+		image_channel_retain(chan);
+		if (! fileio_async_load(chan->list_url, 0, 2, 0,
+					image_channel_listing_loaded, chan)) {
+			log_error("[%s] Unable to queue listing prefetch: %s",
+			    chan->name, strerror(errno));
+			if (imgsrc != NULL) {
+				image_breaker_cancel(imgsrc);
+			}
+			image_channel_release(chan);
+		}
+	}
+	pthread_mutex_unlock(&image_channels_lock);
+}
+
+/*
+ * image_cache_lookup_locked --
+ *	Look up an image in the channel's image cache.  Gains a retain
+ *	on the image, if found.
+ */
+static struct nabu_image *
+image_cache_lookup_locked(struct image_channel *chan, uint32_t image)
+{
+	struct nabu_image *img;
+
+	LIST_FOREACH(img, &chan->image_cache, link) {
+		if (img->number == IMAGE_NUMBER_NAMED) {
+			continue;
+		}
+		if (img->number == image) {
+			image_retain_locked(img);
+			return img;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * image_cache_lookup_named_locked --
+ *	Look up an image in the channel's image cache by name.
+ *	This is used for named file selections.  Gains a retain
+ *	on the image, if found.
+ */
+static struct nabu_image *
+image_cache_lookup_named_locked(struct image_channel *chan,
+    const char *name)
+{
+	struct nabu_image *img;
+
+	LIST_FOREACH(img, &chan->image_cache, link) {
+		if (img->number != IMAGE_NUMBER_NAMED) {
+			continue;
+		}
+		if (strcmp(img->name, name) == 0) {
+			image_retain_locked(img);
+			return img;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * image_cache_insert_locked --
+ *	Insert an image into the image cache.  If the image
+ *	already exists, we end up releasing the new one and
+ *	using the one from the cache.
+ *
+ *	The image returned has 2 retains:
+ *
+ *	-> For new images, we start with a retain count of 1 (the
+ *	   caller's retain) and the image cache also gains a retain.
+ *
+ *	-> For collisions, we start with a retain count of 1 (the
+ *	   image cache's retain) and the gain another for the caller.
+ */
+static struct nabu_image *
+image_cache_insert_locked(struct image_channel *chan, struct nabu_image *newimg)
+{
+	struct nabu_image *img;
+
+	assert(newimg->cached == false);
+
+	/*
+	 * Don't cache anything on a channel that's gone away; the
+	 * caller's retain is the only one.
+	 */
+	if (chan->retired) {
+		return newimg;
+	}
+
+	if (newimg->number == IMAGE_NUMBER_NAMED) {
+		img = image_cache_lookup_named_locked(chan, newimg->name);
+	} else {
+		img = image_cache_lookup_locked(chan, newimg->number);
+	}
+	if (img == NULL) {
+		image_retain_locked(newimg);
+		LIST_INSERT_HEAD(&chan->image_cache, newimg, link);
+		image_cache_size += newimg->length;
+		newimg->cached = true;
+
+		log_info("Cached %s on Channel %u; "
+		    "total cache size: %zu", newimg->name, chan->number,
+		        image_cache_size);
+		img = newimg;
+	} else {
+		assert(img->cached == true);
+	}
+	return img;
+}
+
+/*
+ * image_cache_remove_locked --
+ *	Remove an image from its channel's image cache.  Caller is
+ *	responsible for dropping the retain if non-NULL is returned.
+ */
+static struct nabu_image *
+image_cache_remove_locked(struct nabu_image *img)
+{
+	if (img->cached) {
+		image_cache_size -= img->length;
+		log_debug(LOG_SUBSYS_IMAGE,
 		    "[Channel %u] Removing image %s from cache; "
 		    "total cache size: %zu",
 		    img->channel->number, img->name, image_cache_size);
 		LIST_REMOVE(img, link);
 		img->cached = false;
+		event_count(EVENT_CTR_CACHE_EVICTIONS);
+		event_post(NABUCTL_EV_CACHE_EVICT, NULL, img->channel->number,
+		    img->number, img->name);
 		return img;
 	}
 	return NULL;
 }
 
+/*
+ * image_cache_resident_bytes --
+ *	Return the number of bytes of image data currently cached.
+ *	This is only a snapshot, so we don't bother with the lock.
+ */
+size_t
+image_cache_resident_bytes(void)
+{
+	return __atomic_load_n(&image_cache_size, __ATOMIC_RELAXED);
+}
+
 /*
  * image_cache_clear --
  *	Clear the image cache for a channel.
@@ -422,6 +1148,8 @@ image_cache_clear(struct image_channel *chan)
 
 	LIST_INIT(&old_cache);
 	pthread_mutex_lock(&image_cache_lock);
+	/* Connections re-validate their working sets against this. */
+	__atomic_add_fetch(&chan->cache_generation, 1, __ATOMIC_RELEASE);
 	while ((img = LIST_FIRST(&chan->image_cache)) != NULL) {
 		assert(img->cached == true);
 		image_cache_remove_locked(img);
@@ -442,6 +1170,180 @@ image_cache_clear(struct image_channel *chan)
 	}
 }
 
+/*
+ * Image cache snapshots are used to hand the cache over to a new
+ * instance of the server when it is upgraded in-place.  The snapshot
+ * is only ever read by the same host that wrote it, so everything
+ * is in host byte order.  The file is the magic string followed by
+ * a record for each image:
+ *
+ *	struct image_snapshot_hdr
+ *	channel path (pathlen bytes)
+ *	image name (namelen bytes)
+ *	image data (length bytes)
+ *
+ * The channel path is recorded so that an image is not restored
+ * into a channel whose configuration has changed in the meantime.
+ */
+#define	IMAGE_SNAPSHOT_MAGIC	"NABUCSH1"
+#define	IMAGE_SNAPSHOT_MAGICLEN	8
+
+struct image_snapshot_hdr {
+	uint64_t	length;
+	uint32_t	channel;
+	uint32_t	number;
+	uint32_t	pathlen;
+	uint32_t	namelen;
+};
+
+static bool
+image_cache_snapshot_cb(struct image_channel *chan, void *ctx)
+{
+	struct image_snapshot_hdr hdr;
+	struct nabu_image *img;
+	FILE *fp = ctx;
+	bool ok = true;
+
+	pthread_mutex_lock(&image_cache_lock);
+	LIST_FOREACH(img, &chan->image_cache, link) {
+		/*
+		 * Local images are only cached while in use, and pack
+		 * images are cheap to get again from the pack.
+		 */
+		if (img->is_local || img->is_mapped) {
+			continue;
+		}
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.length = img->length;
+		hdr.channel = chan->number;
+		hdr.number = img->number;
+		hdr.pathlen = (uint32_t)strlen(chan->path);
+		hdr.namelen = (uint32_t)strlen(img->name);
+		if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		    fwrite(chan->path, hdr.pathlen, 1, fp) != 1 ||
+		    fwrite(img->name, hdr.namelen, 1, fp) != 1 ||
+		    (img->length != 0 &&
+		     fwrite(img->data, img->length, 1, fp) != 1)) {
+			ok = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&image_cache_lock);
+
+	return ok;
+}
+
+/*
+ * image_cache_snapshot --
+ *	Write a snapshot of the image caches to the specified file.
+ */
+bool
+image_cache_snapshot(FILE *fp)
+{
+	if (fwrite(IMAGE_SNAPSHOT_MAGIC, IMAGE_SNAPSHOT_MAGICLEN, 1,
+		   fp) != 1 ||
+	    ! image_channel_enumerate(image_cache_snapshot_cb, fp) ||
+	    fflush(fp) != 0) {
+		log_error("Unable to write image cache snapshot: %s",
+		    strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/*
+ * image_cache_restore --
+ *	Restore the image caches from a snapshot.
+ */
+void
+image_cache_restore(FILE *fp)
+{
+	struct image_snapshot_hdr hdr;
+	struct image_channel *chan;
+	struct nabu_image *img, *using_img;
+	char magic[IMAGE_SNAPSHOT_MAGICLEN];
+	char *path;
+	unsigned int count = 0;
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	    memcmp(magic, IMAGE_SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+		log_error("Image cache snapshot is invalid.");
+		return;
+	}
+
+	while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+		path = NULL;
+		img = calloc(1, sizeof(*img));
+		if (img == NULL ||
+		    (path = malloc(hdr.pathlen + 1)) == NULL ||
+		    (img->name = malloc(hdr.namelen + 1)) == NULL ||
+		    (img->data = malloc(hdr.length != 0 ?
+					hdr.length : 1)) == NULL) {
+			log_error("Unable to allocate memory for cached "
+			    "image.");
+			goto bad;
+		}
+		if ((hdr.pathlen != 0 &&
+		     fread(path, hdr.pathlen, 1, fp) != 1) ||
+		    (hdr.namelen != 0 &&
+		     fread(img->name, hdr.namelen, 1, fp) != 1) ||
+		    (hdr.length != 0 &&
+		     fread(img->data, hdr.length, 1, fp) != 1)) {
+			log_error("Image cache snapshot is truncated.");
+			goto bad;
+		}
+		path[hdr.pathlen] = '\0';
+		img->name[hdr.namelen] = '\0';
+
+		chan = image_channel_lookup(hdr.channel);
+		if (chan == NULL || strcmp(chan->path, path) != 0) {
+			log_debug(LOG_SUBSYS_IMAGE,
+			    "Channel %u changed; discarding %s.",
+			    hdr.channel, img->name);
+			if (chan != NULL) {
+				image_channel_release(chan);
+			}
+			free(path);
+			free(img->name);
+			free(img->data);
+			free(img);
+			continue;
+		}
+		free(path);
+
+		img->channel = chan;		/* takes the lookup's retain */
+		img->length = (size_t)hdr.length;
+		img->number = hdr.number;
+		img->refcnt = 1;
+
+		/*
+		 * The cache takes its own retain; drop the one we
+		 * started with.  If the image was already cached
+		 * somehow, drop the extra retain on the cached one
+		 * and toss ours.
+		 */
+		pthread_mutex_lock(&image_cache_lock);
+		using_img = image_cache_insert_locked(chan, img);
+		if (using_img != img) {
+			(void) image_release_locked(using_img);
+		}
+		img = image_release_locked(img);
+		pthread_mutex_unlock(&image_cache_lock);
+		image_free(img);
+		count++;
+	}
+	log_info("Restored %u images from cache snapshot.", count);
+	return;
+
+ bad:
+	free(path);
+	if (img != NULL) {
+		free(img->name);
+		free(img->data);
+		free(img);
+	}
+}
+
 /*
  * image_channel_fetch_listing --
  *	Return a copy of the channel's listing, fetching it
@@ -450,9 +1352,11 @@ image_cache_clear(struct image_channel *chan)
 char *
 image_channel_copy_listing(struct image_channel *chan, size_t *sizep)
 {
+	struct image_source *imgsrc;
 	char *data, *cp, *tmp;
 	size_t allocsize, filesize;
 	unsigned int attempt = 0;
+	int error;
 
  top:
 	log_debug(LOG_SUBSYS_IMAGE,
@@ -503,288 +1407,812 @@ image_channel_copy_listing(struct image_channel *chan, size_t *sizep)
 		return NULL;
 	}
 
+	imgsrc = image_channel_listing_source(chan);
+	if (imgsrc != NULL && ! image_breaker_admit(imgsrc)) {
+		log_info("[%s] Not fetching listing; Source %s is unhealthy.",
+		    chan->name, imgsrc->name);
+		return NULL;
+	}
+
 	/* Allocate an extra byte to ensure there's a \n\0 at the end. */
 	log_debug(LOG_SUBSYS_IMAGE,
 	    "[%s] Fetching listing from %s", chan->name, chan->list_url);
 	data = fileio_load_file_from_location(chan->list_url, 0, 2, 0, NULL,
 	    &filesize);
+	error = data == NULL ? errno : 0;
+	if (imgsrc != NULL) {
+		image_breaker_record(imgsrc, ! image_error_is_unhealthy(error));
+	}
 	if (data == NULL) {
 		log_error("[%s] Unable to fetch listing from %s\n",
 		    chan->name, chan->list_url);
 		return NULL;
 	}
-	allocsize = filesize + 2;
-	data[filesize] = '\n';
-	data[filesize + 1] = '\0';
-	*sizep = allocsize;
+	allocsize = filesize + 2;
+	data[filesize] = '\n';
+	data[filesize + 1] = '\0';
+	*sizep = allocsize;
+
+	/* Now cache a copy. */
+	cp = malloc(allocsize);
+	if (cp == NULL) {
+		log_error("[%s] Unable to allocate %zu bytes to cache listing.",
+		    chan->name, allocsize);
+		return data;
+	}
+	memcpy(cp, data, allocsize);
+
+	pthread_mutex_lock(&image_cache_lock);
+	tmp = chan->listing;
+	chan->listing = cp;
+	chan->listing_size = allocsize;
+	pthread_mutex_unlock(&image_cache_lock);
+	if (tmp != NULL) {
+		free(tmp);
+	}
+	log_info("[%s] Cached %zu bytes of listing data.", chan->name,
+	    allocsize);
+
+	return data;
+}
+
+/*
+ * image_nabu_name --
+ *	Generate a NABU flat image name.
+ */
+static char *
+image_nabu_name(uint32_t image)
+{
+	char namestr[sizeof("000001.nabu")];
+	snprintf(namestr, sizeof(namestr), "%06X.nabu", image);
+	return strdup(namestr);
+}
+
+/*
+ * image_from_nabu --
+ *	Create an image descriptor from the provided NABU file buffer.
+ */
+static struct nabu_image *
+image_from_nabu(struct image_channel *chan, uint32_t image,
+    const char *image_name, uint8_t *filebuf, size_t filesize)
+{
+	char image_name_buf[sizeof("nabu-000001")];
+
+	if (image_name == NULL) {
+		snprintf(image_name_buf, sizeof(image_name_buf),
+		    "nabu-%06X", image);
+		image_name = image_name_buf;
+	}
+
+	struct nabu_image *img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		log_error("Unable to allocate image descriptor for %s.",
+		    image_name);
+		free(filebuf);
+		return NULL;
+	}
+
+	image_channel_retain(chan);
+	img->channel = chan;
+	img->name = strdup(image_name);
+	img->data = filebuf;
+	img->length = filesize;
+	img->number = image;
+	img->refcnt = 1;
+
+	return img;
+}
+
+/*
+ * image_from_pak --
+ *	Create an image descriptor from the provided (already decrypted)
+ *	PAK buffer.
+ */
+static struct nabu_image *
+image_from_pak(struct image_channel *chan, uint32_t image,
+    const char *image_name, uint8_t *pakbuf, size_t paklen)
+{
+	char image_name_buf[sizeof("pak-000001")];
+
+	if (image_name == NULL) {
+		snprintf(image_name_buf, sizeof(image_name_buf),
+		    "pak-%06X", image);
+		image_name = image_name_buf;
+	}
+
+	struct nabu_image *img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		log_error("Unable to allocate image descriptor for %s.",
+		    image_name);
+		free(pakbuf);
+		return NULL;
+	}
+
+	image_channel_retain(chan);
+	img->channel = chan;
+	img->name = strdup(image_name);
+	img->data = pakbuf;
+	img->length = paklen;
+	img->number = image;
+	img->refcnt = 1;
+
+	return img;
+}
+
+struct image_load_ctx {
+	struct image_channel	*chan;
+	const char		*url;
+	uint8_t			*data;
+	size_t			length;
+	size_t			allocsize;
+	size_t			decrypted;
+	bool			encrypted;
+	const bool		*cancel;
+	int			error;
+	struct pak_cipher	cipher;
+};
+
+/*
+ * image_load_chunk --
+ *	Consume a chunk of image data as it arrives from the image
+ *	source, decrypting whatever whole PAK blocks we now have.
+ */
+static bool
+image_load_chunk(void *arg, const void *chunk, size_t len)
+{
+	struct image_load_ctx *ctx = arg;
+	size_t ready;
+
+	/* Another mirror beat us to it. */
+	if (ctx->cancel != NULL &&
+	    __atomic_load_n(ctx->cancel, __ATOMIC_RELAXED)) {
+		ctx->error = ECANCELED;
+		return false;
+	}
+
+	if (len > ctx->allocsize - ctx->length) {
+		log_error("[%s] %s is larger than expected.",
+		    ctx->chan->name, ctx->url);
+		ctx->error = EINVAL;
+		return false;
+	}
+	memcpy(ctx->data + ctx->length, chunk, len);
+	ctx->length += len;
+
+	if (ctx->encrypted) {
+		ready = (ctx->length - ctx->decrypted) &
+		    ~(size_t)(PAK_BLOCKSIZE - 1);
+		if (ready != 0) {
+			if (! pak_cipher_update(&ctx->cipher,
+					ctx->data + ctx->decrypted, ready)) {
+				log_error("[%s] Unable to decrypt %s.",
+				    ctx->chan->name, ctx->url);
+				ctx->error = EINVAL;
+				return false;
+			}
+			ctx->decrypted += ready;
+		}
+	}
+	return true;
+}
+
+/*
+ * image_load_image_from_url --
+ *	Load an image from the specified url.  The image is streamed
+ *	from the source, so we don't need to know its size up-front,
+ *	and PAK images are decrypted as they arrive.  If "cancel" is
+ *	provided, the load is abandoned once it becomes true.  On
+ *	failure, errno indicates why.
+ */
+static struct nabu_image *
+image_load_image_from_url(struct image_channel *chan, uint32_t image,
+    const char *image_name, const char *url, bool encrypted,
+    const bool *cancel)
+{
+	struct image_load_ctx ctx = {
+		.chan = chan,
+		.url = url,
+		.encrypted = encrypted && chan->type == IMAGE_CHANNEL_PAK,
+		.cancel = cancel,
+	};
+	struct nabu_image *img = NULL;
+	struct fileio_attrs attrs;
+	struct fileio *f;
+	size_t filesize;
+	bool cipher_valid = false;
+	uint64_t start = metrics_timestamp();
+	int error = EINVAL;
+
+	f = fileio_open(url, FILEIO_O_RDONLY | FILEIO_O_REGULAR, NULL, &attrs);
+	if (f == NULL) {
+		error = errno;
+		log_error("Unable to open %s: %s", url, strerror(error));
+		errno = error;
+		return NULL;
+	}
+
+	if (attrs.size == 0 || attrs.size > NABU_MAXSEGMENTSIZE) {
+		log_error("Size of %s (%lld) is nonsensical.",
+		    url, (long long)attrs.size);
+		goto out;
+	}
+	/* Size may be unknown (< 0); allocate for the worst case. */
+	ctx.allocsize = attrs.size > 0 ? (size_t)attrs.size
+				       : NABU_MAXSEGMENTSIZE;
+	if ((ctx.data = malloc(ctx.allocsize)) == NULL) {
+		log_error("Unable to allocate %zu bytes for %s",
+		    ctx.allocsize, url);
+		error = ENOMEM;
+		goto out;
+	}
+
+	if (ctx.encrypted) {
+		if (! pak_cipher_init(&ctx.cipher)) {
+			log_error("[%s] Unable to decrypt PAK image %s.",
+			    chan->name, url);
+			goto out;
+		}
+		cipher_valid = true;
+		log_debug(LOG_SUBSYS_IMAGE,
+		    "[%s] Decrypting PAK image %s.", chan->name, url);
+	}
+
+	if (! fileio_stream_file(f, ctx.allocsize, image_load_chunk, &ctx,
+				 &filesize)) {
+		/* Error already logged. */
+		error = ctx.error != 0 ? ctx.error : EIO;
+		goto out;
+	}
+	if (filesize == 0) {
+		log_error("Size of %s (0) is nonsensical.", url);
+		goto out;
+	}
+	if (ctx.encrypted && ctx.decrypted != filesize) {
+		log_error("[%s] %s size %zu is not a multiple of "
+		    "DES block size.", chan->name, url, filesize);
+		goto out;
+	}
 
-	/* Now cache a copy. */
-	cp = malloc(allocsize);
-	if (cp == NULL) {
-		log_error("[%s] Unable to allocate %zu bytes to cache listing.",
-		    chan->name, allocsize);
-		return data;
+	if (filesize < ctx.allocsize) {
+		/* Give back the slop from an unknown-size transfer. */
+		uint8_t *data = realloc(ctx.data, filesize);
+		if (data != NULL) {
+			ctx.data = data;
+		}
 	}
-	memcpy(cp, data, allocsize);
 
-	pthread_mutex_lock(&image_cache_lock);
-	tmp = chan->listing;
-	chan->listing = cp;
-	chan->listing_size = allocsize;
-	pthread_mutex_unlock(&image_cache_lock);
-	if (tmp != NULL) {
-		free(tmp);
+	if (chan->type == IMAGE_CHANNEL_PAK) {
+		img = image_from_pak(chan, image, image_name, ctx.data,
+		    filesize);
+	} else {
+		img = image_from_nabu(chan, image, image_name, ctx.data,
+		    filesize);
 	}
-	log_info("[%s] Cached %zu bytes of listing data.", chan->name,
-	    allocsize);
+	ctx.data = NULL;		/* image owns it now */
 
-	return data;
+	if (img != NULL) {
+		/* For cache management decisions later. */
+		img->is_local = attrs.is_local;
+	}
+
+ out:
+	if (cipher_valid) {
+		pak_cipher_fini(&ctx.cipher);
+	}
+	if (ctx.data != NULL) {
+		free(ctx.data);
+	}
+	fileio_close(f);
+	if (! attrs.is_local) {
+		metrics_observe(METRIC_HIST_FETCH_LATENCY, start);
+	}
+	if (img == NULL) {
+		errno = error;
+	}
+	return img;
 }
 
 /*
- * image_nabu_name --
- *	Generate a NABU flat image name.
+ * Mirror selection.  Each mirror has a smoothed latency (and mean
+ * deviation, a la TCP's RTT estimator) and a smoothed error rate.
+ * Fetches go to the mirror with the best expected latency, penalized
+ * by its error rate; mirrors we haven't heard from in a while are
+ * treated as unknown, which gives them a chance to redeem themselves.
+ *
+ * If the chosen mirror hasn't delivered the image by the time we'd
+ * reasonably expect it to, a hedged request is sent to the next-best
+ * mirror, and whichever finishes first wins; the loser is cancelled.
+ * If a fetch fails outright, we fail over to the next mirror.
  */
-static char *
-image_nabu_name(uint32_t image)
+static pthread_mutex_t image_mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define	IMAGE_MIRROR_STALE	(300 * UINT64_C(1000000000))
+#define	IMAGE_HEDGE_DEFAULT	UINT64_C(1000000000)
+#define	IMAGE_HEDGE_MIN		UINT64_C(20000000)
+#define	IMAGE_HEDGE_MAX		UINT64_C(5000000000)
+
+struct image_fetch_race {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cv;
+	struct nabu_image *img;		/* the winner */
+	unsigned int	running;
+	unsigned int	refcnt;
+	int		error;		/* most telling failure */
+	bool		cancel;
+	bool		hedged;
+};
+
+struct image_fetch {
+	struct image_fetch_race *race;
+	struct image_channel *chan;	/* retained; keeps the mirror too */
+	struct image_mirror *mirror;
+	char		*url;
+	char		*image_name;
+	uint32_t	image;
+	bool		encrypted;
+};
+
+/*
+ * image_mirror_is_stale --
+ *	Check if we've heard from a mirror recently enough to trust
+ *	its statistics.  Must be called with the mirror lock held.
+ */
+static bool
+image_mirror_is_stale(const struct image_mirror *mirror, uint64_t now)
 {
-	char namestr[sizeof("000001.nabu")];
-	snprintf(namestr, sizeof(namestr), "%06X.nabu", image);
-	return strdup(namestr);
+	return mirror->last_sample == 0 ||
+	    now - mirror->last_sample > IMAGE_MIRROR_STALE;
 }
 
-#define	ENCRYPTED_PAK_NAME_SIZE	\
-	sizeof("FE-A1-04-B7-3D-67-F8-8B-26-4C-0C-81-9B-F6-24-58.npak")
-
 /*
- * image_encrypted_pak_name --
- *	Generate a NabuRetroNet encrypted PAK name from the given
- *	image number.
+ * image_mirror_record --
+ *	Record the outcome of a fetch from a mirror.  A fetch that
+ *	was cancelled because it lost a race contributes its elapsed
+ *	time as a latency sample; it was at least that slow.  A fetch
+ *	that failed counts as being as slow as we're willing to wait,
+ *	lest a mirror that refuses connections look fast.
  */
-static char *
-image_encrypted_pak_name(uint32_t image)
+static void
+image_mirror_record(struct image_mirror *mirror, uint64_t start,
+    bool ok, bool won)
 {
-#if defined(HAVE_COMMONCRYPTO_H) || defined(HAVE_OPENSSL)
-	char namestr[sizeof("000001nabu")];
-	char pakname[ENCRYPTED_PAK_NAME_SIZE];
-
-	MD5_CTX ctx;
-	unsigned char digest[MD5_DIGEST_LENGTH];
+	uint64_t now = metrics_timestamp();
+	double sample = (double)(now - start);
+	double err;
 
-	snprintf(namestr, sizeof(namestr), "%06Xnabu", image);
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, namestr, sizeof(namestr) - 1);
-	MD5_Final(digest, &ctx);
+	if (! ok && sample < (double)IMAGE_HEDGE_MAX) {
+		sample = (double)IMAGE_HEDGE_MAX;
+	}
 
-	snprintf(pakname, sizeof(pakname),
-	    "%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X.npak",
-	    digest[0],  digest[1],  digest[2],  digest[3],
-	    digest[4],  digest[5],  digest[6],  digest[7],
-	    digest[8],  digest[9],  digest[10], digest[11],
-	    digest[12], digest[13], digest[14], digest[15]);
+	pthread_mutex_lock(&image_mirror_lock);
+	mirror->fetches++;
+	if (! ok) {
+		mirror->errors++;
+	}
+	if (won) {
+		mirror->wins++;
+	}
+	if (image_mirror_is_stale(mirror, now)) {
+		mirror->latency = sample;
+		mirror->latency_dev = sample / 2;
+		mirror->error_rate = ok ? 0.0 : 1.0;
+	} else {
+		err = sample - mirror->latency;
+		mirror->latency += err / 8;
+		mirror->latency_dev +=
+		    ((err < 0 ? -err : err) - mirror->latency_dev) / 4;
+		mirror->error_rate +=
+		    ((ok ? 0.0 : 1.0) - mirror->error_rate) / 8;
+	}
+	mirror->last_sample = now;
+	pthread_mutex_unlock(&image_mirror_lock);
+}
 
-	return strdup(pakname);
-#else
-	return NULL;
-#endif
+/*
+ * image_mirror_score --
+ *	Compute a mirror's score; lower is better.  Must be called
+ *	with the mirror lock held.
+ */
+static double
+image_mirror_score(const struct image_mirror *mirror, uint64_t now)
+{
+	if (image_mirror_is_stale(mirror, now)) {
+		return 0.0;
+	}
+	return mirror->latency * (1.0 + (4.0 * mirror->error_rate));
 }
 
 /*
- * image_pak_name --
- *	Generate a PAK image name.
+ * image_mirror_hedge_delay --
+ *	How long to wait for a mirror before hedging (ns).  Must be
+ *	called with the mirror lock held.
  */
-static char *
-image_pak_name(uint32_t image, bool encrypted)
+static uint64_t
+image_mirror_hedge_delay(const struct image_mirror *mirror, uint64_t now)
 {
-	char namestr[sizeof("000001.pak")];
+	double delay;
 
-	if (encrypted) {
-		return image_encrypted_pak_name(image);
+	if (image_mirror_is_stale(mirror, now)) {
+		return IMAGE_HEDGE_DEFAULT;
 	}
-
-	snprintf(namestr, sizeof(namestr), "%06X.pak", image);
-	return strdup(namestr);
+	delay = mirror->latency + (4.0 * mirror->latency_dev);
+	if (delay < (double)IMAGE_HEDGE_MIN) {
+		return IMAGE_HEDGE_MIN;
+	}
+	if (delay > (double)IMAGE_HEDGE_MAX) {
+		return IMAGE_HEDGE_MAX;
+	}
+	return (uint64_t)delay;
 }
 
 /*
- * image_from_nabu --
- *	Create an image descriptor from the provided NABU file buffer.
+ * image_fetch_race_release --
+ *	Release a reference to a fetch race.
  */
-static struct nabu_image *
-image_from_nabu(struct image_channel *chan, uint32_t image,
-    const char *image_name, uint8_t *filebuf, size_t filesize)
+static void
+image_fetch_race_release(struct image_fetch_race *race)
 {
-	char image_name_buf[sizeof("nabu-000001")];
+	unsigned int refcnt;
 
-	if (image_name == NULL) {
-		snprintf(image_name_buf, sizeof(image_name_buf),
-		    "nabu-%06X", image);
-		image_name = image_name_buf;
+	pthread_mutex_lock(&race->mutex);
+	refcnt = --race->refcnt;
+	pthread_mutex_unlock(&race->mutex);
+
+	if (refcnt == 0) {
+		pthread_mutex_destroy(&race->mutex);
+		pthread_cond_destroy(&race->cv);
+		free(race);
 	}
+}
 
-	struct nabu_image *img = calloc(1, sizeof(*img));
-	if (img == NULL) {
-		log_error("Unable to allocate image descriptor for %s.",
-		    image_name);
-		free(filebuf);
-		return NULL;
+/*
+ * image_fetch_thread --
+ *	Fetch an image from one mirror as part of a race.
+ */
+static void *
+image_fetch_thread(void *arg)
+{
+	struct image_fetch *fetch = arg;
+	struct image_fetch_race *race = fetch->race;
+	struct nabu_image *img;
+	uint64_t start = metrics_timestamp();
+	bool ok, won = false;
+	int error;
+
+	img = image_load_image_from_url(fetch->chan, fetch->image,
+	    fetch->image_name, fetch->url, fetch->encrypted, &race->cancel);
+	error = img == NULL ? errno : 0;
+
+	pthread_mutex_lock(&race->mutex);
+	/* A fetch that was cancelled didn't really fail. */
+	ok = img != NULL || race->cancel;
+	if (! ok && (race->error == 0 ||
+		     image_error_is_unhealthy(race->error))) {
+		/* Prefer errors that say the source is OK. */
+		race->error = error;
 	}
+	if (img != NULL && race->img == NULL) {
+		race->img = img;
+		race->cancel = true;
+		won = race->hedged;
+		img = NULL;
+	}
+	race->running--;
+	pthread_cond_signal(&race->cv);
+	pthread_mutex_unlock(&race->mutex);
 
-	img->channel = chan;
-	img->name = strdup(image_name);
-	img->data = filebuf;
-	img->length = filesize;
-	img->number = image;
-	img->refcnt = 1;
+	if (img != NULL) {
+		/* Finished, but lost. */
+		image_release(img);
+	}
+	image_mirror_record(fetch->mirror, start, ok, won);
 
-	return img;
+	image_fetch_race_release(race);
+	image_channel_release(fetch->chan);
+	free(fetch->url);
+	free(fetch->image_name);
+	free(fetch);
+	return NULL;
 }
 
 /*
- * image_decrypt_pak --
- *	Decrypt a PAK image.
+ * image_fetch_start --
+ *	Start fetching an image from a mirror.  Must be called with
+ *	the race mutex held.
  */
 static bool
-image_decrypt_pak(const uint8_t *src, uint8_t *dst, size_t len)
-{
-#if defined(HAVE_COMMONCRYPTO_H)
-	uint8_t iv[] = NABU_PAK_IV;
-	uint8_t key[] = NABU_PAK_KEY;
-	CCCryptorStatus status;
-	CCCryptorRef cryptor;
-	size_t actual;
-
-	status = CCCryptorCreate(kCCDecrypt, kCCAlgorithmDES, 0,
-	    key, sizeof(key), iv, &cryptor);
-	if (status == kCCSuccess) {
-		status = CCCryptorUpdate(cryptor, src, len, dst, len, &actual);
-		if (status == kCCSuccess) {
-			status = CCCryptorFinal(cryptor, dst, len, &actual);
-			if (status != kCCSuccess) {
-				log_error("CCCryptorFinal() failed: %d",
-				    status);
-			}
-		} else {
-			log_error("CCCryptorUpdate() failed: %d", status);
-		}
-		CCCryptorRelease(cryptor);
-	} else {
-		log_error("CCCryptorCreate() failed: %d", status);
+image_fetch_start(struct image_fetch_race *race, struct image_channel *chan,
+    struct image_mirror *mirror, uint32_t image, const char *image_name,
+    const char *fname, bool encrypted)
+{
+	const char *relpath = chan->path + strlen(chan->source->root);
+	struct image_fetch *fetch;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int error;
+
+	fetch = calloc(1, sizeof(*fetch));
+	if (fetch == NULL) {
+		goto nomem;
+	}
+	fetch->race = race;
+	fetch->chan = chan;
+	fetch->mirror = mirror;
+	fetch->image = image;
+	fetch->encrypted = encrypted;
+	if (asprintf(&fetch->url, "%s%s/%s", mirror->root, relpath,
+		     fname) < 0) {
+		fetch->url = NULL;
+		goto nomem;
+	}
+	if (image_name != NULL &&
+	    (fetch->image_name = strdup(image_name)) == NULL) {
+		goto nomem;
 	}
 
-	return status == kCCSuccess;
-#elif defined(HAVE_OPENSSL)
-	DES_cblock iv = NABU_PAK_IV;
-	DES_cblock key = NABU_PAK_KEY;
-	DES_key_schedule ks;
-
-	DES_set_key_unchecked(&key, &ks);
-	DES_ncbc_encrypt((const unsigned char *)src,
-	    (unsigned char *)dst, (long)len, &ks, &iv, 0);
-
+	log_debug(LOG_SUBSYS_IMAGE, "[%s] Fetching %s", chan->name,
+	    fetch->url);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	race->refcnt++;
+	race->running++;
+	/* The fetch may outlive our caller if it loses the race. */
+	image_channel_retain(chan);
+	error = pthread_create(&thread, &attr, image_fetch_thread, fetch);
+	pthread_attr_destroy(&attr);
+	if (error != 0) {
+		log_error("[%s] Unable to create fetch thread: %s",
+		    chan->name, strerror(error));
+		race->refcnt--;
+		race->running--;
+		image_channel_release(chan);
+		free(fetch->url);
+		free(fetch->image_name);
+		free(fetch);
+		return false;
+	}
 	return true;
-#else
+
+ nomem:
+	log_error("[%s] Unable to allocate fetch for %s.", chan->name, fname);
+	if (fetch != NULL) {
+		free(fetch->url);
+		free(fetch);
+	}
 	return false;
-#endif
 }
 
 /*
- * image_from_pak --
- *	Create an image descriptor from the provided PAK buffer.
+ * image_load_image_from_mirrors --
+ *	Load an image from the best of a source's mirrors, hedging
+ *	or failing over to the others as needed.
  */
 static struct nabu_image *
-image_from_pak(struct image_channel *chan, uint32_t image,
-    const char *image_name, uint8_t *pakbuf, size_t paklen,
-    bool encrypted)
+image_load_image_from_mirrors(struct image_channel *chan, uint32_t image,
+    const char *image_name, const char *fname, bool encrypted)
 {
-	char image_name_buf[sizeof("pak-000001")];
-	uint8_t *pakdata;
-
-	if (image_name == NULL) {
-		snprintf(image_name_buf, sizeof(image_name_buf),
-		    "pak-%06X", image);
-		image_name = image_name_buf;
+	struct image_source *imgsrc = chan->source;
+	struct image_mirror **order;
+	struct image_fetch_race *race;
+	struct nabu_image *img;
+	struct timespec deadline;
+	uint64_t now, delay;
+	unsigned int i, j, next;
+	bool waiting_to_hedge;
+	int error;
+
+	order = calloc(imgsrc->nmirrors, sizeof(*order));
+	race = calloc(1, sizeof(*race));
+	if (order == NULL || race == NULL) {
+		log_error("[%s] Unable to allocate mirror race.", chan->name);
+		free(order);
+		free(race);
+		return NULL;
 	}
-
-	struct nabu_image *img = calloc(1, sizeof(*img));
-	if (img == NULL) {
-		log_error("Unable to allocate image descriptor for %s.",
-		    image_name);
-		goto bad;
+	pthread_mutex_init(&race->mutex, NULL);
+	pthread_cond_init(&race->cv, NULL);
+	race->refcnt = 1;
+
+	/* Rank the mirrors, best first. */
+	now = metrics_timestamp();
+	pthread_mutex_lock(&image_mirror_lock);
+	for (i = 0; i < imgsrc->nmirrors; i++) {
+		struct image_mirror *mirror = &imgsrc->mirrors[i];
+		double score = image_mirror_score(mirror, now);
+
+		for (j = i; j > 0 &&
+		     image_mirror_score(order[j - 1], now) > score; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = mirror;
 	}
-
-	if (encrypted) {
-		if ((paklen % 8) != 0) {	/* XXX magic number */
-			log_error("[%s] %s size %zu is not a multiple of "
-			    "DES block size.", chan->name, image_name, paklen);
-			goto bad;
+	delay = image_mirror_hedge_delay(order[0], now);
+	pthread_mutex_unlock(&image_mirror_lock);
+
+	pthread_mutex_lock(&race->mutex);
+	next = 0;
+	waiting_to_hedge = false;
+	for (;;) {
+		if (race->img != NULL) {
+			break;
 		}
-
-		pakdata = malloc(paklen);
-		if (pakdata == NULL) {
-			log_error("[%s] Unable to allocate buffer for "
-			    "decrypted %s.", chan->name, image_name);
-			goto bad;
+		if (race->running == 0) {
+			/* Nothing in flight; fail over to the next one. */
+			if (next == imgsrc->nmirrors) {
+				break;
+			}
+			if (next != 0) {
+				log_info("[%s] Failing over to mirror %s.",
+				    chan->name, order[next]->root);
+				metrics_count(METRIC_IMAGE_MIRROR_FAILOVERS);
+			}
+			if (image_fetch_start(race, chan, order[next], image,
+					      image_name, fname, encrypted) &&
+			    next + 1 < imgsrc->nmirrors && ! race->hedged) {
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec += (time_t)(delay /
+				    UINT64_C(1000000000));
+				deadline.tv_nsec += (long)(delay %
+				    UINT64_C(1000000000));
+				if (deadline.tv_nsec >= 1000000000L) {
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000L;
+				}
+				waiting_to_hedge = true;
+			}
+			next++;
+			continue;
 		}
-
-		log_debug(LOG_SUBSYS_IMAGE,
-		    "[%s] Decrypting PAK image %s.", chan->name, image_name);
-		    
-		if (! image_decrypt_pak(pakbuf, pakdata, paklen)) {
-			log_error("[%s] Unable to decrypt PAK image %s.",
-			    chan->name, image_name);
-			free(pakdata);
-			goto bad;
+		if (waiting_to_hedge) {
+			if (pthread_cond_timedwait(&race->cv, &race->mutex,
+					&deadline) != ETIMEDOUT) {
+				continue;
+			}
+			waiting_to_hedge = false;
+			if (race->img != NULL || race->running == 0 ||
+			    next == imgsrc->nmirrors) {
+				continue;
+			}
+			/* Too slow -- hedge with the next mirror. */
+			log_debug(LOG_SUBSYS_IMAGE,
+			    "[%s] Hedging %s with mirror %s.",
+			    chan->name, fname, order[next]->root);
+			race->hedged = true;
+			metrics_count(METRIC_IMAGE_HEDGED_FETCHES);
+			(void) image_fetch_start(race, chan, order[next],
+			    image, image_name, fname, encrypted);
+			next++;
+			continue;
 		}
-		free(pakbuf);
-	} else {
-		pakdata = pakbuf;
+		pthread_cond_wait(&race->cv, &race->mutex);
+	}
+	img = race->img;
+	race->img = NULL;
+	race->cancel = true;
+	error = race->error != 0 ? race->error : EIO;
+	pthread_mutex_unlock(&race->mutex);
+
+	image_fetch_race_release(race);
+	free(order);
+	if (img == NULL) {
+		errno = error;
 	}
+	return img;
+}
 
-	img->channel = chan;
-	img->name = strdup(image_name);
-	img->data = pakdata;
-	img->length = paklen;
-	img->number = image;
-	img->refcnt = 1;
+/*
+ * image_load_image --
+ *	Load an image from a channel's source.  If the source is
+ *	unhealthy, fail fast rather than tying up the caller.
+ */
+static struct nabu_image *
+image_load_image(struct image_channel *chan, uint32_t image,
+    const char *image_name, const char *fname, bool encrypted)
+{
+	struct image_source *imgsrc = chan->source;
+	struct nabu_image *img;
+	char *image_url;
+	int error;
 
-	return img;
+	/*
+	 * image_load() looks at errno (EHOSTDOWN in particular) when
+	 * we fail, so don't let logging or the breaker clobber it.
+	 */
+	if (! image_breaker_admit(imgsrc)) {
+		error = errno;
+		log_info("[%s] Not loading %s; Source %s is unhealthy.",
+		    chan->name, fname, imgsrc->name);
+		errno = error;
+		return NULL;
+	}
 
- bad:
-	free(pakbuf);
-	return NULL;
+	if (imgsrc->nmirrors > 1) {
+		img = image_load_image_from_mirrors(chan, image, image_name,
+		    fname, encrypted);
+	} else if (asprintf(&image_url, "%s/%s", chan->path, fname) < 0) {
+		log_error("[%s] Unable to allocate URL for %s.",
+		    chan->name, fname);
+		img = NULL;
+		errno = ENOMEM;
+	} else {
+		img = image_load_image_from_url(chan, image, image_name,
+		    image_url, encrypted, NULL);
+		free(image_url);
+	}
+	error = img == NULL ? errno : 0;
+	image_breaker_record(imgsrc,
+	    img != NULL || ! image_error_is_unhealthy(error));
+	if (img == NULL) {
+		errno = error;
+	}
+	return img;
 }
 
 /*
- * image_load_image_from_url --
- *	Load an image from the specified url.
+ * image_load_image_from_pack --
+ *	Load an image from a channel pack.  The image data is used
+ *	in-place out of the mapping; PAK images were decrypted when
+ *	the pack was built.
  */
 static struct nabu_image *
-image_load_image_from_url(struct image_channel *chan, uint32_t image,
-    const char *image_name, const char *url, bool encrypted)
+image_load_image_from_pack(struct image_channel *chan, uint32_t image,
+    const char *image_name)
 {
+	char image_name_buf[sizeof("nabu-000001")];
+	struct chanpack_ent ent;
 	struct nabu_image *img;
-	uint8_t *filebuf;
-	size_t filesize;
-	struct fileio_attrs attrs;
+	const char *dir = chan->path + strlen(chan->source->root) + 1;
+	const char *fname = image_name;
+	char *fname_buf = NULL;
+
+	if (fname == NULL) {
+		fname_buf = chan->type == IMAGE_CHANNEL_PAK ?
+		    pak_name(image, false) : image_nabu_name(image);
+		if (fname_buf == NULL) {
+			return NULL;
+		}
+		fname = fname_buf;
+	}
 
-	filebuf = fileio_load_file_from_location(url, 0, 0, NABU_MAXSEGMENTSIZE,
-	    &attrs, &filesize);
-	if (filebuf == NULL) {
-		/* Error already logged. */
+	if (! chanpack_lookup(chan->source->pack, dir, fname, &ent)) {
+		log_error("[%s] %s/%s not found in %s.", chan->name, dir,
+		    fname, chan->source->root);
+		free(fname_buf);
 		return NULL;
 	}
+	free(fname_buf);
 
-	if (chan->type == IMAGE_CHANNEL_PAK) {
-		img = image_from_pak(chan, image, image_name, filebuf,
-		    filesize, encrypted);
-	} else {
-		img = image_from_nabu(chan, image, image_name, filebuf,
-		    filesize);
+	if (ent.length == 0 || ent.length > NABU_MAXSEGMENTSIZE) {
+		log_error("[%s] Size of %s (%zu) is nonsensical.",
+		    chan->name, ent.name, ent.length);
+		return NULL;
 	}
 
-	/* For cache management decisions later. */
-	img->is_local = attrs.is_local;
+	if (image_name == NULL) {
+		snprintf(image_name_buf, sizeof(image_name_buf), "%s-%06X",
+		    chan->type == IMAGE_CHANNEL_PAK ? "pak" : "nabu", image);
+		image_name = image_name_buf;
+	}
+
+	img = calloc(1, sizeof(*img));
+	if (img == NULL || (img->name = strdup(image_name)) == NULL) {
+		log_error("Unable to allocate image descriptor for %s.",
+		    image_name);
+		free(img);
+		return NULL;
+	}
+	image_channel_retain(chan);
+	img->channel = chan;
+	img->data = ent.data;
+	img->length = ent.length;
+	img->number = image;
+	img->refcnt = 1;
+	/*
+	 * Not is_local: pack images are immutable (a rebuilt pack
+	 * replaces the whole source), so keep them cached.
+	 */
+	img->is_mapped = true;
 
 	return img;
 }
@@ -816,20 +2244,21 @@ image_channel_select(struct nabu_connection *conn, int16_t channel)
 	    conn_name(conn), chan->number, chan->name, chan->source->name);
 
 	conn_set_channel(conn, chan);
+	image_channel_release(chan);
 }
 
 /*
  * image_load --
- *	Load the specified segment.
+ *	Load the specified image.  The image is placed in the
+ *	connection's working set, whose retain the caller borrows;
+ *	hand it back with image_unload().
  */
 struct nabu_image *
 image_load(struct nabu_connection *conn, uint32_t image)
 {
-	char *image_url = NULL;
 	struct nabu_image *img = NULL;
 	struct image_channel *chan;
 	char *selected_name = NULL;
-	int rv;
 	bool try_encrypted_pak = false;
 
 	assert(image != IMAGE_NUMBER_NAMED);
@@ -845,41 +2274,26 @@ image_load(struct nabu_connection *conn, uint32_t image)
 		}
 	}
 
-	pthread_mutex_lock(&image_cache_lock);
-
-	img = conn_get_last_image(conn);
-	if (img != NULL) {
-		/* Maybe a cache hit. */
-		if (image == IMAGE_NUMBER_NAMED &&
-		    strcmp(img->name, selected_name) == 0) {
-			/* Cache hit! */
-			log_debug(LOG_SUBSYS_IMAGE,
-			    "[%s] Connection cache hit for named image: %s",
-			    conn_name(conn), img->name);
-		} else if (image != IMAGE_NUMBER_NAMED &&
-			   img->number == image) {
-			/* Cache hit! */
-			log_debug(LOG_SUBSYS_IMAGE,
-			    "[%s] Connection cache hit for image %06X: %s",
-			    conn_name(conn), image, img->name);
-		} else {
-			/* Boo, cache miss. */
-			img = NULL;
-		}
-	}
-	if (img != NULL) {
-		image_retain_locked(img);
-		pthread_mutex_unlock(&image_cache_lock);
-		goto out;
-	}
-
 	chan = conn_get_channel(conn);
 	if (chan == NULL) {
 		log_error("[%s] No channel selected.", conn_name(conn));
-		pthread_mutex_unlock(&image_cache_lock);
 		goto out;
 	}
 
+	/*
+	 * Check the connection's working set first; this doesn't
+	 * need the image cache lock.
+	 */
+	img = conn_image_lookup(conn, chan, image, selected_name);
+	if (img != NULL) {
+		log_debug(LOG_SUBSYS_IMAGE,
+		    "[%s] Connection cache hit for image %06X: %s",
+		    conn_name(conn), image, img->name);
+		metrics_count(METRIC_IMAGE_CACHE_HITS);
+		goto out;
+	}
+
+	pthread_mutex_lock(&image_cache_lock);
 	if ((img = image_cache_lookup_locked(chan, image)) != NULL) {
 		struct nabu_image *oimg;
 
@@ -888,30 +2302,39 @@ image_load(struct nabu_connection *conn, uint32_t image)
 		    "Channel %u cache hit for image %06X: %s",
 		    chan->number, image, img->name);
 
-		/* Add an extra retain for the last-image cache. */
-		image_retain_locked(img);
-		oimg = conn_set_last_image(conn, img);
+		/* The working set takes over the lookup's retain. */
+		oimg = conn_image_insert(conn, img);
 		oimg = image_release_locked(oimg);
 		pthread_mutex_unlock(&image_cache_lock);
 		image_free(oimg);
+		metrics_count(METRIC_IMAGE_CACHE_HITS);
 		goto out;
 	}
 
 	pthread_mutex_unlock(&image_cache_lock);
+	metrics_count(METRIC_IMAGE_CACHE_MISSES);
+
+	event_post(NABUCTL_EV_IMAGE_LOAD_START, conn_name(conn), chan->number,
+	    image, selected_name);
+
+	if (chan->source->pack != NULL) {
+		img = image_load_image_from_pack(chan, image, selected_name);
+		goto loaded;
+	}
 
  try_again:
 	if (selected_name != NULL) {
-		rv = asprintf(&image_url, "%s/%s", chan->path, selected_name);
-		assert(rv != -1 && image_url != NULL);
 		log_debug(LOG_SUBSYS_IMAGE,
 		    "[%s] Loading '%s' from %s", conn_name(conn),
-		    selected_name, image_url);
+		    selected_name, chan->path);
+		img = image_load_image(chan, image, selected_name,
+		    selected_name, false);
 	} else {
 		const char *imgtype;
 		char *fname;
 
 		if (chan->type == IMAGE_CHANNEL_PAK) {
-			fname = image_pak_name(image, try_encrypted_pak);
+			fname = pak_name(image, try_encrypted_pak);
 			imgtype = "pak";
 		} else {
 			fname = image_nabu_name(image);
@@ -921,27 +2344,25 @@ image_load(struct nabu_connection *conn, uint32_t image)
 			log_error("[%s] Unable to generate file name "
 			    "for %s-%06X.", conn_name(conn),
 			    imgtype, image);
+		} else {
+			log_debug(LOG_SUBSYS_IMAGE,
+			    "[%s] Loading %s-%06X (%s) from %s",
+			    conn_name(conn), imgtype, image, fname,
+			    chan->path);
+			img = image_load_image(chan, image, NULL, fname,
+			    try_encrypted_pak);
+			free(fname);
 		}
-		rv = asprintf(&image_url, "%s/%s", chan->path, fname);
-		assert(rv != -1 && image_url != NULL);
-		log_debug(LOG_SUBSYS_IMAGE,
-		    "[%s] Loading %s-%06X from %s", conn_name(conn),
-		    imgtype, image, image_url);
-		free(fname);
 	}
-
-	img = image_load_image_from_url(chan, image, selected_name, image_url,
-	    try_encrypted_pak);
-	free(image_url);
+ loaded:
 	if (img != NULL) {
 		struct nabu_image *oimg, *using_img;
 
 		pthread_mutex_lock(&image_cache_lock);
 		using_img = image_cache_insert_locked(chan, img);
 
-		/* Add an extra retain for the last-image cache. */
-		image_retain_locked(using_img);
-		oimg = conn_set_last_image(conn, using_img);
+		/* The working set takes over the caller's retain. */
+		oimg = conn_image_insert(conn, using_img);
 		oimg = image_release_locked(oimg);
 		if (using_img != img) {
 			img = image_release_locked(img);
@@ -952,22 +2373,34 @@ image_load(struct nabu_connection *conn, uint32_t image)
 		image_free(oimg);
 		image_free(img);
 		img = using_img;
+
+		event_count(EVENT_CTR_IMAGE_LOADS);
+		event_post(NABUCTL_EV_IMAGE_LOAD_DONE, conn_name(conn),
+		    chan->number, image, img->name);
 	} else {
-		if (selected_name == NULL &&
-		    chan->type == IMAGE_CHANNEL_PAK && !try_encrypted_pak) {
+		if (selected_name == NULL && chan->source->pack == NULL &&
+		    chan->type == IMAGE_CHANNEL_PAK && !try_encrypted_pak &&
+		    errno != EHOSTDOWN) {
 			/*
 			 * The unencrypted name didn't work.  While the
 			 * original 1984 cycles are now being vended as
 			 * unencrypted files for the most part, our config
 			 * might be referencing an old Source, so we'll
 			 * try the encrypted name if the regular name failed.
+			 * (No point if the source's breaker is open.)
 			 */
 			try_encrypted_pak = true;
 			goto try_again;
 		}
+		event_count(EVENT_CTR_IMAGE_LOAD_FAILURES);
+		event_post(NABUCTL_EV_IMAGE_LOAD_FAILED, conn_name(conn),
+		    chan->number, image, selected_name);
 	}
 
  out:
+	if (chan != NULL) {
+		image_channel_release(chan);
+	}
 	if (selected_name != NULL) {
 		free(selected_name);
 	}
@@ -976,46 +2409,36 @@ image_load(struct nabu_connection *conn, uint32_t image)
 
 /*
  * image_unload --
- *	The reverse of image_load().  We release our references, and
- *	maybe free the image completely.
+ *	The reverse of image_load().  Images stay in the connection's
+ *	working set for next time, except that once a local image has
+ *	been sent in full it's dropped from the working set and the
+ *	channel cache, so that changes to the file are picked up the
+ *	next time it's loaded.
  */
 void
 image_unload(struct nabu_connection *conn, struct nabu_image *img,
     bool lastuse)
 {
-	struct nabu_image *oimg;
+	struct nabu_image *wimg = NULL, *cimg;
 
-	pthread_mutex_lock(&image_cache_lock);
-
-	/*
-	 * If this is the last-use of an image by the connection, then
-	 * get rid of caching retains before dropping the primary retain.
-	 */
-	if (lastuse) {
-		log_debug(LOG_SUBSYS_IMAGE,
-		    "[%s] dropping last-image retain of %s.",
-		    conn_name(conn), img->name);
-		oimg = conn_set_last_image(conn, NULL);
-		assert(oimg == img);
-		image_release_locked(oimg);
-
-		if (img->is_local) {
-			log_debug(LOG_SUBSYS_IMAGE,
-			    "[%s] Removing %s from channel cache.",
-			    conn_name(conn), img->name);
-			oimg = image_cache_remove_locked(img);
-			if (oimg != NULL) {
-				log_debug(LOG_SUBSYS_IMAGE,
-				    "[%s] Dropping cache retain for %s.",
-				    conn_name(conn), img->name);
-				image_release_locked(oimg);
-			}
-		}
+	if (! lastuse || ! img->is_local) {
+		return;
 	}
 
-	img = image_release_locked(img);
+	log_debug(LOG_SUBSYS_IMAGE,
+	    "[%s] Removing %s from working set and channel cache.",
+	    conn_name(conn), img->name);
 
+	pthread_mutex_lock(&image_cache_lock);
+	if (conn_image_remove(conn, img)) {
+		wimg = image_release_locked(img);
+	}
+	cimg = image_cache_remove_locked(img);
+	if (cimg != NULL) {
+		cimg = image_release_locked(cimg);
+	}
 	pthread_mutex_unlock(&image_cache_lock);
 
-	image_free(img);
+	image_free(wimg);
+	image_free(cimg);
 }
@@ -29,13 +29,60 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "libnabud/nbsd_queue.h"
 
+struct chanpack;
+
+/*
+ * A source may have several mirrors with the same layout.  We track
+ * how each one is doing so that fetches go to the best one.  The
+ * statistics are protected by the mirror lock in image.c.
+ */
+struct image_mirror {
+	char		*root;
+	double		latency;	/* smoothed fetch latency (ns) */
+	double		latency_dev;	/* smoothed mean deviation (ns) */
+	double		error_rate;	/* smoothed fraction of failures */
+	uint64_t	last_sample;	/* time of last sample (ns) */
+	uint64_t	fetches;
+	uint64_t	errors;
+	uint64_t	wins;		/* fetches won when hedged */
+};
+
+/*
+ * Remote sources are guarded by a circuit breaker.  After enough
+ * consecutive failures the breaker opens and requests that would go
+ * to the source fail immediately (cached data is still served).  Once
+ * the cool-down expires, one request is let through as a probe; if it
+ * succeeds the breaker closes, otherwise it opens again for longer.
+ * Protected by the breaker lock in image.c.
+ */
+typedef enum {
+	IMAGE_BREAKER_CLOSED		= 0,
+	IMAGE_BREAKER_OPEN		= 1,
+	IMAGE_BREAKER_HALF_OPEN		= 2,
+} image_breaker_state;
+
+struct image_breaker {
+	image_breaker_state state;
+	unsigned int	failures;	/* consecutive failures */
+	unsigned int	trips;		/* consecutive trips (for backoff) */
+	uint64_t	retry_time;	/* when to probe (ns) */
+};
+
 struct image_source {
 	LIST_ENTRY(image_source) link;
 	char		*name;
-	char		*root;
+	char		*root;		/* == mirrors[0].root */
+	struct chanpack	*pack;		/* if root is a channel pack */
+	struct image_mirror *mirrors;
+	unsigned int	nmirrors;
+	struct image_breaker breaker;
+	unsigned int	refcnt;
+	bool		remote;
+	bool		stale;		/* not (yet) seen during reload */
 };
 
 typedef enum {
@@ -57,7 +104,11 @@ struct image_channel {
 	void		*listing;
 	size_t		listing_size;
 	unsigned int	number;
+	unsigned int	refcnt;
 	bool		retronet_enabled;
+	bool		stale;		/* not (yet) seen during reload */
+	bool		retired;	/* removed by a reload */
+	uint32_t	cache_generation; /* bumped when cache is cleared */
 	LIST_HEAD(, nabu_image) image_cache;
 };
 
@@ -70,12 +121,15 @@ struct nabu_image {
 	uint32_t	number;
 	uint32_t	refcnt;
 	bool		is_local;
+	bool		is_mapped;	/* data is in a channel pack */
 	bool		cached;
 };
 
 struct image_add_source_args {
 	char		*name;
 	char		*root;
+	char		**mirrors;	/* additional locations */
+	unsigned int	nmirrors;
 };
 
 struct image_add_channel_args {
@@ -93,12 +147,21 @@ struct nabu_connection;
 
 void	image_add_source(const struct image_add_source_args *);
 void	image_add_channel(const struct image_add_channel_args *);
+void	image_reload_begin(void);
+void	image_reload_end(void);
 
 struct image_channel *image_channel_lookup(unsigned int);
+void	image_channel_retain(struct image_channel *);
+void	image_channel_release(struct image_channel *);
 bool	image_channel_enumerate(bool (*)(struct image_channel *, void *),
 				void *);
 void	image_cache_clear(struct image_channel *);
+bool	image_cache_snapshot(FILE *);
+void	image_cache_restore(FILE *);
+size_t	image_cache_resident_bytes(void);
 char *	image_channel_copy_listing(struct image_channel *, size_t *);
+void	image_channel_prefetch_listings(void);
+bool	image_source_health(struct image_source *, char *, size_t);
 
 void	image_channel_select(struct nabu_connection *, int16_t);
 struct nabu_image *image_load(struct nabu_connection *, uint32_t);
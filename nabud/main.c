@@ -52,6 +52,8 @@
 #include "conn.h"
 #include "control.h"
 #include "image.h"
+#include "metrics.h"
+#include "upgrade.h"
 
 #include "../libmj/mj.h"
 
@@ -202,8 +204,9 @@ config_load_channel(mj_t *atom)
 static void
 config_load_source(mj_t *atom)
 {
-	mj_t *name_atom, *loc_atom;
+	mj_t *name_atom, *loc_atom, *mirrors_atom, *mirror_atom;
 	struct image_add_source_args args = { };
+	unsigned int i;
 
 	if (! VALID_ATOM(atom, MJ_OBJECT)) {
 		config_error("Invalid Source object", atom);
@@ -226,10 +229,40 @@ config_load_source(mj_t *atom)
 	}
 	mj_asprint(&args.root, loc_atom, MJ_HUMAN);
 
+	mirrors_atom = mj_get_atom(atom, "Mirrors");
+	if (mirrors_atom != NULL) {
+		if (! VALID_ATOM(mirrors_atom, MJ_ARRAY)) {
+			config_error("Invalid Mirrors in Source object",
+			    atom);
+			goto out;
+		}
+		if (mj_arraycount(mirrors_atom) != 0) {
+			args.mirrors = calloc(mj_arraycount(mirrors_atom),
+			    sizeof(*args.mirrors));
+			if (args.mirrors == NULL) {
+				log_error("Unable to allocate Mirrors for "
+				    "Source %s", args.name);
+				goto out;
+			}
+		}
+		for (i = 0; i < mj_arraycount(mirrors_atom); i++) {
+			mirror_atom = mj_get_atom(mirrors_atom, i);
+			if (! VALID_ATOM(mirror_atom, MJ_STRING)) {
+				config_error("Invalid Mirror location in "
+				    "Source object", atom);
+				goto out;
+			}
+			mj_asprint(&args.mirrors[args.nmirrors++],
+			    mirror_atom, MJ_HUMAN);
+		}
+	}
+
 	image_add_source(&args);
 	/* image_add_source() owns these. */
 	args.name = NULL;
 	args.root = NULL;
+	args.mirrors = NULL;
+	args.nmirrors = 0;
 
  out:
 	if (args.name != NULL) {
@@ -238,14 +271,58 @@ config_load_source(mj_t *atom)
 	if (args.root != NULL) {
 		free(args.root);
 	}
+	for (i = 0; i < args.nmirrors; i++) {
+		free(args.mirrors[i]);
+	}
+	if (args.mirrors != NULL) {
+		free(args.mirrors);
+	}
+}
+
+/*
+ * config_get_limit --
+ *	Get an optional non-negative limit from a Connection stanza.
+ */
+static bool
+config_get_limit(mj_t *atom, const char *name, unsigned int *valp)
+{
+	mj_t *limit_atom;
+	char *str = NULL, msg[64];
+	long val;
+
+	limit_atom = mj_get_atom(atom, name);
+	if (limit_atom == NULL) {
+		*valp = 0;
+		return true;
+	}
+	if (VALID_ATOM(limit_atom, MJ_NUMBER)) {
+		mj_asprint(&str, limit_atom, MJ_HUMAN);
+		val = strtol(str, NULL, 10);
+		free(str);
+		if (val >= 0 && val <= INT32_MAX) {
+			*valp = (unsigned int)val;
+			return true;
+		}
+	}
+	snprintf(msg, sizeof(msg), "Invalid %s in Connection object", name);
+	config_error(msg, atom);
+	return false;
 }
 
+/*
+ * config_load_connection --
+ *	Load a Connection stanza.  Each connection is identified
+ *	by a key built from all of its parameters; if a connection
+ *	with the same key already exists (because we're reloading),
+ *	it is left alone.  Otherwise, it is created if "add" is true.
+ */
 static void
-config_load_connection(mj_t *atom)
+config_load_connection(mj_t *atom, bool add)
 {
 	mj_t *type_atom, *port_atom, *channel_atom, *file_root_atom,
-	    *baud_atom, *flow_control_atom;
-	char *type = NULL, *channel = NULL, *baud = NULL;
+	    *baud_atom, *stop_bits_atom, *flow_control_atom, *record_atom;
+	char *type = NULL, *channel = NULL, *baud = NULL, *stop_bits = NULL;
+	char *record_dir = NULL, *key = NULL;
 	struct conn_add_args args = { };
 	long val;
 
@@ -292,6 +369,20 @@ config_load_connection(mj_t *atom)
 	}
 	args.baud = (unsigned int)val;
 
+	/* StopBits is optional. */
+	stop_bits_atom = mj_get_atom(atom, "StopBits");
+	if (VALID_ATOM(stop_bits_atom, MJ_NUMBER)) {
+		mj_asprint(&stop_bits, stop_bits_atom, MJ_HUMAN);
+		val = strtol(stop_bits, NULL, 10);
+		if (val != 1 && val != 2) {
+			config_error("StopBits must be 1 or 2", atom);
+			goto out;
+		}
+	} else {
+		val = 0;
+	}
+	args.stop_bits = (unsigned int)val;
+
 	/* FlowControl is optional. */
 	flow_control_atom = mj_get_atom(atom, "FlowControl");
 	if (VALID_ATOM(flow_control_atom, MJ_TRUE)) {
@@ -310,6 +401,32 @@ config_load_connection(mj_t *atom)
 		mj_asprint(&args.file_root, file_root_atom, MJ_HUMAN);
 	}
 
+	/* RecordSessions is optional. */
+	record_atom = mj_get_atom(atom, "RecordSessions");
+	if (VALID_ATOM(record_atom, MJ_STRING)) {
+		mj_asprint(&record_dir, record_atom, MJ_HUMAN);
+		args.record_dir = record_dir;
+	}
+
+	/* Admission control limits are optional (TCP only). */
+	if (! config_get_limit(atom, "MaxConnections",
+			       &args.max_connections) ||
+	    ! config_get_limit(atom, "ConnectionRate",
+			       &args.connection_rate) ||
+	    ! config_get_limit(atom, "RequestRate", &args.request_rate)) {
+		goto out;
+	}
+
+	/* ImageWorkingSet is optional. */
+	if (! config_get_limit(atom, "ImageWorkingSet", &args.max_images)) {
+		goto out;
+	}
+	if (args.max_images > CONN_IMAGES_MAX) {
+		config_error("ImageWorkingSet in Connection object "
+		    "is too large", atom);
+		goto out;
+	}
+
 	type_atom = mj_get_atom(atom, "Type");
 	if (! VALID_ATOM(type_atom, MJ_STRING)) {
 		config_error("Invalid or missing Type in Connection object",
@@ -318,6 +435,28 @@ config_load_connection(mj_t *atom)
 	}
 	mj_asprint(&type, type_atom, MJ_HUMAN);
 
+	if (strcasecmp(type, "serial") != 0 && strcasecmp(type, "tcp") != 0) {
+		config_error("Connection Type must be Serial or TCP", atom);
+		goto out;
+	}
+
+	if (asprintf(&key, "%s|%s|%u|%u|%u|%d|%s|%s|%u|%u|%u|%u",
+		     strcasecmp(type, "serial") == 0 ? "serial" : "tcp",
+		     args.port, args.channel, args.baud, args.stop_bits,
+		     args.flow_control,
+		     args.file_root != NULL ? args.file_root : "",
+		     record_dir != NULL ? record_dir : "",
+		     args.max_connections, args.connection_rate,
+		     args.request_rate, args.max_images) < 0) {
+		log_error("Unable to allocate connection key.");
+		key = NULL;
+		goto out;
+	}
+	if (conn_reload_keep(key) || ! add) {
+		goto out;
+	}
+	args.config_key = key;
+
 	if (strcasecmp(type, "serial") == 0) {
 		conn_add_serial(&args);
 		/* conn_add_serial() owns these. */
@@ -326,9 +465,6 @@ config_load_connection(mj_t *atom)
 		conn_add_tcp(&args);
 		/* conn_add_tcp() owns these. */
 		args.port = args.file_root = NULL;
-	} else {
-		config_error("Connection Type must be Serial or TCP", atom);
-		goto out;
 	}
 
  out:
@@ -344,15 +480,133 @@ config_load_connection(mj_t *atom)
 	if (baud != NULL) {
 		free(baud);
 	}
+	if (stop_bits != NULL) {
+		free(stop_bits);
+	}
+	if (record_dir != NULL) {
+		free(record_dir);
+	}
+	if (key != NULL) {
+		free(key);
+	}
 	if (args.file_root != NULL) {
 		free(args.file_root);
 	}
 }
 
+static void
+config_load_log_rate_limit(mj_t *atom)
+{
+	mj_t *subsys_atom, *rate_atom, *burst_atom;
+	char *subsys = NULL, *rate = NULL, *burst = NULL;
+	long rate_val, burst_val = 0;
+
+	if (! VALID_ATOM(atom, MJ_OBJECT)) {
+		config_error("Invalid LogRateLimit object.", atom);
+		goto out;
+	}
+
+	subsys_atom = mj_get_atom(atom, "Subsystem");
+	if (! VALID_ATOM(subsys_atom, MJ_STRING)) {
+		config_error("Invalid or missing Subsystem in "
+		    "LogRateLimit object", atom);
+		goto out;
+	}
+	mj_asprint(&subsys, subsys_atom, MJ_HUMAN);
+
+	rate_atom = mj_get_atom(atom, "Rate");
+	if (! VALID_ATOM(rate_atom, MJ_NUMBER)) {
+		config_error("Invalid or missing Rate in "
+		    "LogRateLimit object", atom);
+		goto out;
+	}
+	mj_asprint(&rate, rate_atom, MJ_HUMAN);
+	rate_val = strtol(rate, NULL, 10);
+	if (rate_val < 0 || rate_val > 1000000) {
+		config_error("Rate must be between 0 and 1000000", atom);
+		goto out;
+	}
+
+	/* Burst is optional. */
+	burst_atom = mj_get_atom(atom, "Burst");
+	if (VALID_ATOM(burst_atom, MJ_NUMBER)) {
+		mj_asprint(&burst, burst_atom, MJ_HUMAN);
+		burst_val = strtol(burst, NULL, 10);
+		if (burst_val < 1 || burst_val > 1000000) {
+			config_error("Burst must be between 1 and 1000000",
+			    atom);
+			goto out;
+		}
+	} else {
+		burst_val = rate_val * 2;
+	}
+
+	if (! log_ratelimit_set(subsys, (unsigned int)rate_val,
+				(unsigned int)burst_val)) {
+		config_error("Unknown Subsystem in LogRateLimit object", atom);
+	}
+
+ out:
+	if (subsys != NULL) {
+		free(subsys);
+	}
+	if (rate != NULL) {
+		free(rate);
+	}
+	if (burst != NULL) {
+		free(burst);
+	}
+}
+
+static void
+config_load_metrics(mj_t *atom)
+{
+	mj_t *port_atom, *address_atom;
+	char *port = NULL, *address = NULL;
+
+	if (! VALID_ATOM(atom, MJ_OBJECT)) {
+		config_error("Invalid Metrics object.", atom);
+		goto out;
+	}
+
+	port_atom = mj_get_atom(atom, "Port");
+	if (! VALID_ATOM(port_atom, MJ_STRING)) {
+		config_error("Invalid or missing Port in Metrics object",
+		    atom);
+		goto out;
+	}
+	mj_asprint(&port, port_atom, MJ_HUMAN);
+
+	/* Address is optional. */
+	address_atom = mj_get_atom(atom, "Address");
+	if (VALID_ATOM(address_atom, MJ_STRING)) {
+		mj_asprint(&address, address_atom, MJ_HUMAN);
+	}
+
+	metrics_init(address, port);
+
+ out:
+	if (port != NULL) {
+		free(port);
+	}
+	if (address != NULL) {
+		free(address);
+	}
+}
+
+/*
+ * config_load --
+ *	Load the configuration file.  When reloading, sources,
+ *	channels, and connections that are unchanged are left as-is
+ *	(along with their image caches), changed ones are replaced,
+ *	and ones that are no longer present are removed.  The Metrics
+ *	stanza is only processed at startup.
+ */
 static bool
-config_load(const char *path)
+config_load(const char *path, bool reload)
 {
-	mj_t root_atom, *sources_atom, *channels_atom, *connections_atom;
+	mj_t root_atom, *sources_atom, *channels_atom, *connections_atom,
+	    *rate_limits_atom, *metrics_atom;
 	int from, to, tok, i;
 	uint8_t *file_data = NULL;
 	size_t file_size;
@@ -401,6 +655,28 @@ config_load(const char *path)
 		goto out;
 	}
 
+	/* LogRateLimits is optional. */
+	rate_limits_atom = mj_get_atom(&root_atom, "LogRateLimits");
+	if (VALID_ATOM(rate_limits_atom, MJ_ARRAY)) {
+		for (i = 0; i < mj_arraycount(rate_limits_atom); i++) {
+			config_load_log_rate_limit(
+			    mj_get_atom(rate_limits_atom, i));
+		}
+	}
+
+	/* Metrics is optional. */
+	metrics_atom = mj_get_atom(&root_atom, "Metrics");
+	if (metrics_atom != NULL && ! reload) {
+		config_load_metrics(metrics_atom);
+	}
+
+	if (reload) {
+		/* Storage areas may have moved; re-open their roots. */
+		fileio_local_roots_flush();
+		image_reload_begin();
+		conn_reload_begin();
+	}
+
 	/* Load up the sources. */
 	for (i = 0; i < mj_arraycount(sources_atom); i++) {
 		config_load_source(mj_get_atom(sources_atom, i));
@@ -411,10 +687,26 @@ config_load(const char *path)
 		config_load_channel(mj_get_atom(channels_atom, i));
 	}
 
+	if (reload) {
+		image_reload_end();
+
+		/*
+		 * Figure out which connections we're keeping, and shut
+		 * down the rest before adding new ones; a changed
+		 * connection might be re-using the same port.
+		 */
+		for (i = 0; i < mj_arraycount(connections_atom); i++) {
+			config_load_connection(
+			    mj_get_atom(connections_atom, i), false);
+		}
+		conn_reload_end();
+	}
+
 	/* Load up the connections. */
 	for (i = 0; i < mj_arraycount(connections_atom); i++) {
-		config_load_connection(mj_get_atom(connections_atom, i));
+		config_load_connection(mj_get_atom(connections_atom, i), true);
 	}
+	ret = true;
 
  out:
 	mj_delete(&root_atom);
@@ -473,6 +765,7 @@ main(int argc, char *argv[])
 	int ch;
 
 	setprogname(argv[0]);
+	upgrade_init(argv);
 
 	while ((ch = getopt(argc, argv,
 			    GETOPT_FLAGS PLATFORM_GETOPT_FLAGS)) != -1) {
@@ -596,15 +889,39 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	/* If we're not running in the foreground, daemonize ourselves now. */
-	if (!foreground && daemon(0, 0) < 0) {
+	/*
+	 * If we're not running in the foreground, daemonize ourselves now
+	 * (unless we're being upgraded, in which case we already are).
+	 */
+	if (!foreground && !upgrade_in_progress() && daemon(0, 0) < 0) {
 		fprintf(stderr, "Unable to daemonize: %s\n",
 		    strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
+	/*
+	 * Block the shutdown, reload, and upgrade signals before creating
+	 * any threads so that they are only delivered to sigwait() below;
+	 * otherwise the default action would kill us before pending
+	 * log messages are flushed.
+	 */
+	sigset_t waitset;
+	int sig;
+
+	sigemptyset(&waitset);
+	sigaddset(&waitset, SIGINT);
+	sigaddset(&waitset, SIGTERM);
+	sigaddset(&waitset, SIGHUP);
+	sigaddset(&waitset, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &waitset, NULL);
+
+	/*
+	 * Now that we're done forking, move logging off of the
+	 * connection threads.
+	 */
+	(void) log_async_start();
+
 	/* Set up our signal state. */
-	(void) signal(SIGHUP, SIG_IGN);
 	(void) signal(SIGPIPE, SIG_IGN);
 
 	log_info("Welcome to NABU! I'm version %s of your host, %s.",
@@ -616,7 +933,13 @@ main(int argc, char *argv[])
 	control_init(NULL);
 
 	/* Load our configuration */
-	config_load(nabud_conf);
+	config_load(nabud_conf, false);
+
+	/* Pick up the image cache from our predecessor, if any. */
+	upgrade_finish();
+
+	/* Warm up channel listings in the background. */
+	image_channel_prefetch_listings();
 
 	if (conn_count == 0) {
 		log_error("No connections! So boring! Goodbye.");
@@ -625,18 +948,33 @@ main(int argc, char *argv[])
 
 	/*
 	 * Now that our connections are up and running, just wait
-	 * for a clean-shutdown signal.
+	 * for a clean-shutdown signal, reloading the configuration
+	 * whenever we get a SIGHUP and upgrading in-place whenever
+	 * we get a SIGUSR2.
 	 */
-	sigset_t waitset;
-	int sig;
-
-	sigemptyset(&waitset);
-	sigaddset(&waitset, SIGINT);
-	sigaddset(&waitset, SIGTERM);
-
-	if (sigwait(&waitset, &sig) != 0) {
-		log_fatal("sigwait() failed: %s\n", strerror(errno));
-		/* NOTREACHED */
+	for (;;) {
+		if (sigwait(&waitset, &sig) != 0) {
+			log_fatal("sigwait() failed: %s\n", strerror(errno));
+			/* NOTREACHED */
+		}
+		if (sig == SIGUSR2) {
+			log_info("Received SIGUSR2, upgrading.");
+			upgrade_exec();
+			/* Only get here if it failed. */
+			continue;
+		}
+		if (sig != SIGHUP) {
+			break;
+		}
+		log_info("Received SIGHUP, reloading configuration.");
+		if (config_load(nabud_conf, true)) {
+			image_channel_prefetch_listings();
+			log_info("Configuration reloaded; %u connections.",
+			    conn_count);
+		} else {
+			log_error("Configuration reload failed; "
+			    "keeping the current configuration.");
+		}
 	}
 
 	log_info("Received signal %d, shutting down...", sig);
@@ -0,0 +1,782 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Daemon metrics, exported in OpenMetrics text format over a small
+ * local HTTP listener.
+ *
+ * Every thread that records a metric gets its own shard of counters
+ * and histogram buckets.  Only the owning thread ever writes to a
+ * shard, so recording a metric is a plain load and store with no
+ * read-modify-write atomics and no locks.  A scrape walks the list
+ * of shards and sums them; the shard list lock is taken only when
+ * a thread records its first metric or exits, so scraping never
+ * contends with the paths that are serving NABUs.  When a thread
+ * exits, its shard is folded into a "retired" shard so that no
+ * counts are lost.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnabud/conn_io.h"
+#include "libnabud/log.h"
+#include "libnabud/missing.h"
+#include "libnabud/nbsd_queue.h"
+
+#include "image.h"
+#include "metrics.h"
+#include "upgrade.h"
+
+/*
+ * Histogram bucket upper bounds, in nanoseconds.  100us .. 10s.
+ * There is an implicit +Inf bucket at the end.
+ */
+static const struct {
+	uint64_t	ns;
+	const char	*le;
+} metrics_buckets[] = {
+	{ .ns = UINT64_C(100000),	.le = "0.0001" },
+	{ .ns = UINT64_C(250000),	.le = "0.00025" },
+	{ .ns = UINT64_C(500000),	.le = "0.0005" },
+	{ .ns = UINT64_C(1000000),	.le = "0.001" },
+	{ .ns = UINT64_C(2500000),	.le = "0.0025" },
+	{ .ns = UINT64_C(5000000),	.le = "0.005" },
+	{ .ns = UINT64_C(10000000),	.le = "0.01" },
+	{ .ns = UINT64_C(25000000),	.le = "0.025" },
+	{ .ns = UINT64_C(50000000),	.le = "0.05" },
+	{ .ns = UINT64_C(100000000),	.le = "0.1" },
+	{ .ns = UINT64_C(250000000),	.le = "0.25" },
+	{ .ns = UINT64_C(500000000),	.le = "0.5" },
+	{ .ns = UINT64_C(1000000000),	.le = "1.0" },
+	{ .ns = UINT64_C(2500000000),	.le = "2.5" },
+	{ .ns = UINT64_C(5000000000),	.le = "5.0" },
+	{ .ns = UINT64_C(10000000000),	.le = "10.0" },
+};
+#define	METRICS_NBUCKETS						\
+	(sizeof(metrics_buckets) / sizeof(metrics_buckets[0]) + 1)
+
+struct metrics_shard {
+	LIST_ENTRY(metrics_shard) link;
+	uint64_t	counters[METRIC_NCOUNTERS];
+	uint64_t	buckets[METRIC_NHISTOGRAMS][METRICS_NBUCKETS];
+	uint64_t	sum_ns[METRIC_NHISTOGRAMS];
+};
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_shard_key;
+static bool metrics_shard_key_valid;
+static pthread_mutex_t metrics_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, metrics_shard) metrics_shards =
+    LIST_HEAD_INITIALIZER(metrics_shards);
+static struct metrics_shard metrics_retired;
+
+/* Maximum size of an HTTP request header we're willing to read. */
+#define	METRICS_REQ_MAX		1024
+
+/* Maximum size of a scrape response body. */
+#define	METRICS_BODY_MAX	16384
+
+/* How long we'll wait on a slow scraper, in seconds. */
+#define	METRICS_HTTP_TIMEOUT	5
+
+/*
+ * metrics_shard_thread_exit --
+ *	pthread key destructor; fold an exiting thread's shard
+ *	into the retired shard.
+ */
+static void
+metrics_shard_thread_exit(void *arg)
+{
+	struct metrics_shard *shard = arg;
+	unsigned int i, j;
+
+	pthread_mutex_lock(&metrics_shards_lock);
+	for (i = 0; i < METRIC_NCOUNTERS; i++) {
+		metrics_retired.counters[i] += shard->counters[i];
+	}
+	for (i = 0; i < METRIC_NHISTOGRAMS; i++) {
+		for (j = 0; j < METRICS_NBUCKETS; j++) {
+			metrics_retired.buckets[i][j] += shard->buckets[i][j];
+		}
+		metrics_retired.sum_ns[i] += shard->sum_ns[i];
+	}
+	LIST_REMOVE(shard, link);
+	pthread_mutex_unlock(&metrics_shards_lock);
+
+	free(shard);
+}
+
+/*
+ * metrics_shard_key_init --
+ *	One-time initialization of the per-thread shard key.
+ */
+static void
+metrics_shard_key_init(void)
+{
+	int error = pthread_key_create(&metrics_shard_key,
+	    metrics_shard_thread_exit);
+	if (error != 0) {
+		log_error("pthread_key_create() failed: %s",
+		    strerror(error));
+		return;
+	}
+	metrics_shard_key_valid = true;
+}
+
+/*
+ * metrics_shard --
+ *	Get the calling thread's metrics shard, creating it if needed.
+ *	Returns NULL if we're unable to allocate one, in which case
+ *	the sample is simply dropped.
+ */
+static struct metrics_shard *
+metrics_shard(void)
+{
+	struct metrics_shard *shard;
+
+	pthread_once(&metrics_once, metrics_shard_key_init);
+	if (! metrics_shard_key_valid) {
+		return NULL;
+	}
+
+	shard = pthread_getspecific(metrics_shard_key);
+	if (shard != NULL) {
+		return shard;
+	}
+
+	shard = calloc(1, sizeof(*shard));
+	if (shard == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&metrics_shards_lock);
+	LIST_INSERT_HEAD(&metrics_shards, shard, link);
+	pthread_mutex_unlock(&metrics_shards_lock);
+
+	if (pthread_setspecific(metrics_shard_key, shard) != 0) {
+		pthread_mutex_lock(&metrics_shards_lock);
+		LIST_REMOVE(shard, link);
+		pthread_mutex_unlock(&metrics_shards_lock);
+		free(shard);
+		return NULL;
+	}
+	return shard;
+}
+
+/*
+ * metrics_bump --
+ *	Add to a shard slot.  Only the owning thread writes to a
+ *	shard, so this need not be an atomic read-modify-write; the
+ *	store just has to be visible to a concurrent scrape untorn.
+ */
+static inline void
+metrics_bump(uint64_t *slot, uint64_t val)
+{
+	__atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + val,
+	    __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_add --
+ *	Add a value to a counter.
+ */
+void
+metrics_add(metric_counter ctr, uint64_t val)
+{
+	struct metrics_shard *shard;
+
+	assert(ctr >= 0 && ctr < METRIC_NCOUNTERS);
+	if ((shard = metrics_shard()) != NULL) {
+		metrics_bump(&shard->counters[ctr], val);
+	}
+}
+
+/*
+ * metrics_timestamp --
+ *	Return a timestamp suitable for metrics_observe().
+ */
+uint64_t
+metrics_timestamp(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) +
+	    (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * metrics_observe --
+ *	Record the time elapsed since the specified start timestamp
+ *	in a histogram.
+ */
+void
+metrics_observe(metric_histogram hist, uint64_t start)
+{
+	struct metrics_shard *shard;
+	uint64_t now = metrics_timestamp();
+	uint64_t elapsed = now > start ? now - start : 0;
+	unsigned int i;
+
+	assert(hist >= 0 && hist < METRIC_NHISTOGRAMS);
+	if ((shard = metrics_shard()) == NULL) {
+		return;
+	}
+
+	for (i = 0; i < METRICS_NBUCKETS - 1; i++) {
+		if (elapsed <= metrics_buckets[i].ns) {
+			break;
+		}
+	}
+	metrics_bump(&shard->buckets[hist][i], 1);
+	metrics_bump(&shard->sum_ns[hist], elapsed);
+}
+
+/*
+ * metrics_snapshot --
+ *	Sum up all of the shards.
+ */
+static void
+metrics_snapshot(struct metrics_shard *snap)
+{
+	const struct metrics_shard *shard;
+	unsigned int i, j;
+
+	pthread_mutex_lock(&metrics_shards_lock);
+	*snap = metrics_retired;
+	LIST_FOREACH(shard, &metrics_shards, link) {
+		for (i = 0; i < METRIC_NCOUNTERS; i++) {
+			snap->counters[i] += __atomic_load_n(
+			    &shard->counters[i], __ATOMIC_RELAXED);
+		}
+		for (i = 0; i < METRIC_NHISTOGRAMS; i++) {
+			for (j = 0; j < METRICS_NBUCKETS; j++) {
+				snap->buckets[i][j] += __atomic_load_n(
+				    &shard->buckets[i][j], __ATOMIC_RELAXED);
+			}
+			snap->sum_ns[i] += __atomic_load_n(
+			    &shard->sum_ns[i], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&metrics_shards_lock);
+}
+
+/*****************************************************************************
+ * OpenMetrics text formatting
+ *****************************************************************************/
+
+struct metrics_buf {
+	char		*buf;
+	size_t		size;
+	size_t		len;
+};
+
+static void	metrics_printf(struct metrics_buf *, const char *, ...)
+		    __attribute__((__format__(__printf__, 2, 3)));
+
+/*
+ * metrics_printf --
+ *	Append formatted text to the output buffer.  Output that
+ *	doesn't fit is silently truncated at a line boundary.
+ */
+static void
+metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int rv;
+
+	if (mb->len >= mb->size) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	rv = vsnprintf(mb->buf + mb->len, mb->size - mb->len, fmt, ap);
+	va_end(ap);
+
+	if (rv < 0 || (size_t)rv >= mb->size - mb->len) {
+		/* Didn't fit; drop the partial line. */
+		mb->buf[mb->len] = '\0';
+		mb->size = mb->len;
+		return;
+	}
+	mb->len += (size_t)rv;
+}
+
+static const struct {
+	const char	*type;
+	metric_counter	opened;
+	metric_counter	closed;
+} metrics_conn_types[] = {
+	{ "listener",	METRIC_CONN_OPENED_LISTENER,
+			METRIC_CONN_CLOSED_LISTENER },
+	{ "serial",	METRIC_CONN_OPENED_SERIAL,
+			METRIC_CONN_CLOSED_SERIAL },
+	{ "tcp",	METRIC_CONN_OPENED_TCP,
+			METRIC_CONN_CLOSED_TCP },
+};
+
+static const struct {
+	const char	*reason;
+	metric_counter	ctr;
+} metrics_admit_rejections[] = {
+	{ "max_connections",	METRIC_ADMIT_REJECTED_MAX_CONNS },
+	{ "connection_rate",	METRIC_ADMIT_REJECTED_CONN_RATE },
+	{ "request_rate",	METRIC_ADMIT_REJECTED_REQ_RATE },
+};
+
+static const struct {
+	metric_counter	ctr;
+	const char	*name;
+	const char	*unit;
+	const char	*help;
+} metrics_simple_counters[] = {
+	{ METRIC_PACKETS_SENT,		"nabud_packets_sent", NULL,
+	  "Packets sent to NABUs." },
+	{ METRIC_BYTES_SENT,		"nabud_sent_bytes", "bytes",
+	  "Packet bytes sent to NABUs." },
+	{ METRIC_IMAGE_CACHE_HITS,	"nabud_image_cache_hits", NULL,
+	  "Image loads satisfied from the cache." },
+	{ METRIC_IMAGE_CACHE_MISSES,	"nabud_image_cache_misses", NULL,
+	  "Image loads that had to go to the channel source." },
+	{ METRIC_IMAGE_HEDGED_FETCHES,	"nabud_image_hedged_fetches", NULL,
+	  "Image fetches hedged with a second mirror." },
+	{ METRIC_IMAGE_MIRROR_FAILOVERS, "nabud_image_mirror_failovers", NULL,
+	  "Image fetches retried on another mirror after a failure." },
+	{ METRIC_NHACP_REQUESTS,	"nabud_nhacp_requests", NULL,
+	  "NHACP requests processed." },
+	{ METRIC_NHACP_ERRORS,		"nabud_nhacp_errors", NULL,
+	  "NHACP error responses sent." },
+	{ METRIC_RETRONET_REQUESTS,	"nabud_retronet_requests", NULL,
+	  "RetroNet requests processed." },
+	{ METRIC_RETRONET_ERRORS,	"nabud_retronet_errors", NULL,
+	  "RetroNet requests that failed." },
+	{ METRIC_ADMIT_THROTTLED_REQUESTS, "nabud_requests_throttled", NULL,
+	  "Requests delayed by the per-peer request rate limit." },
+	{ METRIC_SOURCE_BREAKER_TRIPS,	"nabud_source_breaker_trips", NULL,
+	  "Times a remote source was marked unhealthy." },
+	{ METRIC_SOURCE_FAST_FAILS,	"nabud_source_fast_fails", NULL,
+	  "Requests failed immediately because a source was unhealthy." },
+};
+
+static const struct {
+	metric_histogram hist;
+	const char	*name;
+	const char	*help;
+} metrics_histograms[] = {
+	{ METRIC_HIST_SEGMENT_LATENCY,	"nabud_segment_latency_seconds",
+	  "Time from segment request to segment sent." },
+	{ METRIC_HIST_FETCH_LATENCY,	"nabud_remote_fetch_latency_seconds",
+	  "Time to fetch an image from a remote source." },
+};
+
+#define	ARRAY_COUNT(a)	(sizeof(a) / sizeof((a)[0]))
+
+/*
+ * metrics_format --
+ *	Format a snapshot of the metrics as OpenMetrics text.
+ */
+static void
+metrics_format(struct metrics_buf *mb)
+{
+	struct metrics_shard snap;
+	uint64_t hits, misses, cum;
+	unsigned int i, j;
+
+	metrics_snapshot(&snap);
+
+	metrics_printf(mb, "# TYPE nabud_connections gauge\n"
+	    "# HELP nabud_connections Current connections.\n");
+	for (i = 0; i < ARRAY_COUNT(metrics_conn_types); i++) {
+		uint64_t opened = snap.counters[metrics_conn_types[i].opened];
+		uint64_t closed = snap.counters[metrics_conn_types[i].closed];
+		metrics_printf(mb, "nabud_connections{type=\"%s\"} %" PRIu64
+		    "\n", metrics_conn_types[i].type,
+		    opened > closed ? opened - closed : 0);
+	}
+
+	metrics_printf(mb, "# TYPE nabud_connections_opened counter\n"
+	    "# HELP nabud_connections_opened Connections created.\n");
+	for (i = 0; i < ARRAY_COUNT(metrics_conn_types); i++) {
+		metrics_printf(mb,
+		    "nabud_connections_opened_total{type=\"%s\"} %" PRIu64
+		    "\n", metrics_conn_types[i].type,
+		    snap.counters[metrics_conn_types[i].opened]);
+	}
+
+	metrics_printf(mb, "# TYPE nabud_admission_rejected counter\n"
+	    "# HELP nabud_admission_rejected "
+	    "Connections shed by admission control.\n");
+	for (i = 0; i < ARRAY_COUNT(metrics_admit_rejections); i++) {
+		metrics_printf(mb,
+		    "nabud_admission_rejected_total{reason=\"%s\"} %" PRIu64
+		    "\n", metrics_admit_rejections[i].reason,
+		    snap.counters[metrics_admit_rejections[i].ctr]);
+	}
+
+	for (i = 0; i < ARRAY_COUNT(metrics_simple_counters); i++) {
+		const char *name = metrics_simple_counters[i].name;
+
+		metrics_printf(mb, "# TYPE %s counter\n", name);
+		if (metrics_simple_counters[i].unit != NULL) {
+			metrics_printf(mb, "# UNIT %s %s\n", name,
+			    metrics_simple_counters[i].unit);
+		}
+		metrics_printf(mb, "# HELP %s %s\n", name,
+		    metrics_simple_counters[i].help);
+		metrics_printf(mb, "%s_total %" PRIu64 "\n", name,
+		    snap.counters[metrics_simple_counters[i].ctr]);
+	}
+
+	hits = snap.counters[METRIC_IMAGE_CACHE_HITS];
+	misses = snap.counters[METRIC_IMAGE_CACHE_MISSES];
+	metrics_printf(mb, "# TYPE nabud_image_cache_hit_ratio gauge\n"
+	    "# HELP nabud_image_cache_hit_ratio "
+	    "Fraction of image loads satisfied from the cache.\n"
+	    "nabud_image_cache_hit_ratio %.6f\n",
+	    hits + misses == 0 ? 0.0 : (double)hits / (double)(hits + misses));
+
+	metrics_printf(mb, "# TYPE nabud_image_cache_resident_bytes gauge\n"
+	    "# UNIT nabud_image_cache_resident_bytes bytes\n"
+	    "# HELP nabud_image_cache_resident_bytes "
+	    "Bytes of image data held in the cache.\n"
+	    "nabud_image_cache_resident_bytes %zu\n",
+	    image_cache_resident_bytes());
+
+	for (i = 0; i < ARRAY_COUNT(metrics_histograms); i++) {
+		const char *name = metrics_histograms[i].name;
+		metric_histogram hist = metrics_histograms[i].hist;
+
+		metrics_printf(mb, "# TYPE %s histogram\n"
+		    "# UNIT %s seconds\n"
+		    "# HELP %s %s\n", name, name, name,
+		    metrics_histograms[i].help);
+		for (j = 0, cum = 0; j < METRICS_NBUCKETS; j++) {
+			cum += snap.buckets[hist][j];
+			metrics_printf(mb, "%s_bucket{le=\"%s\"} %" PRIu64 "\n",
+			    name, j < METRICS_NBUCKETS - 1 ?
+			    metrics_buckets[j].le : "+Inf", cum);
+		}
+		metrics_printf(mb, "%s_count %" PRIu64 "\n"
+		    "%s_sum %" PRIu64 ".%09" PRIu64 "\n",
+		    name, cum, name,
+		    snap.sum_ns[hist] / UINT64_C(1000000000),
+		    snap.sum_ns[hist] % UINT64_C(1000000000));
+	}
+
+	metrics_printf(mb, "# EOF\n");
+}
+
+/*****************************************************************************
+ * HTTP listener
+ *****************************************************************************/
+
+/*
+ * metrics_http_reply --
+ *	Send an HTTP response.
+ */
+static void
+metrics_http_reply(struct conn_io *conn, const char *status,
+    const char *content_type, const char *body, size_t bodylen)
+{
+	char hdr[256];
+	int hdrlen;
+
+	hdrlen = snprintf(hdr, sizeof(hdr),
+	    "HTTP/1.0 %s\r\n"
+	    "Content-Type: %s\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Connection: close\r\n"
+	    "\r\n", status, content_type, bodylen);
+	assert(hdrlen > 0 && (size_t)hdrlen < sizeof(hdr));
+
+	conn_io_send(conn, hdr, (size_t)hdrlen);
+	if (body != NULL) {
+		conn_io_send(conn, body, bodylen);
+	}
+}
+
+/*
+ * metrics_http_thread --
+ *	Service a single HTTP request on a metrics connection.
+ */
+static void *
+metrics_http_thread(void *arg)
+{
+	struct conn_io *conn = arg;
+	char req[METRICS_REQ_MAX];
+	size_t reqlen = 0;
+	char *path, *cp;
+	bool is_head;
+
+	conn_io_start_watchdog(conn, METRICS_HTTP_TIMEOUT);
+
+	/* Read up to the blank line that ends the request header. */
+	for (;;) {
+		if (reqlen == sizeof(req) - 1) {
+			static const char msg[] = "Request too large.\n";
+			metrics_http_reply(conn, "400 Bad Request",
+			    "text/plain", msg, sizeof(msg) - 1);
+			goto out;
+		}
+		if (! conn_io_recv_byte(conn, (uint8_t *)&req[reqlen])) {
+			/* Error already logged. */
+			goto out;
+		}
+		reqlen++;
+		req[reqlen] = '\0';
+		if ((reqlen >= 4 && strcmp(&req[reqlen - 4], "\r\n\r\n") == 0) ||
+		    (reqlen >= 2 && strcmp(&req[reqlen - 2], "\n\n") == 0)) {
+			break;
+		}
+	}
+
+	if (strncmp(req, "GET ", 4) == 0) {
+		is_head = false;
+		path = &req[4];
+	} else if (strncmp(req, "HEAD ", 5) == 0) {
+		is_head = true;
+		path = &req[5];
+	} else {
+		static const char msg[] = "Method not allowed.\n";
+		metrics_http_reply(conn, "405 Method Not Allowed",
+		    "text/plain", msg, sizeof(msg) - 1);
+		goto out;
+	}
+	if ((cp = strpbrk(path, " ?\r\n")) != NULL) {
+		*cp = '\0';
+	}
+
+	log_debug(LOG_SUBSYS_CONTROL, "[%s] %s %s", conn_io_name(conn),
+	    is_head ? "HEAD" : "GET", path);
+
+	if (strcmp(path, "/metrics") != 0) {
+		static const char msg[] = "Not found.\n";
+		metrics_http_reply(conn, "404 Not Found",
+		    "text/plain", msg, sizeof(msg) - 1);
+		goto out;
+	}
+
+	struct metrics_buf mb = {
+		.buf = malloc(METRICS_BODY_MAX),
+		.size = METRICS_BODY_MAX,
+	};
+	if (mb.buf == NULL) {
+		static const char msg[] = "Out of memory.\n";
+		metrics_http_reply(conn, "500 Internal Server Error",
+		    "text/plain", msg, sizeof(msg) - 1);
+		goto out;
+	}
+	metrics_format(&mb);
+	metrics_http_reply(conn, "200 OK",
+	    "application/openmetrics-text; version=1.0.0; charset=utf-8",
+	    is_head ? NULL : mb.buf, mb.len);
+	free(mb.buf);
+
+ out:
+	conn_io_fini(conn);
+	free(conn);
+	return NULL;
+}
+
+/*
+ * metrics_listen_thread --
+ *	Worker thread that accepts new metrics connections.
+ */
+static void *
+metrics_listen_thread(void *arg)
+{
+	struct conn_io *conn = arg;
+	struct conn_io *newconn;
+	struct sockaddr_storage peerss;
+	socklen_t peersslen;
+	char host[NI_MAXHOST];
+	char *name;
+	int sock;
+
+	for (;;) {
+		peersslen = sizeof(peerss);
+		if (! conn_io_accept(conn, (struct sockaddr *)&peerss,
+				     &peersslen, &sock)) {
+			/* Error already logged. */
+			break;
+		}
+
+		if (getnameinfo((struct sockaddr *)&peerss, peersslen,
+				host, sizeof(host), NULL, 0,
+				NI_NUMERICHOST) != 0) {
+			strcpy(host, "unknown");
+		}
+		if (asprintf(&name, "Metrics-%s", host) < 0) {
+			log_error("Unable to allocate connection name.");
+			close(sock);
+			continue;
+		}
+
+		newconn = calloc(1, sizeof(*newconn));
+		if (newconn == NULL) {
+			log_error("Unable to allocate new connection.");
+			free(name);
+			close(sock);
+			continue;
+		}
+		if (! conn_io_init(newconn, name, sock)) {
+			/* Error already logged; sock and name consumed. */
+			free(newconn);
+			continue;
+		}
+		if (! conn_io_start(newconn, metrics_http_thread, newconn)) {
+			/* Error already logged. */
+			conn_io_fini(newconn);
+			free(newconn);
+			continue;
+		}
+	}
+
+	conn_io_fini(conn);
+	free(conn);
+
+	return NULL;
+}
+
+/*
+ * metrics_init --
+ *	Start the metrics listener.  If no address is specified,
+ *	we listen only on the loopback interface.
+ */
+void
+metrics_init(const char *address, const char *port)
+{
+	static const struct addrinfo hints = {
+		.ai_flags = AI_NUMERICSERV,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+	};
+	struct addrinfo *ai0, *ai;
+	struct conn_io *conn;
+	char host[NI_MAXHOST];
+	char *name;
+	long portnum;
+	int error, sock;
+	const int on = 1;
+
+	portnum = strtol(port, NULL, 10);
+	if (portnum < 1 || portnum > UINT16_MAX) {
+		log_error("Invalid metrics port number: %s", port);
+		return;
+	}
+
+	/* A NULL address without AI_PASSIVE yields the loopback address. */
+	error = getaddrinfo(address, port, &hints, &ai0);
+	if (error) {
+		log_error("getaddrinfo() failed: %s", gai_strerror(error));
+		return;
+	}
+
+	for (ai = ai0; ai != NULL; ai = ai->ai_next) {
+		if (getnameinfo(ai->ai_addr, ai->ai_addrlen, host,
+				sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
+			strcpy(host, "?");
+		}
+		if (asprintf(&name, "Metrics-%s%s%s-%ld",
+			     ai->ai_family == AF_INET6 ? "[" : "", host,
+			     ai->ai_family == AF_INET6 ? "]" : "",
+			     portnum) < 0) {
+			log_error("Unable to allocate listener name.");
+			continue;
+		}
+
+		/* Already listening if we were handed it by an upgrade. */
+		if ((sock = upgrade_take_fd(name)) >= 0) {
+			goto listening;
+		}
+
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0) {
+			log_error("Unable to create %s socket: %s",
+			    name, strerror(errno));
+			free(name);
+			continue;
+		}
+		(void) setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+		    &on, sizeof(on));
+#ifdef IPV6_V6ONLY
+		if (ai->ai_family == AF_INET6) {
+			(void) setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY,
+			    &on, sizeof(on));
+		}
+#endif
+		if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+			log_error("Unable to bind %s: %s",
+			    name, strerror(errno));
+			goto bad;
+		}
+		if (listen(sock, 8) < 0) {
+			log_error("Unable to listen on %s: %s",
+			    name, strerror(errno));
+			goto bad;
+		}
+
+ listening:
+		conn = calloc(1, sizeof(*conn));
+		if (conn == NULL) {
+			log_error("Unable to allocate metrics listener.");
+			goto bad;
+		}
+		if (! conn_io_init(conn, name, sock)) {
+			/* Error already logged; sock and name consumed. */
+			free(conn);
+			continue;
+		}
+		conn->handoff = true;
+		log_info("[%s] Serving metrics.", conn_io_name(conn));
+		if (! conn_io_start(conn, metrics_listen_thread, conn)) {
+			/* Error already logged. */
+			conn_io_fini(conn);
+			free(conn);
+		}
+		continue;
+ bad:
+		close(sock);
+		free(name);
+	}
+	freeaddrinfo(ai0);
+}
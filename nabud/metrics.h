@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef metrics_h_included
+#define	metrics_h_included
+
+#include <stdint.h>
+
+typedef enum {
+	METRIC_CONN_OPENED_LISTENER	= 0,
+	METRIC_CONN_OPENED_SERIAL,
+	METRIC_CONN_OPENED_TCP,
+	METRIC_CONN_CLOSED_LISTENER,
+	METRIC_CONN_CLOSED_SERIAL,
+	METRIC_CONN_CLOSED_TCP,
+	METRIC_PACKETS_SENT,
+	METRIC_BYTES_SENT,
+	METRIC_IMAGE_CACHE_HITS,
+	METRIC_IMAGE_CACHE_MISSES,
+	METRIC_IMAGE_HEDGED_FETCHES,
+	METRIC_IMAGE_MIRROR_FAILOVERS,
+	METRIC_NHACP_REQUESTS,
+	METRIC_NHACP_ERRORS,
+	METRIC_RETRONET_REQUESTS,
+	METRIC_RETRONET_ERRORS,
+	METRIC_ADMIT_REJECTED_MAX_CONNS,
+	METRIC_ADMIT_REJECTED_CONN_RATE,
+	METRIC_ADMIT_REJECTED_REQ_RATE,
+	METRIC_ADMIT_THROTTLED_REQUESTS,
+	METRIC_SOURCE_BREAKER_TRIPS,
+	METRIC_SOURCE_FAST_FAILS,
+
+	METRIC_NCOUNTERS
+} metric_counter;
+
+typedef enum {
+	METRIC_HIST_SEGMENT_LATENCY	= 0,
+	METRIC_HIST_FETCH_LATENCY,
+
+	METRIC_NHISTOGRAMS
+} metric_histogram;
+
+void	metrics_add(metric_counter, uint64_t);
+uint64_t metrics_timestamp(void);
+void	metrics_observe(metric_histogram, uint64_t);
+
+#define	metrics_count(c)	metrics_add((c), 1)
+
+void	metrics_init(const char *, const char *);
+
+#endif /* metrics_h_included */
@@ -57,7 +57,9 @@
 #include "libnabud/nhacp_proto.h"
 #include "libnabud/nbsd_queue.h"
 
+#include "admit.h"
 #include "conn.h"
+#include "metrics.h"
 #include "nhacp.h"
 #include "stext.h"
 
@@ -100,7 +102,8 @@ struct nhacp_file_private {
 #define	NABUD_NHACP_VERSION	NHACP_VERS_0_1
 
 /* We support these NHACP options. */
-#define	NABUD_NHACP_OPTIONS	NHACP_OPTION_CRC8
+#define	NABUD_NHACP_OPTIONS	(NHACP_OPTION_CRC8 |			\
+				 NHACP_OPTION_NABUD_BLOCKV)
 
 /*
  * File private data routines.
@@ -644,6 +647,7 @@ nhacp_send_error_details(struct nhacp_context *ctx, uint16_t code,
 		}
 	}
 
+	metrics_count(METRIC_NHACP_ERRORS);
 	nabu_set_uint16(ctx->reply.error.code, code);
 	nhacp_string_set_limit(&ctx->reply.error.message, error_message,
 	    max_message_length);
@@ -687,6 +691,41 @@ nhacp_send_data_buffer(struct nhacp_context *ctx, uint16_t length)
 	    sizeof(ctx->reply.data_buffer) + length);
 }
 
+/*
+ * nhacp_zero_copy_ok --
+ *	Returns true if reply data can be sent straight from a file
+ *	to the connection.  Only TCP connections qualify, and only
+ *	when there's no CRC trailer that would have to cover the data.
+ */
+static bool
+nhacp_zero_copy_ok(struct nhacp_context *ctx)
+{
+	return ctx->stext.conn->type == CONN_TYPE_TCP &&
+	    nhacp_crc_len(ctx->nhacp_options) == 0;
+}
+
+/*
+ * nhacp_sendfile_data_buffer --
+ *	Like nhacp_send_data_buffer(), but the payload is sent directly
+ *	from the file descriptor at the specified offset.  Any part of
+ *	the payload beyond EOF is sent as zeros.
+ */
+static void
+nhacp_sendfile_data_buffer(struct nhacp_context *ctx, int fd,
+    uint32_t offset, uint16_t length)
+{
+	assert(nhacp_zero_copy_ok(ctx));
+
+	nabu_set_uint16(ctx->reply.length,
+	    sizeof(ctx->reply.data_buffer) + length);
+	ctx->reply.data_buffer.type = NHACP_RESP_DATA_BUFFER;
+	nabu_set_uint16(ctx->reply.data_buffer.length, length);
+
+	conn_sendfile(ctx->stext.conn, &ctx->reply,
+	    sizeof(ctx->reply.length) + sizeof(ctx->reply.data_buffer),
+	    fd, offset, length);
+}
+
 /*
  * nhacp_send_uint32 --
  *	Convenience function to send a UINT32-VALUE response.
@@ -806,6 +845,10 @@ nhacp_req_hello(struct nhacp_context *ctx)
 		log_info("[%s] session %u: CRC-8 FCS option enabled.",
 		    conn_name(conn), ctx->session_id);
 	}
+	if (ctx->nhacp_options & NHACP_OPTION_NABUD_BLOCKV) {
+		log_info("[%s] session %u: vectored block I/O option enabled.",
+		    conn_name(conn), ctx->session_id);
+	}
 	nhacp_send_reply(ctx, NHACP_RESP_SESSION_STARTED,
 	    sizeof(ctx->reply.session_started) +
 	    nhacp_strsize(&ctx->reply.session_started.adapter_id));
@@ -948,6 +991,13 @@ nhacp_req_storage_get(struct nhacp_context *ctx)
 		return;
 	}
 
+	int fd;
+	if (nhacp_zero_copy_ok(ctx) &&
+	    stext_file_pread_fd(f, offset, &length, &fd) == 0) {
+		nhacp_sendfile_data_buffer(ctx, fd, offset, length);
+		return;
+	}
+
 	int error = stext_file_pread(f, ctx->reply.data_buffer.data,
 	    offset, &length);
 	if (error != 0) {
@@ -1001,19 +1051,41 @@ nhacp_req_storage_put(struct nhacp_context *ctx)
 }
 
 /*
- * nhacp_req_storage_get_block --
- *	Handle the STORAGE-GET-BLOCK request.
+ * nhacp_storage_blkoff --
+ *	Compute the file offset of a block, making sure we won't
+ *	overflow the 32-bit file offsets we use in the storage
+ *	extensions.
+ */
+static bool
+nhacp_storage_blkoff(struct nhacp_context *ctx, uint32_t blkno,
+    uint16_t blklen, uint32_t *offsetp)
+{
+	uint64_t offset = (uint64_t)blkno * blklen;
+	if (offset > UINT32_MAX - blklen + 1) {
+		log_debug(LOG_SUBSYS_NHACP, "[%s] offset %llu too large",
+		    conn_name(ctx->stext.conn), (unsigned long long)offset);
+		return false;
+	}
+	*offsetp = (uint32_t)offset;
+	return true;
+}
+
+/*
+ * nhacp_storage_get_block --
+ *	Read a block and send the DATA-BUFFER (or ERROR) reply.
+ *	Common code for STORAGE-GET-BLOCK and STORAGE-GET-BLOCKV.
  */
 static void
-nhacp_req_storage_get_block(struct nhacp_context *ctx)
+nhacp_storage_get_block(struct nhacp_context *ctx, uint8_t fdesc,
+    uint32_t blkno, uint16_t blklen)
 {
 	struct stext_file *f;
+	uint32_t offset;
 
-	f = stext_file_find(&ctx->stext, ctx->request.storage_get_block.fdesc);
+	f = stext_file_find(&ctx->stext, fdesc);
 	if (f == NULL) {
 		log_debug(LOG_SUBSYS_NHACP, "[%s] No file for fdesc %u.",
-		    conn_name(ctx->stext.conn),
-		    ctx->request.storage_get_block.fdesc);
+		    conn_name(ctx->stext.conn), fdesc);
 		nhacp_send_error(ctx, NHACP_EBADF);
 		return;
 	}
@@ -1023,23 +1095,10 @@ nhacp_req_storage_get_block(struct nhacp_context *ctx)
 		return;
 	}
 
-	uint32_t blkno =
-	    nabu_get_uint32(ctx->request.storage_get_block.block_number);
-	uint16_t blklen =
-	    nabu_get_uint16(ctx->request.storage_get_block.block_length);
-
 	log_debug(LOG_SUBSYS_NHACP, "[%s] fdesc %u blkno %u blklen %u",
-	    conn_name(ctx->stext.conn), ctx->request.storage_get_block.fdesc,
-	    blkno, blklen);
+	    conn_name(ctx->stext.conn), fdesc, blkno, blklen);
 
-	/*
-	 * Make sure we won't overflow the 32-bit file offsets we use
-	 * in the storage extensions.
-	 */
-	uint64_t offset = (uint64_t)blkno * blklen;
-	if (offset > UINT32_MAX - blklen + 1) {
-		log_debug(LOG_SUBSYS_NHACP, "[%s] offset %llu too large",
-		    conn_name(ctx->stext.conn), (unsigned long long)offset);
+	if (! nhacp_storage_blkoff(ctx, blkno, blklen, &offset)) {
 		nhacp_send_error(ctx, NHACP_EINVAL);
 		return;
 	}
@@ -1051,8 +1110,20 @@ nhacp_req_storage_get_block(struct nhacp_context *ctx)
 
 	uint16_t save_blklen = blklen;
 
+	int fd;
+	if (nhacp_zero_copy_ok(ctx) &&
+	    stext_file_pread_fd(f, offset, &blklen, &fd) == 0) {
+		/*
+		 * Same EOF semantics as below; the zero-padding of a
+		 * partial block is done for us.
+		 */
+		nhacp_sendfile_data_buffer(ctx, fd, offset,
+		    blklen == 0 ? 0 : save_blklen);
+		return;
+	}
+
 	int error = stext_file_pread(f, ctx->reply.data_buffer.data,
-	    (uint32_t)offset, &blklen);
+	    offset, &blklen);
 	if (error != 0) {
 		nhacp_send_error(ctx, nhacp_error_from_unix(error));
 		return;
@@ -1074,60 +1145,197 @@ nhacp_req_storage_get_block(struct nhacp_context *ctx)
 }
 
 /*
- * nhacp_req_storage_put_block --
- *	Handle the STORAGE-PUT-BLOCK request.
+ * nhacp_req_storage_get_block --
+ *	Handle the STORAGE-GET-BLOCK request.
  */
 static void
-nhacp_req_storage_put_block(struct nhacp_context *ctx)
+nhacp_req_storage_get_block(struct nhacp_context *ctx)
+{
+	nhacp_storage_get_block(ctx,
+	    ctx->request.storage_get_block.fdesc,
+	    nabu_get_uint32(ctx->request.storage_get_block.block_number),
+	    nabu_get_uint16(ctx->request.storage_get_block.block_length));
+}
+
+/*
+ * nhacp_storage_put_block --
+ *	Write a block.  Returns false with the NHACP error code to
+ *	send in *errorp on failure.  Common code for STORAGE-PUT-BLOCK
+ *	and STORAGE-PUT-BLOCKV.
+ */
+static bool
+nhacp_storage_put_block(struct nhacp_context *ctx, uint8_t fdesc,
+    uint32_t blkno, uint16_t blklen, const uint8_t *data, uint16_t *errorp)
 {
 	struct stext_file *f;
+	uint32_t offset;
 
-	f = stext_file_find(&ctx->stext, ctx->request.storage_put_block.fdesc);
+	f = stext_file_find(&ctx->stext, fdesc);
 	if (f == NULL) {
 		log_debug(LOG_SUBSYS_NHACP, "[%s] No file for fdesc %u.",
-		    conn_name(ctx->stext.conn),
-		    ctx->request.storage_put_block.fdesc);
-		nhacp_send_error(ctx, NHACP_EBADF);
-		return;
+		    conn_name(ctx->stext.conn), fdesc);
+		*errorp = NHACP_EBADF;
+		return false;
 	}
 
 	if (nhacp_file_is_directory(f)) {
-		nhacp_send_error(ctx, NHACP_EISDIR);
-		return;
+		*errorp = NHACP_EISDIR;
+		return false;
 	}
 
-	uint32_t blkno =
-	    nabu_get_uint32(ctx->request.storage_put_block.block_number);
-	uint16_t blklen =
-	    nabu_get_uint16(ctx->request.storage_put_block.block_length);
-
 	log_debug(LOG_SUBSYS_NHACP, "[%s] fdesc %u blkno %u blklen %u",
-	    conn_name(ctx->stext.conn), ctx->request.storage_put_block.fdesc,
-	    blkno, blklen);
+	    conn_name(ctx->stext.conn), fdesc, blkno, blklen);
 
-	/*
-	 * Make sure we won't overflow the 32-bit file offsets we use
-	 * in the storage extensions.
-	 */
-	uint64_t offset = (uint64_t)blkno * blklen;
-	if (offset > UINT32_MAX - blklen + 1) {
-		log_debug(LOG_SUBSYS_NHACP, "[%s] offset %llu too large",
-		    conn_name(ctx->stext.conn), (unsigned long long)offset);
-		nhacp_send_error(ctx, NHACP_EINVAL);
-		return;
+	if (! nhacp_storage_blkoff(ctx, blkno, blklen, &offset)) {
+		*errorp = NHACP_EINVAL;
+		return false;
 	}
 
 	if (blklen > nhacp_max_payload(ctx, NHACP_REQ_STORAGE_PUT_BLOCK)) {
-		nhacp_send_error(ctx, NHACP_EINVAL);
-		return;
+		*errorp = NHACP_EINVAL;
+		return false;
 	}
 
-	int error = stext_file_pwrite(f, ctx->request.storage_put_block.data,
-	    (uint32_t)offset, blklen);
+	int error = stext_file_pwrite(f, data, offset, blklen);
 	if (error != 0) {
-		nhacp_send_error(ctx, nhacp_error_from_unix(error));
-	} else {
+		*errorp = nhacp_error_from_unix(error);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * nhacp_req_storage_put_block --
+ *	Handle the STORAGE-PUT-BLOCK request.
+ */
+static void
+nhacp_req_storage_put_block(struct nhacp_context *ctx)
+{
+	uint16_t error;
+
+	if (nhacp_storage_put_block(ctx,
+	    ctx->request.storage_put_block.fdesc,
+	    nabu_get_uint32(ctx->request.storage_put_block.block_number),
+	    nabu_get_uint16(ctx->request.storage_put_block.block_length),
+	    ctx->request.storage_put_block.data, &error)) {
 		nhacp_send_ok(ctx);
+	} else {
+		nhacp_send_error(ctx, error);
+	}
+}
+
+/*
+ * nhacp_blockv_check --
+ *	Validate the shape of a STORAGE-GET-BLOCKV or STORAGE-PUT-BLOCKV
+ *	request: the entry count must be sane and the request must be
+ *	long enough to hold the entries (and, for PUT, the data).  The
+ *	client is expecting one reply per entry, so if the count is OK
+ *	but the request isn't, every entry gets an error.
+ */
+static bool
+nhacp_blockv_check(struct nhacp_context *ctx, unsigned int count,
+    uint16_t blklen, bool is_put)
+{
+	unsigned int i;
+
+	/* The length of the message body, sans CRC. */
+	size_t reqlen = nabu_get_uint16(ctx->request.length) -
+	    nhacp_crc_len(ctx->nhacp_options);
+	size_t needed = sizeof(struct nhacp_request_nabud_storage_get_blockv) +
+	    count * sizeof(struct nhacp_blockv_entry);
+
+	if (count == 0 || count > NHACP_NABUD_BLOCKV_MAX) {
+		log_debug(LOG_SUBSYS_NHACP, "[%s] bad BLOCKV count %u",
+		    conn_name(ctx->stext.conn), count);
+		nhacp_send_error(ctx, NHACP_EINVAL);
+		return false;
+	}
+	if (is_put) {
+		needed += (size_t)count * blklen;
+	}
+	if (reqlen < needed) {
+		log_debug(LOG_SUBSYS_NHACP,
+		    "[%s] BLOCKV request too short: %zu < %zu",
+		    conn_name(ctx->stext.conn), reqlen, needed);
+		for (i = 0; i < count; i++) {
+			nhacp_send_error(ctx, NHACP_EINVAL);
+		}
+		return false;
+	}
+	return true;
+}
+
+/*
+ * nhacp_req_nabud_storage_get_blockv --
+ *	Handle the STORAGE-GET-BLOCKV request.
+ */
+static void
+nhacp_req_nabud_storage_get_blockv(struct nhacp_context *ctx)
+{
+	struct nhacp_blockv_entry entries[NHACP_NABUD_BLOCKV_MAX];
+	uint16_t blklen =
+	    nabu_get_uint16(ctx->request.nabud_storage_get_blockv.block_length);
+	unsigned int count = ctx->request.nabud_storage_get_blockv.count;
+	unsigned int i;
+
+	if (! nhacp_blockv_check(ctx, count, blklen, false)) {
+		/* Error(s) already sent. */
+		return;
+	}
+
+	/* Each reply overwrites the request; grab the entries first. */
+	memcpy(entries, ctx->request.nabud_storage_get_blockv.entries,
+	    count * sizeof(entries[0]));
+
+	for (i = 0; i < count; i++) {
+		nhacp_storage_get_block(ctx, entries[i].fdesc,
+		    nabu_get_uint32(entries[i].block_number), blklen);
+		if (conn_state(ctx->stext.conn) != CONN_STATE_OK) {
+			break;
+		}
+	}
+}
+
+/*
+ * nhacp_req_nabud_storage_put_blockv --
+ *	Handle the STORAGE-PUT-BLOCKV request.
+ */
+static void
+nhacp_req_nabud_storage_put_blockv(struct nhacp_context *ctx)
+{
+	uint16_t errors[NHACP_NABUD_BLOCKV_MAX];
+	bool ok[NHACP_NABUD_BLOCKV_MAX];
+	const struct nhacp_blockv_entry *entries =
+	    ctx->request.nabud_storage_put_blockv.entries;
+	uint16_t blklen =
+	    nabu_get_uint16(ctx->request.nabud_storage_put_blockv.block_length);
+	unsigned int count = ctx->request.nabud_storage_put_blockv.count;
+	unsigned int i;
+
+	if (! nhacp_blockv_check(ctx, count, blklen, true)) {
+		/* Error(s) already sent. */
+		return;
+	}
+
+	/*
+	 * Each reply overwrites the request, so do all of the writes
+	 * before sending any of the replies.
+	 */
+	const uint8_t *data = (const uint8_t *)&entries[count];
+	for (i = 0; i < count; i++, data += blklen) {
+		ok[i] = nhacp_storage_put_block(ctx, entries[i].fdesc,
+		    nabu_get_uint32(entries[i].block_number), blklen, data,
+		    &errors[i]);
+	}
+	for (i = 0; i < count; i++) {
+		if (ok[i]) {
+			nhacp_send_ok(ctx);
+		} else {
+			nhacp_send_error(ctx, errors[i]);
+		}
+		if (conn_state(ctx->stext.conn) != CONN_STATE_OK) {
+			break;
+		}
 	}
 }
 
@@ -1221,6 +1429,14 @@ nhacp_req_file_read(struct nhacp_context *ctx)
 		return;
 	}
 
+	uint32_t offset;
+	int fd;
+	if (nhacp_zero_copy_ok(ctx) &&
+	    stext_file_read_fd(f, &offset, &length, &fd) == 0) {
+		nhacp_sendfile_data_buffer(ctx, fd, offset, length);
+		return;
+	}
+
 	int error = stext_file_read(f, ctx->reply.data_buffer.data, &length);
 	if (error != 0) {
 		nhacp_send_error(ctx, nhacp_error_from_unix(error));
@@ -1701,22 +1917,25 @@ nhacp_req_mkdir(struct nhacp_context *ctx)
 	}
 }
 
-#define	HANDLER_ENTRY(v, d, n, mpv)					\
+#define	HANDLER_ENTRY(v, d, n, mpv, opt)				\
 	[(v)] = {							\
 		.handler    = nhacp_req_ ## n ,				\
 		.debug_desc = d ,					\
 		.min_reqlen = sizeof(struct nhacp_request_ ## n ),	\
 		.min_version = (mpv),					\
+		.options    = (opt),					\
 	}
 
-#define	ENTRY_0_0(v, n)		HANDLER_ENTRY(v, #v, n, NHACP_VERS_0_0)
-#define	ENTRY_0_1(v, n)		HANDLER_ENTRY(v, #v, n, NHACP_VERS_0_1)
+#define	ENTRY_0_0(v, n)	HANDLER_ENTRY(v, #v, n, NHACP_VERS_0_0, 0)
+#define	ENTRY_0_1(v, n)	HANDLER_ENTRY(v, #v, n, NHACP_VERS_0_1, 0)
+#define	ENTRY_OPT(v, n, o) HANDLER_ENTRY(v, #v, n, NHACP_VERS_0_1, (o))
 
 static const struct {
 	void		(*handler)(struct nhacp_context *);
 	const char	*debug_desc;
 	ssize_t		min_reqlen;
 	uint16_t	min_version;
+	uint16_t	options;	/* session must have negotiated these */
 } nhacp_request_types[] = {
 	ENTRY_0_1(NHACP_REQ_HELLO,             hello),
 	ENTRY_0_0(NHACP_REQ_STORAGE_OPEN,      storage_open),
@@ -1737,12 +1956,19 @@ static const struct {
 	ENTRY_0_1(NHACP_REQ_REMOVE,            remove),
 	ENTRY_0_1(NHACP_REQ_RENAME,            rename),
 	ENTRY_0_1(NHACP_REQ_MKDIR,             mkdir),
+
+	/* nabud extensions */
+	ENTRY_OPT(NHACP_REQ_NABUD_STORAGE_GET_BLOCKV,
+		  nabud_storage_get_blockv, NHACP_OPTION_NABUD_BLOCKV),
+	ENTRY_OPT(NHACP_REQ_NABUD_STORAGE_PUT_BLOCKV,
+		  nabud_storage_put_blockv, NHACP_OPTION_NABUD_BLOCKV),
 };
 static const unsigned int nhacp_request_type_count =
     sizeof(nhacp_request_types) / sizeof(nhacp_request_types[0]);
 
 #undef ENTRY_0_0
 #undef ENTRY_0_1
+#undef ENTRY_OPT
 #undef HANDLER_ENTRY
 
 /*
@@ -1767,7 +1993,8 @@ nhacp_request_check(struct nhacp_context *ctx, uint16_t length)
 	default:
 		if (req >= nhacp_request_type_count ||
 		    nhacp_request_types[req].handler == NULL) {
-			log_error("[%s] Unknown NHACP request: 0x%02x",
+			log_error_ratelimited(LOG_SUBSYS_NHACP,
+			    "[%s] Unknown NHACP request: 0x%02x",
 			    conn_name(conn), ctx->request.generic.type);
 			return false;
 		}
@@ -1789,6 +2016,16 @@ nhacp_request_check(struct nhacp_context *ctx, uint16_t length)
 			    nhacp_request_types[req].debug_desc);
 			return false;
 		}
+		if ((ctx->nhacp_options & nhacp_request_types[req].options) !=
+		    nhacp_request_types[req].options) {
+			log_error_ratelimited(LOG_SUBSYS_NHACP,
+			    "[%s] %s requires NHACP options 0x%04x, "
+			    "session has 0x%04x.", conn_name(conn),
+			    nhacp_request_types[req].debug_desc,
+			    nhacp_request_types[req].options,
+			    ctx->nhacp_options);
+			return false;
+		}
 		break;
 	}
 
@@ -1885,6 +2122,9 @@ nhacp_process_request(struct nhacp_context *ctx)
 {
 	log_debug(LOG_SUBSYS_NHACP, "[%s] Got %s.", conn_name(ctx->stext.conn),
 	    nhacp_request_types[ctx->request.generic.type].debug_desc);
+	conn_trace(ctx->stext.conn, NHACP_REQ, ctx->request.generic.type,
+	    0, 0, 0);
+	metrics_count(METRIC_NHACP_REQUESTS);
 	(*nhacp_request_types[ctx->request.generic.type].handler)(ctx);
 }
 
@@ -2015,6 +2255,17 @@ nhacp_start_0_0(struct nabu_connection *conn)
 			continue;
 		}
 
+		/*
+		 * These requests never go through the adaptor's event
+		 * loop, so charge them here.  Shed the peer if it's
+		 * running away.
+		 */
+		if (! admit_request(conn)) {
+			/* Error already logged. */
+			conn_set_state(conn, CONN_STATE_ABORTED);
+			break;
+		}
+
 		/*
 		 * Check for END-PROTOCOL before we do anything else.
 		 * There's no payload and no reply -- we just get out.
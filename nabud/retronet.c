@@ -56,6 +56,7 @@
 #include "libnabud/nbsd_queue.h"
 
 #include "conn.h"
+#include "metrics.h"
 #include "retronet.h"
 #include "stext.h"
 
@@ -81,6 +82,17 @@ struct retronet_context {
 #define	COPY_BUFSIZE	sizeof(ctx->reply.fh_read.data)
 #define	COPY_BUF	ctx->reply.fh_read.data
 
+/*
+ * rn_zero_copy_ok --
+ *	Returns true if reply data can be sent straight from a file
+ *	to the connection.  Only TCP connections qualify.
+ */
+static bool
+rn_zero_copy_ok(struct retronet_context *ctx)
+{
+	return ctx->stext.conn->type == CONN_TYPE_TCP;
+}
+
 /*****************************************************************************
  * Request handling
  *****************************************************************************/
@@ -95,6 +107,7 @@ rn_recv_filename(struct nabu_connection *conn, const char *which,
 	if (! conn_recv_byte(conn, bp)) {
 		log_error("[%s] Failed to receive %sLen.",
 		    conn_name(conn), which);
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return ETIMEDOUT;
 	}
 	uint8_t len = *bp++;
@@ -105,6 +118,7 @@ rn_recv_filename(struct nabu_connection *conn, const char *which,
 	if (! conn_recv(conn, bp, len)) {
 		log_error("[%s] Failed to receive %s.",
 		    conn_name(conn), which);
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return ETIMEDOUT;
 	}
 	*fnamep = (char *)bp;
@@ -275,6 +289,7 @@ rn_req_file_open(struct retronet_context *ctx)
 	if (! conn_recv(conn, req, 3)) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -305,6 +320,7 @@ rn_req_file_open(struct retronet_context *ctx)
 	 * later when I/O is requested.
 	 */
 	if (error != 0) {
+		metrics_count(METRIC_RETRONET_ERRORS);
 		ctx->reply.file_open.fileHandle = 0xff;
 	} else {
 		ctx->reply.file_open.fileHandle = stext_file_slot(f);
@@ -331,6 +347,7 @@ rn_req_fh_size(struct retronet_context *ctx)
 			sizeof(ctx->request.fh_size))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -374,6 +391,7 @@ rn_req_fh_read(struct retronet_context *ctx)
 			sizeof(ctx->request.fh_read))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -393,6 +411,16 @@ rn_req_fh_read(struct retronet_context *ctx)
 		    conn_name(conn), ctx->request.fh_read.fileHandle,
 		    offset, length);
 
+		int fd;
+		if (rn_zero_copy_ok(ctx) &&
+		    stext_file_pread_fd(f, offset, &length, &fd) == 0) {
+			nabu_set_uint16(ctx->reply.fh_read.returnLength,
+			    length);
+			conn_sendfile(conn, &ctx->reply.fh_read, 2,
+			    fd, offset, length);
+			return;
+		}
+
 		int error = stext_file_pread(f, ctx->reply.fh_read.data,
 		    offset, &length);
 		if (error != 0) {
@@ -418,6 +446,7 @@ rn_req_fh_close(struct retronet_context *ctx)
 			sizeof(ctx->request.fh_close))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -482,6 +511,7 @@ rn_req_fh_append(struct retronet_context *ctx)
 			offsetof(struct rn_fh_append_req, data))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -544,6 +574,7 @@ rn_req_fh_insert(struct retronet_context *ctx)
 			offsetof(struct rn_fh_insert_req, data))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -678,6 +709,7 @@ rn_req_fh_delete_range(struct retronet_context *ctx)
 			sizeof(ctx->request.fh_delete_range))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -793,6 +825,7 @@ rn_req_fh_replace(struct retronet_context *ctx)
 			offsetof(struct rn_fh_replace_req, data))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -1082,6 +1115,7 @@ rn_req_fh_truncate(struct retronet_context *ctx)
 			sizeof(ctx->request.fh_truncate))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -1244,6 +1278,7 @@ rn_req_file_list_item(struct retronet_context *ctx)
 			sizeof(ctx->request.file_list_item))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -1324,6 +1359,7 @@ rn_req_fh_details(struct retronet_context *ctx)
 			sizeof(ctx->request.fh_details))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -1361,6 +1397,7 @@ rn_req_fh_readseq(struct retronet_context *ctx)
 			sizeof(ctx->request.fh_readseq))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -1378,6 +1415,17 @@ rn_req_fh_readseq(struct retronet_context *ctx)
 		    conn_name(conn), ctx->request.fh_readseq.fileHandle,
 		    length);
 
+		uint32_t offset;
+		int fd;
+		if (rn_zero_copy_ok(ctx) &&
+		    stext_file_read_fd(f, &offset, &length, &fd) == 0) {
+			nabu_set_uint16(ctx->reply.fh_readseq.returnLength,
+			    length);
+			conn_sendfile(conn, &ctx->reply.fh_readseq, 2,
+			    fd, offset, length);
+			return;
+		}
+
 		int error = stext_file_read(f, ctx->reply.fh_readseq.data,
 		    &length);
 		if (error != 0) {
@@ -1404,6 +1452,7 @@ rn_req_fh_seek(struct retronet_context *ctx)
 			sizeof(ctx->request.fh_seek))) {
 		log_error("[%s] Failed to receive request.",
 		    conn_name(conn));
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return;
 	}
 
@@ -1538,6 +1587,7 @@ retronet_request(struct nabu_connection *conn, uint8_t msg)
 	    retronet_request_types[idx].handler == NULL) {
 		log_error("[%s] Unknown RetroNet request type 0x%02x.",
 		    conn_name(conn), msg);
+		metrics_count(METRIC_RETRONET_ERRORS);
 		return false;
 	}
 
@@ -1550,12 +1600,14 @@ retronet_request(struct nabu_connection *conn, uint8_t msg)
 		if (ctx == NULL) {
 			log_error("[%s] Unable to allocate RetroNet context.",
 			    conn_name(conn));
+			metrics_count(METRIC_RETRONET_ERRORS);
 			return true;
 		}
 	}
 
 	log_debug(LOG_SUBSYS_RETRONET, "[%s] Got %s.", conn_name(conn),
 	    retronet_request_types[idx].debug_desc);
+	metrics_count(METRIC_RETRONET_REQUESTS);
 	(*retronet_request_types[idx].handler)(ctx);
 	return true;
 }
@@ -65,6 +65,8 @@ struct stext_file {
 	union {
 		struct {
 			struct fileio	*fileio;
+			off_t		size;	/* cached; see getattr */
+			off_t		cursor;
 		} fileio;
 		struct {
 			uint8_t		*data;
@@ -91,6 +93,7 @@ struct stext_fileops {
 	int	(*file_truncate)(struct stext_file *, uint32_t);
 	int	(*file_getattr)(struct stext_file *, struct fileio_attrs *);
 	const char * (*file_location)(struct stext_file *);
+	int	(*file_fd)(struct stext_file *, off_t *);
 	void	(*file_close)(struct stext_file *);
 };
 
@@ -249,49 +252,31 @@ stext_context_fini(struct stext_context *ctx)
 static int
 stext_fileop_read_fileio(struct stext_file *f, void *vbuf, uint16_t *lengthp)
 {
-	uint8_t *buf = vbuf;
-	size_t resid = *lengthp;
-	ssize_t actual;
+	int error;
 
-	while (resid != 0) {
-		actual = fileio_read(f->fileio.fileio, buf, resid);
-		if (actual < 0) {
-			if (errno == EINTR) {
-				continue;
-			}
-			return errno;
-		}
-		if (actual == 0) {
-			/* EOF. */
-			break;
-		}
-		buf += actual;
-		resid -= actual;
+	if (f->fileio.cursor >= MAX_FILEIO_LENGTH) {
+		*lengthp = 0;
+		return 0;
 	}
-	*lengthp -= resid;
-	return 0;
+
+	error = stext_file_pread(f, vbuf, (uint32_t)f->fileio.cursor, lengthp);
+	if (error == 0) {
+		f->fileio.cursor += *lengthp;
+	}
+	return error;
 }
 
 static int
 stext_fileop_write_fileio(struct stext_file *f, const void *vbuf,
     uint16_t length)
 {
-	const uint8_t *buf = vbuf;
-	size_t resid = length;
-	ssize_t actual;
+	int error;
 
-	while (resid != 0) {
-		actual = fileio_write(f->fileio.fileio, buf, resid);
-		if (actual <= 0) {
-			if (actual < 0 && errno == EINTR) {
-				continue;
-			}
-			return errno;
-		}
-		buf += actual;
-		resid -= actual;
+	error = stext_file_pwrite(f, vbuf, (uint32_t)f->fileio.cursor, length);
+	if (error == 0) {
+		f->fileio.cursor += length;
 	}
-	return 0;
+	return error;
 }
 
 static int
@@ -346,13 +331,44 @@ stext_fileop_pwrite_fileio(struct stext_file *f, const void *vbuf,
 		offset += actual;
 		resid -= actual;
 	}
+	if (offset > f->fileio.size) {
+		f->fileio.size = offset;
+	}
 	return 0;
 }
 
 static off_t
 stext_fileop_seek_fileio(struct stext_file *f, off_t offset, int whence)
 {
-	return fileio_seek(f->fileio.fileio, offset, whence);
+	switch (whence) {
+	case SEEK_SET:
+		if (offset < 0) {
+			goto invalid;
+		}
+		f->fileio.cursor = offset;
+		break;
+
+	case SEEK_CUR:
+		if (offset < 0 && -offset > f->fileio.cursor) {
+			goto invalid;
+		}
+		f->fileio.cursor += offset;
+		break;
+
+	case SEEK_END:
+		if (offset < 0 && -offset > f->fileio.size) {
+			goto invalid;
+		}
+		f->fileio.cursor = f->fileio.size + offset;
+		break;
+
+	default:
+	invalid:
+		errno = EINVAL;
+		return -1;
+	}
+
+	return f->fileio.cursor;
 }
 
 static int
@@ -361,6 +377,7 @@ stext_fileop_truncate_fileio(struct stext_file *f, uint32_t size)
 	if (! fileio_truncate(f->fileio.fileio, size)) {
 		return errno;
 	}
+	f->fileio.size = size;
 	return 0;
 }
 
@@ -370,6 +387,8 @@ stext_fileop_getattr_fileio(struct stext_file *f, struct fileio_attrs *attrs)
 	if (! fileio_getattr(f->fileio.fileio, attrs)) {
 		return errno;
 	}
+	/* Pick up any changes made behind our back. */
+	f->fileio.size = attrs->size;
 	return 0;
 }
 
@@ -379,6 +398,13 @@ stext_fileop_location_fileio(struct stext_file *f)
 	return fileio_location(f->fileio.fileio);
 }
 
+static int
+stext_fileop_fd_fileio(struct stext_file *f, off_t *sizep)
+{
+	*sizep = f->fileio.size;
+	return fileio_local_fd(f->fileio.fileio);
+}
+
 static void
 stext_fileop_close_fileio(struct stext_file *f)
 {
@@ -397,6 +423,7 @@ static const struct stext_fileops stext_fileops_fileio = {
 	.file_truncate	= stext_fileop_truncate_fileio,
 	.file_getattr	= stext_fileop_getattr_fileio,
 	.file_location	= stext_fileop_location_fileio,
+	.file_fd	= stext_fileop_fd_fileio,
 	.file_close	= stext_fileop_close_fileio,
 };
 
@@ -629,8 +656,19 @@ stext_file_open(struct stext_context *ctx, const char *filename,
 			goto out;
 		}
 
+		/*
+		 * The size may be unknown here (e.g. a chunked HTTP
+		 * transfer); the loader will stream it in that case,
+		 * and we report the actual size we got.
+		 */
 		f->shadow.data = fileio_load_file(fileio, attrs,
-		    0 /*extra*/, 0 /*maxsize XXX*/, &f->shadow.length);
+		    0 /*extra*/, MAX_SHADOW_LENGTH, &f->shadow.length);
+		if (f->shadow.data == NULL) {
+			/* Error already logged. */
+			error = EIO;
+			goto out;
+		}
+		attrs->size = f->shadow.length;
 		f->shadow.mtime = attrs->mtime;
 		f->shadow.location = strdup(fileio_location(fileio));
 		f->ops = &stext_fileops_shadow;
@@ -647,6 +685,7 @@ stext_file_open(struct stext_context *ctx, const char *filename,
 			goto out;
 		}
 		f->fileio.fileio = fileio;
+		f->fileio.size = attrs->size;
 		fileio = NULL;		/* file owns it now */
 		f->ops = &stext_fileops_fileio;
 	}
@@ -747,6 +786,68 @@ stext_file_pread(struct stext_file *f, void *vbuf, uint32_t offset,
 	return (*f->ops->file_pread)(f, vbuf, offset, lengthp);
 }
 
+/*
+ * stext_file_pread_fd --
+ *	Like stext_file_pread(), but rather than reading the data,
+ *	return a descriptor that it can be sent from directly, with
+ *	*lengthp clamped to the data that's available.  Returns
+ *	EOPNOTSUPP if the file has no such descriptor (shadow and
+ *	remote files).  The clamp uses the cached file size, so
+ *	this costs no system calls; if the file has shrunk behind
+ *	our back, the sender pads out the difference.
+ */
+int
+stext_file_pread_fd(struct stext_file *f, uint32_t offset,
+    uint16_t *lengthp, int *fdp)
+{
+	off_t size;
+	int fd;
+
+	if (f->ops->file_fd == NULL ||
+	    (fd = (*f->ops->file_fd)(f, &size)) < 0) {
+		return EOPNOTSUPP;
+	}
+	if (size > f->ops->max_length) {
+		size = f->ops->max_length;
+	}
+	if (offset >= size) {
+		*lengthp = 0;
+	} else if (*lengthp > size - offset) {
+		*lengthp = (uint16_t)(size - offset);
+	}
+	*fdp = fd;
+	return 0;
+}
+
+/*
+ * stext_file_read_fd --
+ *	Sequential version of stext_file_pread_fd().  Returns the
+ *	current cursor position in *offsetp and advances the cursor
+ *	past the data, as if it had been read.
+ */
+int
+stext_file_read_fd(struct stext_file *f, uint32_t *offsetp,
+    uint16_t *lengthp, int *fdp)
+{
+	off_t cur;
+	int error;
+
+	cur = (*f->ops->file_seek)(f, 0, SEEK_CUR);
+	if (cur < 0) {
+		return EIO;
+	}
+	if (cur >= f->ops->max_length) {
+		return EOPNOTSUPP;
+	}
+	error = stext_file_pread_fd(f, (uint32_t)cur, lengthp, fdp);
+	if (error != 0) {
+		return error;
+	}
+	(*f->ops->file_seek)(f, *lengthp, SEEK_CUR);
+	*offsetp = (uint32_t)cur;
+	return 0;
+}
+
 /*
  * stext_file_pwrite --
  *	Positional file write.
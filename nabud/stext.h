@@ -52,6 +52,8 @@ void	stext_file_close(struct stext_file *);
 int	stext_file_read(struct stext_file *, void *, uint16_t *);
 int	stext_file_write(struct stext_file *, const void *, uint16_t);
 int	stext_file_pread(struct stext_file *, void *, uint32_t, uint16_t *);
+int	stext_file_pread_fd(struct stext_file *, uint32_t, uint16_t *, int *);
+int	stext_file_read_fd(struct stext_file *, uint32_t *, uint16_t *, int *);
 int	stext_file_pwrite(struct stext_file *, const void *, uint32_t,
 	    uint16_t);
 int	stext_file_seek(struct stext_file *, int32_t *, int);
@@ -0,0 +1,379 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * In-place upgrade of the server.  On SIGUSR2, we exec(2) the server
+ * binary again (which has presumably been replaced with a new version)
+ * with the same arguments.  The listening sockets, the control socket,
+ * and serial ports are inherited by the new image, and their descriptor
+ * numbers are passed in the environment so that the new instance picks
+ * them up instead of creating new ones.  The image cache is written to
+ * an (unlinked) temporary file which is also inherited, and the new
+ * instance loads it once the configuration has been loaded.
+ *
+ * Connections from TCP clients are not handed off; the protocol state
+ * that goes along with them lives only in the old image.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libnabud/conn_io.h"
+#include "libnabud/log.h"
+#include "libnabud/missing.h"
+
+#include "image.h"
+#include "upgrade.h"
+
+#define	UPGRADE_ENV_FDS		"NABUD_UPGRADE_FDS"
+#define	UPGRADE_ENV_CACHE	"NABUD_UPGRADE_CACHE"
+
+struct upgrade_fd {
+	char		*name;
+	int		fd;
+};
+
+static char *upgrade_path;
+static char **upgrade_argv;
+
+static struct upgrade_fd *upgrade_fds;
+static size_t upgrade_nfds;
+static int upgrade_cache_fd = -1;
+static bool upgrading;
+
+/*
+ * upgrade_parse_fds --
+ *	Parse the list of inherited descriptors.  Each entry is
+ *	"<fd> <name>", and entries are separated by newlines.
+ */
+static void
+upgrade_parse_fds(const char *str)
+{
+	char *list, *cp, *ep, *line;
+	long fd;
+
+	list = strdup(str);
+	if (list == NULL) {
+		return;
+	}
+	for (cp = list; (line = strsep(&cp, "\n")) != NULL;) {
+		if (*line == '\0') {
+			continue;
+		}
+		fd = strtol(line, &ep, 10);
+		if (*ep != ' ' || fd < 0 || fd > INT_MAX) {
+			continue;
+		}
+		struct upgrade_fd *nfds = realloc(upgrade_fds,
+		    (upgrade_nfds + 1) * sizeof(*nfds));
+		if (nfds == NULL) {
+			break;
+		}
+		upgrade_fds = nfds;
+		upgrade_fds[upgrade_nfds].fd = (int)fd;
+		upgrade_fds[upgrade_nfds].name = strdup(ep + 1);
+		if (upgrade_fds[upgrade_nfds].name == NULL) {
+			break;
+		}
+		upgrade_nfds++;
+	}
+	free(list);
+}
+
+/*
+ * upgrade_init --
+ *	Remember how we were invoked (so that we can do it again),
+ *	and pick up any state handed to us by the previous instance.
+ *	Must be called before argv is processed by getopt(3), and
+ *	before we chdir(2) anywhere.
+ */
+void
+upgrade_init(char *argv[])
+{
+	const char *str;
+	int argc, i;
+
+	for (argc = 0; argv[argc] != NULL; argc++) {
+		/* count them */
+	}
+	upgrade_argv = calloc((size_t)argc + 1, sizeof(*upgrade_argv));
+	if (upgrade_argv != NULL) {
+		for (i = 0; i < argc; i++) {
+			upgrade_argv[i] = strdup(argv[i]);
+		}
+	}
+
+	/*
+	 * If we were invoked with a path, resolve it now; a bare
+	 * name is looked up in $PATH again at exec time.
+	 */
+	if (strchr(argv[0], '/') != NULL) {
+		upgrade_path = realpath(argv[0], NULL);
+	}
+	if (upgrade_path == NULL) {
+		upgrade_path = strdup(argv[0]);
+	}
+
+	if ((str = getenv(UPGRADE_ENV_FDS)) != NULL) {
+		upgrading = true;
+		upgrade_parse_fds(str);
+		unsetenv(UPGRADE_ENV_FDS);
+	}
+	if ((str = getenv(UPGRADE_ENV_CACHE)) != NULL) {
+		upgrading = true;
+		upgrade_cache_fd = (int)strtol(str, NULL, 10);
+		unsetenv(UPGRADE_ENV_CACHE);
+	}
+}
+
+/*
+ * upgrade_in_progress --
+ *	Returns true if we were started by an in-place upgrade.
+ */
+bool
+upgrade_in_progress(void)
+{
+	return upgrading;
+}
+
+/*
+ * upgrade_take_fd --
+ *	Claim the inherited descriptor with the specified name.
+ *	Returns -1 if there isn't one.
+ */
+int
+upgrade_take_fd(const char *name)
+{
+	size_t i;
+	int fd;
+
+	for (i = 0; i < upgrade_nfds; i++) {
+		if (upgrade_fds[i].fd >= 0 &&
+		    strcmp(upgrade_fds[i].name, name) == 0) {
+			fd = upgrade_fds[i].fd;
+			upgrade_fds[i].fd = -1;
+			log_info("[%s] Using inherited descriptor %d.",
+			    name, fd);
+			return fd;
+		}
+	}
+	return -1;
+}
+
+/*
+ * upgrade_finish --
+ *	Finish starting up after an upgrade: load the image cache
+ *	snapshot and close any descriptors that the configuration
+ *	no longer calls for.
+ */
+void
+upgrade_finish(void)
+{
+	size_t i;
+
+	if (upgrade_cache_fd >= 0) {
+		FILE *fp = fdopen(upgrade_cache_fd, "rb");
+		if (fp != NULL) {
+			image_cache_restore(fp);
+			fclose(fp);
+		} else {
+			close(upgrade_cache_fd);
+		}
+		upgrade_cache_fd = -1;
+	}
+
+	for (i = 0; i < upgrade_nfds; i++) {
+		if (upgrade_fds[i].fd >= 0) {
+			log_info("[%s] Closing unused inherited descriptor.",
+			    upgrade_fds[i].name);
+			close(upgrade_fds[i].fd);
+		}
+		free(upgrade_fds[i].name);
+	}
+	free(upgrade_fds);
+	upgrade_fds = NULL;
+	upgrade_nfds = 0;
+
+	if (upgrading) {
+		log_info("Upgrade complete.");
+		upgrading = false;
+	}
+}
+
+struct upgrade_exec_ctx {
+	char		*list;
+	int		*fds;
+	size_t		nfds;
+	size_t		maxfds;
+	bool		error;
+};
+
+static bool
+upgrade_collect_cb(struct conn_io *conn, void *v)
+{
+	struct upgrade_exec_ctx *ctx = v;
+	char *nlist;
+
+	if (! conn->handoff || conn->fd < 0) {
+		return true;
+	}
+	if (ctx->nfds == ctx->maxfds) {
+		size_t nmax = ctx->maxfds ? ctx->maxfds * 2 : 8;
+		int *nfds = realloc(ctx->fds, nmax * sizeof(*nfds));
+		if (nfds == NULL) {
+			ctx->error = true;
+			return false;
+		}
+		ctx->fds = nfds;
+		ctx->maxfds = nmax;
+	}
+	if (asprintf(&nlist, "%s%d %s\n", ctx->list != NULL ? ctx->list : "",
+		     conn->fd, conn_io_name(conn)) < 0) {
+		ctx->error = true;
+		return false;
+	}
+	free(ctx->list);
+	ctx->list = nlist;
+	ctx->fds[ctx->nfds++] = conn->fd;
+	return true;
+}
+
+/*
+ * upgrade_set_cloexec --
+ *	Arrange for every descriptor except stdio and the ones being
+ *	handed off to be closed across exec.
+ */
+static void
+upgrade_set_cloexec(const struct upgrade_exec_ctx *ctx, int cache_fd)
+{
+	long maxfd = sysconf(_SC_OPEN_MAX);
+	int fd, flags;
+	size_t i;
+
+	if (maxfd < 0 || maxfd > 65536) {
+		maxfd = 65536;
+	}
+	for (fd = 3; fd < maxfd; fd++) {
+		if ((flags = fcntl(fd, F_GETFD)) < 0) {
+			continue;
+		}
+		bool keep = fd == cache_fd;
+		for (i = 0; !keep && i < ctx->nfds; i++) {
+			keep = fd == ctx->fds[i];
+		}
+		if (keep) {
+			flags &= ~FD_CLOEXEC;
+		} else {
+			flags |= FD_CLOEXEC;
+		}
+		(void) fcntl(fd, F_SETFD, flags);
+	}
+}
+
+/*
+ * upgrade_exec --
+ *	Replace ourselves with a new instance of the server.  Only
+ *	returns if that fails, in which case we carry on as before
+ *	(although logging is now synchronous).
+ */
+void
+upgrade_exec(void)
+{
+	struct upgrade_exec_ctx ctx = { };
+	char cachestr[sizeof("-2147483648")];
+	FILE *cache_fp;
+	int cache_fd = -1;
+
+	if (upgrade_argv == NULL || upgrade_path == NULL) {
+		log_error("Upgrade not possible; original arguments unknown.");
+		return;
+	}
+
+	log_info("Upgrading: executing %s", upgrade_path);
+
+	/*
+	 * Snapshot the image cache.  If that fails, we can still
+	 * upgrade; the new instance just starts out cold.
+	 */
+	cache_fp = tmpfile();
+	if (cache_fp != NULL) {
+		if (image_cache_snapshot(cache_fp) &&
+		    fseek(cache_fp, 0, SEEK_SET) == 0) {
+			cache_fd = fileno(cache_fp);
+		}
+	} else {
+		log_error("Unable to create image cache snapshot file: %s",
+		    strerror(errno));
+	}
+
+	conn_io_enumerate(upgrade_collect_cb, &ctx);
+	if (ctx.error) {
+		log_error("Unable to collect descriptors for upgrade.");
+		goto out;
+	}
+
+	if (ctx.list != NULL) {
+		setenv(UPGRADE_ENV_FDS, ctx.list, 1);
+	} else {
+		/* Still tells the new instance not to daemonize. */
+		setenv(UPGRADE_ENV_FDS, "", 1);
+	}
+	if (cache_fd >= 0) {
+		snprintf(cachestr, sizeof(cachestr), "%d", cache_fd);
+		setenv(UPGRADE_ENV_CACHE, cachestr, 1);
+	}
+
+	/*
+	 * Flush the log; the new instance will say hello when
+	 * it gets going.  After this, logging is synchronous.
+	 */
+	log_fini();
+
+	upgrade_set_cloexec(&ctx, cache_fd);
+	if (strchr(upgrade_path, '/') != NULL) {
+		execv(upgrade_path, upgrade_argv);
+	} else {
+		execvp(upgrade_path, upgrade_argv);
+	}
+	log_error("Unable to execute %s: %s", upgrade_path, strerror(errno));
+
+	unsetenv(UPGRADE_ENV_FDS);
+	unsetenv(UPGRADE_ENV_CACHE);
+ out:
+	if (cache_fp != NULL) {
+		fclose(cache_fp);
+	}
+	free(ctx.list);
+	free(ctx.fds);
+}
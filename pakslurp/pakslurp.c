@@ -0,0 +1,691 @@
+/*-
+ * Copyright (c) 2023 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * pakslurp --
+ *
+ * Mirror the PAK cycles of the NabuRetroNet (or any other channel
+ * directory served over HTTP/FTP) to the local machine so that they
+ * can be served locally.  Files are fetched in parallel over kept-alive
+ * connections, partial downloads are resumed, files that are already
+ * up-to-date are skipped, and every file is verified before it is put
+ * in place.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>	/* XXX HAVE_ERR_H-ize, please */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	NABU_PROTO_INLINES
+
+#include "libfetch/fetch.h"
+
+#include "libnabud/log.h"
+#include "libnabud/missing.h"
+#include "libnabud/nabu_proto.h"
+#include "libnabud/pak.h"
+
+#define	DEFAULT_BASE_URL	"https://cloud.nabu.ca"
+#define	DEFAULT_MAX_IMAGE	0x2ff	/* published cycles top out here */
+#define	DEFAULT_JOBS		4
+#define	DEFAULT_RETRIES		2
+#define	MAX_JOBS		64
+
+/*
+ * Nothing legitimate in a cycle is anywhere near this large; it's just
+ * here to keep a misbehaving server from filling up the disk.
+ */
+#define	MAX_FILE_SIZE		(1024 * 1024)
+
+struct slurp_job {
+	char		*url;
+	char		*path;		/* final local path */
+	uint32_t	image;
+	bool		encrypted;
+};
+
+static pthread_mutex_t slurp_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slurp_job *jobs;
+static size_t njobs, maxjobs, nextjob;
+
+static struct {
+	unsigned int	fetched;
+	unsigned int	resumed;
+	unsigned int	unchanged;
+	unsigned int	missing;
+	unsigned int	failed;
+	uint64_t	bytes;
+} stats;
+
+static bool decrypt;
+static bool force;
+static bool size_only;
+static bool verbose;
+static unsigned int retries = DEFAULT_RETRIES;
+
+typedef enum {
+	SLURP_FETCHED,
+	SLURP_RESUMED,
+	SLURP_UNCHANGED,
+	SLURP_MISSING,
+	SLURP_FAILED,
+	SLURP_RETRY,
+} slurp_result;
+
+static void __attribute__((__noreturn__))
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-dfsv] [-j jobs] [-m max-image] "
+			"[-o dir] [-r retries]\n"
+			"       %*s [-u base-url] [remote-dir[=local-dir] ...]\n",
+	    getprogname(), (int)strlen(getprogname()), "");
+	fprintf(stderr, "       -d         fetch encrypted PAKs and decrypt "
+			"them\n");
+	fprintf(stderr, "       -f         fetch files even if they are "
+			"unchanged\n");
+	fprintf(stderr, "       -j jobs    number of parallel transfers "
+			"(default %d)\n", DEFAULT_JOBS);
+	fprintf(stderr, "       -m max     highest image number to fetch "
+			"(default 0x%X)\n", DEFAULT_MAX_IMAGE);
+	fprintf(stderr, "       -o dir     local directory to mirror into "
+			"(default .)\n");
+	fprintf(stderr, "       -r retries retries per file (default %d)\n",
+	    DEFAULT_RETRIES);
+	fprintf(stderr, "       -s         compare only file sizes when "
+			"checking for changes\n");
+	fprintf(stderr, "       -u url     base URL (default %s)\n",
+	    DEFAULT_BASE_URL);
+	fprintf(stderr, "       -v         verbose\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * url_escape --
+ *	Escape a path component for use in a URL.
+ */
+static char *
+url_escape(const char *str)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char *escaped, *cp;
+
+	if ((escaped = malloc((strlen(str) * 3) + 1)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (cp = escaped; *str != '\0'; str++) {
+		unsigned char c = (unsigned char)*str;
+
+		if (isalnum(c) || strchr("-._~/", c) != NULL) {
+			*cp++ = (char)c;
+		} else {
+			*cp++ = '%';
+			*cp++ = hex[c >> 4];
+			*cp++ = hex[c & 0xf];
+		}
+	}
+	*cp = '\0';
+	return escaped;
+}
+
+/*
+ * add_job --
+ *	Queue up a file to be fetched.
+ */
+static void
+add_job(const char *base_url, const char *remote, const char *local,
+    uint32_t image)
+{
+	struct slurp_job *job;
+	char *fname, *escaped;
+
+	if (njobs == maxjobs) {
+		maxjobs = maxjobs == 0 ? 1024 : maxjobs * 2;
+		jobs = realloc(jobs, maxjobs * sizeof(*jobs));
+		if (jobs == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+	}
+	job = &jobs[njobs++];
+	memset(job, 0, sizeof(*job));
+	job->image = image;
+	job->encrypted = decrypt;
+
+	if (decrypt) {
+		fname = pak_encrypted_name(image);
+		if (fname == NULL) {
+			errx(EXIT_FAILURE,
+			    "Encrypted PAKs are not supported on this system.");
+		}
+	} else if (asprintf(&fname, "%06X.pak", image) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	escaped = url_escape(remote);
+	if (asprintf(&job->url, "%s/%s/%s", base_url, escaped, fname) < 0 ||
+	    asprintf(&job->path, "%s/%06X.pak", local, image) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+	free(escaped);
+	free(fname);
+}
+
+/*
+ * add_cycle --
+ *	Queue up all of the images in a cycle directory.  The argument
+ *	is "remote-dir[=local-dir]", relative to the base URL and the
+ *	output directory, respectively.
+ */
+static void
+add_cycle(const char *base_url, const char *outdir, const char *arg,
+    uint32_t max_image)
+{
+	char *remote, *local, *cp;
+	uint32_t image;
+
+	if ((remote = strdup(arg)) == NULL) {
+		err(EXIT_FAILURE, "strdup");
+	}
+	if ((cp = strchr(remote, '=')) != NULL) {
+		*cp++ = '\0';
+	} else {
+		cp = remote;
+	}
+	if (*remote == '\0' || *cp == '\0') {
+		errx(EXIT_FAILURE, "%s: invalid directory specification", arg);
+	}
+	if (asprintf(&local, "%s/%s", outdir, cp) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+	if (mkdir(local, 0777) < 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "%s", local);
+	}
+
+	for (image = 0; image <= max_image; image++) {
+		add_job(base_url, remote, local, image);
+	}
+
+	free(remote);
+	free(local);
+}
+
+/*
+ * verify_pak --
+ *	Check that a PAK looks like what the server will try to send:
+ *	a series of length-prefixed packets, each of which has a header
+ *	that identifies the image and segment.
+ */
+static bool
+verify_pak(const struct slurp_job *job, const uint8_t *buf, size_t len)
+{
+	const size_t seglen = NABU_TOTALPAYLOADSIZE;
+	const struct nabu_pkthdr *hdr;
+	unsigned int segment;
+	size_t off;
+
+	for (segment = 0;; segment++) {
+		off = (segment * seglen) + ((2 * segment) + 2);
+		if (off + NABU_HEADERSIZE + NABU_FOOTERSIZE > len) {
+			warnx("%s: truncated at segment %u", job->path,
+			    segment);
+			return false;
+		}
+		hdr = (const struct nabu_pkthdr *)&buf[off];
+		if (nabu_get_uint24_be(hdr->image) != job->image ||
+		    hdr->segment_lsb != (uint8_t)segment) {
+			warnx("%s: segment %u has bad header "
+			    "(image %06X segment %u)", job->path, segment,
+			    nabu_get_uint24_be(hdr->image), hdr->segment_lsb);
+			return false;
+		}
+		if (off + seglen >= len) {
+			return true;
+		}
+	}
+}
+
+/*
+ * install_file --
+ *	Verify (and decrypt, if necessary) a completed download and
+ *	put it in place.
+ */
+static bool
+install_file(const struct slurp_job *job, const char *partpath, int fd,
+    size_t len, time_t mtime)
+{
+	struct timeval tv[2];
+	uint8_t *buf;
+	bool rv = false;
+
+	if ((buf = malloc(len)) == NULL) {
+		warn("%s", job->path);
+		return false;
+	}
+	if (pread(fd, buf, len, 0) != (ssize_t)len) {
+		warn("%s", partpath);
+		goto out;
+	}
+
+	if (job->encrypted) {
+		if (! pak_decrypt(buf, len)) {
+			warnx("%s: unable to decrypt", job->url);
+			goto out;
+		}
+		if (pwrite(fd, buf, len, 0) != (ssize_t)len) {
+			warn("%s", partpath);
+			goto out;
+		}
+	}
+
+	if (! verify_pak(job, buf, len)) {
+		goto out;
+	}
+
+	if (mtime > 0) {
+		tv[0].tv_sec = tv[1].tv_sec = mtime;
+		tv[0].tv_usec = tv[1].tv_usec = 0;
+		(void)futimes(fd, tv);
+	}
+	if (rename(partpath, job->path) < 0) {
+		warn("%s", job->path);
+		goto out;
+	}
+	rv = true;
+
+ out:
+	free(buf);
+	return rv;
+}
+
+/*
+ * is_unchanged --
+ *	Check if the local copy of a file matches the remote one.
+ */
+static bool
+is_unchanged(const struct slurp_job *job, const struct stat *sb,
+    const struct url_stat *ust)
+{
+	if (ust->size < 0 || ust->size != sb->st_size) {
+		return false;
+	}
+	if (size_only || ust->mtime <= 0) {
+		return true;
+	}
+	return ust->mtime == sb->st_mtime;
+}
+
+/*
+ * slurp_one --
+ *	Make one attempt at fetching a file.
+ */
+static slurp_result
+slurp_one(const struct slurp_job *job, uint64_t *bytesp)
+{
+	struct url_stat ust;
+	struct stat sb;
+	struct url *url;
+	fetchIO *fio = NULL;
+	char *partpath = NULL;
+	char buf[8192];
+	off_t offset;
+	size_t total;
+	ssize_t actual;
+	int fd = -1;
+	slurp_result rv = SLURP_FAILED;
+
+	/*
+	 * If we already have the file, ask the server if it's changed
+	 * before fetching it again.
+	 */
+	if (! force && stat(job->path, &sb) == 0) {
+		if (fetchStatURL(job->url, &ust, "") < 0) {
+			if (fetchLastErrCode == FETCH_UNAVAIL) {
+				return SLURP_MISSING;
+			}
+			warnx("%s: %s", job->url, fetchLastErrString);
+			return SLURP_RETRY;
+		}
+		if (is_unchanged(job, &sb, &ust)) {
+			return SLURP_UNCHANGED;
+		}
+	}
+
+	if (asprintf(&partpath, "%s.part", job->path) < 0) {
+		warn("asprintf");
+		return SLURP_FAILED;
+	}
+	fd = open(partpath, O_RDWR | O_CREAT, 0666);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		warn("%s", partpath);
+		goto out;
+	}
+	offset = sb.st_size;
+
+	if ((url = fetchParseURL(job->url)) == NULL) {
+		warnx("%s: %s", job->url, fetchLastErrString);
+		goto out;
+	}
+	url->offset = offset;
+	fio = fetchXGet(url, &ust, "");
+	if (fio == NULL) {
+		if (fetchLastErrCode == FETCH_UNAVAIL) {
+			rv = SLURP_MISSING;
+		} else {
+			warnx("%s: %s", job->url, fetchLastErrString);
+			rv = SLURP_RETRY;
+		}
+		/*
+		 * If we were trying to resume, the partial file might
+		 * be bogus (e.g. the file changed on the server and got
+		 * smaller).  Start over next time.
+		 */
+		if (offset != 0) {
+			(void)ftruncate(fd, 0);
+		}
+		fetchFreeURL(url);
+		goto out;
+	}
+
+	/*
+	 * If the server doesn't do ranges, it'll send the whole
+	 * file back.
+	 */
+	if (url->offset != offset) {
+		offset = url->offset;
+		if (ftruncate(fd, offset) < 0) {
+			warn("%s", partpath);
+			fetchFreeURL(url);
+			goto out;
+		}
+	}
+	fetchFreeURL(url);
+
+	if (ust.size > MAX_FILE_SIZE) {
+		warnx("%s: size %lld is nonsensical", job->url,
+		    (long long)ust.size);
+		(void)ftruncate(fd, 0);
+		goto out;
+	}
+
+	total = (size_t)offset;
+	while ((actual = fetchIO_read(fio, buf, sizeof(buf))) > 0) {
+		if (total + (size_t)actual > MAX_FILE_SIZE) {
+			warnx("%s: file is too large", job->url);
+			(void)ftruncate(fd, 0);
+			goto out;
+		}
+		if (pwrite(fd, buf, (size_t)actual, (off_t)total) != actual) {
+			warn("%s", partpath);
+			goto out;
+		}
+		total += (size_t)actual;
+		*bytesp += (uint64_t)actual;
+	}
+	if (actual < 0) {
+		warnx("%s: %s", job->url, fetchLastErrString);
+		rv = SLURP_RETRY;
+		goto out;
+	}
+	if (ust.size >= 0 && (size_t)ust.size != total) {
+		warnx("%s: got %zu bytes, expected %lld", job->url, total,
+		    (long long)ust.size);
+		rv = SLURP_RETRY;
+		goto out;
+	}
+
+	if (install_file(job, partpath, fd, total, ust.mtime)) {
+		rv = offset != 0 ? SLURP_RESUMED : SLURP_FETCHED;
+	} else {
+		/* Don't try to resume a file that didn't verify. */
+		(void)unlink(partpath);
+	}
+
+ out:
+	if (fio != NULL) {
+		fetchIO_close(fio);
+	}
+	if (fd >= 0) {
+		close(fd);
+		/*
+		 * Don't leave empty turds lying around for missing
+		 * files, or for ones we didn't get any of (a later
+		 * retry will just create it again).
+		 */
+		if (rv == SLURP_MISSING ||
+		    (rv != SLURP_FETCHED && rv != SLURP_RESUMED &&
+		     stat(partpath, &sb) == 0 && sb.st_size == 0)) {
+			(void)unlink(partpath);
+		}
+	}
+	free(partpath);
+	return rv;
+}
+
+/*
+ * slurp_worker --
+ *	Worker thread: pull jobs off the queue until it's empty.
+ */
+static void *
+slurp_worker(void *arg)
+{
+	struct slurp_job *job;
+	slurp_result result;
+	uint64_t bytes;
+	unsigned int attempt;
+
+	for (;;) {
+		pthread_mutex_lock(&slurp_lock);
+		if (nextjob == njobs) {
+			pthread_mutex_unlock(&slurp_lock);
+			break;
+		}
+		job = &jobs[nextjob++];
+		pthread_mutex_unlock(&slurp_lock);
+
+		bytes = 0;
+		for (attempt = 0;; attempt++) {
+			result = slurp_one(job, &bytes);
+			if (result != SLURP_RETRY) {
+				break;
+			}
+			if (attempt == retries) {
+				result = SLURP_FAILED;
+				break;
+			}
+			sleep(1 << attempt);
+		}
+
+		pthread_mutex_lock(&slurp_lock);
+		stats.bytes += bytes;
+		switch (result) {
+		case SLURP_FETCHED:
+			stats.fetched++;
+			break;
+		case SLURP_RESUMED:
+			stats.resumed++;
+			break;
+		case SLURP_UNCHANGED:
+			stats.unchanged++;
+			break;
+		case SLURP_MISSING:
+			stats.missing++;
+			break;
+		default:
+			stats.failed++;
+			break;
+		}
+		pthread_mutex_unlock(&slurp_lock);
+
+		if (verbose && result != SLURP_MISSING) {
+			printf("%s -> %s: %s\n", job->url, job->path,
+			    result == SLURP_FETCHED   ? "fetched" :
+			    result == SLURP_RESUMED   ? "resumed" :
+			    result == SLURP_UNCHANGED ? "unchanged" :
+							"FAILED");
+		}
+	}
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char * const raw_cycles[] = {
+		"cycle 1 raw=cycle1",
+		"cycle 2 raw=cycle2",
+		"cycle DJ raw=cycleDJ",
+	};
+	static const char * const encrypted_cycles[] = {
+		"cycle1",
+		"cycle2",
+		"cycleDJ",
+	};
+	const char *base_url = DEFAULT_BASE_URL;
+	const char *outdir = ".";
+	uint32_t max_image = DEFAULT_MAX_IMAGE;
+	pthread_t threads[MAX_JOBS];
+	unsigned int njobthreads = DEFAULT_JOBS;
+	unsigned int i;
+	char *ep;
+	int ch, error;
+
+	setprogname(argv[0]);
+
+	while ((ch = getopt(argc, argv, "dfj:m:o:r:su:v")) != -1) {
+		switch (ch) {
+		case 'd':
+			decrypt = true;
+			break;
+
+		case 'f':
+			force = true;
+			break;
+
+		case 'j':
+			njobthreads = (unsigned int)strtoul(optarg, &ep, 0);
+			if (*ep != '\0' || njobthreads < 1 ||
+			    njobthreads > MAX_JOBS) {
+				errx(EXIT_FAILURE, "invalid job count: %s",
+				    optarg);
+			}
+			break;
+
+		case 'm':
+			max_image = (uint32_t)strtoul(optarg, &ep, 0);
+			if (*ep != '\0' || max_image > 0xffffff) {
+				errx(EXIT_FAILURE, "invalid image number: %s",
+				    optarg);
+			}
+			break;
+
+		case 'o':
+			outdir = optarg;
+			break;
+
+		case 'r':
+			retries = (unsigned int)strtoul(optarg, &ep, 0);
+			if (*ep != '\0' || retries > 10) {
+				errx(EXIT_FAILURE, "invalid retry count: %s",
+				    optarg);
+			}
+			break;
+
+		case 's':
+			size_only = true;
+			break;
+
+		case 'u':
+			base_url = optarg;
+			break;
+
+		case 'v':
+			verbose = true;
+			break;
+
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (! log_init(NULL, LOG_OPT_FOREGROUND)) {
+		errx(EXIT_FAILURE, "log_init() failed");
+	}
+
+	if (mkdir(outdir, 0777) < 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "%s", outdir);
+	}
+
+	if (argc == 0) {
+		const char * const *cycles =
+		    decrypt ? encrypted_cycles : raw_cycles;
+
+		for (i = 0; i < 3; i++) {
+			add_cycle(base_url, outdir, cycles[i], max_image);
+		}
+	} else {
+		for (i = 0; i < (unsigned int)argc; i++) {
+			add_cycle(base_url, outdir, argv[i], max_image);
+		}
+	}
+
+	/* Let each worker keep its connection to the server alive. */
+	fetchConnectionCacheInit((int)njobthreads, (int)njobthreads);
+	fetchTimeout = 30;
+
+	for (i = 0; i < njobthreads; i++) {
+		error = pthread_create(&threads[i], NULL, slurp_worker, NULL);
+		if (error != 0) {
+			errx(EXIT_FAILURE, "pthread_create: %s",
+			    strerror(error));
+		}
+	}
+	for (i = 0; i < njobthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	fetchConnectionCacheClose();
+
+	printf("%u fetched, %u resumed, %u unchanged, %u missing, "
+	    "%u failed; %" PRIu64 " bytes transferred\n",
+	    stats.fetched, stats.resumed, stats.unchanged, stats.missing,
+	    stats.failed, stats.bytes);
+
+	exit(stats.failed != 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}